@@ -21,12 +21,41 @@ LOCAL_MODULE := audio.primary.$(TARGET_BOOTLOADER_BOARD_NAME)
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_MODULE_TAGS := optional
 
-LOCAL_SRC_FILES := audio_hw.c ril_interface.c
+LOCAL_SRC_FILES := \
+	api_trace.c \
+	arena.c \
+	audio_hw.c \
+	dev_state.c \
+	echo_ref.c \
+	energy.c \
+	hal_lock.c \
+	hdmi_caps.c \
+	link_rate.c \
+	loopback.c \
+	parms.c \
+	pcm_convert.c \
+	pcm_tap.c \
+	pcm_watch.c \
+	preroll.c \
+	rate_conv.c \
+	ril_interface.c \
+	routing.c \
+	spk_prot.c \
+	startup.c \
+	stream_pool.c \
+	thread_mgr.c \
+	two_mic.c \
+	voice_rec.c
 
 ifeq ($(BOARD_HDMI_INCAPABLE), true)
 	LOCAL_CFLAGS += -DHDMI_INCAPABLE
 endif
 
+# Abort when an audio thread allocates in its real time section
+ifeq ($(BOARD_AUDIO_RT_ALLOC_CHECK), true)
+	LOCAL_CFLAGS += -DAUDIO_RT_ALLOC_CHECK
+endif
+
 LOCAL_C_INCLUDES += \
 	$(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include \
 	external/tinyalsa/include \
@@ -48,3 +77,32 @@ LOCAL_SHARED_LIBRARIES := \
 	libsecril-client
 
 include $(BUILD_SHARED_LIBRARY)
+
+# Round trip latency test, run on the device with audioserver stopped
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_loopback_test
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	tests/loopback_test.c
+
+LOCAL_SHARED_LIBRARIES := \
+	libhardware
+
+include $(BUILD_EXECUTABLE)
+
+# The routing tables against the branch chains they replaced
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_routing_test
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	routing.c \
+	tests/routing_test.c
+
+LOCAL_SHARED_LIBRARIES := \
+	liblog
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,464 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_api_trace"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "api_trace.h"
+#include "hal_lock.h"
+
+/* A call this many times longer than the average of its event */
+#define OUTLIER_FACTOR 4
+
+/* Records written to the file at a time */
+#define WRITE_CHUNK 64
+
+struct api_trace_ring {
+    pid_t                   tid;    /* 0 if free, claimed with a CAS */
+    uint32_t                head;   /* records appended, published with release */
+    struct api_trace_record records[API_TRACE_RECORDS];
+};
+
+static const char * const event_names[API_TRACE_EVENT_COUNT] = {
+    [API_TRACE_OUT_WRITE] = "out write",
+    [API_TRACE_OUT_STANDBY] = "out standby",
+    [API_TRACE_OUT_SET_PARAMETERS] = "out set_parameters",
+    [API_TRACE_OUT_SET_VOLUME] = "out set_volume",
+    [API_TRACE_IN_READ] = "in read",
+    [API_TRACE_IN_STANDBY] = "in standby",
+    [API_TRACE_IN_SET_PARAMETERS] = "in set_parameters",
+    [API_TRACE_OPEN_OUTPUT] = "open output",
+    [API_TRACE_CLOSE_OUTPUT] = "close output",
+    [API_TRACE_OPEN_INPUT] = "open input",
+    [API_TRACE_CLOSE_INPUT] = "close input",
+    [API_TRACE_SET_MODE] = "set_mode",
+    [API_TRACE_SET_PARAMETERS] = "set_parameters",
+    [API_TRACE_SET_VOICE_VOLUME] = "set_voice_volume",
+    [API_TRACE_SET_MIC_MUTE] = "set_mic_mute",
+};
+
+/* start, stop and dump */
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Allocated by the first start, kept for the life of the process */
+static struct api_trace_ring *rings;
+static bool active;
+static bool hash_buffers;
+static int64_t start_ns;
+/* Bumped by every start, a thread claims a new ring in the next trace */
+static uint32_t generation;
+/* Calls of threads that found no free ring */
+static uint32_t no_ring;
+
+static __thread struct api_trace_ring *thread_ring;
+static __thread uint32_t thread_generation;
+
+static int64_t api_trace_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint32_t api_trace_hash(const void *buffer, size_t bytes)
+{
+    const uint8_t *p = buffer;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < bytes; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static struct api_trace_ring *api_trace_claim(void)
+{
+    uint32_t gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    pid_t tid = gettid();
+    pid_t expected;
+    int i;
+
+    if (thread_ring != NULL && thread_generation == gen) {
+        return thread_ring;
+    }
+
+    for (i = 0; i < API_TRACE_MAX_THREADS; i++) {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&rings[i].tid, &expected, tid, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            thread_ring = &rings[i];
+            thread_generation = gen;
+            return thread_ring;
+        }
+    }
+
+    return NULL;
+}
+
+int api_trace_start(bool hash)
+{
+    int i;
+
+    pthread_mutex_lock(&control_lock);
+
+    if (rings == NULL) {
+        rings = calloc(API_TRACE_MAX_THREADS, sizeof(struct api_trace_ring));
+        if (rings == NULL) {
+            pthread_mutex_unlock(&control_lock);
+            return -ENOMEM;
+        }
+    }
+
+    /* A call that was in flight when the last trace stopped may still land here */
+    for (i = 0; i < API_TRACE_MAX_THREADS; i++) {
+        __atomic_store_n(&rings[i].head, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&rings[i].tid, 0, __ATOMIC_RELAXED);
+    }
+    no_ring = 0;
+    hash_buffers = hash;
+    start_ns = api_trace_now_ns();
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&active, true, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&control_lock);
+
+    ALOGI("%s: tracing HAL calls%s", __func__, hash ? " with buffer hashes" : "");
+
+    return 0;
+}
+
+bool api_trace_active(void)
+{
+    return __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+}
+
+void api_trace_begin(struct api_trace_call *call)
+{
+    if (!api_trace_active()) {
+        call->start_ns = 0;
+        return;
+    }
+
+    call->start_ns = api_trace_now_ns();
+    call->lock_wait_ns = hal_lock_thread_wait_ns();
+}
+
+void api_trace_end(const struct api_trace_call *call,
+                   enum api_trace_event event,
+                   const void *stream,
+                   int32_t arg,
+                   int32_t ret,
+                   const void *buffer,
+                   size_t bytes)
+{
+    struct api_trace_record *record;
+    struct api_trace_ring *ring;
+    uint32_t head;
+
+    if (call->start_ns == 0 || !api_trace_active()) {
+        return;
+    }
+
+    ring = api_trace_claim();
+    if (ring == NULL) {
+        __atomic_add_fetch(&no_ring, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    head = ring->head;
+    record = &ring->records[head % API_TRACE_RECORDS];
+
+    record->time_ns = call->start_ns;
+    record->duration_us = (api_trace_now_ns() - call->start_ns) / 1000;
+    record->lock_wait_us = (hal_lock_thread_wait_ns() - call->lock_wait_ns) / 1000;
+    record->tid = ring->tid;
+    record->event = event;
+    record->reserved = 0;
+    record->stream = (uint32_t)(uintptr_t)stream;
+    record->arg = arg;
+    record->ret = ret;
+    record->hash = hash_buffers && buffer != NULL && bytes > 0 ?
+                           api_trace_hash(buffer, bytes) : 0;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void api_trace_end_parameters(const struct api_trace_call *call,
+                              enum api_trace_event event,
+                              const void *stream,
+                              int ret,
+                              const char *kvpairs)
+{
+    size_t len;
+
+    if (call->start_ns == 0 || !api_trace_active()) {
+        return;
+    }
+
+    len = strlen(kvpairs);
+    api_trace_end(call, event, stream, len, ret, kvpairs, len);
+
+    ALOGI("%s %lld %#x: %s", event_names[event], (long long)call->start_ns,
+          (uint32_t)(uintptr_t)stream, kvpairs);
+}
+
+/*
+ * Copies what is left of a ring, oldest first. A writer still finishing a
+ * call may have overwritten the oldest copied records meanwhile, those are
+ * dropped. Returns the number of records in copy.
+ */
+static uint32_t api_trace_copy_ring(const struct api_trace_ring *ring,
+                                    struct api_trace_record *copy,
+                                    uint32_t *dropped)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t count = head < API_TRACE_RECORDS ? head : API_TRACE_RECORDS;
+    uint32_t first = head - count;
+    uint32_t skip;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        copy[i] = ring->records[(first + i) % API_TRACE_RECORDS];
+    }
+
+    /* and the slot of the record it may be writing now */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + 1;
+    skip = head > API_TRACE_RECORDS && head - API_TRACE_RECORDS > first ?
+                   head - API_TRACE_RECORDS - first : 0;
+    if (skip > count) {
+        skip = count;
+    }
+    memmove(copy, copy + skip, (count - skip) * sizeof(struct api_trace_record));
+
+    *dropped += first + skip;
+
+    return count - skip;
+}
+
+int api_trace_stop(const char *path)
+{
+    struct api_trace_record chunk[WRITE_CHUNK];
+    struct api_trace_record *copies[API_TRACE_MAX_THREADS];
+    uint32_t counts[API_TRACE_MAX_THREADS];
+    uint32_t cursors[API_TRACE_MAX_THREADS];
+    struct api_trace_header header;
+    size_t chunk_len = 0;
+    int threads = 0;
+    int ret = 0;
+    int fd = -1;
+    int best;
+    int i;
+
+    pthread_mutex_lock(&control_lock);
+
+    if (!api_trace_active()) {
+        pthread_mutex_unlock(&control_lock);
+        return -EINVAL;
+    }
+    __atomic_store_n(&active, false, __ATOMIC_RELEASE);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = API_TRACE_MAGIC;
+    header.version = API_TRACE_VERSION;
+    header.record_size = sizeof(struct api_trace_record);
+    header.flags = hash_buffers ? API_TRACE_HASH : 0;
+    header.start_ns = start_ns;
+    header.dropped = __atomic_load_n(&no_ring, __ATOMIC_RELAXED);
+
+    for (i = 0; i < API_TRACE_MAX_THREADS; i++) {
+        copies[i] = NULL;
+        counts[i] = 0;
+        cursors[i] = 0;
+
+        if (__atomic_load_n(&rings[i].tid, __ATOMIC_ACQUIRE) == 0) {
+            continue;
+        }
+        copies[i] = malloc(API_TRACE_RECORDS * sizeof(struct api_trace_record));
+        if (copies[i] == NULL) {
+            ret = -ENOMEM;
+            goto exit;
+        }
+        counts[i] = api_trace_copy_ring(&rings[i], copies[i], &header.dropped);
+        header.records += counts[i];
+        threads++;
+    }
+    header.threads = threads;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        ret = -errno;
+        ALOGE("%s: %s: %s", __func__, path, strerror(errno));
+        goto exit;
+    }
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        ret = -EIO;
+        goto exit;
+    }
+
+    /* Each ring is in time order, merge them */
+    for (;;) {
+        best = -1;
+        for (i = 0; i < API_TRACE_MAX_THREADS; i++) {
+            if (cursors[i] < counts[i] &&
+                (best < 0 ||
+                 copies[i][cursors[i]].time_ns < copies[best][cursors[best]].time_ns)) {
+                best = i;
+            }
+        }
+
+        if (best >= 0) {
+            chunk[chunk_len++] = copies[best][cursors[best]++];
+        }
+        if (chunk_len == WRITE_CHUNK || (best < 0 && chunk_len > 0)) {
+            ssize_t len = chunk_len * sizeof(struct api_trace_record);
+
+            if (write(fd, chunk, len) != len) {
+                ret = -EIO;
+                goto exit;
+            }
+            chunk_len = 0;
+        }
+        if (best < 0) {
+            break;
+        }
+    }
+
+    ret = header.records;
+    ALOGI("%s: %u records of %d threads written to %s, %u dropped", __func__,
+          header.records, threads, path, header.dropped);
+
+exit:
+    if (fd >= 0) {
+        close(fd);
+    }
+    for (i = 0; i < API_TRACE_MAX_THREADS; i++) {
+        free(copies[i]);
+    }
+
+    pthread_mutex_unlock(&control_lock);
+
+    ALOGE_IF(ret < 0, "%s: trace not written: %s", __func__, strerror(-ret));
+
+    return ret;
+}
+
+struct event_stats {
+    uint32_t    calls;
+    uint64_t    duration_sum_us;
+    uint32_t    duration_max_us;
+    uint32_t    lock_waits;
+    uint32_t    lock_wait_max_us;
+    uint32_t    outliers;
+};
+
+/* Over the records still in the rings, those of running threads may be torn */
+void api_trace_dump(int fd)
+{
+    struct event_stats stats[API_TRACE_EVENT_COUNT];
+    const struct api_trace_record *record;
+    struct event_stats *s;
+    uint32_t count;
+    int pass;
+    int i;
+    uint32_t j;
+
+    pthread_mutex_lock(&control_lock);
+
+    if (rings == NULL) {
+        pthread_mutex_unlock(&control_lock);
+        return;
+    }
+
+    memset(stats, 0, sizeof(stats));
+
+    /* The outliers need the averages of the first pass */
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < API_TRACE_MAX_THREADS; i++) {
+            if (__atomic_load_n(&rings[i].tid, __ATOMIC_ACQUIRE) == 0) {
+                continue;
+            }
+            count = __atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE);
+            if (count > API_TRACE_RECORDS) {
+                count = API_TRACE_RECORDS;
+            }
+
+            for (j = 0; j < count; j++) {
+                record = &rings[i].records[j];
+                if (record->event >= API_TRACE_EVENT_COUNT) {
+                    continue;
+                }
+                s = &stats[record->event];
+
+                if (pass == 1) {
+                    if (s->calls > 0 &&
+                        record->duration_us * (uint64_t)s->calls >
+                                OUTLIER_FACTOR * s->duration_sum_us) {
+                        s->outliers++;
+                    }
+                    continue;
+                }
+
+                s->calls++;
+                s->duration_sum_us += record->duration_us;
+                if (record->duration_us > s->duration_max_us) {
+                    s->duration_max_us = record->duration_us;
+                }
+                if (record->lock_wait_us > 0) {
+                    s->lock_waits++;
+                    if (record->lock_wait_us > s->lock_wait_max_us) {
+                        s->lock_wait_max_us = record->lock_wait_us;
+                    }
+                }
+            }
+        }
+    }
+
+    dprintf(fd, "  API trace: %s%s, %u calls without a ring\n",
+            api_trace_active() ? "active" : "stopped",
+            hash_buffers ? ", hashing buffers" : "",
+            __atomic_load_n(&no_ring, __ATOMIC_RELAXED));
+
+    for (i = 0; i < API_TRACE_EVENT_COUNT; i++) {
+        s = &stats[i];
+        if (s->calls == 0) {
+            continue;
+        }
+        dprintf(fd, "    %s: %u calls, avg %llu us, max %u us, "
+                "%u outliers (>%dx avg), %u lock waits, max %u us\n",
+                event_names[i], s->calls,
+                (unsigned long long)(s->duration_sum_us / s->calls),
+                s->duration_max_us, s->outliers, OUTLIER_FACTOR,
+                s->lock_waits, s->lock_wait_max_us);
+    }
+
+    pthread_mutex_unlock(&control_lock);
+}
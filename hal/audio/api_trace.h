@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef API_TRACE_H
+#define API_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Record of the calls into the HAL.
+ *
+ * While tracing, every entry point appends a record to a ring of the
+ * calling thread: when it was entered, how long it took, how much of that
+ * it waited for HAL locks, its argument and result and, if asked for, a
+ * hash of the buffer written or read. A thread claims its ring at its
+ * first call, so appending takes no lock; when the ring is full the oldest
+ * records go. Stopping writes the rings, merged in time order, to a file
+ * a replayer can drive the same calls from with the same timing. The
+ * key/value pairs of set_parameters calls go to the log, tagged with the
+ * entry time of their record.
+ *
+ * File: struct api_trace_header, then header.records records.
+ */
+enum api_trace_event {
+    API_TRACE_OUT_WRITE,            /* arg: bytes, ret: bytes written */
+    API_TRACE_OUT_STANDBY,
+    API_TRACE_OUT_SET_PARAMETERS,   /* arg: length of the key/value pairs */
+    API_TRACE_OUT_SET_VOLUME,       /* arg: left volume * 1000 */
+    API_TRACE_IN_READ,              /* arg: bytes, ret: bytes read */
+    API_TRACE_IN_STANDBY,
+    API_TRACE_IN_SET_PARAMETERS,
+    API_TRACE_OPEN_OUTPUT,          /* arg: flags, stream: the new output */
+    API_TRACE_CLOSE_OUTPUT,
+    API_TRACE_OPEN_INPUT,           /* arg: source, stream: the new input */
+    API_TRACE_CLOSE_INPUT,
+    API_TRACE_SET_MODE,             /* arg: mode */
+    API_TRACE_SET_PARAMETERS,
+    API_TRACE_SET_VOICE_VOLUME,     /* arg: volume * 1000 */
+    API_TRACE_SET_MIC_MUTE,         /* arg: muted */
+    API_TRACE_EVENT_COUNT
+};
+
+#define API_TRACE_MAGIC 0x52544148  /* "HATR" */
+#define API_TRACE_VERSION 1
+
+#define API_TRACE_MAX_THREADS 16
+#define API_TRACE_RECORDS 2048      /* per thread */
+
+#define API_TRACE_PATH "/data/misc/audioserver/hal_api_trace.bin"
+
+struct api_trace_header {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    record_size;
+    uint32_t    records;
+    uint32_t    threads;
+    uint32_t    dropped;        /* overwritten or of threads without a ring */
+    uint32_t    flags;          /* API_TRACE_HASH */
+    int64_t     start_ns;       /* CLOCK_MONOTONIC */
+};
+
+#define API_TRACE_HASH 0x1
+
+struct api_trace_record {
+    int64_t     time_ns;        /* entry, CLOCK_MONOTONIC */
+    uint32_t    duration_us;
+    uint32_t    lock_wait_us;
+    int32_t     tid;
+    uint16_t    event;
+    uint16_t    reserved;
+    uint32_t    stream;         /* low bits of the stream, 0 for the device */
+    int32_t     arg;
+    int32_t     ret;
+    uint32_t    hash;           /* FNV-1a of the buffer, 0 if not hashed */
+};
+
+/* Filled by api_trace_begin(), start_ns is 0 while not tracing */
+struct api_trace_call {
+    int64_t     start_ns;
+    int64_t     lock_wait_ns;
+};
+
+/* Function prototypes */
+
+/* Clears the rings, hash: record buffer hashes of writes and reads */
+int api_trace_start(bool hash);
+
+/* Returns the number of records written to path or a negative errno */
+int api_trace_stop(const char *path);
+
+bool api_trace_active(void);
+
+void api_trace_begin(struct api_trace_call *call);
+
+/* buffer and bytes for the hash, buffer may be NULL */
+void api_trace_end(const struct api_trace_call *call,
+                   enum api_trace_event event,
+                   const void *stream,
+                   int32_t arg,
+                   int32_t ret,
+                   const void *buffer,
+                   size_t bytes);
+
+/* set_parameters calls, records the hash of kvpairs and logs them */
+void api_trace_end_parameters(const struct api_trace_call *call,
+                              enum api_trace_event event,
+                              const void *stream,
+                              int ret,
+                              const char *kvpairs);
+
+/* Per event: calls, average and worst time, lock waits, outliers */
+void api_trace_dump(int fd);
+
+#endif
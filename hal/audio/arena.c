@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_arena"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#define ARENA_NO_RT_CHECK_MACROS
+#include "arena.h"
+
+int arena_init(struct arena *arena, size_t size)
+{
+    void *base;
+
+    memset(arena, 0, sizeof(struct arena));
+
+    size = ARENA_SIZE(size);
+    if (posix_memalign(&base, ARENA_ALIGN, size) != 0) {
+        return -ENOMEM;
+    }
+
+    /* Fault the pages in now, not on the first read */
+    memset(base, 0, size);
+
+    arena->base = base;
+    arena->size = size;
+
+    return 0;
+}
+
+void arena_release(struct arena *arena)
+{
+    free(arena->base);
+    memset(arena, 0, sizeof(struct arena));
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    void *ptr;
+
+    size = ARENA_SIZE(size);
+    if (arena->size - arena->used < size) {
+        ALOGE("%s: %zu bytes requested, %zu left", __func__,
+              size, arena->size - arena->used);
+        return NULL;
+    }
+
+    ptr = arena->base + arena->used;
+    arena->used += size;
+
+    return ptr;
+}
+
+#ifdef AUDIO_RT_ALLOC_CHECK
+static __thread int rt_depth;
+
+void rt_section_enter(void)
+{
+    rt_depth++;
+}
+
+void rt_section_leave(void)
+{
+    rt_depth--;
+}
+
+static void rt_check(const char *what, const char *caller)
+{
+    if (rt_depth > 0) {
+        LOG_ALWAYS_FATAL("%s() called by %s() in a real time section",
+                         what, caller);
+    }
+}
+
+void *rt_check_malloc(size_t size, const char *caller)
+{
+    rt_check("malloc", caller);
+    return malloc(size);
+}
+
+void *rt_check_calloc(size_t count, size_t size, const char *caller)
+{
+    rt_check("calloc", caller);
+    return calloc(count, size);
+}
+
+void *rt_check_realloc(void *ptr, size_t size, const char *caller)
+{
+    rt_check("realloc", caller);
+    return realloc(ptr, size);
+}
+#endif
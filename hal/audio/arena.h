@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * One allocation carved into the buffers a stream needs, sized when the
+ * stream is opened. Nothing is returned to the arena before it is released
+ * as a whole.
+ */
+struct arena {
+    uint8_t *base;
+    size_t  size;
+    size_t  used;
+};
+
+/* Alignment of every buffer, enough for NEON loads */
+#define ARENA_ALIGN 16
+
+#define ARENA_SIZE(bytes) (((bytes) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+/* Function prototypes */
+int arena_init(struct arena *arena, size_t size);
+
+void arena_release(struct arena *arena);
+
+/* Returns size zeroed bytes, or NULL if the arena is too small */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/*
+ * Real time sections.
+ *
+ * With AUDIO_RT_ALLOC_CHECK, the audio threads mark the part of a read or
+ * write that must not allocate, and every malloc(), calloc() or realloc()
+ * made by the HAL sources in such a section aborts with its caller's name.
+ * Without it the markers compile to nothing.
+ */
+#ifdef AUDIO_RT_ALLOC_CHECK
+void rt_section_enter(void);
+
+void rt_section_leave(void);
+
+void *rt_check_malloc(size_t size, const char *caller);
+
+void *rt_check_calloc(size_t count, size_t size, const char *caller);
+
+void *rt_check_realloc(void *ptr, size_t size, const char *caller);
+
+#ifndef ARENA_NO_RT_CHECK_MACROS
+#define malloc(size) rt_check_malloc((size), __func__)
+#define calloc(count, size) rt_check_calloc((count), (size), __func__)
+#define realloc(ptr, size) rt_check_realloc((ptr), (size), __func__)
+#endif
+#else
+#define rt_section_enter() do { } while (0)
+#define rt_section_leave() do { } while (0)
+#endif
+
+#endif
@@ -26,19 +26,23 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/param.h>
 #include <sys/time.h>
 #include <fcntl.h>
 
 #include <cutils/log.h>
 #include <cutils/properties.h>
-#include <cutils/str_parms.h>
 
 #include <linux/videodev2.h>
 #include <linux/videodev2_exynos_media.h>
 
 #include <system/audio.h>
 
+#include <audio_effects/effect_aec.h>
+#include <audio_utils/echo_reference.h>
+
 #include "audio_hw.h"
 #include "routing.h"
 #include "ril_interface.h"
@@ -52,6 +56,9 @@
 /* duration in ms of volume ramp applied when starting capture to remove plop */
 #define CAPTURE_START_RAMP_MS 100
 
+/* persist.audio.preroll.offset_ms, for voice recognition and the camcorder */
+#define PREROLL_OFFSET_MS 500
+
 #define DAPM_SHUTDOWN_TIME 10000 /* 10 ms */
 
 static struct pcm_device_profile pcm_device_playback = {
@@ -117,6 +124,28 @@ static struct pcm_device_profile pcm_device_capture_low_latency = {
                AUDIO_DEVICE_IN_BACK_MIC,
 };
 
+/*
+ * Call recording shares the capture link with the mics. The "incall-record"
+ * path puts the uplink on the left and the downlink on the right slot.
+ */
+static struct pcm_device_profile pcm_device_capture_voice_call = {
+    .config = {
+        .channels = CAPTURE_DEFAULT_CHANNEL_COUNT,
+        .rate = CAPTURE_DEFAULT_SAMPLING_RATE,
+        .period_size = CAPTURE_PERIOD_SIZE,
+        .period_count = CAPTURE_PERIOD_COUNT,
+        .format = PCM_FORMAT_S16_LE,
+        .start_threshold = CAPTURE_START_THRESHOLD,
+        .stop_threshold = 0,
+        .silence_threshold = 0,
+        .avail_min = 0,
+    },
+    .card = SOUND_CARD,
+    .id = PCM_DEVICE_CAPTURE,
+    .type = PCM_CAPTURE,
+    .devices = AUDIO_DEVICE_IN_VOICE_CALL,
+};
+
 static struct pcm_device_profile pcm_device_playback_sco = {
     .config = {
         .channels = SCO_DEFAULT_CHANNEL_COUNT,
@@ -155,6 +184,44 @@ static struct pcm_device_profile pcm_device_capture_sco = {
     .devices = AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET,
 };
 
+static struct pcm_device_profile pcm_device_playback_sco_wb = {
+    .config = {
+        .channels = SCO_WB_CHANNEL_COUNT,
+        .rate = SCO_WB_SAMPLING_RATE,
+        .period_size = SCO_PERIOD_SIZE,
+        .period_count = SCO_PERIOD_COUNT,
+        .format = PCM_FORMAT_S16_LE,
+        .start_threshold = SCO_START_THRESHOLD,
+        .stop_threshold = SCO_STOP_THRESHOLD,
+        .silence_threshold = 0,
+        .avail_min = SCO_AVAILABLE_MIN,
+    },
+    .card = SOUND_CARD,
+    .id = PCM_DEVICE_SCO,
+    .type = PCM_PLAYBACK,
+    .devices = AUDIO_DEVICE_OUT_BLUETOOTH_SCO |
+               AUDIO_DEVICE_OUT_BLUETOOTH_SCO_HEADSET |
+               AUDIO_DEVICE_OUT_BLUETOOTH_SCO_CARKIT,
+};
+
+static struct pcm_device_profile pcm_device_capture_sco_wb = {
+    .config = {
+        .channels = SCO_WB_CHANNEL_COUNT,
+        .rate = SCO_WB_SAMPLING_RATE,
+        .period_size = SCO_PERIOD_SIZE,
+        .period_count = SCO_PERIOD_COUNT,
+        .format = PCM_FORMAT_S16_LE,
+        .start_threshold = CAPTURE_START_THRESHOLD,
+        .stop_threshold = 0,
+        .silence_threshold = 0,
+        .avail_min = 0,
+    },
+    .card = SOUND_CARD,
+    .id = PCM_DEVICE_SCO,
+    .type = PCM_CAPTURE,
+    .devices = AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET,
+};
+
 static struct pcm_device_profile pcm_device_voice = {
     .config = {
         .channels = VOICE_DEFAULT_CHANNEL_COUNT,
@@ -195,23 +262,123 @@ static struct pcm_device_profile pcm_device_voice_wideband = {
                AUDIO_DEVICE_IN_BACK_MIC,
 };
 
+/*
+ * VoIP runs on the playback and capture links with its own periods, see
+ * voip_set_periods(). A period queued is enough to start, a period free
+ * enough to wake up.
+ */
+static struct pcm_device_profile pcm_device_playback_voip = {
+    .config = {
+        .channels = VOIP_DEFAULT_CHANNEL_COUNT,
+        .rate = VOIP_DEFAULT_SAMPLING_RATE,
+        .period_size = VOIP_DEFAULT_SAMPLING_RATE * VOIP_PERIOD_MS / 1000,
+        .period_count = VOIP_PERIOD_COUNT,
+        .format = PCM_FORMAT_S16_LE,
+        .start_threshold = VOIP_DEFAULT_SAMPLING_RATE * VOIP_PERIOD_MS / 1000,
+        .stop_threshold = INT_MAX,
+        .silence_threshold = 0,
+        .avail_min = VOIP_DEFAULT_SAMPLING_RATE * VOIP_PERIOD_MS / 1000,
+    },
+    .card = SOUND_CARD,
+    .id = PCM_DEVICE_PLAYBACK,
+    .type = PCM_PLAYBACK,
+    .devices = AUDIO_DEVICE_OUT_WIRED_HEADSET|
+               AUDIO_DEVICE_OUT_WIRED_HEADPHONE|
+               AUDIO_DEVICE_OUT_SPEAKER,
+};
+
+static struct pcm_device_profile pcm_device_capture_voip = {
+    .config = {
+        .channels = CAPTURE_DEFAULT_CHANNEL_COUNT,
+        .rate = VOIP_DEFAULT_SAMPLING_RATE,
+        .period_size = VOIP_DEFAULT_SAMPLING_RATE * VOIP_PERIOD_MS / 1000,
+        .period_count = VOIP_PERIOD_COUNT,
+        .format = PCM_FORMAT_S16_LE,
+        .start_threshold = CAPTURE_START_THRESHOLD,
+        .stop_threshold = 0,
+        .silence_threshold = 0,
+        .avail_min = 0,
+    },
+    .card = SOUND_CARD,
+    .id = PCM_DEVICE_CAPTURE,
+    .type = PCM_CAPTURE,
+    .devices = AUDIO_DEVICE_IN_BUILTIN_MIC|
+               AUDIO_DEVICE_IN_WIRED_HEADSET|
+               AUDIO_DEVICE_IN_BACK_MIC,
+};
+
+static struct pcm_device_profile * const pcm_devices[] = {
+    &pcm_device_playback,
+    &pcm_device_capture,
+    &pcm_device_capture_low_latency,
+    &pcm_device_capture_voice_call,
+    &pcm_device_playback_sco,
+    &pcm_device_capture_sco,
+    &pcm_device_voice,
+    &pcm_device_voice_wideband,
+    NULL,
+};
+
 static struct pcm_config pcm_config_deep_buffer = {
     .channels = DEEP_BUFFER_CHANNEL_COUNT,
-    .rate = DEEP_BUFFER_OUTPUT_SAMPLING_RATE,
-    .period_size = DEEP_BUFFER_OUTPUT_PERIOD_SIZE,
-    .period_count = DEEP_BUFFER_OUTPUT_PERIOD_COUNT,
+    .rate = DEEP_BUFFER_SAMPLING_RATE,
+    .period_size = DEEP_BUFFER_PERIOD_SIZE,
+    .period_count = DEEP_BUFFER_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = DEEP_BUFFER_PERIOD_SIZE / 4,
+    .stop_threshold = INT_MAX,
+    .avail_min = DEEP_BUFFER_PERIOD_SIZE / 4,
+};
+
+/*
+ * A blocked write only wakes up once a whole period is free, the mixer then
+ * fills it in one go. Starts as soon as a normal period is queued.
+ */
+static struct pcm_config pcm_config_deep_buffer_low_power = {
+    .channels = DEEP_BUFFER_CHANNEL_COUNT,
+    .rate = DEEP_BUFFER_SAMPLING_RATE,
+    .period_size = DEEP_BUFFER_LOW_POWER_PERIOD_SIZE,
+    .period_count = DEEP_BUFFER_LOW_POWER_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = DEEP_BUFFER_PERIOD_SIZE,
+    .stop_threshold = INT_MAX,
+    .avail_min = DEEP_BUFFER_LOW_POWER_PERIOD_SIZE,
+};
+
+/* The main mic while no input captures, see preroll.h */
+static struct pcm_config pcm_config_preroll = {
+    .channels = CAPTURE_DEFAULT_CHANNEL_COUNT,
+    .rate = CAPTURE_DEFAULT_SAMPLING_RATE,
+    .period_size = PREROLL_PERIOD_SIZE,
+    .period_count = PREROLL_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = CAPTURE_START_THRESHOLD,
+    .stop_threshold = 0,
+    .avail_min = 0,
+};
+
+/* Direct multichannel output to the HDMI sink, see hdmi_caps.h */
+static struct pcm_config pcm_config_hdmi_multi = {
+    .channels = HDMI_DEFAULT_CHANNEL_COUNT,
+    .rate = HDMI_DEFAULT_SAMPLING_RATE,
+    .period_size = HDMI_PERIOD_SIZE,
+    .period_count = HDMI_PERIOD_COUNT,
     .format = PCM_FORMAT_S16_LE,
-    .start_threshold = DEEP_BUFFER_OUTPUT_PERIOD_SIZE / 4,
+    .start_threshold = HDMI_START_THRESHOLD,
     .stop_threshold = INT_MAX,
-    .avail_min = DEEP_BUFFER_OUTPUT_PERIOD_SIZE / 4,
+    .avail_min = 0,
 };
 
 static const char * const use_case_table[AUDIO_USECASE_MAX] = {
     [USECASE_AUDIO_PLAYBACK] = "playback",
+    [USECASE_AUDIO_PLAYBACK_DEEP_BUFFER] = "playback deep-buffer",
     [USECASE_AUDIO_PLAYBACK_MULTI_CH] = "playback multi-channel",
+    [USECASE_AUDIO_PLAYBACK_VOIP] = "playback voip",
     [USECASE_AUDIO_HFP_SCO] = "hfp-sco",
     [USECASE_AUDIO_CAPTURE] = "capture",
     [USECASE_AUDIO_CAPTURE_LOW_LATENCY] = "capture low-latency",
+    [USECASE_AUDIO_CAPTURE_VOICE_CALL] = "capture voice-call",
+    [USECASE_AUDIO_CAPTURE_VOIP] = "capture voip",
     [USECASE_VOICE_CALL] = "voice-call",
 };
 
@@ -396,48 +563,234 @@ static const char *get_snd_device_display_name(snd_device_t snd_device)
     return name;
 }
 
+/* First of pcm_devices[] by type and device bit, -1 for none */
+static int8_t pcm_device_index[USECASE_TYPE_MAX][32];
+
+static void init_pcm_device_index(void)
+{
+    audio_devices_t devices;
+    int bit;
+    int i;
+
+    memset(pcm_device_index, -1, sizeof(pcm_device_index));
+
+    for (i = 0; pcm_devices[i] != NULL; i++) {
+        if (pcm_devices[i]->type >= USECASE_TYPE_MAX) {
+            continue;
+        }
+        devices = pcm_devices[i]->devices & ~AUDIO_DEVICE_BIT_IN;
+        for (bit = 0; bit < 32; bit++) {
+            if ((devices & (1u << bit)) &&
+                pcm_device_index[pcm_devices[i]->type][bit] < 0) {
+                pcm_device_index[pcm_devices[i]->type][bit] = i;
+            }
+        }
+    }
+}
+
+/* The first of pcm_devices[] of uc_type with any of devices */
 static struct pcm_device_profile *get_pcm_device(usecase_type_t uc_type,
                                                  audio_devices_t devices)
 {
+    int first = -1;
     int i;
 
+    if (uc_type >= USECASE_TYPE_MAX) {
+        return NULL;
+    }
+
     devices &= ~AUDIO_DEVICE_BIT_IN;
 
-    for (i = 0; pcm_devices[i] != NULL; i++) {
-        if ((pcm_devices[i]->type == uc_type) &&
-            (devices & pcm_devices[i]->devices)) {
-            return pcm_devices[i];
+    /* one or two bits set */
+    while (devices != 0) {
+        i = pcm_device_index[uc_type][__builtin_ctz(devices)];
+        if (i >= 0 && (first < 0 || i < first)) {
+            first = i;
         }
+        devices &= devices - 1;
     }
 
-    return NULL;
+    return first < 0 ? NULL : pcm_devices[first];
+}
+
+/* pcm_devices[] holds the narrowband SCO profiles, swap in wideband ones */
+static struct pcm_device_profile *get_sco_profile(struct audio_device *adev,
+                                                  struct pcm_device_profile *profile)
+{
+    if (!adev->sco.wbs) {
+        return profile;
+    }
+
+    if (profile == &pcm_device_playback_sco) {
+        return &pcm_device_playback_sco_wb;
+    } else if (profile == &pcm_device_capture_sco) {
+        return &pcm_device_capture_sco_wb;
+    }
+
+    return profile;
+}
+
+/* VoIP takes over the playback and capture links, SCO keeps its own periods */
+static struct pcm_device_profile *get_voip_profile(audio_usecase_t uc_id,
+                                                   struct pcm_device_profile *profile)
+{
+    if (uc_id == USECASE_AUDIO_PLAYBACK_VOIP && profile == &pcm_device_playback) {
+        return &pcm_device_playback_voip;
+    } else if (uc_id == USECASE_AUDIO_CAPTURE_VOIP && profile == &pcm_device_capture) {
+        return &pcm_device_capture_voip;
+    }
+
+    return profile;
+}
+
+/* What each usecase is accounted as, see energy.h */
+static const enum energy_class usecase_energy_class[AUDIO_USECASE_MAX] = {
+    [USECASE_AUDIO_PLAYBACK] = ENERGY_PLAYBACK,
+    [USECASE_AUDIO_PLAYBACK_DEEP_BUFFER] = ENERGY_DEEP_BUFFER,
+    [USECASE_AUDIO_PLAYBACK_MULTI_CH] = ENERGY_PLAYBACK,
+    [USECASE_AUDIO_PLAYBACK_VOIP] = ENERGY_VOICE,
+    [USECASE_AUDIO_HFP_SCO] = ENERGY_SCO,
+    [USECASE_AUDIO_CAPTURE] = ENERGY_CAPTURE,
+    [USECASE_AUDIO_CAPTURE_LOW_LATENCY] = ENERGY_CAPTURE,
+    [USECASE_AUDIO_CAPTURE_VOICE_CALL] = ENERGY_CAPTURE,
+    [USECASE_AUDIO_CAPTURE_VOIP] = ENERGY_VOICE,
+    [USECASE_VOICE_CALL] = ENERGY_VOICE,
+};
+
+/* Streams routed to a headset run on the SCO link, whatever their usecase */
+static enum energy_class pcm_device_energy_class(const struct pcm_device *pcm_device,
+                                                 audio_usecase_t uc_id)
+{
+    const struct pcm_device_profile *profile = pcm_device->pcm_profile;
+
+    if (profile == &pcm_device_playback_sco ||
+        profile == &pcm_device_capture_sco ||
+        profile == &pcm_device_playback_sco_wb ||
+        profile == &pcm_device_capture_sco_wb) {
+        return ENERGY_SCO;
+    }
+
+    return usecase_energy_class[uc_id];
+}
+
+/* Periods of adev->voip_period_ms at the rate the link runs at */
+static void voip_set_periods(const struct audio_device *adev,
+                             struct pcm_config *config,
+                             bool playback)
+{
+    config->period_size = config->rate * adev->voip_period_ms / 1000;
+    config->period_count = VOIP_PERIOD_COUNT;
+    if (playback) {
+        config->start_threshold = config->period_size;
+        config->avail_min = config->period_size;
+    }
+}
+
+static void in_voip_config(const struct stream_in *in, struct pcm_config *config)
+{
+    *config = pcm_device_capture_voip.config;
+    config->rate = link_rate_select(&pcm_device_capture_voip.rates,
+                                    in->requested_rate);
+    voip_set_periods(in->dev, config, false);
 }
 
+/* The first in usecase_list of its id */
 static struct audio_usecase *get_usecase_from_id(struct audio_device *adev,
                                                  audio_usecase_t uc_id)
 {
+    return adev->usecase_by_id[uc_id];
+}
+
+/* The first in usecase_list whose type has a bit of type */
+static struct audio_usecase *get_usecase_from_type(struct audio_device *adev,
+                                                   usecase_type_t type)
+{
+    struct audio_usecase *found = NULL;
     struct audio_usecase *usecase;
+    int t;
+
+    for (t = 0; t < USECASE_TYPE_MAX; t++) {
+        usecase = adev->usecase_by_type[t];
+        if ((t & type) && usecase != NULL &&
+            (found == NULL || usecase->seq < found->seq)) {
+            found = usecase;
+        }
+    }
+
+    return found;
+}
+
+static inline void usecase_slot_update(struct audio_usecase **slot,
+                                       struct audio_usecase *usecase)
+{
+    if (*slot == NULL || usecase->seq < (*slot)->seq) {
+        *slot = usecase;
+    }
+}
+
+/* always called with adev lock held */
+static void usecase_add_l(struct audio_device *adev,
+                          struct audio_usecase *usecase,
+                          bool head)
+{
+    if (head) {
+        usecase->seq = --adev->usecase_head_seq;
+        list_add_head(&adev->usecase_list, &usecase->adev_list_node);
+    } else {
+        usecase->seq = ++adev->usecase_tail_seq;
+        list_add_tail(&adev->usecase_list, &usecase->adev_list_node);
+    }
+
+    usecase_slot_update(&adev->usecase_by_id[usecase->id], usecase);
+    usecase_slot_update(&adev->usecase_by_type[usecase->type], usecase);
+}
+
+/*
+ * always called with adev lock held
+ * The few usecases left are walked only when this one held a slot.
+ */
+static void usecase_remove_l(struct audio_device *adev,
+                             struct audio_usecase *usecase)
+{
+    struct audio_usecase **id_slot = &adev->usecase_by_id[usecase->id];
+    struct audio_usecase **type_slot = &adev->usecase_by_type[usecase->type];
+    struct audio_usecase *other;
     struct listnode *node;
 
+    list_remove(&usecase->adev_list_node);
+
+    if (*id_slot != usecase && *type_slot != usecase) {
+        return;
+    }
+    if (*id_slot == usecase) {
+        *id_slot = NULL;
+    }
+    if (*type_slot == usecase) {
+        *type_slot = NULL;
+    }
+
+    /* in list order, the first found is the one nearest the head */
     list_for_each(node, &adev->usecase_list) {
-        usecase = node_to_item(node, struct audio_usecase, adev_list_node);
-        if (usecase->id == uc_id) {
-            return usecase;
+        other = node_to_item(node, struct audio_usecase, adev_list_node);
+        if (other->id == usecase->id && *id_slot == NULL) {
+            *id_slot = other;
+        }
+        if (other->type == usecase->type && *type_slot == NULL) {
+            *type_slot = other;
         }
     }
-
-    return NULL;
 }
 
-static struct audio_usecase *get_usecase_from_type(struct audio_device *adev,
-                                                   usecase_type_t type)
+/* Outputs of the same usecase share its id, their entries differ by stream */
+static struct audio_usecase *get_usecase_from_stream(struct audio_device *adev,
+                                                     struct audio_stream *stream)
 {
     struct audio_usecase *usecase;
     struct listnode *node;
 
     list_for_each(node, &adev->usecase_list) {
         usecase = node_to_item(node, struct audio_usecase, adev_list_node);
-        if (usecase->type & type) {
+        if (usecase->stream == stream) {
             return usecase;
         }
     }
@@ -445,6 +798,78 @@ static struct audio_usecase *get_usecase_from_type(struct audio_device *adev,
     return NULL;
 }
 
+/*
+ * How many outputs of each usecase can be open at once. Routing is keyed
+ * by usecase id, select_devices() and get_usecase_from_id() only see the
+ * first usecase of an id: a second output of the same id would never be
+ * routed, so each usecase has a single output.
+ */
+static const unsigned int output_capacity[AUDIO_USECASE_MAX] = {
+    [USECASE_AUDIO_PLAYBACK] = 1,
+    [USECASE_AUDIO_PLAYBACK_DEEP_BUFFER] = 1,
+    [USECASE_AUDIO_PLAYBACK_MULTI_CH] = 1,
+    [USECASE_AUDIO_PLAYBACK_VOIP] = 1,
+};
+
+/* The usecase of an output is set at open, no lock needed */
+static inline bool out_is_hdmi(const struct stream_out *out)
+{
+    return out->usecase == USECASE_AUDIO_PLAYBACK_MULTI_CH;
+}
+
+/* must be called with hw device outputs list locked */
+static int output_register_l(struct audio_device *adev, struct stream_out *out)
+{
+    if (adev->output_count[out->usecase] >= output_capacity[out->usecase]) {
+        ALOGE("%s: %u %s outputs open already", __func__,
+              adev->output_count[out->usecase], use_case_table[out->usecase]);
+        return -EBUSY;
+    }
+
+    out->state_slot = dev_state_add_output(&adev->dev_state);
+    if (out->state_slot < 0) {
+        return out->state_slot;
+    }
+
+    adev->output_count[out->usecase]++;
+    list_add_tail(&adev->output_list, &out->adev_list_node);
+
+    return 0;
+}
+
+/* must be called with hw device outputs list locked */
+static void output_unregister_l(struct audio_device *adev, struct stream_out *out)
+{
+    dev_state_remove_output(&adev->dev_state, out->state_slot);
+    adev->output_count[out->usecase]--;
+    list_remove(&out->adev_list_node);
+}
+
+/*
+ * The mixer, the RIL client and the link rates are set up on threads of
+ * their own while audioserver starts, see adev_open(). These wait for them
+ * the first time.
+ */
+static bool adev_mixer_ready(struct audio_device *adev)
+{
+    startup_task_join(&adev->mixer.init);
+
+    return adev->mixer.audio_route != NULL;
+}
+
+static struct ril_handle *adev_ril(struct audio_device *adev)
+{
+    startup_task_join(&adev->ril_init);
+
+    return &adev->ril;
+}
+
+/* The profiles' rates are only read when streams open */
+static void adev_link_rates_ready(struct audio_device *adev)
+{
+    startup_task_join(&adev->link_rates);
+}
+
 /* always called with adev lock held */
 static int set_voice_volume_l(struct audio_device *adev, float volume)
 {
@@ -476,7 +901,7 @@ static int set_voice_volume_l(struct audio_device *adev, float volume)
                 sound_type = SOUND_TYPE_VOICE;
         }
 
-        ril_set_call_volume(&adev->ril, sound_type, volume);
+        ril_set_call_volume(adev_ril(adev), sound_type, volume);
     }
 
     return err;
@@ -485,85 +910,14 @@ static int set_voice_volume_l(struct audio_device *adev, float volume)
 static snd_device_t get_output_snd_device(struct audio_device *adev,
                                           audio_devices_t devices)
 {
+    snd_device_t snd_device;
 
-    snd_device_t snd_device = SND_DEVICE_NONE;
-    audio_mode_t mode = adev->mode;
-    bool amr_wb = adev->voice.wb_amr;
-
-    ALOGV("%s: enter: output devices(%#x), mode(%d)", __func__, devices, mode);
-
-    if (devices == AUDIO_DEVICE_NONE ||
-        devices & AUDIO_DEVICE_BIT_IN) {
-        ALOGV("%s: Invalid output devices (%#x)", __func__, devices);
-        goto exit;
-    }
-
-    if (mode == AUDIO_MODE_IN_CALL) {
-        if (devices & AUDIO_DEVICE_OUT_WIRED_HEADPHONE ||
-            devices & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
-            if (wb_amr) {
-                snd_device = SND_DEVICE_OUT_VOICE_HEADPHONES_WB;
-            } else {
-                snd_device = SND_DEVICE_OUT_VOICE_HEADPHONES;
-            }
-        } else if (devices & AUDIO_DEVICE_OUT_SPEAKER) {
-            if (wb_amr) {
-                snd_device = SND_DEVICE_OUT_VOICE_SPEAKER_WB;
-            } else {
-                snd_device = SND_DEVICE_OUT_VOICE_SPEAKER;
-            }
-        } else if (devices & AUDIO_DEVICE_OUT_EARPIECE) {
-            if (wb_amr) {
-                snd_device = SND_DEVICE_OUT_VOICE_EARPIECE_WB;
-            } else {
-                snd_device = SND_DEVICE_OUT_VOICE_EARPIECE;
-            }
-        } else if (devices & AUDIO_DEVICE_OUT_ALL_SCO) {
-            snd_device = SND_DEVICE_OUT_BT_SCO;
-        }
-
-        if (snd_device != SND_DEVICE_NONE) {
-            goto exit;
-        }
-    }
-
-    if (popcount(devices) == 2) {
-        if (devices == (AUDIO_DEVICE_OUT_WIRED_HEADPHONE |
-                        AUDIO_DEVICE_OUT_SPEAKER)) {
-            snd_device = SND_DEVICE_OUT_SPEAKER_AND_HEADPHONES;
-        } else if (devices == (AUDIO_DEVICE_OUT_WIRED_HEADSET |
-                               AUDIO_DEVICE_OUT_SPEAKER)) {
-            snd_device = SND_DEVICE_OUT_SPEAKER_AND_HEADPHONES;
-        } else {
-            ALOGE("%s: Invalid combo device(%#x)", __func__, devices);
-            goto exit;
-        }
-
-        if (snd_device != SND_DEVICE_NONE) {
-            goto exit;
-        }
-    }
-
-    if (popcount(devices) != 1) {
-        ALOGE("%s: Invalid output devices(%#x)", __func__, devices);
-        goto exit;
-    }
-
-    if (devices & AUDIO_DEVICE_OUT_WIRED_HEADPHONE ||
-        devices & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
-        snd_device = SND_DEVICE_OUT_HEADPHONES;
-    } else if (devices & AUDIO_DEVICE_OUT_SPEAKER) {
-        snd_device = SND_DEVICE_OUT_SPEAKER;
-    } else if (devices & AUDIO_DEVICE_OUT_EARPIECE) {
-        snd_device = SND_DEVICE_OUT_HANDSET;
-    } else if (devices & AUDIO_DEVICE_OUT_ALL_SCO) {
-        snd_device = SND_DEVICE_OUT_BT_SCO;
-    } else {
-        ALOGE("%s: Unknown device(s) %#x", __func__, devices);
-    }
+    snd_device = routing_output_snd_device(adev->mode == AUDIO_MODE_IN_CALL,
+                                           adev->voice.wb_amr,
+                                           devices);
 
-exit:
-    ALOGV("%s: exit: snd_device(%s)", __func__, device_table[snd_device]);
+    ALOGV("%s: output devices(%#x), mode(%d): snd_device(%s)", __func__,
+          devices, adev->mode, device_table[snd_device]);
 
     return snd_device;
 }
@@ -571,128 +925,36 @@ exit:
 static snd_device_t get_input_snd_device(struct audio_device *adev,
                                          audio_devices_t out_device)
 {
-    audio_source_t source;
-    audio_mode_t mode = adev->mode;
-    audio_devices_t in_device;
-    audio_channel_mask_t channel_mask;
-    snd_device_t snd_device = SND_DEVICE_NONE;
     struct stream_in *active_input = NULL;
     struct audio_usecase *usecase;
+    snd_device_t snd_device;
 
     usecase = get_usecase_from_type(adev, PCM_CAPTURE | VOICE_CALL);
     if (usecase != NULL) {
         active_input = (struct stream_in *)usecase->stream;
     }
-    source = (active_input == NULL) ?
-                    AUDIO_SOURCE_DEFAULT :
-                    active_input->source;
-
-    in_device = ((active_input == NULL) ?
-                    AUDIO_DEVICE_NONE :
-                    active_input->devices) & ~AUDIO_DEVICE_BIT_IN;
 
-    channel_mask = (active_input == NULL) ?
-                    AUDIO_CHANNEL_IN_MONO :
-                    active_input->main_channels;
+    if (active_input == NULL) {
+        snd_device = routing_input_snd_device(adev->mode == AUDIO_MODE_IN_CALL,
+                                              out_device,
+                                              AUDIO_DEVICE_NONE,
+                                              AUDIO_SOURCE_DEFAULT,
+                                              false);
+    } else {
+        snd_device = routing_input_snd_device(adev->mode == AUDIO_MODE_IN_CALL,
+                                              out_device,
+                                              active_input->devices,
+                                              active_input->source,
+                                              active_input->main_channels ==
+                                                      AUDIO_CHANNEL_IN_FRONT_BACK ||
+                                              active_input->two_mic_active);
+    }
 
-    ALOGV("%s: enter: out_device(%#x) in_device(%#x)",
-          __func__,
-          out_device,
-          in_device);
+    ALOGV("%s: out_device(%#x): in_snd_device(%s)", __func__,
+          out_device, device_table[snd_device]);
 
-    if (mode == AUDIO_MODE_IN_CALL) {
-        if (out_device == AUDIO_DEVICE_NONE) {
-            ALOGE("%s: No output device set for voice call", __func__);
-            goto exit;
-        }
-
-        if (out_device & AUDIO_DEVICE_OUT_EARPIECE ||
-            out_device & AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
-            snd_device = SND_DEVICE_IN_EARPIECE_MIC;
-        } else if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
-            snd_device = SND_DEVICE_IN_VOICE_HEADSET_MIC;
-        } else if (out_device & AUDIO_DEVICE_OUT_SPEAKER) {
-            snd_device = SND_DEVICE_IN_VOICE_SPEAKER_MIC;
-        } else if (out_device & AUDIO_DEVICE_OUT_ALL_SCO) {
-            snd_device = SND_DEVICE_IN_BT_SCO_MIC ;
-        }
-    } else if (source == AUDIO_SOURCE_CAMCORDER) {
-        if (in_device & AUDIO_DEVICE_IN_BUILTIN_MIC ||
-            in_device & AUDIO_DEVICE_IN_BACK_MIC) {
-            snd_device = SND_DEVICE_IN_CAMCORDER_MIC;
-        }
-    } else if (source == AUDIO_SOURCE_VOICE_COMMUNICATION ||
-               source == AUDIO_SOURCE_MIC) {
-        if (out_device & AUDIO_DEVICE_OUT_SPEAKER) {
-            in_device = AUDIO_DEVICE_IN_BACK_MIC;
-        }
-#if 0
-        if (active_input) {
-            if (active_input->enable_aec) {
-                if (in_device & AUDIO_DEVICE_IN_BACK_MIC) {
-                    snd_device = SND_DEVICE_IN_SPEAKER_MIC_AEC;
-                } else if (in_device & AUDIO_DEVICE_IN_BUILTIN_MIC) {
-                    if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
-                        snd_device = SND_DEVICE_IN_SPEAKER_MIC_AEC;
-                    } else {
-                        snd_device = SND_DEVICE_IN_HANDSET_MIC_AEC;
-                    }
-                } else if (in_device & AUDIO_DEVICE_IN_WIRED_HEADSET) {
-                    snd_device = SND_DEVICE_IN_HEADSET_MIC_AEC;
-                }
-            }
-            /* TODO: set echo reference */
-        }
-#endif
-    } else if (source == AUDIO_SOURCE_DEFAULT) {
-        goto exit;
-    }
-
-    if (snd_device != SND_DEVICE_NONE) {
-        goto exit;
-    }
-
-    if (in_device != AUDIO_DEVICE_NONE &&
-        !(in_device & AUDIO_DEVICE_IN_VOICE_CALL) &&
-        !(in_device & AUDIO_DEVICE_IN_COMMUNICATION)) {
-        if (in_device & AUDIO_DEVICE_IN_BUILTIN_MIC) {
-            snd_device = SND_DEVICE_IN_EARPIECE_MIC;
-        } else if (in_device & AUDIO_DEVICE_IN_BACK_MIC) {
-            snd_device = SND_DEVICE_IN_SPEAKER_MIC;
-        } else if (in_device & AUDIO_DEVICE_IN_WIRED_HEADSET) {
-            snd_device = SND_DEVICE_IN_HEADSET_MIC;
-        } else if (in_device & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
-            snd_device = SND_DEVICE_IN_BT_SCO_MIC ;
-        } else if (in_device & AUDIO_DEVICE_IN_AUX_DIGITAL) {
-            snd_device = SND_DEVICE_IN_HDMI_MIC;
-        } else {
-            ALOGE("%s: Unknown input device(s) %#x", __func__, in_device);
-            ALOGW("%s: Using default handset-mic", __func__);
-            snd_device = SND_DEVICE_IN_HANDSET_MIC;
-        }
-    } else {
-        if (out_device & AUDIO_DEVICE_OUT_EARPIECE) {
-            snd_device = SND_DEVICE_IN_EARPIECE_MIC;
-        } else if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
-            snd_device = SND_DEVICE_IN_HEADSET_MIC;
-        } else if (out_device & AUDIO_DEVICE_OUT_SPEAKER) {
-            snd_device = SND_DEVICE_IN_SPEAKER_MIC;
-        } else if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
-            snd_device = SND_DEVICE_IN_HANDSET_MIC;
-        } else if (out_device & AUDIO_DEVICE_OUT_BLUETOOTH_SCO_HEADSET) {
-            snd_device = SND_DEVICE_IN_BT_SCO_MIC;
-        } else {
-            ALOGE("%s: Unknown output device(s) %#x", __func__, out_device);
-            ALOGW("%s: Using default handset-mic", __func__);
-            snd_device = SND_DEVICE_IN_HANDSET_MIC;
-        }
-    }
-
-exit:
-    ALOGV("%s: exit: in_snd_device(%s)", __func__, device_table[snd_device]);
-
-    return snd_device;
-}
+    return snd_device;
+}
 
 static int enable_snd_device(struct audio_device *adev,
                              struct audio_usecase *uc_info,
@@ -732,16 +994,23 @@ static int enable_snd_device(struct audio_device *adev,
 
     clock_gettime(CLOCK_MONOTONIC, &activation_time);
 
-    elapsed_time = time_spec_diff(adev->mixer.shutdown_time,
-                                  activation_time);
+    elapsed_time = time_spec_diff(activation_time,
+                                  adev->mixer.shutdown_time);
     if (elapsed_time.tv_sec == 0) {
         long elapsed_usec = elapsed_time.tv_nsec / 1000;
 
-        if (elapsed_usec < DAPM_STUTDOWN_TIME) {
-            usleep(DAPM_STUTDOWN_TIME - elapsed_usec);
+        if (elapsed_usec < DAPM_SHUTDOWN_TIME) {
+            usleep(DAPM_SHUTDOWN_TIME - elapsed_usec);
+            /* only the pre-roll enables devices without a usecase */
+            energy_dapm_wait(uc_info != NULL ?
+                             usecase_energy_class[uc_info->id] : ENERGY_CAPTURE,
+                             (DAPM_SHUTDOWN_TIME - elapsed_usec) * 1000LL);
         }
     }
 
+    if (!adev_mixer_ready(adev)) {
+        return -ENODEV;
+    }
     audio_route_apply_and_update_path(adev->mixer.audio_route,
                                       snd_device_name);
 
@@ -780,11 +1049,13 @@ static int disable_snd_device(struct audio_device *adev,
               snd_device,
               snd_device_name);
 
-        audio_route_reset_and_update_path(adev->mixer.audio_route,
-                                          snd_device_name);
+        if (adev_mixer_ready(adev)) {
+            audio_route_reset_and_update_path(adev->mixer.audio_route,
+                                              snd_device_name);
+        }
 
         /* Store the shutdown time */
-        clock_gettime(CLOCK_MONOTONIC, &adev->mixer.last_shutdown);
+        clock_gettime(CLOCK_MONOTONIC, &adev->mixer.shutdown_time);
     }
 
     return 0;
@@ -805,16 +1076,16 @@ static void start_ril_call(struct audio_device *adev)
 
     if (adev->two_mic_control) {
         ALOGV("%s: enabling two mic control", __func__);
-        ril_set_two_mic_control(&adev->ril, AUDIENCE, TWO_MIC_SOLUTION_ON);
+        ril_set_two_mic_control(adev_ril(adev), AUDIENCE, TWO_MIC_SOLUTION_ON);
     } else {
         ALOGV("%s: disabling two mic control", __func__);
-        ril_set_two_mic_control(&adev->ril, AUDIENCE, TWO_MIC_SOLUTION_OFF);
+        ril_set_two_mic_control(adev_ril(adev), AUDIENCE, TWO_MIC_SOLUTION_OFF);
     }
 
     adev_set_call_audio_path(adev);
     voice_set_volume(&adev->hw_device, adev->voice_volume);
 
-    ril_set_call_clock_sync(&adev->ril, SOUND_CLOCK_START);
+    ril_set_call_clock_sync(adev_ril(adev), SOUND_CLOCK_START);
 }
 
 static int select_devices(struct audio_device *adev,
@@ -881,7 +1152,15 @@ static int select_devices(struct audio_device *adev,
         } else if (usecase->type == PCM_CAPTURE) {
             usecase->devices = ((struct stream_in *)usecase->stream)->devices;
             out_snd_device = SND_DEVICE_NONE;
-            if (in_snd_device == SND_DEVICE_NONE) {
+            /*
+             * The call recorder only adds the uplink/downlink taps on top of
+             * the voice call route, it never takes over the call mics.
+             */
+            if (usecase->id == USECASE_AUDIO_CAPTURE_VOICE_CALL) {
+                in_snd_device = adev->voice.in_call ?
+                                SND_DEVICE_IN_VOICE_CALL_REC :
+                                SND_DEVICE_NONE;
+            } else if (in_snd_device == SND_DEVICE_NONE) {
                 if (active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION &&
                     adev->primary_output && !adev->primary_output->standby) {
                     in_snd_device = get_input_snd_device(adev,
@@ -906,6 +1185,9 @@ static int select_devices(struct audio_device *adev,
           in_snd_device,
           get_snd_device_display_name(in_snd_device));
 
+    energy_route_change(usecase_energy_class[uc_id], use_case_table[uc_id],
+                        device_table[out_snd_device],
+                        device_table[in_snd_device]);
 
     /* Disable current sound devices */
     if (usecase->out_snd_device != SND_DEVICE_NONE) {
@@ -992,11 +1274,18 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     audio_buffer_t in_buf;
     audio_buffer_t out_buf;
     size_t src_channels = in->config.channels;
-    size_t dst_channels = audio_channel_count_from_in_mask(in->main_channels);
+    size_t dst_channels;
     int i;
     void *proc_buf_out;
     struct pcm_device *pcm_device;
-    bool has_additional_channels = (dst_channels != src_channels) ? true : false;
+    bool has_additional_channels;
+
+    if (in->usecase == USECASE_AUDIO_CAPTURE_VOICE_CALL) {
+        dst_channels = voice_rec_channel_count(in->voice_rec_mode);
+    } else {
+        dst_channels = audio_channel_count_from_in_mask(in->main_channels);
+    }
+    has_additional_channels = (dst_channels != src_channels) ? true : false;
 
     /* Additional channels might be added on top of main_channels:
     * - aux_channels (by processing effects)
@@ -1004,7 +1293,7 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     * In case of additional channels, we cannot work inplace
     */
     if (has_additional_channels) {
-        proc_buf_out = in->proc_buf_out;
+        proc_buf_out = in->proc_buf;
     } else {
         proc_buf_out = buffer;
     }
@@ -1018,19 +1307,10 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
                               struct pcm_device,
                               stream_list_node);
 
-    /* No processing effects attached */
-    if (has_additional_channels) {
-        /* With additional channels, we cannot use original buffer */
-        if (in->proc_buf_size < (size_t)frames) {
-            size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, frames);
-            in->proc_buf_size = (size_t)frames;
-            in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out,
-                                                  size_in_bytes);
-            ALOG_ASSERT((in->proc_buf_out != NULL),
-                        "process_frames() failed to reallocate proc_buf_out");
-            proc_buf_out = in->proc_buf_out;
-        }
-    }
+    /* proc_buf holds in->max_frames, see in_read() */
+    ALOG_ASSERT((size_t)frames <= in->max_frames,
+                "%s: %zd frames for a chunk of %zu", __func__,
+                frames, in->max_frames);
     frames_wr = read_frames(in, proc_buf_out, frames);
 
     /* Remove all additional channels that have been added on top of main_channels:
@@ -1039,7 +1319,15 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
      * Assumption is made that the channels are interleaved and that the main
      * channels are first. */
 
-    if (has_additional_channels) {
+    if (in->usecase == USECASE_AUDIO_CAPTURE_VOICE_CALL) {
+        /* Select or mix the uplink/downlink slots */
+        if (frames_wr > 0) {
+            voice_rec_process(in->voice_rec_mode,
+                              (int16_t *)proc_buf_out,
+                              (int16_t *)buffer,
+                              frames_wr);
+        }
+    } else if (has_additional_channels) {
         int16_t *src_buffer = (int16_t *)proc_buf_out;
         int16_t *dst_buffer = (int16_t *)buffer;
 
@@ -1060,6 +1348,149 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     return frames_wr;
 }
 
+static enum pcm_tap_format stream_tap_format(audio_format_t format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        return PCM_TAP_S24_IN_32;
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return PCM_TAP_FLOAT;
+    default:
+        return PCM_TAP_S16;
+    }
+}
+
+/*
+ * Links are S16_LE or S24_LE. Keyed by the stream: its pcm_device is
+ * allocated again each time it starts.
+ */
+static void pcm_device_tap(const void *stream,
+                           struct pcm_device *pcm_device,
+                           enum pcm_tap_point point,
+                           const void *buffer,
+                           size_t bytes)
+{
+    pcm_tap_write(point, stream, buffer, bytes,
+                  pcm_device->config.rate, pcm_device->config.channels,
+                  pcm_device->config.format == PCM_FORMAT_S24_LE ?
+                          PCM_TAP_S24_IN_32 : PCM_TAP_S16);
+}
+
+static int pcm_device_write(struct pcm_device *pcm_device,
+                            const void *buffer,
+                            size_t bytes)
+{
+    enum pcm_watch_action action;
+    int ret;
+
+    pcm_watch_begin(&pcm_device->watch, pcm_device->pcm,
+                    pcm_bytes_to_frames(pcm_device->pcm, bytes),
+                    &pcm_device->config);
+    ret = pcm_write(pcm_device->pcm, buffer, bytes);
+    action = pcm_watch_end(&pcm_device->watch);
+    if (action != PCM_WATCH_NONE) {
+        pcm_device->recovery = action;
+    }
+
+    return ret;
+}
+
+static int pcm_device_read(struct pcm_device *pcm_device,
+                           void *buffer,
+                           size_t bytes)
+{
+    enum pcm_watch_action action;
+    int ret;
+
+    pcm_watch_begin(&pcm_device->watch, pcm_device->pcm,
+                    pcm_bytes_to_frames(pcm_device->pcm, bytes),
+                    &pcm_device->config);
+    ret = pcm_read(pcm_device->pcm, buffer, bytes);
+    action = pcm_watch_end(&pcm_device->watch);
+    if (action != PCM_WATCH_NONE) {
+        pcm_device->recovery = action;
+    }
+
+    return ret;
+}
+
+/* Resets and applies the mixer path again, the reference count stays */
+static void reapply_snd_device(struct audio_device *adev,
+                               snd_device_t snd_device)
+{
+    const char *snd_device_name;
+
+    if (snd_device == SND_DEVICE_OUT_SPEAKER_AND_HEADPHONES) {
+        reapply_snd_device(adev, SND_DEVICE_OUT_SPEAKER);
+        reapply_snd_device(adev, SND_DEVICE_OUT_HEADPHONES);
+        return;
+    }
+
+    snd_device_name = get_snd_device_name(snd_device);
+    if (snd_device_name == NULL || !adev_mixer_ready(adev)) {
+        return;
+    }
+
+    audio_route_reset_and_update_path(adev->mixer.audio_route,
+                                      snd_device_name);
+    audio_route_apply_and_update_path(adev->mixer.audio_route,
+                                      snd_device_name);
+}
+
+/*
+ * Takes the step the watchdog asked for after it stopped a stuck PCM: the
+ * call that was stuck failed, the next one finds the PCM playing again.
+ * A PCM that cannot be opened again is left NULL and -ENODEV returned,
+ * the caller puts the stream in standby so that the next call opens it.
+ * must be called with the stream mutex locked
+ */
+static int pcm_device_recover(struct audio_device *adev,
+                              struct pcm_device *pcm_device,
+                              audio_usecase_t uc_id,
+                              unsigned int flags)
+{
+    enum pcm_watch_action action = pcm_device->recovery;
+    struct audio_usecase *usecase;
+    int ret = 0;
+
+    pcm_device->recovery = PCM_WATCH_NONE;
+
+    if (action == PCM_WATCH_PREPARE) {
+        ret = pcm_prepare(pcm_device->pcm);
+    } else {
+        energy_pcm_close(&pcm_device->energy);
+        pcm_close(pcm_device->pcm);
+        pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
+                                   pcm_device->pcm_profile->id,
+                                   flags,
+                                   &pcm_device->config);
+        if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
+            ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
+            pcm_close(pcm_device->pcm);
+            pcm_device->pcm = NULL;
+            ret = -ENODEV;
+        } else {
+            energy_pcm_open(&pcm_device->energy,
+                            pcm_device_energy_class(pcm_device, uc_id),
+                            &pcm_device->config);
+        }
+    }
+
+    if (action == PCM_WATCH_REROUTE) {
+        hal_lock_acquire(&adev->lock);
+        usecase = get_usecase_from_id(adev, uc_id);
+        if (usecase != NULL) {
+            reapply_snd_device(adev, usecase->out_snd_device);
+            reapply_snd_device(adev, usecase->in_snd_device);
+        }
+        hal_lock_release(&adev->lock);
+    }
+
+    pcm_watch_recovered(&pcm_device->watch, action, ret);
+
+    return ret;
+}
+
 static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                            struct resampler_buffer *buffer)
 {
@@ -1084,19 +1515,22 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                               struct pcm_device,
                               stream_list_node);
 
+    /* Not opened again after a stall, see pcm_device_recover() */
+    if (pcm_device->pcm == NULL) {
+        buffer->raw = NULL;
+        buffer->frame_count = 0;
+        in->read_status = -ENODEV;
+        return -ENODEV;
+    }
+
     if (in->read_buf_frames == 0) {
+        /* read_buf holds the largest capture period, see in_init_arena() */
         size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm,
                                                    in->config.period_size);
-        if (in->read_buf_size < in->config.period_size) {
-            in->read_buf_size = in->config.period_size;
-            in->read_buf = (int16_t *)realloc(in->read_buf, size_in_bytes);
-            ALOG_ASSERT((in->read_buf != NULL),
-                        "get_next_buffer() failed to reallocate read_buf");
-        }
 
-        in->read_status = pcm_read(pcm_device->pcm,
-                                   (void*)in->read_buf,
-                                   size_in_bytes);
+        in->read_status = pcm_device_read(pcm_device,
+                                          (void*)in->read_buf,
+                                          size_in_bytes);
 
         if (in->read_status != 0) {
             ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
@@ -1105,6 +1539,11 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
             return in->read_status;
         }
         in->read_buf_frames = in->config.period_size;
+        pcm_device_tap(in, pcm_device, PCM_TAP_IN_POST_PCM, in->read_buf, size_in_bytes);
+
+        if (in->two_mic_active) {
+            two_mic_process(in->two_mic, in->read_buf, in->config.period_size);
+        }
     }
 
     buffer->frame_count = (buffer->frame_count > in->read_buf_frames) ?
@@ -1164,6 +1603,23 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
             in->resampler->resample_from_provider(in->resampler,
                     (int16_t *)((char *)buffer + pcm_frames_to_bytes(pcm_device->pcm, frames_wr)),
                     &frames_rd);
+        } else if (in->rate_conv != NULL) {
+            struct resampler_buffer buf = {
+                .raw = NULL,
+                .frame_count = rate_conv_in_frames(in->rate_conv, frames_rd),
+            };
+            get_next_buffer(&in->buf_provider, &buf);
+            if (buf.raw != NULL) {
+                rate_conv_process(in->rate_conv,
+                                  buf.i16,
+                                  &buf.frame_count,
+                                  (int16_t *)((char *)buffer +
+                                      pcm_frames_to_bytes(pcm_device->pcm, frames_wr)),
+                                  &frames_rd);
+            } else {
+                frames_rd = 0;
+            }
+            release_buffer(&in->buf_provider, &buf);
         } else {
             struct resampler_buffer buf = {
                 .raw = NULL,
@@ -1190,140 +1646,574 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
     return frames_wr;
 }
 
-static int in_release_pcm_devices(struct stream_in *in)
+/**********************************************************
+ * Echo reference
+ **********************************************************/
+
+static bool in_needs_echo_ref(struct stream_in *in)
 {
-    struct pcm_device *pcm_device;
-    struct listnode *node;
-    struct listnode *next;
+    return in->enable_aec &&
+           in->source == AUDIO_SOURCE_VOICE_COMMUNICATION &&
+           in->dev->echo_ref != NULL;
+}
 
-    list_for_each_safe(node, next, &in->pcm_dev_list) {
-        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
-        list_remove(node);
-        free(pcm_device);
-    }
+/* The AEC gets the reference as mono at the rate of the capture stream */
+static void in_configure_reverse(struct stream_in *in)
+{
+    effect_config_t config;
+    int32_t cmd_status;
+    uint32_t size = sizeof(int32_t);
+    int i;
 
-    return 0;
+    memset(&config, 0, sizeof(config));
+    config.inputCfg.channels = AUDIO_CHANNEL_IN_MONO;
+    config.outputCfg.channels = AUDIO_CHANNEL_IN_MONO;
+    config.inputCfg.format = AUDIO_FORMAT_PCM_16_BIT;
+    config.outputCfg.format = AUDIO_FORMAT_PCM_16_BIT;
+    config.inputCfg.samplingRate = in->requested_rate;
+    config.outputCfg.samplingRate = in->requested_rate;
+    config.inputCfg.mask = (EFFECT_CONFIG_SMP_RATE |
+                            EFFECT_CONFIG_CHANNELS |
+                            EFFECT_CONFIG_FORMAT);
+    config.outputCfg.mask = config.inputCfg.mask;
+
+    for (i = 0; i < in->num_preprocessors; i++) {
+        (*in->preprocessors[i])->command(in->preprocessors[i],
+                                         EFFECT_CMD_SET_CONFIG_REVERSE,
+                                         sizeof(effect_config_t),
+                                         &config,
+                                         &size,
+                                         &cmd_status);
+    }
 }
 
-static int stop_input_stream(struct stream_in *in)
+static void in_start_echo_ref(struct stream_in *in)
 {
-    struct audio_usecase *uc_info;
     struct audio_device *adev = in->dev;
+    uint32_t ref_rate = echo_ref_get_rate(adev->echo_ref);
+    int ret;
 
-    adev->active_input = NULL;
+    if (in->ref_resampler == NULL && ref_rate != in->requested_rate) {
+        ret = create_resampler(ref_rate,
+                               in->requested_rate,
+                               1,
+                               RESAMPLER_QUALITY_DEFAULT,
+                               NULL,
+                               &in->ref_resampler);
+        if (ret != 0) {
+            ALOGE("%s: failed to create echo reference resampler", __func__);
+            in->ref_resampler = NULL;
+            return;
+        }
+    }
 
-    ALOGV("%s: enter: usecase(%d: %s)",
+    in_configure_reverse(in);
+    memset(&in->aec_stats, 0, sizeof(in->aec_stats));
+    echo_ref_set_active(adev->echo_ref, true);
+
+    ALOGV("%s: echo reference %u -> %u Hz",
           __func__,
-          in->usecase,
-          use_case_table[in->usecase]);
+          ref_rate,
+          in->requested_rate);
+}
 
-    uc_info = get_usecase_from_id(adev, in->usecase);
-    if (uc_info == NULL) {
-        ALOGE("%s: Could not find the usecase (%d) in the list",
-              __func__,
-              in->usecase);
-        return -EINVAL;
+static void in_stop_echo_ref(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+
+    if (adev->echo_ref != NULL && in_needs_echo_ref(in)) {
+        echo_ref_set_active(adev->echo_ref, false);
     }
 
-    /* Disable the tx device */
-    disable_snd_device(adev, uc_info, uc_info->in_snd_device);
+    if (in->ref_resampler != NULL) {
+        release_resampler(in->ref_resampler);
+        in->ref_resampler = NULL;
+    }
+}
 
-    list_remove(&uc_info->adev_list_node);
-    free(uc_info);
+/*
+ * Returns the CLOCK_MONOTONIC time at which the first of the frames just
+ * returned by read_frames() was captured.
+ */
+static int get_capture_time(struct stream_in *in,
+                            size_t frames,
+                            int64_t *capture_ns)
+{
+    struct pcm_device *pcm_device;
+    struct timespec time_stamp;
+    unsigned int avail;
+    int64_t pending;
+    int status;
 
     if (list_empty(&in->pcm_dev_list)) {
-        ALOGE("%s: pcm device list empty", __func__);
-        return -EINVAL;
+        return -ENODEV;
     }
 
-    in_release_pcm_devices(in);
-    list_init(&in->pcm_dev_list);
+    pcm_device = node_to_item(list_head(&in->pcm_dev_list),
+                              struct pcm_device,
+                              stream_list_node);
 
-    ALOGV("%s: exit", __func__);
+    status = pcm_get_htimestamp(pcm_device->pcm, &avail, &time_stamp);
+    if (status < 0) {
+        return status;
+    }
+
+    /* Frames still in the kernel and in read_buf were captured after ours */
+    pending = (int64_t)avail + in->read_buf_frames +
+              (int64_t)frames * in->config.rate / in->requested_rate;
+
+    *capture_ns = time_stamp.tv_sec * 1000000000LL + time_stamp.tv_nsec -
+                  pending * 1000000000LL / in->config.rate;
 
     return 0;
 }
 
-static int start_input_stream(struct stream_in *in)
+static void in_push_echo_ref(struct stream_in *in, size_t frames)
 {
-    /* Enable output device and stream routing controls */
-    struct pcm_device_profile *pcm_profile;
     struct audio_device *adev = in->dev;
-    struct audio_usecase *uc_info;
-    struct pcm_device *pcm_device;
-    bool recreate_resampler = false;
-    int ret = 0;
+    uint32_t ref_rate = echo_ref_get_rate(adev->echo_ref);
+    size_t ref_frames = (frames * ref_rate + in->requested_rate - 1) /
+                        in->requested_rate;
+    audio_buffer_t buf;
+    int64_t capture_ns;
+    int i;
 
-    ALOGV("%s: enter: usecase(%d)", __func__, in->usecase);
+    if (get_capture_time(in, frames, &capture_ns) == 0) {
+        echo_ref_read(adev->echo_ref, in->ref_buf, ref_frames, capture_ns);
+    } else {
+        memset(in->ref_buf, 0, ref_frames * sizeof(int16_t));
+    }
+
+    if (in->ref_resampler != NULL) {
+        size_t in_frames = ref_frames;
+        size_t out_frames = frames;
+
+        in->ref_resampler->resample_from_input(in->ref_resampler,
+                                               in->ref_buf,
+                                               &in_frames,
+                                               in->ref_out_buf,
+                                               &out_frames);
+        if (out_frames < frames) {
+            memset(in->ref_out_buf + out_frames,
+                   0,
+                   (frames - out_frames) * sizeof(int16_t));
+        }
+    } else {
+        memcpy(in->ref_out_buf, in->ref_buf, frames * sizeof(int16_t));
+    }
 
-    adev->active_input = in;
+    buf.frameCount = frames;
+    buf.s16 = in->ref_out_buf;
 
-    pcm_profile = get_pcm_device(in->usecase_type, in->devices);
-    if (pcm_profile == NULL) {
-        ALOGE("%s: Could not find PCM device id for the usecase(%d)",
-              __func__,
-              in->usecase);
-        ret = -EINVAL;
-        goto error_config;
+    for (i = 0; i < in->num_preprocessors; i++) {
+        if ((*in->preprocessors[i])->process_reverse == NULL) {
+            continue;
+        }
+        (*in->preprocessors[i])->process_reverse(in->preprocessors[i],
+                                                 &buf,
+                                                 NULL);
     }
+}
 
-    uc_info = (struct audio_usecase *)calloc(1, sizeof(struct audio_usecase));
-    if (uc_info == NULL) {
-        ret = -ENOMEM;
-        goto error_config;
+/*
+ * Runs the attached pre-processors (AEC, NS, AGC) on the captured frames,
+ * in place. The echo reference is fed first so the AEC sees the playback
+ * that was rendered while these frames were captured.
+ */
+static void in_process_effects(struct stream_in *in, int16_t *buffer, size_t frames)
+{
+    size_t channels = audio_channel_count_from_in_mask(in->main_channels);
+    audio_buffer_t in_buf;
+    audio_buffer_t out_buf;
+    struct timespec start;
+    struct timespec end;
+    int64_t cpu_ns;
+    int i;
+
+    if (in->num_preprocessors == 0 || frames == 0) {
+        return;
     }
 
-    uc_info->id = in->usecase;
-    uc_info->type = PCM_CAPTURE;
-    uc_info->stream = (struct audio_stream *)in;
-    uc_info->devices = in->devices;
-    uc_info->in_snd_device = SND_DEVICE_NONE;
-    uc_info->out_snd_device = SND_DEVICE_NONE;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 
-    pcm_device = (struct pcm_device *)calloc(1, sizeof(struct pcm_device));
-    if (pcm_device == NULL) {
-        free(uc_info);
-        ret = -ENOMEM;
-        goto error_config;
+    if (in_needs_echo_ref(in)) {
+        in_push_echo_ref(in, frames);
     }
 
-    pcm_device->pcm_profile = pcm_profile;
-    list_init(&in->pcm_dev_list);
-    list_add_tail(&in->pcm_dev_list, &pcm_device->stream_list_node);
-
-    list_add_tail(&adev->usecase_list, &uc_info->adev_list_node);
+    for (i = 0; i < in->num_preprocessors; i++) {
+        in_buf.frameCount = frames;
+        in_buf.s16 = buffer;
+        out_buf.frameCount = frames;
+        out_buf.s16 = in->aec_buf;
 
-    select_devices(adev, in->usecase);
+        (*in->preprocessors[i])->process(in->preprocessors[i],
+                                         &in_buf,
+                                         &out_buf);
 
-    /* Config should be updated as profile can be changed between different calls
-     * to this function:
-     * - Trigger resampler creation
-     * - Config needs to be updated */
-    if (in->config.rate != pcm_profile->config.rate) {
-        recreate_resampler = true;
+        memcpy(buffer, in->aec_buf, out_buf.frameCount * channels * sizeof(int16_t));
     }
-    in->config = pcm_profile->config;
 
-    if (in->requested_rate != in->config.rate) {
-        recreate_resampler = true;
-    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
 
-    if (recreate_resampler) {
-        if (in->resampler) {
-            release_resampler(in->resampler);
-            in->resampler = NULL;
-        }
-        in->buf_provider.get_next_buffer = get_next_buffer;
-        in->buf_provider.release_buffer = release_buffer;
-        ret = create_resampler(in->config.rate,
-                               in->requested_rate,
-                               in->config.channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
+    cpu_ns = (end.tv_sec - start.tv_sec) * 1000000000LL +
+             (end.tv_nsec - start.tv_nsec);
+    in->aec_stats.blocks++;
+    in->aec_stats.frames += frames;
+    in->aec_stats.cpu_sum_ns += cpu_ns;
+    if (cpu_ns > in->aec_stats.cpu_max_ns) {
+        in->aec_stats.cpu_max_ns = cpu_ns;
     }
+}
 
-    /*
+/*
+ * During a VoIP call the far end plays on the VoIP output, otherwise on the
+ * primary output. Either only feeds a reference running at its rate.
+ */
+static bool out_feeds_echo_ref(const struct stream_out *out)
+{
+    const struct audio_device *adev = out->dev;
+    const struct stream_out *source = adev->voip_output != NULL ?
+                                      adev->voip_output : adev->primary_output;
+
+    return out == source &&
+           adev->echo_ref != NULL &&
+           echo_ref_get_rate(adev->echo_ref) == out->config.rate;
+}
+
+/* buffer is 16 bit, converted first for high resolution streams */
+static void out_push_echo_ref(struct stream_out *out,
+                              const int16_t *buffer,
+                              size_t frames)
+{
+    struct echo_reference_buffer ref_buf;
+    int64_t render_ns;
+
+    if (get_playback_delay(out, frames, &ref_buf) != 0) {
+        return;
+    }
+
+    render_ns = ref_buf.time_stamp.tv_sec * 1000000000LL +
+                ref_buf.time_stamp.tv_nsec +
+                ref_buf.delay_ns;
+
+    echo_ref_write(out->dev->echo_ref,
+                   buffer,
+                   frames,
+                   out->config.channels,
+                   render_ns);
+}
+
+/* The FAST output plays the test signal in place of its content */
+static void out_loopback_render(struct stream_out *out,
+                                void *buffer,
+                                size_t bytes)
+{
+    struct echo_reference_buffer ref_buf;
+    size_t frames = bytes / audio_stream_out_frame_size(&out->stream);
+    int64_t render_ns;
+
+    if (get_playback_delay(out, frames, &ref_buf) != 0) {
+        return;
+    }
+
+    render_ns = ref_buf.time_stamp.tv_sec * 1000000000LL +
+                ref_buf.time_stamp.tv_nsec +
+                ref_buf.delay_ns;
+
+    loopback_render(out->dev->loopback,
+                    (int16_t *)buffer,
+                    frames,
+                    out->config.channels,
+                    out->config.period_size,
+                    render_ns);
+}
+
+static void in_loopback_capture(struct stream_in *in,
+                                const void *buffer,
+                                size_t frames)
+{
+    int64_t capture_ns;
+
+    if (get_capture_time(in, frames, &capture_ns) != 0) {
+        return;
+    }
+
+    loopback_capture(in->dev->loopback,
+                     (const int16_t *)buffer,
+                     frames,
+                     audio_channel_count_from_in_mask(in->main_channels),
+                     in->config.period_size,
+                     capture_ns);
+}
+
+static int in_release_pcm_devices(struct stream_in *in)
+{
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    struct listnode *next;
+
+    list_for_each_safe(node, next, &in->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        pcm_watch_detach(&pcm_device->watch);
+        if (pcm_device->pcm) {
+            energy_pcm_close(&pcm_device->energy);
+            pcm_close(pcm_device->pcm);
+        }
+        list_remove(node);
+        free(pcm_device);
+    }
+
+    return 0;
+}
+
+/*
+ * Keeps the main mic running into the pre-roll while no input and no call
+ * need the capture PCM. The mic is routed as for voice recognition.
+ * must be called with hw device mutex locked
+ */
+static void preroll_arm_l(struct audio_device *adev)
+{
+    snd_device_t snd_device;
+    struct pcm *pcm;
+
+    if (adev->preroll == NULL || preroll_armed(adev->preroll) ||
+        adev->active_input != NULL || adev->voice.in_call) {
+        return;
+    }
+
+    snd_device = routing_input_snd_device(false,
+                                          AUDIO_DEVICE_NONE,
+                                          AUDIO_DEVICE_IN_BUILTIN_MIC,
+                                          AUDIO_SOURCE_VOICE_RECOGNITION,
+                                          false);
+    enable_snd_device(adev, NULL, snd_device);
+
+    pcm = pcm_open(pcm_device_capture.card,
+                   pcm_device_capture.id,
+                   PCM_IN | PCM_MONOTONIC,
+                   &pcm_config_preroll);
+    if (pcm && !pcm_is_ready(pcm)) {
+        ALOGE("%s: %s", __func__, pcm_get_error(pcm));
+        pcm_close(pcm);
+        disable_snd_device(adev, NULL, snd_device);
+        return;
+    }
+
+    if (preroll_start(adev->preroll, pcm, &pcm_config_preroll) != 0) {
+        pcm_close(pcm);
+        disable_snd_device(adev, NULL, snd_device);
+        return;
+    }
+    adev->preroll_snd_device = snd_device;
+    energy_pcm_open(&adev->preroll_energy, ENERGY_CAPTURE, &pcm_config_preroll);
+}
+
+/* must be called with hw device mutex locked */
+static void preroll_disarm_l(struct audio_device *adev)
+{
+    if (adev->preroll == NULL || !preroll_armed(adev->preroll)) {
+        return;
+    }
+
+    energy_pcm_close(&adev->preroll_energy);
+    pcm_close(preroll_stop(adev->preroll));
+    disable_snd_device(adev, NULL, adev->preroll_snd_device);
+    adev->preroll_snd_device = SND_DEVICE_NONE;
+}
+
+/* Whether the input would open the PCM the pre-roll runs, as it runs it */
+static bool in_can_take_preroll(const struct stream_in *in,
+                                const struct pcm_device_profile *pcm_profile)
+{
+    const struct audio_device *adev = in->dev;
+
+    return adev->preroll != NULL &&
+           preroll_armed(adev->preroll) &&
+           in->usecase == USECASE_AUDIO_CAPTURE &&
+           pcm_profile->card == pcm_device_capture.card &&
+           pcm_profile->id == pcm_device_capture.id &&
+           pcm_profile->config.rate == pcm_config_preroll.rate &&
+           pcm_profile->config.channels == pcm_config_preroll.channels &&
+           pcm_profile->config.format == pcm_config_preroll.format;
+}
+
+static int stop_input_stream(struct stream_in *in)
+{
+    struct audio_usecase *uc_info;
+    struct audio_device *adev = in->dev;
+
+    adev->active_input = NULL;
+
+    ALOGV("%s: enter: usecase(%d: %s)",
+          __func__,
+          in->usecase,
+          use_case_table[in->usecase]);
+
+    uc_info = get_usecase_from_id(adev, in->usecase);
+    if (uc_info == NULL) {
+        ALOGE("%s: Could not find the usecase (%d) in the list",
+              __func__,
+              in->usecase);
+        return -EINVAL;
+    }
+
+    in_stop_echo_ref(in);
+
+    /* Disable the tx device */
+    disable_snd_device(adev, uc_info, uc_info->in_snd_device);
+    in->two_mic_active = false;
+
+    usecase_remove_l(adev, uc_info);
+    free(uc_info);
+
+    if (list_empty(&in->pcm_dev_list)) {
+        ALOGE("%s: pcm device list empty", __func__);
+        return -EINVAL;
+    }
+
+    in_release_pcm_devices(in);
+    list_init(&in->pcm_dev_list);
+    in->preroll_taken = false;
+
+    preroll_arm_l(adev);
+
+    ALOGV("%s: exit", __func__);
+
+    return 0;
+}
+
+/* Fades the first frames in, against the plop of the mics powering up */
+static void in_start_ramp(struct stream_in *in)
+{
+    unsigned int ramp_ms = in->usecase == USECASE_AUDIO_CAPTURE_VOIP ?
+                           VOIP_START_RAMP_MS : CAPTURE_START_RAMP_MS;
+
+    in->ramp_frames = ramp_ms * in->requested_rate / 1000;
+    in->ramp_step = (uint16_t)(USHRT_MAX / in->ramp_frames);
+    in->ramp_vol = 0;
+}
+
+static int start_input_stream(struct stream_in *in)
+{
+    /* Enable output device and stream routing controls */
+    struct pcm_device_profile *pcm_profile;
+    struct audio_device *adev = in->dev;
+    struct audio_usecase *uc_info;
+    struct pcm_device *pcm_device;
+    bool recreate_resampler = false;
+    bool take_preroll;
+    struct timespec start, end;
+    int ret = 0;
+
+    ALOGV("%s: enter: usecase(%d)", __func__, in->usecase);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    adev->active_input = in;
+    in->preroll_taken = false;
+
+    pcm_profile = get_pcm_device(in->usecase_type, in->devices);
+    if (pcm_profile == NULL) {
+        ALOGE("%s: Could not find PCM device id for the usecase(%d)",
+              __func__,
+              in->usecase);
+        ret = -EINVAL;
+        goto error_config;
+    }
+    pcm_profile = get_sco_profile(adev, pcm_profile);
+    pcm_profile = get_voip_profile(in->usecase, pcm_profile);
+
+    /* Otherwise the capture PCM and the mic route are freed first */
+    take_preroll = in_can_take_preroll(in, pcm_profile);
+    if (!take_preroll) {
+        preroll_disarm_l(adev);
+    }
+
+    uc_info = (struct audio_usecase *)calloc(1, sizeof(struct audio_usecase));
+    if (uc_info == NULL) {
+        ret = -ENOMEM;
+        goto error_config;
+    }
+
+    uc_info->id = in->usecase;
+    uc_info->type = PCM_CAPTURE;
+    uc_info->stream = (struct audio_stream *)in;
+    uc_info->devices = in->devices;
+    uc_info->in_snd_device = SND_DEVICE_NONE;
+    uc_info->out_snd_device = SND_DEVICE_NONE;
+
+    pcm_device = (struct pcm_device *)calloc(1, sizeof(struct pcm_device));
+    if (pcm_device == NULL) {
+        free(uc_info);
+        ret = -ENOMEM;
+        goto error_config;
+    }
+
+    pcm_device->pcm_profile = pcm_profile;
+    pcm_device->config = pcm_profile->config;
+    if (pcm_profile == &pcm_device_capture_voip) {
+        in_voip_config(in, &pcm_device->config);
+    }
+    list_init(&in->pcm_dev_list);
+    list_add_tail(&in->pcm_dev_list, &pcm_device->stream_list_node);
+
+    usecase_add_l(adev, uc_info, false);
+
+    /* Both mics are routed, one slot each, only for the main mics */
+    in->two_mic_active = in->two_mic != NULL &&
+                         adev->ns_in_voice_rec &&
+                         !adev->voice.in_call &&
+                         (in->devices & (AUDIO_DEVICE_IN_BUILTIN_MIC |
+                                         AUDIO_DEVICE_IN_BACK_MIC) &
+                          ~AUDIO_DEVICE_BIT_IN) != 0;
+    if (in->two_mic_active) {
+        two_mic_reset(in->two_mic);
+    }
+
+    select_devices(adev, in->usecase);
+
+    /* Config should be updated as profile can be changed between different calls
+     * to this function:
+     * - Trigger resampler creation
+     * - Config needs to be updated */
+    if (in->config.rate != pcm_device->config.rate) {
+        recreate_resampler = true;
+    }
+    in->config = pcm_device->config;
+
+    if (in->requested_rate != in->config.rate) {
+        recreate_resampler = true;
+    }
+
+    if (recreate_resampler) {
+        if (in->resampler) {
+            release_resampler(in->resampler);
+            in->resampler = NULL;
+        }
+        if (in->rate_conv) {
+            rate_conv_destroy(in->rate_conv);
+            in->rate_conv = NULL;
+        }
+        in->buf_provider.get_next_buffer = get_next_buffer;
+        in->buf_provider.release_buffer = release_buffer;
+        if (pcm_profile->id == PCM_DEVICE_SCO &&
+            rate_conv_supported(in->config.rate, in->requested_rate)) {
+            /* The SCO link is an integer fraction of the stream rate */
+            in->rate_conv = rate_conv_create(in->config.rate,
+                                             in->requested_rate,
+                                             in->config.channels,
+                                             in->config.channels);
+            ret = (in->rate_conv == NULL) ? -ENOMEM : 0;
+        } else if (in->requested_rate != in->config.rate) {
+            ret = create_resampler(in->config.rate,
+                                   in->requested_rate,
+                                   in->config.channels,
+                                   RESAMPLER_QUALITY_DEFAULT,
+                                   &in->buf_provider,
+                                   &in->resampler);
+        }
+    }
+
+    /*
      * Open the PCM device.
      * The HW is limited to support only the default pcm_profile settings.  As
      * such a change in aux_channels will not have an effect.
@@ -1333,15 +2223,33 @@ static int start_input_stream(struct stream_in *in)
           __func__,
           pcm_device->pcm_profile->card,
           pcm_device->pcm_profile->id,
-          pcm_device->pcm_profile->config.channels,
-          pcm_device->pcm_profile->config.rate,
-          pcm_device->pcm_profile->config.format,
-          pcm_device->pcm_profile->config.period_size);
+          pcm_device->config.channels,
+          pcm_device->config.rate,
+          pcm_device->config.format,
+          pcm_device->config.period_size);
 
-    pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
-                               pcm_device->pcm_profile->id,
-                               PCM_IN|PCM_MONOTONIC,
-                               &pcm_device->pcm_profile->config);
+    if (take_preroll) {
+        /*
+         * Running with the longer periods of the pre-roll, in->config keeps
+         * the periods read_buf is made for. The route of the pre-roll goes
+         * now that the input's is up.
+         */
+        pcm_device->pcm = preroll_take(adev->preroll,
+                                       in->preroll_ms,
+                                       in->requested_rate,
+                                       audio_channel_count_from_in_mask(in->main_channels),
+                                       &pcm_device->config);
+        in->preroll_taken = true;
+        /* accounted from here on as the input's */
+        energy_pcm_close(&adev->preroll_energy);
+        disable_snd_device(adev, NULL, adev->preroll_snd_device);
+        adev->preroll_snd_device = SND_DEVICE_NONE;
+    } else {
+        pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
+                                   pcm_device->pcm_profile->id,
+                                   PCM_IN|PCM_MONOTONIC,
+                                   &pcm_device->config);
+    }
 
     if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
         ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
@@ -1350,18 +2258,37 @@ static int start_input_stream(struct stream_in *in)
         ret = -EIO;
         goto error_open;
     }
+    pcm_watch_attach(&pcm_device->watch, use_case_table[in->usecase], true);
+    energy_pcm_open(&pcm_device->energy,
+                    pcm_device_energy_class(pcm_device, in->usecase),
+                    &pcm_device->config);
 
-    /* force read and proc buffer reallocation in case of frame size or
-     * channel count change */
-    in->proc_buf_frames = 0;
-    in->proc_buf_size = 0;
-    in->read_buf_size = 0;
     in->read_buf_frames = 0;
+    if (in->preroll_taken) {
+        /* the mics are already up */
+        in->ramp_frames = 0;
+    } else {
+        in_start_ramp(in);
+    }
 
     /* if no supported sample rate is available, use the resampler */
     if (in->resampler) {
         in->resampler->reset(in->resampler);
     }
+    if (in->rate_conv) {
+        rate_conv_reset(in->rate_conv);
+    }
+
+    if (in_needs_echo_ref(in)) {
+        in_start_echo_ref(in);
+    }
+
+    if (adev->preroll != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        preroll_account_start(adev->preroll, in->preroll_taken,
+                              (end.tv_sec - start.tv_sec) * 1000000000LL +
+                              (end.tv_nsec - start.tv_nsec));
+    }
 
     ALOGV("%s: exit", __func__);
 
@@ -1372,6 +2299,10 @@ error_open:
         release_resampler(in->resampler);
         in->resampler = NULL;
     }
+    if (in->rate_conv) {
+        rate_conv_destroy(in->rate_conv);
+        in->rate_conv = NULL;
+    }
     stop_input_stream(in);
 
 error_config:
@@ -1382,28 +2313,54 @@ error_config:
     return ret;
 }
 
-static void lock_input_stream(struct stream_in *in)
+/*
+ * The lock helpers take the name of their caller, so that hal_lock accounts
+ * each acquisition to where it is made rather than to the helper.
+ */
+#define lock_input_stream(in) lock_input_stream_site((in), __func__)
+#define lock_output_stream(out) lock_output_stream_site((out), __func__)
+#define lock_all_outputs(adev) lock_all_outputs_site((adev), __func__)
+#define lock_output_state(out) lock_output_state_site((out), __func__)
+
+static void lock_input_stream_site(struct stream_in *in, const char *site)
 {
-    pthread_mutex_lock(&in->pre_lock);
-    pthread_mutex_lock(&in->lock);
-    pthread_mutex_unlock(&in->pre_lock);
+    hal_lock_acquire_site(&in->pre_lock, site);
+    hal_lock_acquire_site(&in->lock, site);
+    hal_lock_release(&in->pre_lock);
 }
 
 static void unlock_input_stream(struct stream_in *in)
 {
-    pthread_mutex_unlock(&in->lock);
+    hal_lock_release(&in->lock);
 }
 
-static void lock_output_stream(struct stream_out *out)
+/* Returns how long the caller waited, 0 without contention */
+static int64_t lock_output_stream_site(struct stream_out *out, const char *site)
 {
-    pthread_mutex_lock(&out->pre_lock);
-    pthread_mutex_lock(&out->lock);
-    pthread_mutex_unlock(&out->pre_lock);
+    int64_t wait_ns;
+
+    wait_ns = hal_lock_acquire_site(&out->pre_lock, site);
+    wait_ns += hal_lock_acquire_site(&out->lock, site);
+    hal_lock_release(&out->pre_lock);
+
+    return wait_ns;
 }
 
 static void unlock_output_stream(struct stream_out *out)
 {
-    pthread_mutex_unlock(&out->lock);
+    hal_lock_release(&out->lock);
+}
+
+static void out_account_lock_wait(struct stream_out *out, int64_t wait_ns)
+{
+    out->lock_stats.writes++;
+    if (wait_ns > 0) {
+        out->lock_stats.contended++;
+        out->lock_stats.wait_sum_ns += wait_ns;
+        if (wait_ns > out->lock_stats.wait_max_ns) {
+            out->lock_stats.wait_max_ns = wait_ns;
+        }
+    }
 }
 
 static int uc_release_pcm_devices(struct audio_usecase *usecase)
@@ -1440,7 +2397,9 @@ static int uc_select_pcm_devices(struct audio_usecase *usecase)
             return -ENOMEM;
         }
 
-        pcm_device->pcm_profile = pcm_profile;
+        pcm_device->pcm_profile = get_voip_profile(out->usecase,
+                                                   get_sco_profile(out->dev,
+                                                                   pcm_profile));
         list_add_tail(&out->pcm_dev_list, &pcm_device->stream_list_node);
         devices &= ~pcm_profile->devices;
 
@@ -1458,25 +2417,82 @@ static int out_close_pcm_devices(struct stream_out *out)
 
     list_for_each(node, &out->pcm_dev_list) {
         pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        pcm_watch_detach(&pcm_device->watch);
         if (pcm_device->pcm) {
+            energy_pcm_close(&pcm_device->energy);
             pcm_close(pcm_device->pcm);
             pcm_device->pcm = NULL;
         }
+        pcm_device->recovery = PCM_WATCH_NONE;
 
         if (pcm_device->resampler) {
             release_resampler(pcm_device->resampler);
             pcm_device->resampler = NULL;
         }
 
+        if (pcm_device->rate_conv) {
+            rate_conv_destroy(pcm_device->rate_conv);
+            pcm_device->rate_conv = NULL;
+        }
+
         if (pcm_device->res_buffer) {
             free(pcm_device->res_buffer);
             pcm_device->res_buffer = NULL;
         }
+
+        if (pcm_device->conv_buffer) {
+            free(pcm_device->conv_buffer);
+            pcm_device->conv_buffer = NULL;
+        }
     }
 
     return 0;
 }
 
+/*
+ * The link runs at the stream rate when it can, see link_rate.h, and high
+ * resolution streams keep 24 bits if the link takes them and nothing has
+ * to be resampled. Deep buffer outputs take their periods from the current
+ * power mode, scaled to keep their duration.
+ */
+static void out_set_pcm_config(struct stream_out *out,
+                               struct pcm_device *pcm_device)
+{
+    const struct link_rates *rates = &pcm_device->pcm_profile->rates;
+    const struct pcm_config *deep;
+
+    pcm_device->config = pcm_device->pcm_profile->config;
+    pcm_device->config.rate = link_rate_select(rates, out->sample_rate);
+    pcm_device->config.format = PCM_FORMAT_S16_LE;
+    if (out->format != AUDIO_FORMAT_PCM_16_BIT &&
+        rates->max_bits >= 24 &&
+        pcm_device->config.rate == out->sample_rate) {
+        pcm_device->config.format = PCM_FORMAT_S24_LE;
+    }
+
+    if (pcm_device->pcm_profile == &pcm_device_playback_voip) {
+        voip_set_periods(out->dev, &pcm_device->config, true);
+        return;
+    }
+
+    if (!(out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) ||
+        pcm_device->pcm_profile->id != PCM_DEVICE_PLAYBACK) {
+        return;
+    }
+
+    deep = out->low_power ? &pcm_config_deep_buffer_low_power :
+                            &pcm_config_deep_buffer;
+
+    pcm_device->config.period_size = deep->period_size *
+                                     pcm_device->config.rate / deep->rate;
+    pcm_device->config.period_count = deep->period_count;
+    pcm_device->config.start_threshold = deep->start_threshold *
+                                         pcm_device->config.rate / deep->rate;
+    pcm_device->config.stop_threshold = deep->stop_threshold;
+    pcm_device->config.avail_min = deep->avail_min *
+                                   pcm_device->config.rate / deep->rate;
+}
+
 static int out_open_pcm_devices(struct stream_out *out)
 {
     struct pcm_device *pcm_device;
@@ -1491,38 +2507,89 @@ static int out_open_pcm_devices(struct stream_out *out)
               pcm_device->pcm_profile->card,
               pcm_device->pcm_profile->id);
 
+        out_set_pcm_config(out, pcm_device);
         pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
                                    pcm_device->pcm_profile->id,
                                    PCM_OUT|PCM_MONOTONIC,
-                                   &pcm_device->pcm_profile->config);
+                                   &pcm_device->config);
         if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
             ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
             pcm_device->pcm = NULL;
             ret = -EIO;
             goto error_open;
         }
+        pcm_watch_attach(&pcm_device->watch, use_case_table[out->usecase], false);
+        energy_pcm_open(&pcm_device->energy,
+                        pcm_device_energy_class(pcm_device, out->usecase),
+                        &pcm_device->config);
 
         /*
         * If the stream rate differs from the PCM rate, we need to
         * create a resampler.
         */
-        if (out->sample_rate != pcm_device->pcm_profile->config.rate) {
+        if (out->sample_rate != pcm_device->config.rate) {
+            uint32_t channels = audio_channel_count_from_out_mask(out->channel_mask);
+            size_t res_frames;
+
             ALOGV("%s: create_resampler(), pcm_device_card(%d), "
                   "pcm_device_id(%d), out_rate(%d), device_rate(%d)",
                   __func__,
                   pcm_device->pcm_profile->card,
                   pcm_device->pcm_profile->id,
                   out->sample_rate,
-                  pcm_device->pcm_profile->config.rate);
+                  pcm_device->config.rate);
+
+            /* The SCO link is an integer fraction of the stream rate */
+            if (pcm_device->pcm_profile->id == PCM_DEVICE_SCO &&
+                rate_conv_supported(out->sample_rate,
+                                    pcm_device->config.rate)) {
+                pcm_device->rate_conv =
+                        rate_conv_create(out->sample_rate,
+                                         pcm_device->config.rate,
+                                         channels,
+                                         pcm_device->pcm_profile->config.channels);
+                if (pcm_device->rate_conv == NULL) {
+                    ret = -ENOMEM;
+                    goto error_open;
+                }
+                res_frames = rate_conv_out_frames(pcm_device->rate_conv,
+                                                  out->config.period_size);
+            } else {
+                ret = create_resampler(out->sample_rate,
+                                       pcm_device->config.rate,
+                                       channels,
+                                       (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) ?
+                                               RESAMPLER_QUALITY_HIGH :
+                                               RESAMPLER_QUALITY_DEFAULT,
+                                       NULL,
+                                       &pcm_device->resampler);
+                if (ret != 0) {
+                    goto error_open;
+                }
+                res_frames = out->config.period_size *
+                             pcm_device->config.rate /
+                             out->sample_rate + 1;
+            }
 
-            ret = create_resampler(out->sample_rate,
-                                   pcm_device->pcm_profile->config.rate,
-                                   audio_channel_count_from_out_mask(out->channel_mask),
-                                   RESAMPLER_QUALITY_DEFAULT,
-                                   NULL,
-                                   &pcm_device->resampler);
-            pcm_device->res_byte_count = 0;
-            pcm_device->res_buffer = NULL;
+            /* Output is written in chunks of at most this size */
+            pcm_device->res_byte_count =
+                    pcm_frames_to_bytes(pcm_device->pcm, res_frames);
+            pcm_device->res_buffer = malloc(pcm_device->res_byte_count);
+            if (pcm_device->res_buffer == NULL) {
+                ret = -ENOMEM;
+                goto error_open;
+            }
+        }
+
+        if (out->format != AUDIO_FORMAT_PCM_16_BIT) {
+            pcm_device->conv_frames = out->config.period_size;
+            pcm_device->conv_buffer =
+                    malloc(pcm_frames_to_bytes(pcm_device->pcm,
+                                               pcm_device->conv_frames));
+            if (pcm_device->conv_buffer == NULL) {
+                ret = -ENOMEM;
+                goto error_open;
+            }
         }
     }
 
@@ -1539,7 +2606,7 @@ static int disable_output_path_l(struct stream_out *out)
     struct audio_device *adev = out->dev;
     struct audio_usecase *uc_info;
 
-    uc_info = get_usecase_from_id(adev, out->usecase);
+    uc_info = get_usecase_from_stream(adev, &out->stream.common);
     if (uc_info == NULL) {
         ALOGE("%s: Could not find the usecase (%d) in the list",
              __func__,
@@ -1549,7 +2616,7 @@ static int disable_output_path_l(struct stream_out *out)
 
     disable_snd_device(adev, uc_info, uc_info->out_snd_device);
     uc_release_pcm_devices(uc_info);
-    list_remove(&uc_info->adev_list_node);
+    usecase_remove_l(adev, uc_info);
     free(uc_info);
 
     return 0;
@@ -1572,7 +2639,7 @@ static int enable_output_path_l(struct stream_out *out)
     uc_info->out_snd_device = SND_DEVICE_NONE;
     uc_select_pcm_devices(uc_info);
 
-    list_add_tail(&adev->usecase_list, &uc_info->adev_list_node);
+    usecase_add_l(adev, uc_info, true);
     select_devices(adev, out->usecase);
 
     return 0;
@@ -1626,19 +2693,22 @@ error_open:
     return ret;
 }
 
+static void start_bt_sco(struct audio_device *adev);
+static void stop_bt_sco(struct audio_device *adev);
+
 static int stop_voice_call(struct audio_device *adev)
 {
     struct audio_usecase *uc_info;
 
     ALOGV("%s: enter", __func__);
     if (!adev->voice.in_call) {
-        return;
+        return 0;
     }
 
-    adev->voice.in_call = false;
+    /* Do not change devices if we are switching to WB, the call goes on */
+    if (adev->mode != AUDIO_MODE_IN_CALL) {
+        adev->voice.in_call = false;
 
-    /* Do not change devices if we are switching to WB */
-    if (adev->mode != AUDIO_MODE_IN_CALL) {
         uc_info = get_usecase_from_id(adev, USECASE_VOICE_CALL);
         if (uc_info == NULL) {
             ALOGE("%s: Could not find the usecase (%d) in the list",
@@ -1648,10 +2718,14 @@ static int stop_voice_call(struct audio_device *adev)
 
         disable_snd_device(adev, uc_info, uc_info->out_snd_device);
         disable_snd_device(adev, uc_info, uc_info->in_snd_device);
+        stop_bt_sco(adev);
 
         uc_release_pcm_devices(uc_info);
-        list_remove(&uc_info->adev_list_node);
+        usecase_remove_l(adev, uc_info);
         free(uc_info);
+        energy_pcm_close(&adev->voice.energy);
+
+        preroll_arm_l(adev);
     }
 
     ALOGV("%s: exit", __func__);
@@ -1666,6 +2740,13 @@ static int start_voice_call(struct audio_device *adev)
 
     ALOGV("%s: enter", __func__);
 
+    /* still up, stop_voice_call() kept it for a switch to WB */
+    if (adev->voice.in_call) {
+        return 0;
+    }
+
+    preroll_disarm_l(adev);
+
     uc_info = (struct audio_usecase *)calloc(1, sizeof(struct audio_usecase));
     uc_info->id = USECASE_VOICE_CALL;
     uc_info->type = VOICE_CALL;
@@ -1676,16 +2757,22 @@ static int start_voice_call(struct audio_device *adev)
 
     uc_select_pcm_devices(uc_info);
 
-    list_add_tail(&adev->usecase_list, &uc_info->adev_list_node);
+    usecase_add_l(adev, uc_info, false);
 
     select_devices(adev, USECASE_VOICE_CALL);
+    energy_pcm_open(&adev->voice.energy, ENERGY_VOICE, NULL);
 
+    /* the only user of the hostless link, streams on SCO open their own PCM */
+    if (uc_info->devices & AUDIO_DEVICE_OUT_ALL_SCO) {
+        start_bt_sco(adev);
+    }
 
     /* TODO: implement voice call start */
 
     /* set cached volume */
     set_voice_volume_l(adev, adev->voice_volume);
 
+    adev->voice.in_call = true;
     adev->in_call = true;
     ALOGV("%s: exit", __func__);
     return 0;
@@ -1798,6 +2885,10 @@ static int do_out_standby_l(struct stream_out *out)
     int status = 0;
 
     out->standby = true;
+    if (out->writer_tid != 0) {
+        thread_mgr_leave(out->writer_tid);
+        out->writer_tid = 0;
+    }
     stop_compressed_output_l(out);
     out->gapless_mdata.encoder_delay = 0;
     out->gapless_mdata.encoder_padding = 0;
@@ -1822,9 +2913,9 @@ static int out_standby(struct audio_stream *stream)
 
     lock_output_stream(out);
     if (!out->standby) {
-        pthread_mutex_lock(&adev->lock);
+        hal_lock_acquire(&adev->lock);
         do_out_standby_l(out);
-        pthread_mutex_unlock(&adev->lock);
+        hal_lock_release(&adev->lock);
     }
     unlock_output_stream(out);
 
@@ -1838,6 +2929,91 @@ static int out_dump(const struct audio_stream *stream __unused, int fd __unused)
     return 0;
 }
 
+/**********************************************************
+ * Bluetooth SCO link
+ **********************************************************/
+
+/*
+ * While a call is routed to SCO the link runs hostless, the codec moves the
+ * audio between AIF3 and the baseband. Only the voice call usecase starts
+ * it: outputs and inputs on SCO open the same PCM device themselves. Narrowband or wideband only changes
+ * the link configuration, the primary outputs are never touched.
+ *
+ * Must be called with hw device mutex locked.
+ */
+static void start_bt_sco(struct audio_device *adev)
+{
+    struct pcm_device_profile *rx_profile =
+            get_sco_profile(adev, &pcm_device_playback_sco);
+    struct pcm_device_profile *tx_profile =
+            get_sco_profile(adev, &pcm_device_capture_sco);
+
+    if (adev->sco.rx != NULL || adev->sco.tx != NULL) {
+        ALOGW("%s: SCO PCMs already open!", __func__);
+        return;
+    }
+
+    ALOGV("%s: Opening SCO PCMs, %u Hz, %u channel(s)",
+          __func__,
+          rx_profile->config.rate,
+          rx_profile->config.channels);
+
+    adev->sco.rx = pcm_open(rx_profile->card,
+                            rx_profile->id,
+                            PCM_OUT | PCM_MONOTONIC,
+                            &rx_profile->config);
+    if (adev->sco.rx != NULL && !pcm_is_ready(adev->sco.rx)) {
+        ALOGE("%s: cannot open PCM SCO RX stream: %s",
+              __func__, pcm_get_error(adev->sco.rx));
+        goto err_sco_rx;
+    }
+
+    adev->sco.tx = pcm_open(tx_profile->card,
+                            tx_profile->id,
+                            PCM_IN | PCM_MONOTONIC,
+                            &tx_profile->config);
+    if (adev->sco.tx != NULL && !pcm_is_ready(adev->sco.tx)) {
+        ALOGE("%s: cannot open PCM SCO TX stream: %s",
+              __func__, pcm_get_error(adev->sco.tx));
+        goto err_sco_tx;
+    }
+
+    pcm_start(adev->sco.rx);
+    pcm_start(adev->sco.tx);
+    energy_pcm_open(&adev->sco.rx_energy, ENERGY_SCO, &rx_profile->config);
+    energy_pcm_open(&adev->sco.tx_energy, ENERGY_SCO, &tx_profile->config);
+
+    return;
+
+err_sco_tx:
+    pcm_close(adev->sco.tx);
+    adev->sco.tx = NULL;
+err_sco_rx:
+    pcm_close(adev->sco.rx);
+    adev->sco.rx = NULL;
+}
+
+/* Must be called with hw device mutex locked */
+static void stop_bt_sco(struct audio_device *adev)
+{
+    ALOGV("%s: Closing SCO PCMs", __func__);
+
+    energy_pcm_close(&adev->sco.rx_energy);
+    energy_pcm_close(&adev->sco.tx_energy);
+
+    if (adev->sco.rx != NULL) {
+        pcm_stop(adev->sco.rx);
+        pcm_close(adev->sco.rx);
+        adev->sco.rx = NULL;
+    }
+
+    if (adev->sco.tx != NULL) {
+        pcm_stop(adev->sco.tx);
+        pcm_close(adev->sco.tx);
+        adev->sco.tx = NULL;
+    }
+}
+
 /**********************************************************
  * Samsung RIL functions
  **********************************************************/
@@ -1887,10 +3063,7 @@ static int start_voice_call(struct audio_device *adev)
     pcm_start(adev->pcm_voice_rx);
     pcm_start(adev->pcm_voice_tx);
 
-    /* start SCO stream if needed */
-    if (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO) {
-        start_bt_sco(adev);
-    }
+    /* the SCO link is started with the voice call usecase, see start_bt_sco() */
 
     return 0;
 
@@ -1928,12 +3101,6 @@ static void stop_voice_call(struct audio_device *adev)
         status++;
     }
 
-    /* End SCO stream if needed */
-    if (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO) {
-        stop_bt_sco(adev);
-        status++;
-    }
-
     ALOGV("%s: Successfully closed %d active PCMs", __func__, status);
 }
 
@@ -1951,16 +3118,16 @@ static void start_ril_call(struct audio_device *adev)
 
     if (adev->two_mic_control) {
         ALOGV("%s: enabling two mic control", __func__);
-        ril_set_two_mic_control(&adev->ril, AUDIENCE, TWO_MIC_SOLUTION_ON);
+        ril_set_two_mic_control(adev_ril(adev), AUDIENCE, TWO_MIC_SOLUTION_ON);
     } else {
         ALOGV("%s: disabling two mic control", __func__);
-        ril_set_two_mic_control(&adev->ril, AUDIENCE, TWO_MIC_SOLUTION_OFF);
+        ril_set_two_mic_control(adev_ril(adev), AUDIENCE, TWO_MIC_SOLUTION_OFF);
     }
 
     adev_set_call_audio_path(adev);
     voice_set_volume(&adev->hw_device, adev->voice_volume);
 
-    ril_set_call_clock_sync(&adev->ril, SOUND_CLOCK_START);
+    ril_set_call_clock_sync(adev_ril(adev), SOUND_CLOCK_START);
 }
 
 static void start_call(struct audio_device *adev)
@@ -1989,7 +3156,7 @@ static void stop_call(struct audio_device *adev)
         return;
     }
 
-    ril_set_call_clock_sync(&adev->ril, SOUND_CLOCK_STOP);
+    ril_set_call_clock_sync(adev_ril(adev), SOUND_CLOCK_STOP);
     stop_voice_call(adev);
 
     /* Do not change devices if we are switching to WB */
@@ -2017,7 +3184,9 @@ static void adev_set_wb_amr_callback(void *data, int enable)
 {
     struct audio_device *adev = (struct audio_device *)data;
 
-    pthread_mutex_lock(&adev->lock);
+    thread_mgr_enter(THREAD_ROLE_RIL);
+
+    hal_lock_acquire(&adev->lock);
 
     if (adev->wb_amr != enable) {
         adev->wb_amr = enable;
@@ -2033,7 +3202,7 @@ static void adev_set_wb_amr_callback(void *data, int enable)
         }
     }
 
-    pthread_mutex_unlock(&adev->lock);
+    hal_lock_release(&adev->lock);
 }
 
 static void adev_set_call_audio_path(struct audio_device *adev)
@@ -2066,19 +3235,24 @@ static void adev_set_call_audio_path(struct audio_device *adev)
 
     ALOGV("%s: ril_set_call_audio_path(%d)", __func__, device_type);
 
-    ril_set_call_audio_path(&adev->ril, device_type);
+    ril_set_call_audio_path(adev_ril(adev), device_type);
 }
 
-/* must be called with hw device outputs list, output stream, and hw device mutexes locked */
+static void force_non_hdmi_out_standby(struct audio_device *adev);
+
+/*
+ * must be called with output stream and hw device mutexes locked, and for HDMI
+ * with hw device outputs list and all output streams locked as well
+ */
 static int start_output_stream(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
 
     ALOGV("%s: starting stream", __func__);
 
-    if (out == adev->outputs[OUTPUT_HDMI]) {
+    if (out_is_hdmi(out)) {
         force_non_hdmi_out_standby(adev);
-    } else if (adev->outputs[OUTPUT_HDMI] && !adev->outputs[OUTPUT_HDMI]->standby) {
+    } else if (dev_state_hdmi_active(&adev->dev_state, out->state_slot)) {
         out->disabled = true;
         return 0;
     }
@@ -2123,7 +3297,7 @@ static int start_output_stream(struct stream_out *out)
     }
 
     if (out->device & AUDIO_DEVICE_OUT_AUX_DIGITAL) {
-        set_hdmi_channels(adev, out->config.channels);
+        hdmi_caps_set_channels(out->config.channels);
     }
 
     ALOGV("%s: stream out device: %d, actual: %d",
@@ -2337,9 +3511,11 @@ static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
     return out->channel_mask;
 }
 
-static audio_format_t out_get_format(const struct audio_stream *stream __unused)
+static audio_format_t out_get_format(const struct audio_stream *stream)
 {
-    return AUDIO_FORMAT_PCM_16_BIT;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    return out->format;
 }
 
 static int out_set_format(struct audio_stream *stream __unused,
@@ -2349,30 +3525,40 @@ static int out_set_format(struct audio_stream *stream __unused,
 }
 
 /* Return the set of output devices associated with active streams
- * other than out.  Assumes out is non-NULL and out->dev is locked.
+ * other than out, as last published. Needs no lock on the other streams.
  */
 static audio_devices_t output_devices(struct stream_out *out)
 {
-    struct audio_device *dev = out->dev;
-    enum output_type type;
-    audio_devices_t devices = AUDIO_DEVICE_NONE;
-
-    for (type = 0; type < OUTPUT_TOTAL; ++type) {
-        struct stream_out *other = dev->outputs[type];
-        if (other && (other != out) && !other->standby) {
-            // TODO no longer accurate
-            /* safe to access other stream without a mutex,
-             * because we hold the dev lock,
-             * which prevents the other stream from being closed
-             */
-            devices |= other->device;
-        }
+    return dev_state_other_devices(&out->dev->dev_state, out->state_slot);
+}
+
+/* must be called with output stream and hw device mutexes locked */
+static void out_publish_state(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+
+    uint32_t flags = 0;
+
+    if (out_is_hdmi(out)) {
+        flags |= DEV_STATE_OUTPUT_HDMI;
     }
+    if (out->flags & AUDIO_OUTPUT_FLAG_FAST) {
+        flags |= DEV_STATE_OUTPUT_LOW_LATENCY;
+    }
+
+    dev_state_set_output(&adev->dev_state,
+                         out->state_slot,
+                         out->standby ? AUDIO_DEVICE_NONE : out->device,
+                         flags);
 
-    return devices;
+    /* The governor reacts too late for the first low latency periods */
+    thread_mgr_set_boost(dev_state_low_latency_active(&adev->dev_state));
 }
 
-/* must be called with hw device outputs list, all out streams, and hw device mutex locked */
+/*
+ * must be called with output stream and hw device mutexes locked, and for HDMI
+ * with hw device outputs list and all output streams locked as well
+ */
 static void do_out_standby(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
@@ -2388,8 +3574,13 @@ static void do_out_standby(struct stream_out *out)
             }
         }
         out->standby = true;
+        out_publish_state(out);
+        if (out->writer_tid != 0) {
+            thread_mgr_leave(out->writer_tid);
+            out->writer_tid = 0;
+        }
 
-        if (out == adev->outputs[OUTPUT_HDMI]) {
+        if (out_is_hdmi(out)) {
             /* force standby on low latency output stream so that it can reuse HDMI driver if
              * necessary when restarted */
             force_non_hdmi_out_standby(adev);
@@ -2404,51 +3595,160 @@ static void do_out_standby(struct stream_out *out)
     }
 }
 
-/* lock outputs list, all output streams, and device */
-static void lock_all_outputs(struct audio_device *adev)
+/*
+ * must be called with hw device outputs list, all output streams, and hw
+ * device mutexes locked
+ */
+static void force_non_hdmi_out_standby(struct audio_device *adev)
 {
-    enum output_type type;
-    pthread_mutex_lock(&adev->lock_outputs);
-    for (type = 0; type < OUTPUT_TOTAL; ++type) {
-        struct stream_out *out = adev->outputs[type];
-        if (out) {
-            lock_output_stream(out);
+    struct stream_out *out;
+    struct listnode *node;
+
+    list_for_each(node, &adev->output_list) {
+        out = node_to_item(node, struct stream_out, adev_list_node);
+        if (!out_is_hdmi(out)) {
+            do_out_standby(out);
         }
     }
-    pthread_mutex_lock(&adev->lock);
+}
+
+/* lock outputs list, all output streams, and device */
+static void lock_all_outputs_site(struct audio_device *adev, const char *site)
+{
+    struct stream_out *out;
+    struct listnode *node;
+
+    hal_lock_acquire_site(&adev->lock_outputs, site);
+    list_for_each(node, &adev->output_list) {
+        out = node_to_item(node, struct stream_out, adev_list_node);
+        lock_output_stream_site(out, site);
+    }
+    hal_lock_acquire_site(&adev->lock, site);
 }
 
 /* unlock device, all output streams (except specified stream), and outputs list */
 static void unlock_all_outputs(struct audio_device *adev, struct stream_out *except)
 {
+    struct stream_out *out;
+    struct listnode *node;
+
     /* unlock order is irrelevant, but for cleanliness we unlock in reverse order */
-    pthread_mutex_unlock(&adev->lock);
-    enum output_type type = OUTPUT_TOTAL;
-    do {
-        struct stream_out *out = adev->outputs[--type];
-        if (out && out != except) {
+    hal_lock_release(&adev->lock);
+    list_for_each_reverse(node, &adev->output_list) {
+        out = node_to_item(node, struct stream_out, adev_list_node);
+        if (out != except) {
             unlock_output_stream(out);
         }
-    } while (type != (enum output_type) 0);
-    pthread_mutex_unlock(&adev->lock_outputs);
+    }
+    hal_lock_release(&adev->lock_outputs);
+}
+
+/*
+ * Changing the state of an output only needs that output and the device,
+ * the other outputs learn about it from adev->dev_state. HDMI is the
+ * exception, it puts the other outputs in standby.
+ */
+static void lock_output_state_site(struct stream_out *out, const char *site)
+{
+    struct audio_device *adev = out->dev;
+
+    if (out_is_hdmi(out)) {
+        lock_all_outputs_site(adev, site);
+    } else {
+        lock_output_stream_site(out, site);
+        hal_lock_acquire_site(&adev->lock, site);
+    }
+}
+
+static void unlock_output_state(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+
+    if (out_is_hdmi(out)) {
+        unlock_all_outputs(adev, NULL);
+    } else {
+        hal_lock_release(&adev->lock);
+        unlock_output_stream(out);
+    }
 }
 
 static int out_standby(struct audio_stream *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    struct audio_device *adev = out->dev;
 
-    lock_all_outputs(adev);
+    lock_output_state(out);
 
     do_out_standby(out);
 
-    unlock_all_outputs(adev, NULL);
+    unlock_output_state(out);
 
     return 0;
 }
 
-static int out_dump(const struct audio_stream *stream __unused, int fd __unused)
+static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+
+    if (out->lock_stats.writes > 0) {
+        dprintf(fd, "    Write lock waits: %llu of %llu writes, "
+                "avg %lld us, max %lld us\n",
+                (unsigned long long)out->lock_stats.contended,
+                (unsigned long long)out->lock_stats.writes,
+                (long long)(out->lock_stats.contended > 0 ?
+                            out->lock_stats.wait_sum_ns /
+                            (int64_t)out->lock_stats.contended / 1000 : 0),
+                (long long)(out->lock_stats.wait_max_ns / 1000));
+    }
+
+    /*
+     * CPU cost of the HAL's own rate conversion, what a stream at the link
+     * rate saves. Per hour of converted audio.
+     */
+    dprintf(fd, "    Rate %u Hz, converted %llu s, %lld ms CPU per hour\n",
+            out->config.rate,
+            (unsigned long long)(out->resampled_frames / out->config.rate),
+            (long long)(out->resampled_frames > 0 ?
+                        out->resample_ns / 1000000 * 3600 * out->config.rate /
+                        (int64_t)out->resampled_frames : 0));
+
+    /* Cost of the high resolution path, per period of the output */
+    if (out->format != AUDIO_FORMAT_PCM_16_BIT) {
+        dprintf(fd, "    Format %#x, dither %s, converted %llu s, "
+                "%lld us CPU per period\n",
+                out->format, out->dither.enabled ? "on" : "off",
+                (unsigned long long)(out->converted_frames / out->config.rate),
+                (long long)(out->converted_frames > 0 ?
+                            out->convert_ns / 1000 * out->config.period_size /
+                            (int64_t)out->converted_frames : 0));
+    }
+
+    if (out->dev->spk_prot_enabled) {
+        spk_prot_dump(&out->spk_prot, fd);
+    }
+
+    if (out->history != NULL) {
+        static const char * const mode_names[] = { "normal", "low power" };
+        const struct pcm_config *config = out_kernel_config(out);
+        int mode;
+
+        dprintf(fd, "    Deep buffer: %s, %u x %u frames\n",
+                mode_names[out->low_power],
+                config->period_count, config->period_size);
+
+        for (mode = 0; mode < 2; mode++) {
+            uint64_t frames = out->power_stats[mode].frames;
+
+            dprintf(fd, "      %s: %llu s played, %llu wakeups/min, "
+                    "%u switches to\n",
+                    mode_names[mode],
+                    (unsigned long long)(frames / out->config.rate),
+                    (unsigned long long)(frames > 0 ?
+                            out->power_stats[mode].wakeups * 60 *
+                            out->config.rate / frames : 0),
+                    out->power_stats[mode].switches);
+        }
+    }
+
     return 0;
 }
 
@@ -2456,21 +3756,17 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
 {
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
-    struct str_parms *parms;
-    char value[32];
+    struct parms parms;
     int ret;
-    unsigned int val;
+    uint32_t val;
 
     ALOGV("%s: key value pairs: %s", __func__, kvpairs);
 
-    parms = str_parms_create_str(kvpairs);
+    parms_parse(kvpairs, &parms);
 
-    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING,
-                            value, sizeof(value));
+    ret = parms_get_uint(&parms, PARMS_KEY_ROUTING, &val);
     if (ret >= 0) {
-        val = atoi(value);
-
-        lock_all_outputs(adev);
+        lock_output_state(out);
 
         if ((out->device != val) && (val != 0)) {
             /* Force standby if moving to/from SPDIF or if the output
@@ -2490,15 +3786,17 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
 #endif
 
 #ifndef HDMI_INCAPABLE
-            if (!out->standby && (out == adev->outputs[OUTPUT_HDMI] ||
-                !adev->outputs[OUTPUT_HDMI] ||
-                adev->outputs[OUTPUT_HDMI]->standby)) {
+            if (!out->standby && (out_is_hdmi(out) ||
+                !dev_state_hdmi_active(&adev->dev_state, out->state_slot))) {
                 adev->out_device = output_devices(out) | val;
                 select_devices(adev);
             }
 #endif
 
             out->device = val;
+            if (!out->standby) {
+                out_publish_state(out);
+            }
             adev->out_device = output_devices(out) | val;
 
             /*
@@ -2513,70 +3811,134 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
             } else {
                 select_devices(adev);
             }
-
-            /* start SCO stream if needed */
-            if (val & AUDIO_DEVICE_OUT_ALL_SCO) {
-                start_bt_sco(adev);
-            }
         }
 
-        unlock_all_outputs(adev, NULL);
+        unlock_output_state(out);
     }
 
-    str_parms_destroy(parms);
     return ret;
 }
 
+/*
+ * Builds the "sup_channels" reply of out_get_parameters(), call whenever
+ * supported_channel_masks[] changes.
+ */
+static void out_update_sup_channels(struct stream_out *out)
+{
+    size_t len;
+    size_t i, j;
+
+    len = snprintf(out->sup_channels_reply, sizeof(out->sup_channels_reply),
+                   "%s=", parms_key_name(PARMS_KEY_SUP_CHANNELS));
+
+    /* the last entry in supported_channel_masks[] is always 0 */
+    for (i = 0; out->supported_channel_masks[i] != 0; i++) {
+        for (j = 0; j < ARRAY_SIZE(out_channels_name_to_enum_table); j++) {
+            if (out_channels_name_to_enum_table[j].value == out->supported_channel_masks[i]) {
+                len += snprintf(out->sup_channels_reply + len,
+                                sizeof(out->sup_channels_reply) - len,
+                                "%s%s", i > 0 ? "|" : "",
+                                out_channels_name_to_enum_table[j].name);
+                break;
+            }
+        }
+
+        if (len >= sizeof(out->sup_channels_reply)) {
+            ALOGE("%s: reply truncated", __func__);
+            break;
+        }
+    }
+}
+
 /*
  * Returns a pointer to a heap allocated string. The caller is responsible
  * for freeing the memory for it using free().
  */
+/*
+ * Fills the channel masks and the rates of an HDMI output from the cache of
+ * the sink, returns the rate to open it at if none was asked for.
+ */
+static int read_hdmi_channel_masks(struct stream_out *out, uint32_t *default_rate)
+{
+    struct hdmi_caps caps;
+    size_t len;
+    int i;
+
+    if (!hdmi_caps_get(&caps)) {
+        ALOGE("%s: no HDMI sink", __func__);
+        return -ENODEV;
+    }
+
+    for (i = 0; i < MAX_SUPPORTED_CHANNEL_MASKS && caps.channel_masks[i] != 0; i++) {
+        out->supported_channel_masks[i] = caps.channel_masks[i];
+    }
+    out->supported_channel_masks[i] = 0;
+    out_update_sup_channels(out);
+
+    /* 48 kHz if the sink takes it, its lowest rate otherwise */
+    *default_rate = caps.rates[0];
+    len = snprintf(out->sup_rates_reply, sizeof(out->sup_rates_reply), "%s=",
+                   parms_key_name(PARMS_KEY_SUP_SAMPLING_RATES));
+    for (i = 0; caps.rates[i] != 0 && len < sizeof(out->sup_rates_reply); i++) {
+        if (caps.rates[i] == HDMI_DEFAULT_SAMPLING_RATE) {
+            *default_rate = HDMI_DEFAULT_SAMPLING_RATE;
+        }
+        len += snprintf(out->sup_rates_reply + len,
+                        sizeof(out->sup_rates_reply) - len,
+                        "%s%u", i > 0 ? "|" : "", caps.rates[i]);
+    }
+
+    return 0;
+}
+
 static char *out_get_parameters(const struct audio_stream *stream, const char *keys)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    struct str_parms *query = str_parms_create_str(keys);
-    const char *str;
-    char value[256];
-    struct str_parms *reply = str_parms_create();
-    size_t i, j;
-    int ret;
-    bool first = true;
+    struct parms query;
+    char reply[sizeof(out->sup_channels_reply) + sizeof(out->sup_rates_reply)];
 
-    ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value, sizeof(value));
-    if (ret >= 0) {
-        value[0] = '\0';
-        i = 0;
-        /* the last entry in supported_channel_masks[] is always 0 */
-        while (out->supported_channel_masks[i] != 0) {
-            for (j = 0; j < ARRAY_SIZE(out_channels_name_to_enum_table); j++) {
-                if (out_channels_name_to_enum_table[j].value == out->supported_channel_masks[i]) {
-                    if (!first) {
-                        strcat(value, "|");
-                    }
-                    strcat(value, out_channels_name_to_enum_table[j].name);
-                    first = false;
-                    break;
-                }
+    parms_parse(keys, &query);
+
+    reply[0] = '\0';
+    if (parms_has(&query, PARMS_KEY_SUP_CHANNELS)) {
+        strlcat(reply, out->sup_channels_reply, sizeof(reply));
+    }
+    if (parms_has(&query, PARMS_KEY_SUP_SAMPLING_RATES)) {
+        if (reply[0] != '\0') {
+            strlcat(reply, ";", sizeof(reply));
+        }
+        strlcat(reply, out->sup_rates_reply, sizeof(reply));
+    }
+
+    return strdup(reply[0] != '\0' ? reply : keys);
+}
+
+/* Kernel buffer of the first open PCM, out->config when in standby */
+static const struct pcm_config *out_kernel_config(const struct stream_out *out)
+{
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+
+    if (!out->standby) {
+        list_for_each(node, &out->pcm_dev_list) {
+            pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+            if (pcm_device->pcm != NULL) {
+                return &pcm_device->config;
             }
-            i++;
         }
-        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value);
-        str = str_parms_to_str(reply);
-    } else {
-        str = keys;
     }
 
-    str_parms_destroy(query);
-    str_parms_destroy(reply);
-    return strdup(str);
+    return &out->config;
 }
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
+    const struct pcm_config *config = out_kernel_config(out);
 
-    return (out->config.period_size * out->config.period_count * 1000) /
-            out->config.rate;
+    return (config->period_size * config->period_count * 1000) /
+            config->rate +
+           spk_prot_latency_frames(&out->spk_prot) * 1000 / out->sample_rate;
 }
 
 static int out_set_volume(struct audio_stream_out *stream,
@@ -2586,7 +3948,7 @@ static int out_set_volume(struct audio_stream_out *stream,
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
 
-    if (out == adev->outputs[OUTPUT_HDMI]) {
+    if (out_is_hdmi(out)) {
         /* only take left channel into account: the API is for stereo anyway */
         out->muted = (left == 0.0f);
         return 0;
@@ -2594,55 +3956,531 @@ static int out_set_volume(struct audio_stream_out *stream,
     return -ENOSYS;
 }
 
+static void out_save_history(struct stream_out *out,
+                             const void *buffer,
+                             size_t frames,
+                             size_t frame_size);
+
+/* Writes frames as they are, the history follows what reaches the link */
+static int out_pcm_write(struct stream_out *out,
+                         struct pcm_device *pcm_device,
+                         const void *buffer,
+                         size_t frames)
+{
+    size_t frame_size = pcm_frames_to_bytes(pcm_device->pcm, 1);
+    int ret;
+
+    pcm_device_tap(out, pcm_device, PCM_TAP_OUT_PRE_PCM, buffer, frames * frame_size);
+    ret = pcm_device_write(pcm_device, buffer, frames * frame_size);
+    if (ret == 0 && out->history != NULL) {
+        out_save_history(out, buffer, frames, frame_size);
+    }
+
+    return ret;
+}
+
+/* Converts 16 bit frames to the link rate if needed, in chunks of res_buffer */
+static int out_write_s16(struct stream_out *out,
+                         struct pcm_device *pcm_device,
+                         const int16_t *in,
+                         size_t frames)
+{
+    uint32_t channels = audio_channel_count_from_out_mask(out->channel_mask);
+    size_t res_frames;
+    struct timespec start, end;
+    int ret = 0;
+
+    if (pcm_device->rate_conv == NULL && pcm_device->resampler == NULL) {
+        return out_pcm_write(out, pcm_device, in, frames);
+    }
+
+    out->resampled_frames += frames;
+
+    res_frames = pcm_bytes_to_frames(pcm_device->pcm,
+                                     pcm_device->res_byte_count);
+
+    while (frames > 0 && ret == 0) {
+        size_t in_frames = frames;
+        size_t out_frames = res_frames;
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        if (pcm_device->rate_conv != NULL) {
+            rate_conv_process(pcm_device->rate_conv,
+                              in,
+                              &in_frames,
+                              pcm_device->res_buffer,
+                              &out_frames);
+        } else {
+            pcm_device->resampler->resample_from_input(pcm_device->resampler,
+                                                       (int16_t *)in,
+                                                       &in_frames,
+                                                       pcm_device->res_buffer,
+                                                       &out_frames);
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        out->resample_ns += (end.tv_sec - start.tv_sec) * 1000000000LL +
+                            (end.tv_nsec - start.tv_nsec);
+
+        if (in_frames == 0 && out_frames == 0) {
+            break;
+        }
+
+        if (out_frames > 0) {
+            size_t res_bytes = pcm_frames_to_bytes(pcm_device->pcm, out_frames);
+
+            pcm_device_tap(out, pcm_device, PCM_TAP_OUT_POST_RESAMPLE,
+                           pcm_device->res_buffer, res_bytes);
+            pcm_device_tap(out, pcm_device, PCM_TAP_OUT_PRE_PCM,
+                           pcm_device->res_buffer, res_bytes);
+            ret = pcm_device_write(pcm_device, pcm_device->res_buffer,
+                                   res_bytes);
+        }
+
+        in += in_frames * channels;
+        frames -= in_frames;
+    }
+
+    return ret;
+}
+
+/*
+ * High resolution streams are first converted to the link format, in
+ * chunks of conv_buffer: kept at 24 bit if the link takes it, otherwise
+ * dithered down to 16 bit (and then resampled, if needed).
+ */
+static int out_write_pcm_device(struct stream_out *out,
+                                struct pcm_device *pcm_device,
+                                const void *buffer,
+                                size_t bytes)
+{
+    size_t frame_size = audio_stream_out_frame_size(&out->stream);
+    uint32_t channels = audio_channel_count_from_out_mask(out->channel_mask);
+    const uint8_t *src = buffer;
+    size_t frames = bytes / frame_size;
+    size_t count;
+    struct timespec start, end;
+    int ret = 0;
+
+    if (pcm_device->conv_buffer == NULL) {
+        return out_write_s16(out, pcm_device, buffer, frames);
+    }
+
+    while (frames > 0 && ret == 0) {
+        count = MIN(frames, pcm_device->conv_frames);
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        pcm_convert(pcm_device->conv_buffer, pcm_device->config.format,
+                    src, out->format, count * channels, &out->dither);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        out->convert_ns += (end.tv_sec - start.tv_sec) * 1000000000LL +
+                           (end.tv_nsec - start.tv_nsec);
+        out->converted_frames += count;
+
+        if (pcm_device->config.format == PCM_FORMAT_S16_LE) {
+            ret = out_write_s16(out, pcm_device, pcm_device->conv_buffer, count);
+        } else {
+            ret = out_pcm_write(out, pcm_device, pcm_device->conv_buffer, count);
+        }
+
+        src += count * frame_size;
+        frames -= count;
+    }
+
+    return ret;
+}
+
+#if SPK_PROT_BLOCK_FRAMES != PLAYBACK_PERIOD_SIZE
+#error "speaker protection cost is reported per fast period"
+#endif
+
+/* Stereo outputs playing to the speaker alone, by usecase */
+static enum spk_prot_route out_spk_prot_route(const struct stream_out *out)
+{
+    if (!out->dev->spk_prot_enabled ||
+        audio_channel_count_from_out_mask(out->channel_mask) != 2 ||
+        routing_output_snd_device(false, false, out->device) != SND_DEVICE_OUT_SPEAKER) {
+        return SPK_PROT_ROUTE_NONE;
+    }
+
+    return out->usecase == USECASE_AUDIO_PLAYBACK_VOIP ?
+           SPK_PROT_ROUTE_VOICE : SPK_PROT_ROUTE_MEDIA;
+}
+
+/* Whether a deep buffer output should use the low power periods */
+static bool out_want_low_power(const struct stream_out *out)
+{
+    const struct audio_device *adev = out->dev;
+
+    return __atomic_load_n(&adev->screen_off, __ATOMIC_RELAXED) &&
+           !dev_state_low_latency_active(&adev->dev_state);
+}
+
+/*
+ * The PCM whose periods can be switched while playing: the only one of the
+ * output, on the playback link and without rate conversion, so that the
+ * history holds exactly what was written to it.
+ */
+static struct pcm_device *out_deep_buffer_pcm_device(struct stream_out *out)
+{
+    struct pcm_device *pcm_device;
+
+    if (list_empty(&out->pcm_dev_list) ||
+        list_head(&out->pcm_dev_list) != list_tail(&out->pcm_dev_list)) {
+        return NULL;
+    }
+
+    pcm_device = node_to_item(list_head(&out->pcm_dev_list),
+                              struct pcm_device, stream_list_node);
+    if (pcm_device->pcm == NULL ||
+        pcm_device->pcm_profile->id != PCM_DEVICE_PLAYBACK ||
+        pcm_device->rate_conv != NULL ||
+        pcm_device->resampler != NULL) {
+        return NULL;
+    }
+
+    return pcm_device;
+}
+
+/* frame_size is that of the link, frames are kept as written to it */
+static void out_save_history(struct stream_out *out,
+                             const void *buffer,
+                             size_t frames,
+                             size_t frame_size)
+{
+    const uint8_t *src = buffer;
+    size_t count;
+
+    if (frames > out->history_frames) {
+        src += (frames - out->history_frames) * frame_size;
+        frames = out->history_frames;
+    }
+
+    while (frames > 0) {
+        count = MIN(frames, out->history_frames - out->history_pos);
+        memcpy((uint8_t *)out->history + out->history_pos * frame_size,
+               src, count * frame_size);
+        out->history_pos = (out->history_pos + count) % out->history_frames;
+        src += count * frame_size;
+        frames -= count;
+    }
+}
+
+/*
+ * Reopens the PCM with the periods of the other mode. What was still queued
+ * in the kernel is written again from the history, so that nothing is lost
+ * or played twice; out->written and the presentation position carry on.
+ * Returns -ENODEV if neither periods could be opened, the PCM is left NULL.
+ */
+static int out_switch_low_power(struct stream_out *out,
+                                struct pcm_device *pcm_device,
+                                bool low_power)
+{
+    size_t frame_size = pcm_frames_to_bytes(pcm_device->pcm, 1);
+    struct timespec timestamp;
+    unsigned int avail;
+    size_t kernel_frames;
+    size_t queued = 0;
+    size_t pos;
+    size_t count;
+    int write_ret;
+    int ret;
+
+    kernel_frames = pcm_device->config.period_size *
+                    pcm_device->config.period_count;
+    if (pcm_get_htimestamp(pcm_device->pcm, &avail, &timestamp) == 0 &&
+        avail < kernel_frames) {
+        queued = MIN(kernel_frames - avail, out->history_frames);
+    }
+
+    energy_pcm_close(&pcm_device->energy);
+    pcm_close(pcm_device->pcm);
+
+    out->low_power = low_power;
+    out_set_pcm_config(out, pcm_device);
+    pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
+                               pcm_device->pcm_profile->id,
+                               PCM_OUT | PCM_MONOTONIC,
+                               &pcm_device->config);
+    if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
+        ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
+        pcm_close(pcm_device->pcm);
+
+        /* back to the periods that just worked */
+        out->low_power = !low_power;
+        out_set_pcm_config(out, pcm_device);
+        pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
+                                   pcm_device->pcm_profile->id,
+                                   PCM_OUT | PCM_MONOTONIC,
+                                   &pcm_device->config);
+        if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
+            pcm_close(pcm_device->pcm);
+            pcm_device->pcm = NULL;
+            return -ENODEV;
+        }
+        ret = -EIO;
+    } else {
+        out->power_stats[low_power].switches++;
+        ret = 0;
+    }
+    energy_pcm_open(&pcm_device->energy,
+                    pcm_device_energy_class(pcm_device, out->usecase),
+                    &pcm_device->config);
+
+    /*
+     * Oldest queued frame first. A failed write leaves the recovery to the
+     * next out_write(), the rest of the history is dropped.
+     */
+    pos = (out->history_pos + out->history_frames - queued) % out->history_frames;
+    while (queued > 0) {
+        count = MIN(queued, out->history_frames - pos);
+        write_ret = pcm_device_write(pcm_device,
+                                     (uint8_t *)out->history + pos * frame_size,
+                                     count * frame_size);
+        if (write_ret != 0) {
+            ALOGW("%s: %zu frames of history lost: %d", __func__, queued,
+                  write_ret);
+            if (ret == 0) {
+                ret = write_ret;
+            }
+            break;
+        }
+        pos = (pos + count) % out->history_frames;
+        queued -= count;
+    }
+
+    ALOGV("%s: %s periods, %u x %u frames", __func__,
+          out->low_power ? "low power" : "normal",
+          pcm_device->config.period_count, pcm_device->config.period_size);
+
+    return ret;
+}
+
+/*
+ * Acts on changes of the wanted mode only, an output that cannot switch
+ * while playing, or failed to, picks the mode up when it leaves standby.
+ * must be called with output stream mutex locked
+ */
+static int out_update_deep_buffer(struct stream_out *out)
+{
+    struct pcm_device *pcm_device;
+    bool low_power = out_want_low_power(out);
+
+    if (low_power == out->low_power_wanted) {
+        return 0;
+    }
+    out->low_power_wanted = low_power;
+
+    pcm_device = out_deep_buffer_pcm_device(out);
+    if (pcm_device == NULL || low_power == out->low_power) {
+        return 0;
+    }
+
+    return out_switch_low_power(out, pcm_device, low_power);
+}
+
+/*
+ * Up to out->work_bytes of a write when work is set, through the
+ * processing and to all the active PCMs.
+ * must be called with output stream mutex locked
+ */
+static int out_write_chunk(struct stream_out *out,
+                           const void *buffer,
+                           size_t bytes,
+                           bool use_work,
+                           bool render_loopback)
+{
+    struct audio_device *adev = out->dev;
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    const void *data = buffer;
+    void *work = use_work ? out->work_buf : NULL;
+    int ret = 0;
+
+    if (out->muted) {
+        memset(work, 0, bytes);
+        data = work;
+    }
+
+    pcm_tap_write(PCM_TAP_OUT_POST_MUTE, out, data, bytes, out->sample_rate,
+                  audio_channel_count_from_out_mask(out->channel_mask),
+                  stream_tap_format(out->format));
+
+    /* before the echo reference, the AEC has to see what the speaker plays */
+    if (work != NULL &&
+        spk_prot_process(&out->spk_prot, data, work, out->format,
+                         bytes / audio_stream_out_frame_size(&out->stream))) {
+        data = work;
+    }
+
+    if (out_feeds_echo_ref(out) &&
+        echo_ref_is_active(adev->echo_ref)) {
+        size_t frames = bytes / audio_stream_out_frame_size(&out->stream);
+
+        if (out->ref_s16 != NULL) {
+            frames = MIN(frames, out->config.period_size);
+            /* the reference only feeds the AEC, no need for dither */
+            pcm_convert(out->ref_s16, PCM_FORMAT_S16_LE, data, out->format,
+                        frames * out->config.channels, NULL);
+            out_push_echo_ref(out, out->ref_s16, frames);
+        } else {
+            out_push_echo_ref(out, data, frames);
+        }
+    }
+
+    if (render_loopback) {
+        if (data != work) {
+            memcpy(work, data, bytes);
+            data = work;
+        }
+        out_loopback_render(out, work, bytes);
+    }
+
+    /* Write to all active PCMs */
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm == NULL) {
+            continue;
+        }
+
+        ret = out_write_pcm_device(out, pcm_device, data, bytes);
+        if (ret != 0) {
+            break;
+        }
+    }
+    if (ret == 0)
+        out->written += bytes / audio_stream_out_frame_size(&out->stream);
+
+    return ret;
+}
+
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
     int ret = 0;
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
-    int i;
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    bool use_work;
+    bool render_loopback;
+    size_t chunk_max;
+    size_t chunk;
+    size_t done;
+    int64_t wait_ns;
+    struct timespec start, end;
+    int64_t write_ns;
+    bool pcm_lost = false;
+
+    out->writer_tid = thread_mgr_enter((out->flags & AUDIO_OUTPUT_FLAG_FAST) ||
+                                       out->usecase == USECASE_AUDIO_PLAYBACK_VOIP ?
+                                       THREAD_ROLE_FAST_WRITER :
+                                       THREAD_ROLE_DEEP_WRITER);
 
-    /* FIXME This comment is no longer correct
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the output stream mutex - e.g.
-     * executing out_set_parameters() while holding the hw device
-     * mutex
+    /*
+     * Leaving standby only takes the hw device mutex on top of our own, the
+     * other outputs keep writing. Only HDMI has to stop them, see
+     * lock_output_state().
      */
-    lock_output_stream(out);
+    wait_ns = lock_output_stream(out);
     if (out->standby) {
-        unlock_output_stream(out);
-        lock_all_outputs(adev);
-        if (!out->standby) {
+        spk_prot_reset(&out->spk_prot);
+    }
+    if (out->standby && out->history != NULL) {
+        out->low_power = out_want_low_power(out);
+        out->low_power_wanted = out->low_power;
+    }
+    if (out->standby) {
+        if (out_is_hdmi(out)) {
+            unlock_output_stream(out);
+            lock_all_outputs(adev);
+            if (!out->standby) {
+                unlock_all_outputs(adev, out);
+                goto false_alarm;
+            }
+            ret = start_output_stream(out);
+            if (ret < 0) {
+                unlock_all_outputs(adev, NULL);
+                goto final_exit;
+            }
+            out->standby = false;
+            out_publish_state(out);
             unlock_all_outputs(adev, out);
-            goto false_alarm;
+        } else {
+            wait_ns += hal_lock_acquire(&adev->lock);
+            ret = start_output_stream(out);
+            if (ret < 0) {
+                hal_lock_release(&adev->lock);
+                goto exit;
+            }
+            out->standby = false;
+            out_publish_state(out);
+            hal_lock_release(&adev->lock);
         }
-        ret = start_output_stream(out);
-        if (ret < 0) {
-            unlock_all_outputs(adev, NULL);
-            goto final_exit;
+    }
+false_alarm:
+    out_account_lock_wait(out, wait_ns);
+
+    if (out->disabled) {
+        ret = -EPIPE;
+        goto exit;
+    }
+
+    if (out->history != NULL &&
+        out_update_deep_buffer(out) == -ENODEV) {
+        pcm_lost = true;
+        goto standby;
+    }
+
+    spk_prot_set_route(&out->spk_prot, out_spk_prot_route(out), out->sample_rate);
+    render_loopback = (out->flags & AUDIO_OUTPUT_FLAG_FAST) &&
+                      loopback_is_active(adev->loopback) &&
+                      out->sample_rate == loopback_get_rate(adev->loopback);
+
+    /*
+     * What the HAL changes goes to out->work_buf, sized at open for a
+     * buffer: a longer write is handled a buffer at a time.
+     */
+    use_work = out->muted || render_loopback ||
+               spk_prot_latency_frames(&out->spk_prot) > 0;
+    chunk_max = use_work ? out->work_bytes : bytes;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (done = 0; done < bytes && ret == 0; done += chunk) {
+        chunk = MIN(bytes - done, chunk_max);
+        ret = out_write_chunk(out, (const uint8_t *)buffer + done, chunk,
+                              use_work, render_loopback);
+    }
+
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->recovery != PCM_WATCH_NONE &&
+            pcm_device_recover(adev, pcm_device, out->usecase,
+                               PCM_OUT | PCM_MONOTONIC) == -ENODEV) {
+            pcm_lost = true;
         }
-        out->standby = false;
-        unlock_all_outputs(adev, out);
     }
-false_alarm:
 
-    if (out->disabled) {
-        ret = -EPIPE;
-        goto exit;
-    }
+    if (ret == 0 && out->history != NULL) {
+        size_t frames = bytes / audio_stream_out_frame_size(stream);
 
-    if (out->muted)
-        memset((void *)buffer, 0, bytes);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        write_ns = (end.tv_sec - start.tv_sec) * 1000000000LL +
+                   (end.tv_nsec - start.tv_nsec);
 
-    /* Write to all active PCMs */
-    for (i = 0; i < PCM_TOTAL; i++)
-        if (out->pcm[i]) {
-            ret = pcm_write(out->pcm[i], (void *)buffer, bytes);
-            if (ret != 0)
-                break;
+        out->power_stats[out->low_power].frames += frames;
+        if (write_ns > DEEP_BUFFER_WAKEUP_NS) {
+            out->power_stats[out->low_power].wakeups++;
         }
-    if (ret == 0)
-        out->written += bytes / (out->config.channels * sizeof(short));
+    }
+
+standby:
+    /* a PCM could not be opened again, the next write starts the output */
+    if (pcm_lost) {
+        hal_lock_acquire(&adev->lock);
+        do_out_standby_l(out);
+        hal_lock_release(&adev->lock);
+        ret = -ENODEV;
+    }
 
 exit:
     unlock_output_stream(out);
@@ -2704,22 +4542,27 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
                                    uint64_t *frames, struct timespec *timestamp)
 {
     struct stream_out *out = (struct stream_out *)stream;
+    struct pcm_device *pcm_device;
+    struct listnode *node;
     int ret = -1;
 
     lock_output_stream(out);
 
-    int i;
     // There is a question how to implement this correctly when there is more than one PCM stream.
     // We are just interested in the frames pending for playback in the kernel buffer here,
     // not the total played since start.  The current behavior should be safe because the
     // cases where both cards are active are marginal.
-    for (i = 0; i < PCM_TOTAL; i++)
-        if (out->pcm[i]) {
-            size_t avail;
-            if (pcm_get_htimestamp(out->pcm[i], &avail, timestamp) == 0) {
-                size_t kernel_buffer_size = out->config.period_size * out->config.period_count;
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm) {
+            unsigned int avail;
+            if (pcm_get_htimestamp(pcm_device->pcm, &avail, timestamp) == 0) {
+                // the deep buffer periods change with the power mode
+                size_t kernel_buffer_size = pcm_device->config.period_size *
+                                            pcm_device->config.period_count;
                 // FIXME This calculation is incorrect if there is buffering after app processor
-                int64_t signed_frames = out->written - kernel_buffer_size + avail;
+                int64_t signed_frames = out->written - kernel_buffer_size + avail -
+                                        spk_prot_latency_frames(&out->spk_prot);
                 // It would be unusual for this value to be negative, but check just in case ...
                 if (signed_frames >= 0) {
                     *frames = signed_frames;
@@ -2728,6 +4571,7 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
                 break;
             }
         }
+    }
 
     unlock_output_stream(out);
 
@@ -2760,6 +4604,13 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
 {
     struct stream_in *in = (struct stream_in *)stream;
 
+    /* One period, AudioFlinger then reads at the pace of the link */
+    if (in->usecase == USECASE_AUDIO_CAPTURE_VOIP) {
+        return in->requested_rate * in->dev->voip_period_ms / 1000 *
+               audio_channel_count_from_in_mask(in->main_channels) *
+               sizeof(int16_t);
+    }
+
     return get_input_buffer_size(in->requested_rate,
                                  AUDIO_FORMAT_PCM_16_BIT,
                                  audio_channel_count_from_in_mask(in_get_channels(stream)),
@@ -2784,6 +4635,10 @@ static void do_in_standby(struct stream_in *in)
 
     if (!in->standby) {
         in->standby = true;
+        if (in->reader_tid != 0) {
+            thread_mgr_leave(in->reader_tid);
+            in->reader_tid = 0;
+        }
         if (in->pcm != NULL) {
             pcm_close(in->pcm);
             in->pcm = NULL;
@@ -2803,18 +4658,56 @@ static int in_standby(struct audio_stream *stream)
     struct stream_in *in = (struct stream_in *)stream;
 
     lock_input_stream(in);
-    pthread_mutex_lock(&in->dev->lock);
+    hal_lock_acquire(&in->dev->lock);
 
     do_in_standby(in);
 
-    pthread_mutex_unlock(&in->dev->lock);
+    hal_lock_release(&in->dev->lock);
     unlock_input_stream(in);
 
     return 0;
 }
 
-static int in_dump(const struct audio_stream *stream __unused, int fd __unused)
+static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_in *in = (struct stream_in *)stream;
+
+    dprintf(fd, "    Pre-processors: %d, AEC: %s\n",
+            in->num_preprocessors,
+            in->enable_aec ? "on" : "off");
+
+    if (in->aec_stats.blocks > 0) {
+        dprintf(fd, "    Processing: %llu blocks, %llu frames, "
+                "cpu avg %lld us, max %lld us per block\n",
+                (unsigned long long)in->aec_stats.blocks,
+                (unsigned long long)in->aec_stats.frames,
+                (long long)(in->aec_stats.cpu_sum_ns /
+                            (int64_t)in->aec_stats.blocks / 1000),
+                (long long)(in->aec_stats.cpu_max_ns / 1000));
+    }
+
+    if (in->two_mic != NULL) {
+        struct two_mic_stats stats;
+
+        two_mic_get_stats(in->two_mic, &stats);
+        dprintf(fd, "    Two mic: %s, %llu blocks, cpu avg %lld us, "
+                "max %lld us, budget %lld us, over budget %u\n",
+                in->two_mic_active ? "active" : "inactive",
+                (unsigned long long)stats.blocks,
+                (long long)(stats.blocks > 0 ?
+                            stats.cpu_sum_ns / (int64_t)stats.blocks / 1000 : 0),
+                (long long)(stats.cpu_max_ns / 1000),
+                (long long)(stats.budget_ns / 1000),
+                stats.over_budget);
+        dprintf(fd, "    Two mic: adapted %llu, frozen %llu, resets %u, "
+                "noise floor %.1f dBFS, gain %.1f dB\n",
+                (unsigned long long)stats.adapt_blocks,
+                (unsigned long long)stats.frozen_blocks,
+                stats.resets,
+                stats.noise_floor_db,
+                stats.gain_db);
+    }
+
     return 0;
 }
 
@@ -2822,20 +4715,17 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
 {
     struct stream_in *in = (struct stream_in *)stream;
     struct audio_device *adev = in->dev;
-    struct str_parms *parms;
-    char value[32];
+    struct parms parms;
     int ret;
-    unsigned int val;
+    uint32_t val;
     bool apply_now = false;
 
-    parms = str_parms_create_str(kvpairs);
+    parms_parse(kvpairs, &parms);
 
     lock_input_stream(in);
-    pthread_mutex_lock(&adev->lock);
-    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_INPUT_SOURCE,
-                            value, sizeof(value));
+    hal_lock_acquire(&adev->lock);
+    ret = parms_get_uint(&parms, PARMS_KEY_INPUT_SOURCE, &val);
     if (ret >= 0) {
-        val = atoi(value);
         /* no audio source uses val == 0 */
         if ((in->input_source != val) && (val != 0)) {
             in->input_source = val;
@@ -2843,11 +4733,15 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
         }
     }
 
-    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING,
-                            value, sizeof(value));
+    /* Applies when the input next leaves standby */
+    if (parms_get_uint(&parms, PARMS_KEY_PREROLL_OFFSET, &val) >= 0) {
+        in->preroll_ms = MIN(val, PREROLL_MAX_SECONDS * 1000);
+    }
+
+    ret = parms_get_uint(&parms, PARMS_KEY_ROUTING, &val);
     if (ret >= 0) {
         /* strip AUDIO_DEVICE_BIT_IN to allow bitwise comparisons */
-        val = atoi(value) & ~AUDIO_DEVICE_BIT_IN;
+        val &= ~AUDIO_DEVICE_BIT_IN;
         /* no audio device uses val == 0 */
         if ((in->device != val) && (val != 0)) {
 #if 0
@@ -2868,10 +4762,9 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
         select_devices(adev);
     }
 
-    pthread_mutex_unlock(&adev->lock);
+    hal_lock_release(&adev->lock);
     unlock_input_stream(in);
 
-    str_parms_destroy(parms);
     return ret;
 }
 
@@ -2889,38 +4782,64 @@ static int in_set_gain(struct audio_stream_in *stream __unused,
 
 static void in_apply_ramp(struct stream_in *in, int16_t *buffer, size_t frames)
 {
+    size_t channels = audio_channel_count_from_in_mask(in->main_channels);
     size_t i;
+    size_t c;
     uint16_t vol = in->ramp_vol;
     uint16_t step = in->ramp_step;
 
     frames = (frames < in->ramp_frames) ? frames : in->ramp_frames;
 
-    if (in->channel_mask == AUDIO_CHANNEL_IN_MONO)
-        for (i = 0; i < frames; i++)
-        {
-            buffer[i] = (int16_t)((buffer[i] * vol) >> 16);
-            vol += step;
+    for (i = 0; i < frames; i++) {
+        for (c = 0; c < channels; c++) {
+            buffer[i * channels + c] =
+                    (int16_t)((buffer[i * channels + c] * vol) >> 16);
         }
-    else
-        for (i = 0; i < frames; i++)
-        {
-            buffer[2*i] = (int16_t)((buffer[2*i] * vol) >> 16);
-            buffer[2*i + 1] = (int16_t)((buffer[2*i + 1] * vol) >> 16);
-            vol += step;
-        }
-
+        vol += step;
+    }
 
     in->ramp_vol = vol;
     in->ramp_frames -= frames;
 }
 
+/* Reads and processes up to in->max_frames, what the arena buffers hold */
+static int in_read_chunk(struct stream_in *in, void *buffer, size_t frames)
+{
+    struct audio_device *adev = in->dev;
+    ssize_t ret;
+
+    /*if (in->num_preprocessors != 0)
+        ret = process_frames(in, buffer, frames);
+      else */
+    ret = read_and_process_frames(in, buffer, frames);
+
+    /* Before the effects, AEC would cancel the test signal */
+    if (ret > 0 &&
+        loopback_is_active(adev->loopback) &&
+        in->requested_rate == loopback_get_rate(adev->loopback)) {
+        in_loopback_capture(in, buffer, ret);
+    }
+
+    if (ret > 0) {
+        in_process_effects(in, buffer, ret);
+        ret = 0;
+    }
+
+    return ret;
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
     int ret = 0;
     struct stream_in *in = (struct stream_in *)stream;
     struct audio_device *adev = in->dev;
-    size_t frames_rq = bytes / audio_stream_in_frame_size(stream);
+    size_t frame_size = audio_stream_in_frame_size(stream);
+    size_t frames_rq = bytes / frame_size;
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    size_t done = 0;
+    size_t chunk;
 
     /*
      * acquiring hw device mutex systematically is useful if a low
@@ -2928,23 +4847,51 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
      * executing in_set_parameters() while holding the hw device
      * mutex
      */
+    /* Only low latency capture goes real time on the big cluster */
+    if ((in->flags & AUDIO_INPUT_FLAG_FAST) ||
+        in->source == AUDIO_SOURCE_VOICE_COMMUNICATION) {
+        in->reader_tid = thread_mgr_enter(THREAD_ROLE_CAPTURE);
+    }
     lock_input_stream(in);
     if (in->standby) {
-        pthread_mutex_lock(&adev->lock);
+        hal_lock_acquire(&adev->lock);
         ret = start_input_stream(in);
-        pthread_mutex_unlock(&adev->lock);
+        hal_lock_release(&adev->lock);
         if (ret < 0)
             goto exit;
         in->standby = false;
     }
 
-    /*if (in->num_preprocessors != 0)
-        ret = process_frames(in, buffer, frames_rq);
-      else */
-    ret = read_frames(in, buffer, frames_rq);
+    /* The pre-roll first, as captured: the effects start with the PCM */
+    if (in->preroll_taken) {
+        done = preroll_read(adev->preroll, buffer, frames_rq);
+        in->preroll_taken = preroll_pending(adev->preroll) > 0;
+    }
 
-    if (ret > 0)
-        ret = 0;
+    rt_section_enter();
+    for (; done < frames_rq; done += chunk) {
+        chunk = MIN(frames_rq - done, in->max_frames);
+        ret = in_read_chunk(in, (char *)buffer + done * frame_size, chunk);
+        if (ret != 0) {
+            break;
+        }
+    }
+    rt_section_leave();
+
+    list_for_each(node, &in->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->recovery != PCM_WATCH_NONE &&
+            pcm_device_recover(adev, pcm_device, in->usecase,
+                               PCM_IN | PCM_MONOTONIC) == -ENODEV) {
+            /* not opened again, the next read starts the input */
+            hal_lock_acquire(&adev->lock);
+            stop_input_stream(in);
+            hal_lock_release(&adev->lock);
+            in->standby = true;
+            ret = -ENODEV;
+            break;
+        }
+    }
 
     if (in->ramp_frames > 0)
         in_apply_ramp(in, buffer, frames_rq);
@@ -2956,6 +4903,12 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     if (ret == 0 && adev->mic_mute)
         memset(buffer, 0, bytes);
 
+    if (ret == 0) {
+        pcm_tap_write(PCM_TAP_IN_POST_MUTE, in, buffer, bytes,
+                      in_get_sample_rate(&stream->common),
+                      frame_size / sizeof(int16_t), PCM_TAP_S16);
+    }
+
 exit:
     if (ret != 0) {
         struct timespec t = { .tv_sec = 0, .tv_nsec = 0 };
@@ -2996,16 +4949,85 @@ static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream __unused
     return 0;
 }
 
-static int in_add_audio_effect(const struct audio_stream *stream __unused,
-                               effect_handle_t effect __unused)
+static int in_add_audio_effect(const struct audio_stream *stream,
+                               effect_handle_t effect)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+    effect_descriptor_t desc;
+    int status;
+
+    lock_input_stream(in);
+
+    if (in->num_preprocessors >= MAX_PREPROCESSORS) {
+        status = -ENOSYS;
+        goto exit;
+    }
+
+    status = (*effect)->get_descriptor(effect, &desc);
+    if (status != 0) {
+        goto exit;
+    }
+
+    in->preprocessors[in->num_preprocessors++] = effect;
+
+    if (memcmp(&desc.type, FX_IID_AEC, sizeof(effect_uuid_t)) == 0) {
+        ALOGV("%s: AEC attached, source(%d)", __func__, in->source);
+        in->enable_aec = true;
+        if (!in->standby && in_needs_echo_ref(in)) {
+            in_start_echo_ref(in);
+        }
+    } else if (in->enable_aec && !in->standby) {
+        in_configure_reverse(in);
+    }
+
+exit:
+    unlock_input_stream(in);
+
+    return status;
 }
 
-static int in_remove_audio_effect(const struct audio_stream *stream __unused,
-                                  effect_handle_t effect __unused)
+static int in_remove_audio_effect(const struct audio_stream *stream,
+                                  effect_handle_t effect)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+    effect_descriptor_t desc;
+    int status = -EINVAL;
+    int i;
+
+    lock_input_stream(in);
+
+    for (i = 0; i < in->num_preprocessors; i++) {
+        if (status == 0) {
+            /* status == 0 means an effect was removed from a previous slot */
+            in->preprocessors[i - 1] = in->preprocessors[i];
+            continue;
+        }
+        if (in->preprocessors[i] == effect) {
+            in->preprocessors[i] = NULL;
+            status = 0;
+        }
+    }
+
+    if (status != 0) {
+        goto exit;
+    }
+
+    in->num_preprocessors--;
+
+    status = (*effect)->get_descriptor(effect, &desc);
+    if (status == 0 &&
+        memcmp(&desc.type, FX_IID_AEC, sizeof(effect_uuid_t)) == 0) {
+        ALOGV("%s: AEC detached", __func__);
+        if (!in->standby) {
+            in_stop_echo_ref(in);
+        }
+        in->enable_aec = false;
+    }
+
+exit:
+    unlock_input_stream(in);
+
+    return status;
 }
 
 static int in_get_capture_position(const struct audio_stream_in *stream,
@@ -3013,6 +5035,10 @@ static int in_get_capture_position(const struct audio_stream_in *stream,
                                    int64_t *time)
 {
     struct stream_in *in;
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    struct timespec timestamp;
+    unsigned int avail;
     int rc = -ENOSYS;
 
     if (stream == NULL || frames == NULL || time == NULL) {
@@ -3020,18 +5046,31 @@ static int in_get_capture_position(const struct audio_stream_in *stream,
     }
     in = (struct stream_in *)stream;
 
+    /*
+     * VoIP aligns its jitter buffer on this: the frames captured so far, at
+     * the stream rate, and when the last of them was.
+     */
     lock_input_stream(in);
-    if (in->pcm != NULL) {
-        struct timespec timestamp;
-        unsigned int avail;
+    if (!in->standby) {
+        list_for_each(node, &in->pcm_dev_list) {
+            pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+            if (pcm_device->pcm == NULL) {
+                continue;
+            }
 
-        rc = pcm_get_htimestamp(in->pcm, &avail, &timestamp);
-        if (rc != 0) {
-            rc = -EINVAL;
-        } else {
-            *frames = in->frames_read + avail;
+            if (pcm_get_htimestamp(pcm_device->pcm, &avail, &timestamp) != 0) {
+                rc = -EINVAL;
+                break;
+            }
+
+            *frames = in->frames_read +
+                      (int64_t)avail * in->requested_rate / pcm_device->config.rate;
+            if (in->preroll_taken) {
+                *frames += preroll_pending(in->dev->preroll);
+            }
             *time = timestamp.tv_sec * 1000000000LL + timestamp.tv_nsec;
             rc = 0;
+            break;
         }
     }
     unlock_input_stream(in);
@@ -3039,6 +5078,120 @@ static int in_get_capture_position(const struct audio_stream_in *stream,
     return rc;
 }
 
+/*
+ * Entry points as installed in the stream and device structs, recording
+ * each call while the API trace runs.
+ */
+static ssize_t out_write_traced(struct audio_stream_out *stream,
+                                const void *buffer,
+                                size_t bytes)
+{
+    struct api_trace_call call;
+    ssize_t ret;
+
+    api_trace_begin(&call);
+    ret = out_write(stream, buffer, bytes);
+    api_trace_end(&call, API_TRACE_OUT_WRITE, stream, bytes, ret, buffer, bytes);
+
+    return ret;
+}
+
+static int out_standby_traced(struct audio_stream *stream)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = out_standby(stream);
+    api_trace_end(&call, API_TRACE_OUT_STANDBY, stream, 0, ret, NULL, 0);
+
+    return ret;
+}
+
+static int out_set_parameters_traced(struct audio_stream *stream,
+                                     const char *kvpairs)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = out_set_parameters(stream, kvpairs);
+    api_trace_end_parameters(&call, API_TRACE_OUT_SET_PARAMETERS, stream, ret, kvpairs);
+
+    return ret;
+}
+
+static int out_set_volume_traced(struct audio_stream_out *stream,
+                                 float left,
+                                 float right)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = out_set_volume(stream, left, right);
+    api_trace_end(&call, API_TRACE_OUT_SET_VOLUME, stream, left * 1000, ret,
+                  NULL, 0);
+
+    return ret;
+}
+
+static ssize_t in_read_traced(struct audio_stream_in *stream,
+                              void *buffer,
+                              size_t bytes)
+{
+    struct api_trace_call call;
+    ssize_t ret;
+
+    api_trace_begin(&call);
+    ret = in_read(stream, buffer, bytes);
+    api_trace_end(&call, API_TRACE_IN_READ, stream, bytes, ret,
+                  buffer, ret > 0 ? (size_t)ret : 0);
+
+    return ret;
+}
+
+static int in_standby_traced(struct audio_stream *stream)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = in_standby(stream);
+    api_trace_end(&call, API_TRACE_IN_STANDBY, stream, 0, ret, NULL, 0);
+
+    return ret;
+}
+
+static int in_set_parameters_traced(struct audio_stream *stream,
+                                    const char *kvpairs)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = in_set_parameters(stream, kvpairs);
+    api_trace_end_parameters(&call, API_TRACE_IN_SET_PARAMETERS, stream, ret, kvpairs);
+
+    return ret;
+}
+
+/*
+ * The AEC reference runs at the rate of the output feeding it, it can only
+ * change while no capture uses it. The ring is never freed before
+ * adev_close(): the primary output writes to it holding its own lock only.
+ * Outputs above ECHO_REF_MAX_RATE do not feed it.
+ */
+static void adev_set_echo_ref_rate(struct audio_device *adev, unsigned int rate)
+{
+    hal_lock_acquire(&adev->lock);
+    if (adev->echo_ref != NULL && adev->active_input == NULL &&
+        rate <= ECHO_REF_MAX_RATE) {
+        echo_ref_set_rate(adev->echo_ref, rate);
+    }
+    hal_lock_release(&adev->lock);
+}
+
 static int adev_open_output_stream(struct audio_hw_device *dev,
                                    audio_io_handle_t handle __unused,
                                    audio_devices_t devices,
@@ -3049,28 +5202,30 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 {
     struct audio_device *adev = (struct audio_device *)dev;
     struct stream_out *out;
+    uint32_t hdmi_rate;
     int ret;
-    enum output_type type;
 
-    out = (struct stream_out *)calloc(1, sizeof(struct stream_out));
+    adev_link_rates_ready(adev);
+
+    out = (struct stream_out *)stream_pool_alloc(adev->out_pool);
     if (!out)
         return -ENOMEM;
 
     out->supported_channel_masks[0] = AUDIO_CHANNEL_OUT_STEREO;
     out->channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    out->format = AUDIO_FORMAT_PCM_16_BIT;
     if (devices == AUDIO_DEVICE_NONE)
         devices = AUDIO_DEVICE_OUT_SPEAKER;
     out->device = devices;
 
     if (flags & AUDIO_OUTPUT_FLAG_DIRECT &&
         devices == AUDIO_DEVICE_OUT_AUX_DIGITAL) {
-        pthread_mutex_lock(&adev->lock);
-        ret = read_hdmi_channel_masks(adev, out);
-        pthread_mutex_unlock(&adev->lock);
+        /* from the cache of the sink, no need for the device lock */
+        ret = read_hdmi_channel_masks(out, &hdmi_rate);
         if (ret != 0)
             goto err_open;
         if (config->sample_rate == 0)
-            config->sample_rate = HDMI_MULTI_DEFAULT_SAMPLING_RATE;
+            config->sample_rate = hdmi_rate;
         if (config->channel_mask == 0)
             config->channel_mask = AUDIO_CHANNEL_OUT_5POINT1;
         out->channel_mask = config->channel_mask;
@@ -3078,17 +5233,59 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         out->config.rate = config->sample_rate;
         out->config.channels = popcount(config->channel_mask);
         out->pcm_device = PCM_DEVICE;
-        type = OUTPUT_HDMI;
+        out->usecase = USECASE_AUDIO_PLAYBACK_MULTI_CH;
+    } else if (flags & AUDIO_OUTPUT_FLAG_VOIP_RX) {
+        /* The VoIP client writes its periods as they are played */
+        ALOGV("*** %s: VoIP pcm config", __func__);
+        out->config = pcm_device_playback_voip.config;
+        if (config->sample_rate == VOIP_WIDEBAND_SAMPLING_RATE) {
+            out->config.rate = VOIP_WIDEBAND_SAMPLING_RATE;
+        }
+        voip_set_periods(adev, &out->config, true);
+        out->usecase = USECASE_AUDIO_PLAYBACK_VOIP;
     } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
         ALOGV("*** %s: Deep buffer pcm config", __func__);
-        out->config = pcm_config_deep;
+        out->config = pcm_config_deep_buffer;
         out->pcm_device = PCM_DEVICE_DEEP;
-        type = OUTPUT_DEEP_BUF;
+        out->usecase = USECASE_AUDIO_PLAYBACK_DEEP_BUFFER;
+
+        /* Music can be mixed at more than 16 bit, see pcm_convert.h */
+        if (config->format == AUDIO_FORMAT_PCM_8_24_BIT ||
+            config->format == AUDIO_FORMAT_PCM_FLOAT) {
+            out->format = config->format;
+        }
     } else {
         ALOGV("*** %s: Fast buffer pcm config", __func__);
         out->config = pcm_config_fast;
         out->pcm_device = PCM_DEVICE;
-        type = OUTPUT_LOW_LATENCY;
+        out->usecase = USECASE_AUDIO_PLAYBACK;
+    }
+
+    /*
+     * The deep buffer output mixes at the rate of the content, the link
+     * opens at it if it can and the high quality converter takes the
+     * others to the native rate (see out_set_pcm_config()), so that music
+     * is resampled once at most. The fast output keeps the rate asked for
+     * if the link runs at it.
+     */
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER) {
+        out->config.rate = config->sample_rate;
+        if (config->sample_rate == 0 ||
+            (!link_rate_supported(&pcm_device_playback.rates, config->sample_rate) &&
+             config->sample_rate > DEEP_BUFFER_SAMPLING_RATE)) {
+            out->config.rate = pcm_device_playback.rates.native;
+        }
+        out->config.period_size = DEEP_BUFFER_PERIOD_SIZE * out->config.rate /
+                                  DEEP_BUFFER_SAMPLING_RATE;
+    } else if (out->usecase == USECASE_AUDIO_PLAYBACK) {
+        out->config.rate = link_rate_select(&pcm_device_playback.rates,
+                                            config->sample_rate);
+    }
+    out->sample_rate = out->config.rate;
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_MULTI_CH) {
+        out_update_sup_channels(out);
+        snprintf(out->sup_rates_reply, sizeof(out->sup_rates_reply), "%s=%u",
+                 parms_key_name(PARMS_KEY_SUP_SAMPLING_RATES), out->config.rate);
     }
 
     out->stream.common.get_sample_rate = out_get_sample_rate;
@@ -3097,20 +5294,21 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.common.get_channels = out_get_channels;
     out->stream.common.get_format = out_get_format;
     out->stream.common.set_format = out_set_format;
-    out->stream.common.standby = out_standby;
+    out->stream.common.standby = out_standby_traced;
     out->stream.common.dump = out_dump;
-    out->stream.common.set_parameters = out_set_parameters;
+    out->stream.common.set_parameters = out_set_parameters_traced;
     out->stream.common.get_parameters = out_get_parameters;
     out->stream.common.add_audio_effect = out_add_audio_effect;
     out->stream.common.remove_audio_effect = out_remove_audio_effect;
     out->stream.get_latency = out_get_latency;
-    out->stream.set_volume = out_set_volume;
-    out->stream.write = out_write;
+    out->stream.set_volume = out_set_volume_traced;
+    out->stream.write = out_write_traced;
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
     out->stream.get_presentation_position = out_get_presentation_position;
 
     out->dev = adev;
+    out->flags = flags;
 
     config->format = out_get_format(&out->stream.common);
     config->channel_mask = out_get_channels(&out->stream.common);
@@ -3120,88 +5318,283 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     /* out->muted = false; by calloc() */
     /* out->written = 0; by calloc() */
 
-    pthread_mutex_init(&out->lock, (const pthread_mutexattr_t *) NULL);
-    pthread_mutex_init(&out->pre_lock, (const pthread_mutexattr_t *) NULL);
+    hal_lock_init(&out->lock, "output lock", HAL_LOCK_RANK_STREAM);
+    hal_lock_init(&out->pre_lock, "output pre_lock", HAL_LOCK_RANK_STREAM);
+
+    /*
+     * Enough to refill the low power buffer, see out_switch_low_power(),
+     * with room for a 24 bit link.
+     */
+    if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        out->history_frames = DEEP_BUFFER_LOW_POWER_PERIOD_SIZE *
+                              DEEP_BUFFER_LOW_POWER_PERIOD_COUNT;
+        out->history = calloc(out->history_frames,
+                              out->config.channels * sizeof(int32_t));
+        if (out->history == NULL) {
+            ret = -ENOMEM;
+            goto err_open;
+        }
+    }
+
+    spk_prot_init(&out->spk_prot);
+    out->work_bytes = out_get_buffer_size(&out->stream.common);
+    out->work_buf = malloc(out->work_bytes);
+    if (out->work_buf == NULL) {
+        ret = -ENOMEM;
+        goto err_open;
+    }
+
+    if (out->format != AUDIO_FORMAT_PCM_16_BIT) {
+        pcm_dither_init(&out->dither,
+                        property_get_bool("persist.audio.hal.dither", true));
+        out->ref_s16 = malloc(out->config.period_size * out->config.channels *
+                              sizeof(int16_t));
+        if (out->ref_s16 == NULL) {
+            ret = -ENOMEM;
+            goto err_open;
+        }
+    }
 
-    pthread_mutex_lock(&adev->lock_outputs);
-    if (adev->outputs[type]) {
-        pthread_mutex_unlock(&adev->lock_outputs);
-        ret = -EBUSY;
+    hal_lock_acquire(&adev->lock_outputs);
+    ret = output_register_l(adev, out);
+    if (ret != 0) {
+        hal_lock_release(&adev->lock_outputs);
         goto err_open;
     }
-    adev->outputs[type] = out;
-    pthread_mutex_unlock(&adev->lock_outputs);
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_VOIP) {
+        adev->voip_output = out;
+        adev_set_echo_ref_rate(adev, out->config.rate);
+    } else if (flags & AUDIO_OUTPUT_FLAG_PRIMARY) {
+        adev->primary_output = out;
+        if (adev->voip_output == NULL) {
+            adev_set_echo_ref_rate(adev, out->config.rate);
+        }
+    }
+    hal_lock_release(&adev->lock_outputs);
+
+    *stream_out = &out->stream;
+
+    return 0;
+
+err_open:
+    free(out->ref_s16);
+    free(out->work_buf);
+    free(out->history);
+    hal_lock_destroy(&out->pre_lock);
+    hal_lock_destroy(&out->lock);
+    stream_pool_free(adev->out_pool, out);
+    *stream_out = NULL;
+    return ret;
+}
+
+static void adev_close_output_stream(struct audio_hw_device *dev,
+                                     struct audio_stream_out *stream)
+{
+    struct audio_device *adev;
+
+    out_standby(&stream->common);
+    adev = (struct audio_device *)dev;
+    hal_lock_acquire(&adev->lock_outputs);
+    output_unregister_l(adev, (struct stream_out *)stream);
+    if (adev->voip_output == (struct stream_out *) stream) {
+        adev->voip_output = NULL;
+        if (adev->primary_output != NULL) {
+            adev_set_echo_ref_rate(adev, adev->primary_output->config.rate);
+        }
+    }
+    if (adev->primary_output == (struct stream_out *) stream) {
+        adev->primary_output = NULL;
+    }
+    hal_lock_release(&adev->lock_outputs);
+    pcm_tap_release(stream);
+    free(((struct stream_out *)stream)->ref_s16);
+    free(((struct stream_out *)stream)->work_buf);
+    free(((struct stream_out *)stream)->history);
+    hal_lock_destroy(&((struct stream_out *)stream)->pre_lock);
+    hal_lock_destroy(&((struct stream_out *)stream)->lock);
+    stream_pool_free(adev->out_pool, stream);
+}
+
+static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
+{
+    struct audio_device *adev = (struct audio_device *)dev;
+    struct parms parms;
+
+    parms_parse(kvpairs, &parms);
+
+    /* Deep buffer outputs pick this up on their next write */
+    if (parms_has(&parms, PARMS_KEY_SCREEN_STATE)) {
+        __atomic_store_n(&adev->screen_off,
+                         parms_value_is(&parms, PARMS_KEY_SCREEN_STATE,
+                                        AUDIO_PARAMETER_VALUE_OFF),
+                         __ATOMIC_RELAXED);
+    }
+
+    if (parms_has(&parms, PARMS_KEY_BT_NREC)) {
+        adev->bluetooth_nrec = parms_value_is(&parms, PARMS_KEY_BT_NREC,
+                                              AUDIO_PARAMETER_VALUE_ON);
+    }
+
+    if (parms_has(&parms, PARMS_KEY_BT_SCO_WB)) {
+        bool wbs = parms_value_is(&parms, PARMS_KEY_BT_SCO_WB,
+                                  AUDIO_PARAMETER_VALUE_ON);
+
+        hal_lock_acquire(&adev->lock);
+        if (wbs != adev->sco.wbs) {
+            adev->sco.wbs = wbs;
+
+            /* Streams on SCO switch the next time they start */
+            if (adev->sco.rx != NULL || adev->sco.tx != NULL) {
+                stop_bt_sco(adev);
+                start_bt_sco(adev);
+            }
+        }
+        hal_lock_release(&adev->lock);
+    }
+
+    /*
+     * In a call this switches the modem's two mic solution, otherwise the
+     * HAL's own (see two_mic.h), which takes effect on the next capture start.
+     */
+    if (parms_has(&parms, PARMS_KEY_NOISE_SUPPRESSION)) {
+        ALOGV("*** %s: noise_suppression=%.*s", __func__,
+              (int)parms.values[PARMS_KEY_NOISE_SUPPRESSION].len,
+              parms.values[PARMS_KEY_NOISE_SUPPRESSION].str);
+
+        /* value is either off or auto */
+        if (parms_value_is(&parms, PARMS_KEY_NOISE_SUPPRESSION, "off")) {
+            adev->two_mic_control = false;
+            adev->ns_in_voice_rec = false;
+        } else {
+            adev->two_mic_control = true;
+            adev->ns_in_voice_rec = true;
+        }
+    }
+
+    /*
+     * Round trip latency test: "loopback_path" selects the mixer path that
+     * closes the loop, "none" measures through the current (acoustic) route.
+     */
+    if (parms_has(&parms, PARMS_KEY_LOOPBACK_PATH)) {
+        hal_lock_acquire(&adev->lock);
+        parms_get_str(&parms, PARMS_KEY_LOOPBACK_PATH,
+                      adev->loopback_path, sizeof(adev->loopback_path));
+        hal_lock_release(&adev->lock);
+    }
+
+    if (parms_has(&parms, PARMS_KEY_LOOPBACK_TEST) && adev->loopback != NULL) {
+        bool on = parms_value_is(&parms, PARMS_KEY_LOOPBACK_TEST,
+                                 AUDIO_PARAMETER_VALUE_ON);
+
+        ALOGV("%s: loopback_test=%d, path %s", __func__,
+              on, adev->loopback_path);
+
+        hal_lock_acquire(&adev->lock);
+        if (!adev_mixer_ready(adev)) {
+            ALOGE("%s: no mixer, loopback_test ignored", __func__);
+        } else if (on && !loopback_is_active(adev->loopback)) {
+            if (strcmp(adev->loopback_path, "none") != 0) {
+                audio_route_apply_and_update_path(adev->mixer.audio_route,
+                                                  adev->loopback_path);
+            }
+            loopback_start(adev->loopback);
+        } else if (!on && loopback_is_active(adev->loopback)) {
+            loopback_stop(adev->loopback);
+            if (strcmp(adev->loopback_path, "none") != 0) {
+                audio_route_reset_and_update_path(adev->mixer.audio_route,
+                                                  adev->loopback_path);
+            }
+        }
+        hal_lock_release(&adev->lock);
+    }
+
+    /* PCM taps: "pcm_taps=out_post_mute,in_post_pcm", "all" or "off" */
+    if (parms_has(&parms, PARMS_KEY_PCM_TAPS)) {
+        const struct parms_value *value = &parms.values[PARMS_KEY_PCM_TAPS];
+        int points = pcm_tap_parse_points(value->str, value->len);
+
+        if (points >= 0) {
+            pcm_tap_enable(points);
+        }
+    }
 
-    *stream_out = &out->stream;
+    /*
+     * HAL call trace: "on", or "hash" to also hash the buffers written and
+     * read, "off" writes it to API_TRACE_PATH.
+     */
+    if (parms_has(&parms, PARMS_KEY_API_TRACE)) {
+        if (parms_value_is(&parms, PARMS_KEY_API_TRACE, AUDIO_PARAMETER_VALUE_OFF)) {
+            api_trace_stop(API_TRACE_PATH);
+        } else if (!api_trace_active()) {
+            api_trace_start(parms_value_is(&parms, PARMS_KEY_API_TRACE, "hash"));
+        }
+    }
 
     return 0;
-
-err_open:
-    free(out);
-    *stream_out = NULL;
-    return ret;
 }
 
-static void adev_close_output_stream(struct audio_hw_device *dev,
-                                     struct audio_stream_out *stream)
+/*
+ * "loopback_result" returns one entry per output/input period combination,
+ * separated by '|', e.g. "out_period:240,in_period:240,latency_us:10416,...".
+ */
+static char *adev_get_loopback_result(const struct audio_device *adev)
 {
-    struct audio_device *adev;
-    enum output_type type;
+    struct loopback_stats stats[LOOPBACK_MAX_PROFILES];
+    char value[LOOPBACK_MAX_PROFILES * 160];
+    size_t len = 0;
+    int count;
+    int i;
 
-    out_standby(&stream->common);
-    adev = (struct audio_device *)dev;
-    pthread_mutex_lock(&adev->lock_outputs);
-    for (type = 0; type < OUTPUT_TOTAL; type++) {
-        if (adev->outputs[type] == (struct stream_out *) stream) {
-            adev->outputs[type] = NULL;
-            break;
-        }
-    }
-    pthread_mutex_unlock(&adev->lock_outputs);
-    free(stream);
+    value[0] = '\0';
+    if (adev->loopback == NULL) {
+        return strdup(value);
+    }
+
+    count = loopback_get_stats(adev->loopback, stats, LOOPBACK_MAX_PROFILES);
+    for (i = 0; i < count && len < sizeof(value); i++) {
+        int64_t avg = stats[i].measurements > 0 ?
+                      stats[i].latency_sum_us / stats[i].measurements : 0;
+
+        len += snprintf(value + len, sizeof(value) - len,
+                        "%sout_period:%u,in_period:%u,latency_us:%lld,"
+                        "min_us:%lld,max_us:%lld,jitter_us:%lld,"
+                        "glitches:%u,missed:%u,count:%u",
+                        i > 0 ? "|" : "",
+                        stats[i].out_period,
+                        stats[i].in_period,
+                        (long long)avg,
+                        (long long)stats[i].latency_min_us,
+                        (long long)stats[i].latency_max_us,
+                        (long long)loopback_jitter_us(&stats[i]),
+                        stats[i].glitches,
+                        stats[i].missed,
+                        stats[i].measurements);
+    }
+
+    return strdup(value);
 }
 
-static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
+static char *adev_get_parameters(const struct audio_hw_device *dev,
+                                 const char *keys)
 {
-    struct audio_device *adev = (struct audio_device *)dev;
-    struct str_parms *parms;
-    char value[32];
-    int ret;
+    const struct audio_device *adev = (const struct audio_device *)dev;
+    struct parms query;
+    char *result;
+    char *str;
 
-    parms = str_parms_create_str(kvpairs);
-    ret = str_parms_get_str(parms,
-                            AUDIO_PARAMETER_KEY_BT_NREC,
-                            value,
-                            sizeof(value));
-    if (ret >= 0) {
-        if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0) {
-            adev->bluetooth_nrec = true;
-        } else {
-            adev->bluetooth_nrec = false;
-        }
+    parms_parse(keys, &query);
+    if (!parms_has(&query, PARMS_KEY_LOOPBACK_RESULT)) {
+        return strdup("");
     }
 
-    /* FIXME: This does not work with LL, see workaround in this HAL */
-    ret = str_parms_get_str(parms, "noise_suppression", value, sizeof(value));
-    if (ret >= 0) {
-        ALOGV("*** %s: noise_suppression=%s", __func__, value);
-
-        /* value is either off or auto */
-        if (strcmp(value, "off") == 0) {
-            adev->two_mic_control = false;
-        } else {
-            adev->two_mic_control = true;
-        }
+    result = adev_get_loopback_result(adev);
+    if (asprintf(&str, "%s=%s",
+                 parms_key_name(PARMS_KEY_LOOPBACK_RESULT), result) < 0) {
+        str = NULL;
     }
+    free(result);
 
-    str_parms_destroy(parms);
-    return ret;
-}
-
-static char *adev_get_parameters(const struct audio_hw_device *dev __unused,
-                                 const char *keys __unused)
-{
-    return strdup("");
+    return str;
 }
 
 static int adev_init_check(const struct audio_hw_device *dev __unused)
@@ -3241,7 +5634,7 @@ static int voice_set_volume(struct audio_hw_device *dev, float volume)
                 sound_type = SOUND_TYPE_VOICE;
         }
 
-        ril_set_call_volume(&adev->ril, sound_type, volume);
+        ril_set_call_volume(adev_ril(adev), sound_type, volume);
     }
 
     return 0;
@@ -3254,9 +5647,9 @@ static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
 
     ALOGT("%s: Set volume to %f\n", __func__, volume);
 
-    pthread_mutex_lock(&adev->lock);
+    hal_lock_acquire(&adev->lock);
     rc = voice_set_volume(dev, volume);
-    pthread_mutex_unlock(&adev->lock);
+    hal_lock_release(&adev->lock);
 
     return 0;
 }
@@ -3275,7 +5668,7 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
         return 0;
     }
 
-    pthread_mutex_lock(&adev->lock);
+    hal_lock_acquire(&adev->lock);
     adev->mode = mode;
 
     if (adev->mode == AUDIO_MODE_IN_CALL) {
@@ -3286,7 +5679,7 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
         stop_call(adev);
     }
 
-    pthread_mutex_unlock(&adev->lock);
+    hal_lock_release(&adev->lock);
 
     return 0;
 }
@@ -3298,13 +5691,13 @@ static int adev_set_mic_mute(struct audio_hw_device *dev, bool state)
 
     ALOGT("%s: Set mic mute: %d\n", __func__, state);
 
-    pthread_mutex_lock(&adev->lock);
+    hal_lock_acquire(&adev->lock);
     if (adev->in_call) {
-        ril_set_mute(&adev->ril, mute_condition);
+        ril_set_mute(adev_ril(adev), mute_condition);
     }
 
     adev->mic_mute = state;
-    pthread_mutex_unlock(&adev->lock);
+    hal_lock_release(&adev->lock);
 
     return 0;
 }
@@ -3327,6 +5720,84 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev __unu
                                  false /* is_low_latency: since we don't know, be conservative */);
 }
 
+/*
+ * Sizes every buffer of the read path from the capture profiles, the stream
+ * rate and its channels, so that in_read() never has to allocate. A read is
+ * processed in chunks of in->max_frames, the frames AudioFlinger asks for
+ * with the largest capture period.
+ */
+static int in_init_arena(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    const struct pcm_device_profile *profile;
+    size_t main_channels = audio_channel_count_from_in_mask(in->main_channels);
+    size_t period_size = 0;
+    size_t channels = 0;
+    size_t ref_frames = 0;
+    size_t frames;
+    size_t size;
+    int i;
+
+    in->max_frames = 0;
+    for (i = 0; ; i++) {
+        /* pcm_devices[] only has the narrowband SCO profiles */
+        profile = pcm_devices[i] != NULL ? pcm_devices[i] :
+                                           &pcm_device_capture_sco_wb;
+        if (profile->type == PCM_CAPTURE) {
+            frames = (profile->config.period_size * in->requested_rate +
+                      profile->config.rate - 1) / profile->config.rate;
+            in->max_frames = MAX(in->max_frames, frames);
+            period_size = MAX(period_size, profile->config.period_size);
+            channels = MAX(channels, profile->config.channels);
+        }
+        if (pcm_devices[i] == NULL) {
+            break;
+        }
+    }
+
+    /* VoIP periods are set at adev_open, see voip_set_periods() */
+    if (in->usecase == USECASE_AUDIO_CAPTURE_VOIP) {
+        struct pcm_config voip;
+
+        in_voip_config(in, &voip);
+        frames = (voip.period_size * in->requested_rate + voip.rate - 1) /
+                 voip.rate;
+        in->max_frames = MAX(in->max_frames, frames);
+        period_size = MAX(period_size, voip.period_size);
+        channels = MAX(channels, voip.channels);
+    }
+    in->max_frames = ((in->max_frames + 15) / 16) * 16;
+
+    /* the reference may change rate while the input is in standby */
+    if (in->source == AUDIO_SOURCE_VOICE_COMMUNICATION && adev->echo_ref != NULL) {
+        ref_frames = (in->max_frames * ECHO_REF_MAX_RATE +
+                      in->requested_rate - 1) / in->requested_rate;
+    }
+
+    size = ARENA_SIZE(period_size * channels * sizeof(int16_t)) +
+           ARENA_SIZE(in->max_frames * channels * sizeof(int16_t)) +
+           ARENA_SIZE(in->max_frames * main_channels * sizeof(int16_t)) +
+           ARENA_SIZE(ref_frames * sizeof(int16_t)) +
+           ARENA_SIZE(in->max_frames * sizeof(int16_t));
+
+    if (arena_init(&in->arena, size) != 0) {
+        return -ENOMEM;
+    }
+
+    in->read_buf = arena_alloc(&in->arena, period_size * channels * sizeof(int16_t));
+    in->proc_buf = arena_alloc(&in->arena, in->max_frames * channels * sizeof(int16_t));
+    in->aec_buf = arena_alloc(&in->arena,
+                              in->max_frames * main_channels * sizeof(int16_t));
+    if (ref_frames > 0) {
+        in->ref_buf = arena_alloc(&in->arena, ref_frames * sizeof(int16_t));
+        in->ref_out_buf = arena_alloc(&in->arena, in->max_frames * sizeof(int16_t));
+    }
+
+    ALOGV("%s: %zu frames per chunk, %zu bytes", __func__, in->max_frames, size);
+
+    return 0;
+}
+
 static int adev_open_input_stream(struct audio_hw_device *dev,
                                   audio_io_handle_t handle,
                                   audio_devices_t devices,
@@ -3334,17 +5805,34 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
                                   struct audio_stream_in **stream_in,
                                   audio_input_flags_t flags,
                                   const char *address __unused,
-                                  audio_source_t source __unused)
+                                  audio_source_t source)
 {
     struct audio_device *adev = (struct audio_device *)dev;
     struct stream_in *in;
+    enum voice_rec_mode voice_rec_mode = VOICE_REC_NONE;
     int ret;
 
     *stream_in = NULL;
 
-    /* Respond with a request for mono if a different format is given. */
-    if (config->channel_mask != AUDIO_CHANNEL_IN_MONO &&
-        config->channel_mask != AUDIO_CHANNEL_IN_FRONT_BACK) {
+    adev_link_rates_ready(adev);
+
+    if ((devices & ~AUDIO_DEVICE_BIT_IN) &
+        (AUDIO_DEVICE_IN_VOICE_CALL & ~AUDIO_DEVICE_BIT_IN)) {
+        /* Call recording: the channel mask selects uplink and/or downlink */
+        voice_rec_mode = voice_rec_get_mode(source, config->channel_mask);
+        if (voice_rec_mode == VOICE_REC_NONE) {
+            config->channel_mask = AUDIO_CHANNEL_IN_MONO;
+            return -EINVAL;
+        }
+        /* frames are read as the mask counts them, it has to match the mode */
+        if (audio_channel_count_from_in_mask(config->channel_mask) !=
+            voice_rec_channel_count(voice_rec_mode)) {
+            config->channel_mask = voice_rec_channel_mask(voice_rec_mode);
+            return -EINVAL;
+        }
+    } else if (config->channel_mask != AUDIO_CHANNEL_IN_MONO &&
+               config->channel_mask != AUDIO_CHANNEL_IN_FRONT_BACK) {
+        /* Respond with a request for mono if a different format is given. */
         if (!(adev->in_call && adev->two_mic_control)) {
             /* Not in a call and no explicit FRONT_BACK input requested */
             config->channel_mask = AUDIO_CHANNEL_IN_MONO;
@@ -3352,7 +5840,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
         }
     }
 
-    in = (struct stream_in *)calloc(1, sizeof(struct stream_in));
+    in = (struct stream_in *)stream_pool_alloc(adev->in_pool);
     if (in == NULL) {
         return -ENOMEM;
     }
@@ -3363,14 +5851,14 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.common.get_channels = in_get_channels;
     in->stream.common.get_format = in_get_format;
     in->stream.common.set_format = in_set_format;
-    in->stream.common.standby = in_standby;
+    in->stream.common.standby = in_standby_traced;
     in->stream.common.dump = in_dump;
-    in->stream.common.set_parameters = in_set_parameters;
+    in->stream.common.set_parameters = in_set_parameters_traced;
     in->stream.common.get_parameters = in_get_parameters;
     in->stream.common.add_audio_effect = in_add_audio_effect;
     in->stream.common.remove_audio_effect = in_remove_audio_effect;
     in->stream.set_gain = in_set_gain;
-    in->stream.read = in_read;
+    in->stream.read = in_read_traced;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
     in->stream.get_capture_position = in_get_capture_position;
 
@@ -3382,16 +5870,57 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->device = devices & ~AUDIO_DEVICE_BIT_IN;
     in->io_handle = handle;
     in->channel_mask = config->channel_mask;
+    in->main_channels = config->channel_mask;
+    in->source = source;
     in->flags = flags;
+    if (source == AUDIO_SOURCE_VOICE_RECOGNITION ||
+        source == AUDIO_SOURCE_CAMCORDER) {
+        in->preroll_ms = adev->preroll_offset_ms;
+    }
+    if (voice_rec_mode != VOICE_REC_NONE) {
+        in->usecase = USECASE_AUDIO_CAPTURE_VOICE_CALL;
+        in->usecase_type = PCM_CAPTURE;
+        in->voice_rec_mode = voice_rec_mode;
+    } else if (source == AUDIO_SOURCE_VOICE_COMMUNICATION) {
+        in->usecase = USECASE_AUDIO_CAPTURE_VOIP;
+        in->usecase_type = PCM_CAPTURE;
+    } else {
+        in->usecase = USECASE_AUDIO_CAPTURE;
+        in->usecase_type = PCM_CAPTURE;
+    }
     struct pcm_config *pcm_config = flags & AUDIO_INPUT_FLAG_FAST ?
             &pcm_config_in_low_latency : &pcm_config_in;
     in->config = pcm_config;
 
-    in->buffer = malloc(pcm_config->period_size * pcm_config->channels
-                                               * audio_stream_in_frame_size(&in->stream));
+    /*
+     * Mono camcorder and VoIP capture can use both mics, whether it does is
+     * decided by "noise_suppression" when the stream starts.
+     */
+    if (config->channel_mask == AUDIO_CHANNEL_IN_MONO &&
+        (source == AUDIO_SOURCE_CAMCORDER ||
+         source == AUDIO_SOURCE_VOICE_COMMUNICATION)) {
+        uint32_t link_rate = pcm_config->rate;
+        size_t block_frames = CAPTURE_PERIOD_SIZE_LOW_LATENCY;
+
+        /* at the rate and periods the VoIP link opens with */
+        if (in->usecase == USECASE_AUDIO_CAPTURE_VOIP) {
+            struct pcm_config voip;
+
+            in_voip_config(in, &voip);
+            link_rate = voip.rate;
+            block_frames = voip.period_size;
+        }
+        in->two_mic = two_mic_create(link_rate,
+                                     block_frames,
+                                     source == AUDIO_SOURCE_CAMCORDER ?
+                                         TWO_MIC_FAR : TWO_MIC_NEAR);
+        if (in->two_mic == NULL) {
+            ALOGW("%s: two mic noise reduction not available", __func__);
+        }
+    }
 
-    if (!in->buffer) {
-        ret = -ENOMEM;
+    ret = in_init_arena(in);
+    if (ret != 0) {
         goto err_malloc;
     }
 
@@ -3417,22 +5946,23 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     ALOGV("%s: Requesting input stream with rate: %d, channels: 0x%x\n",
           __func__, config->sample_rate, config->channel_mask);
 
-    pthread_mutex_init(&in->lock, (const pthread_mutexattr_t *) NULL);
-    pthread_mutex_init(&in->pre_lock, (const pthread_mutexattr_t *) NULL);
+    hal_lock_init(&in->lock, "input lock", HAL_LOCK_RANK_STREAM);
+    hal_lock_init(&in->pre_lock, "input pre_lock", HAL_LOCK_RANK_STREAM);
 
     *stream_in = &in->stream;
     return 0;
 
 err_resampler:
-    free(in->buffer);
+    arena_release(&in->arena);
 err_malloc:
-    free(in);
+    stream_pool_free(adev->in_pool, in);
     return ret;
 }
 
-static void adev_close_input_stream(struct audio_hw_device *dev __unused,
+static void adev_close_input_stream(struct audio_hw_device *dev,
                                    struct audio_stream_in *stream)
 {
+    struct audio_device *adev = (struct audio_device *)dev;
     struct stream_in *in = (struct stream_in *)stream;
 
     in_standby(&stream->common);
@@ -3440,28 +5970,358 @@ static void adev_close_input_stream(struct audio_hw_device *dev __unused,
         release_resampler(in->resampler);
         in->resampler = NULL;
     }
-    free(in->buffer);
-    free(stream);
+    if (in->ref_resampler) {
+        release_resampler(in->ref_resampler);
+        in->ref_resampler = NULL;
+    }
+    rate_conv_destroy(in->rate_conv);
+    two_mic_destroy(in->two_mic);
+    arena_release(&in->arena);
+    pcm_tap_release(in);
+    hal_lock_destroy(&in->pre_lock);
+    hal_lock_destroy(&in->lock);
+    stream_pool_free(adev->in_pool, stream);
+}
+
+static void adev_dump_echo_ref(const struct audio_device *adev, int fd)
+{
+    struct echo_ref_stats stats;
+
+    if (adev->echo_ref == NULL) {
+        return;
+    }
+
+    echo_ref_get_stats(adev->echo_ref, &stats);
+
+    dprintf(fd, "  Echo reference: %s\n",
+            echo_ref_is_active(adev->echo_ref) ? "active" : "inactive");
+    if (stats.blocks > 0) {
+        dprintf(fd, "    Alignment error: last %lld us, avg %lld us, max %lld us\n",
+                (long long)(stats.align_err_last_ns / 1000),
+                (long long)(stats.align_err_sum_ns /
+                            (int64_t)stats.blocks / 1000),
+                (long long)(stats.align_err_max_ns / 1000));
+        dprintf(fd, "    Blocks: %llu, resyncs: %u, underruns: %u, overruns: %u\n",
+                (unsigned long long)stats.blocks,
+                stats.resyncs,
+                stats.underruns,
+                stats.overruns);
+    }
+}
+
+static void adev_dump_loopback(const struct audio_device *adev, int fd)
+{
+    struct loopback_stats stats[LOOPBACK_MAX_PROFILES];
+    int count;
+    int i;
+
+    if (adev->loopback == NULL) {
+        return;
+    }
+
+    count = loopback_get_stats(adev->loopback, stats, LOOPBACK_MAX_PROFILES);
+    if (count == 0 && !loopback_is_active(adev->loopback)) {
+        return;
+    }
+
+    dprintf(fd, "  Loopback test: %s, path %s\n",
+            loopback_is_active(adev->loopback) ? "active" : "inactive",
+            adev->loopback_path);
+    for (i = 0; i < count; i++) {
+        dprintf(fd, "    Periods %u/%u: last %lld us, min %lld us, max %lld us, "
+                "jitter %lld us\n",
+                stats[i].out_period,
+                stats[i].in_period,
+                (long long)stats[i].latency_last_us,
+                (long long)stats[i].latency_min_us,
+                (long long)stats[i].latency_max_us,
+                (long long)loopback_jitter_us(&stats[i]));
+        dprintf(fd, "      Measurements: %u, missed: %u, glitches: %u\n",
+                stats[i].measurements,
+                stats[i].missed,
+                stats[i].glitches);
+    }
+}
+
+/*
+ * What the HAL adds to the mouth to ear latency of a VoIP call: the
+ * downlink buffer and one uplink period.
+ */
+static void adev_dump_voip(const struct audio_device *adev, int fd)
+{
+    const struct stream_out *out = adev->voip_output;
+    const struct stream_in *in = adev->active_input;
+    unsigned int rx_ms = 0;
+    unsigned int tx_ms = 0;
+
+    dprintf(fd, "  VoIP: %u ms periods", adev->voip_period_ms);
+    if (out != NULL) {
+        const struct pcm_config *config = out_kernel_config(out);
+
+        rx_ms = config->period_size * config->period_count * 1000 / config->rate;
+        dprintf(fd, ", downlink %u Hz %u ms", config->rate, rx_ms);
+    }
+    if (in != NULL && in->usecase == USECASE_AUDIO_CAPTURE_VOIP && !in->standby) {
+        tx_ms = in->config.period_size * 1000 / in->config.rate;
+        dprintf(fd, ", uplink %u Hz %u ms", in->config.rate, tx_ms);
+    }
+    dprintf(fd, ", HAL share of mouth to ear %u ms\n", rx_ms + tx_ms);
+}
+
+/*
+ * Open outputs against their capacity, and the deep buffer output in full.
+ * must be called with hw device outputs list locked
+ */
+static void adev_dump_outputs_l(const struct audio_device *adev, int fd)
+{
+    struct stream_out *out;
+    struct listnode *node;
+    audio_usecase_t id;
+
+    dprintf(fd, "  Outputs:");
+    for (id = 0; id < AUDIO_USECASE_MAX; id++) {
+        if (output_capacity[id] > 0) {
+            dprintf(fd, " %s %u/%u", use_case_table[id],
+                    adev->output_count[id], output_capacity[id]);
+        }
+    }
+    dprintf(fd, "\n");
+
+    list_for_each(node, &adev->output_list) {
+        out = node_to_item(node, struct stream_out, adev_list_node);
+        if (out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER) {
+            dprintf(fd, "  Deep buffer output:\n");
+            out_dump(&out->stream.common, fd);
+        }
+    }
+}
+
+static void adev_dump_preroll(const struct audio_device *adev, int fd)
+{
+    struct preroll_stats stats;
+    int64_t armed_s;
+
+    if (adev->preroll == NULL) {
+        return;
+    }
+
+    preroll_get_stats(adev->preroll, &stats);
+    armed_s = stats.armed_ns / 1000000000LL;
+
+    dprintf(fd, "  Pre-roll: %s, armed %lld s, %llu wakeups (%lld/s), "
+            "cpu %lld ms (%lld us/s), %u read errors\n",
+            preroll_armed(adev->preroll) ? "armed" : "idle",
+            (long long)armed_s,
+            (unsigned long long)stats.reads,
+            (long long)(armed_s > 0 ? (int64_t)stats.reads / armed_s : 0),
+            (long long)(stats.cpu_ns / 1000000),
+            (long long)(armed_s > 0 ? stats.cpu_ns / 1000 / armed_s : 0),
+            stats.read_errors);
+    dprintf(fd, "    %u handoffs, avg %lld us max %lld us, %llu frames served\n",
+            stats.handoffs,
+            (long long)(stats.handoffs > 0 ?
+                        stats.handoff_sum_ns / 1000 / stats.handoffs : 0),
+            (long long)(stats.handoff_max_ns / 1000),
+            (unsigned long long)stats.frames_served);
+    dprintf(fd, "    Input start: %u opening the PCM avg %lld us, "
+            "%u taking it over avg %lld us\n",
+            stats.opened,
+            (long long)(stats.opened > 0 ?
+                        stats.open_sum_ns / 1000 / stats.opened : 0),
+            stats.taken,
+            (long long)(stats.taken > 0 ?
+                        stats.take_sum_ns / 1000 / stats.taken : 0));
 }
 
-static int adev_dump(const audio_hw_device_t *device __unused, int fd __unused)
+/*
+ * The registry lock keeps the outputs from closing, the device lock the
+ * active input, streams are only dumped while both are held.
+ */
+static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+
+    dprintf(fd, "\nAudio HAL state:\n");
+
+    adev_dump_echo_ref(adev, fd);
+    adev_dump_loopback(adev, fd);
+
+    dprintf(fd, "  Output state: version %u, read retries %u\n",
+            dev_state_version(&adev->dev_state),
+            __atomic_load_n(&adev->dev_state.read_retries, __ATOMIC_RELAXED));
+    dprintf(fd, "  Screen: %s\n",
+            __atomic_load_n(&adev->screen_off, __ATOMIC_RELAXED) ? "off" : "on");
+
+    hal_lock_acquire(&adev->lock_outputs);
+    hal_lock_acquire(&adev->lock);
+
+    if (adev->primary_output != NULL) {
+        dprintf(fd, "  Primary output:\n");
+        out_dump(&adev->primary_output->stream.common, fd);
+    }
+    adev_dump_outputs_l(adev, fd);
+    adev_dump_voip(adev, fd);
+
+    dprintf(fd, "  SCO: %s, link %s\n",
+            adev->sco.wbs ? "wideband" : "narrowband",
+            (adev->sco.rx != NULL || adev->sco.tx != NULL) ? "open" : "closed");
+
+    if (adev->active_input != NULL) {
+        dprintf(fd, "  Active input:\n");
+        in_dump(&adev->active_input->stream.common, fd);
+    }
+
+    hal_lock_release(&adev->lock);
+    hal_lock_release(&adev->lock_outputs);
+
+    hal_lock_dump(fd);
+    thread_mgr_dump(fd);
+    api_trace_dump(fd);
+    pcm_tap_dump(fd);
+    pcm_watch_dump(fd);
+    adev_dump_preroll(adev, fd);
+    hdmi_caps_dump(fd);
+    startup_dump(fd);
+    energy_dump(fd);
+
     return 0;
 }
 
+static int adev_open_output_stream_traced(struct audio_hw_device *dev,
+                                          audio_io_handle_t handle,
+                                          audio_devices_t devices,
+                                          audio_output_flags_t flags,
+                                          struct audio_config *config,
+                                          struct audio_stream_out **stream_out,
+                                          const char *address)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = adev_open_output_stream(dev, handle, devices, flags, config,
+                                  stream_out, address);
+    api_trace_end(&call, API_TRACE_OPEN_OUTPUT, *stream_out, flags, ret, NULL, 0);
+
+    return ret;
+}
+
+static void adev_close_output_stream_traced(struct audio_hw_device *dev,
+                                            struct audio_stream_out *stream)
+{
+    struct api_trace_call call;
+
+    api_trace_begin(&call);
+    adev_close_output_stream(dev, stream);
+    api_trace_end(&call, API_TRACE_CLOSE_OUTPUT, stream, 0, 0, NULL, 0);
+}
+
+static int adev_open_input_stream_traced(struct audio_hw_device *dev,
+                                         audio_io_handle_t handle,
+                                         audio_devices_t devices,
+                                         struct audio_config *config,
+                                         struct audio_stream_in **stream_in,
+                                         audio_input_flags_t flags,
+                                         const char *address,
+                                         audio_source_t source)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = adev_open_input_stream(dev, handle, devices, config, stream_in,
+                                 flags, address, source);
+    api_trace_end(&call, API_TRACE_OPEN_INPUT, *stream_in, source, ret, NULL, 0);
+
+    return ret;
+}
+
+static void adev_close_input_stream_traced(struct audio_hw_device *dev,
+                                           struct audio_stream_in *stream)
+{
+    struct api_trace_call call;
+
+    api_trace_begin(&call);
+    adev_close_input_stream(dev, stream);
+    api_trace_end(&call, API_TRACE_CLOSE_INPUT, stream, 0, 0, NULL, 0);
+}
+
+static int adev_set_mode_traced(struct audio_hw_device *dev, audio_mode_t mode)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = adev_set_mode(dev, mode);
+    api_trace_end(&call, API_TRACE_SET_MODE, NULL, mode, ret, NULL, 0);
+
+    return ret;
+}
+
+static int adev_set_parameters_traced(struct audio_hw_device *dev,
+                                      const char *kvpairs)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = adev_set_parameters(dev, kvpairs);
+    api_trace_end_parameters(&call, API_TRACE_SET_PARAMETERS, NULL, ret, kvpairs);
+
+    return ret;
+}
+
+static int adev_set_voice_volume_traced(struct audio_hw_device *dev, float volume)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = adev_set_voice_volume(dev, volume);
+    api_trace_end(&call, API_TRACE_SET_VOICE_VOLUME, NULL, volume * 1000, ret,
+                  NULL, 0);
+
+    return ret;
+}
+
+static int adev_set_mic_mute_traced(struct audio_hw_device *dev, bool state)
+{
+    struct api_trace_call call;
+    int ret;
+
+    api_trace_begin(&call);
+    ret = adev_set_mic_mute(dev, state);
+    api_trace_end(&call, API_TRACE_SET_MIC_MUTE, NULL, state, ret, NULL, 0);
+
+    return ret;
+}
+
 static int adev_close(hw_device_t *device)
 {
     struct audio_device *adev = (struct audio_device *)device;
 
-    audio_route_free(adev->audio_route);
+    startup_task_stop(&adev->mixer.init);
+    startup_task_stop(&adev->ril_init);
+    startup_task_stop(&adev->link_rates);
 
-    if (adev->hdmi_drv_fd >= 0) {
-        close(adev->hdmi_drv_fd);
+    if (adev->mixer.audio_route != NULL) {
+        audio_route_free(adev->mixer.audio_route);
     }
 
     /* RIL */
     ril_close(&adev->ril);
 
+    echo_ref_destroy(adev->echo_ref);
+    loopback_destroy(adev->loopback);
+    preroll_destroy(adev->preroll);
+    energy_release();
+    stream_pool_destroy(adev->in_pool);
+    stream_pool_destroy(adev->out_pool);
+    dev_state_destroy(&adev->dev_state);
+    hal_lock_destroy(&adev->lock_inputs);
+    hal_lock_destroy(&adev->lock_outputs);
+    hal_lock_destroy(&adev->lock);
+
     free(device);
     return 0;
 }
@@ -3524,6 +6384,74 @@ static int adev_open(const hw_module_t* module, const char* name,
 }
 #endif
 
+/*
+ * Before any stream is open, the probe opens the PCM devices. The modem
+ * and SCO links are left out, they run at the rate of their profile and
+ * opening them may disturb the modem or the BT chip.
+ */
+static void adev_probe_link_rates(void *arg __unused)
+{
+    struct pcm_device_profile * const extra[] = {
+        &pcm_device_playback_voip,
+        &pcm_device_capture_voip,
+    };
+    struct pcm_device_profile *profile;
+    size_t i;
+
+    for (i = 0; pcm_devices[i] != NULL; i++) {
+        profile = pcm_devices[i];
+        if (profile->type == VOICE_CALL || profile->id == PCM_DEVICE_SCO) {
+            continue;
+        }
+        link_rate_probe(&profile->rates, profile->card, profile->id,
+                        profile->type == PCM_PLAYBACK,
+                        profile->config.rate);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(extra); i++) {
+        profile = extra[i];
+        link_rate_probe(&profile->rates, profile->card, profile->id,
+                        profile->type == PCM_PLAYBACK,
+                        profile->config.rate);
+    }
+}
+
+/* Parses mixer_paths.xml and writes the initial mixer state */
+static void adev_init_mixer(void *arg)
+{
+    struct audio_device *adev = (struct audio_device *)arg;
+
+    adev->mixer.audio_route = audio_route_init(MIXER_CARD, NULL);
+    if (adev->mixer.audio_route == NULL) {
+        ALOGE("%s: Failed to init the mixer, no routing", __func__);
+    }
+}
+
+/*
+ * Once the mixer is ready, the pre-roll takes the device lock to route the
+ * mic. It opens the capture PCM, not while the probe may have it open.
+ */
+static void adev_arm_preroll(void *arg)
+{
+    struct audio_device *adev = (struct audio_device *)arg;
+
+    if (adev->preroll != NULL) {
+        adev_link_rates_ready(adev);
+        hal_lock_acquire(&adev->lock);
+        preroll_arm_l(adev);
+        hal_lock_release(&adev->lock);
+    }
+}
+
+static void adev_init_ril(void *arg)
+{
+    struct audio_device *adev = (struct audio_device *)arg;
+
+    ril_open(&adev->ril);
+    /* register callback for wideband AMR setting */
+    ril_register_set_wb_amr_callback(adev_set_wb_amr_callback, (void *)adev);
+}
+
 static int adev_open(const hw_module_t *module,
                      const char *name,
                      hw_device_t **device)
@@ -3541,6 +6469,10 @@ static int adev_open(const hw_module_t *module,
         return -EINVAL;
     }
 
+    startup_begin(property_get_bool("persist.audio.startup.deferred", true));
+
+    parms_init();
+
     adev = calloc(1, sizeof(struct audio_device));
     if (adev == NULL) {
         return -ENOMEM;
@@ -3552,21 +6484,21 @@ static int adev_open(const hw_module_t *module,
     adev->device.common.close = adev_close;
 
     adev->device.init_check = adev_init_check;
-    adev->device.set_voice_volume = adev_set_voice_volume;
+    adev->device.set_voice_volume = adev_set_voice_volume_traced;
     adev->device.set_master_volume = adev_set_master_volume;
     adev->device.get_master_volume = adev_get_master_volume;
     adev->device.set_master_mute = adev_set_master_mute;
     adev->device.get_master_mute = adev_get_master_mute;
-    adev->device.set_mode = adev_set_mode;
-    adev->device.set_mic_mute = adev_set_mic_mute;
+    adev->device.set_mode = adev_set_mode_traced;
+    adev->device.set_mic_mute = adev_set_mic_mute_traced;
     adev->device.get_mic_mute = adev_get_mic_mute;
-    adev->device.set_parameters = adev_set_parameters;
+    adev->device.set_parameters = adev_set_parameters_traced;
     adev->device.get_parameters = adev_get_parameters;
     adev->device.get_input_buffer_size = adev_get_input_buffer_size;
-    adev->device.open_output_stream = adev_open_output_stream;
-    adev->device.close_output_stream = adev_close_output_stream;
-    adev->device.open_input_stream = adev_open_input_stream;
-    adev->device.close_input_stream = adev_close_input_stream;
+    adev->device.open_output_stream = adev_open_output_stream_traced;
+    adev->device.close_output_stream = adev_close_output_stream_traced;
+    adev->device.open_input_stream = adev_open_input_stream_traced;
+    adev->device.close_input_stream = adev_close_input_stream_traced;
     adev->device.dump = adev_dump;
 
     /* Set the default route before the PCM stream is opened */
@@ -3578,34 +6510,95 @@ static int adev_open(const hw_module_t *module,
     adev->bluetooth_nrec = true;
     adev->in_call = false;
     /* adev->cur_hdmi_channels = 0;  by calloc() */
-    adev->snd_dev_ref_cnt = calloc(SND_DEVICE_MAX, sizeof(int));
 
     adev->dualmic_config = DUALMIC_CONFIG_NONE;
     adev->ns_in_voice_rec = false;
 
     list_init(&adev->usecase_list);
-
-    adev->mixer.audio_route = audio_route_init(MIXER_CARD, NULL);
-    if (adev->mixer.audio_route == NULL) {
+    list_init(&adev->output_list);
+    routing_init();
+    init_pcm_device_index();
+    hal_lock_init(&adev->lock, "device lock", HAL_LOCK_RANK_DEVICE);
+    hal_lock_init(&adev->lock_outputs, "outputs lock", HAL_LOCK_RANK_OUTPUTS);
+    hal_lock_init(&adev->lock_inputs, "inputs lock", HAL_LOCK_RANK_INPUTS);
+    dev_state_init(&adev->dev_state);
+
+    adev->out_pool = stream_pool_create(sizeof(struct stream_out),
+                                        OUT_STREAM_POOL_SIZE);
+    adev->in_pool = stream_pool_create(sizeof(struct stream_in),
+                                       IN_STREAM_POOL_SIZE);
+
+    if (adev->out_pool == NULL || adev->in_pool == NULL) {
         ALOGE("%s: Failed to init, aborting.", __func__);
 
-        free(adev->snd_dev_ref_cnt);
+        stream_pool_destroy(adev->in_pool);
+        stream_pool_destroy(adev->out_pool);
+        dev_state_destroy(&adev->dev_state);
+        hal_lock_destroy(&adev->lock_inputs);
+        hal_lock_destroy(&adev->lock_outputs);
+        hal_lock_destroy(&adev->lock);
         free(adev);
 
         return -EINVAL;
     }
 
     /* Do not sleep on first enable_snd_device() */
-    adev->mixer.shutdown_time = {
+    adev->mixer.shutdown_time = (struct timespec) {
         .tv_sec = 1,
+    };
+
+    energy_init();
+
+    startup_phase("state");
+
+    pcm_watch_set_multiple(property_get_int32("persist.audio.pcm_watchdog",
+                                              PCM_WATCH_MULTIPLE));
+
+    /* Off unless persist.audio.preroll.seconds is set */
+    adev->preroll = preroll_create(property_get_int32("persist.audio.preroll.seconds", 0),
+                                   pcm_config_preroll.rate,
+                                   pcm_config_preroll.channels);
+    adev->preroll_offset_ms = property_get_int32("persist.audio.preroll.offset_ms",
+                                                 PREROLL_OFFSET_MS);
+    /* armed by adev_arm_preroll() once the mixer is ready */
+    adev->preroll_snd_device = SND_DEVICE_NONE;
+
+    adev->voip_period_ms = property_get_int32("persist.audio.voip.period_ms",
+                                              VOIP_PERIOD_MS);
+    if (adev->voip_period_ms != 10 && adev->voip_period_ms != 20) {
+        adev->voip_period_ms = VOIP_PERIOD_MS;
     }
 
-    /* RIL */
-    ril_open(&adev->ril);
-    /* register callback for wideband AMR setting */
-    ril_register_set_wb_amr_callback(adev_set_wb_amr_callback, (void *)adev);
+    adev->echo_ref = echo_ref_create(PLAYBACK_DEFAULT_SAMPLING_RATE,
+                                     ECHO_REF_FRAMES);
+    if (adev->echo_ref == NULL) {
+        ALOGW("%s: Failed to create echo reference, AEC disabled", __func__);
+    }
 
-    *device = &adev->device.common;
+    adev->loopback = loopback_create(PLAYBACK_DEFAULT_SAMPLING_RATE);
+    strlcpy(adev->loopback_path, "loopback-digital",
+            sizeof(adev->loopback_path));
+
+    adev->spk_prot_enabled = property_get_bool("persist.audio.spk_prot", true);
+
+    startup_phase("buffers");
+
+    /*
+     * Neither is needed before the first stream starts or the first call
+     * is routed, adev_mixer_ready() and adev_ril() wait for them then. The
+     * link rates are joined by the first stream open.
+     */
+    startup_task_start(&adev->mixer.init, "mixer", adev_init_mixer,
+                       adev_arm_preroll, adev);
+    startup_task_start(&adev->ril_init, "ril", adev_init_ril, NULL, adev);
+    startup_task_start(&adev->link_rates, "link rates", adev_probe_link_rates,
+                       NULL, adev);
+    startup_phase("tasks");
+
+#ifndef HDMI_INCAPABLE
+    hdmi_caps_init();
+    startup_phase("hdmi");
+#endif
 
     char value[PROPERTY_VALUE_MAX];
     if (property_get("audio_hal.period_size", value, NULL) > 0) {
@@ -3621,6 +6614,10 @@ static int adev_open(const hw_module_t *module,
             pcm_device_capture_low_latency.config.period_size = trial;
         }
     }
+    startup_phase("period size");
+
+    *device = &adev->device.common;
+    startup_end();
 
     ALOGV("%s: exit", __func__);
 
@@ -19,6 +19,7 @@
 
 #include <cutils/list.h>
 #include <hardware/audio.h>
+#include <hardware/audio_effect.h>
 
 #include <tinyalsa/asoundlib.h>
 #include <tinycompress/tinycompress.h>
@@ -26,6 +27,29 @@
 #include <audio_utils/resampler.h>
 #include <audio_route/audio_route.h>
 
+#include "api_trace.h"
+#include "arena.h"
+#include "dev_state.h"
+#include "echo_ref.h"
+#include "energy.h"
+#include "hal_lock.h"
+#include "hdmi_caps.h"
+#include "link_rate.h"
+#include "loopback.h"
+#include "parms.h"
+#include "pcm_convert.h"
+#include "pcm_tap.h"
+#include "pcm_watch.h"
+#include "preroll.h"
+#include "rate_conv.h"
+#include "routing.h"
+#include "spk_prot.h"
+#include "startup.h"
+#include "stream_pool.h"
+#include "thread_mgr.h"
+#include "two_mic.h"
+#include "voice_rec.h"
+
 #define MIXER_CARD 0
 #define SOUND_CARD 0
 
@@ -33,6 +57,10 @@
 #define PCM_CARD_SPDIF 1
 #define PCM_TOTAL 2
 
+/* Streams allocated up front, more fall back to single allocations */
+#define OUT_STREAM_POOL_SIZE DEV_STATE_MAX_OUTPUTS
+#define IN_STREAM_POOL_SIZE 4
+
 #define PCM_DEVICE_PLAYBACK 0     /* Playback link */
 #define PCM_DEVICE_CAPTURE 0      /* Capture link */
 #define PCM_DEVICE_VOICE 1        /* Baseband link */
@@ -54,6 +82,15 @@
 #define DEEP_BUFFER_CHANNEL_COUNT 2
 #define DEEP_BUFFER_SAMPLING_RATE 48000
 
+/*
+ * Deep buffer periods while the screen is off and no low latency output is
+ * active: 400 ms of buffering, one wakeup every 100 ms.
+ */
+#define DEEP_BUFFER_LOW_POWER_PERIOD_SIZE 4800
+#define DEEP_BUFFER_LOW_POWER_PERIOD_COUNT 4
+/* a pcm_write() that blocked longer than this slept until a period elapsed */
+#define DEEP_BUFFER_WAKEUP_NS 1000000
+
 #define SCO_PERIOD_SIZE 240
 #define SCO_PERIOD_COUNT 2
 #define SCO_DEFAULT_CHANNEL_COUNT 2
@@ -61,6 +98,9 @@
 #define SCO_START_THRESHOLD 335
 #define SCO_STOP_THRESHOLD 336
 #define SCO_AVAILABLE_MIN 1
+/* Wideband speech (mSBC) is mono 16 kHz on the link */
+#define SCO_WB_CHANNEL_COUNT 1
+#define SCO_WB_SAMPLING_RATE 16000
 
 #define CAPTURE_PERIOD_SIZE 320
 #define CAPTURE_PERIOD_SIZE_LOW_LATENCY 240
@@ -85,22 +125,49 @@
 
 #define HDMI_MAX_SUPPORTED_CHANNEL_MASKS 2
 
-#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+/*
+ * VoIP downlink and uplink run with matched periods of 10 or 20 ms
+ * (persist.audio.voip.period_ms) at 16 or 48 kHz, two of them, so that a
+ * jitter buffer sees at most one period of HAL buffering each way.
+ */
+#define VOIP_PERIOD_MS 20
+#define VOIP_PERIOD_COUNT 2
+#define VOIP_DEFAULT_CHANNEL_COUNT 2
+#define VOIP_DEFAULT_SAMPLING_RATE 16000
+#define VOIP_WIDEBAND_SAMPLING_RATE 48000
+/* the uplink ramps up over its first period instead of CAPTURE_START_RAMP_MS */
+#define VOIP_START_RAMP_MS VOIP_PERIOD_MS
+
+/* Direct VoIP downlink, the flag is not in this system/audio.h yet */
+#ifndef AUDIO_OUTPUT_FLAG_VOIP_RX
+#define AUDIO_OUTPUT_FLAG_VOIP_RX 0x8000
+#endif
+
+#define MAX_PREPROCESSORS 3
+
+/* Echo reference history kept for the capture side, about 340 ms */
+#define ECHO_REF_FRAMES 16384
+/* Highest rate of the reference, inputs size their buffers for it */
+#define ECHO_REF_MAX_RATE 48000
 
-typedef int snd_device_t;
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 typedef enum {
     USECASE_INVALID = -1,
 
     /* Playback usecases */
     USECASE_AUDIO_PLAYBACK = 0,
+    USECASE_AUDIO_PLAYBACK_DEEP_BUFFER,
     USECASE_AUDIO_PLAYBACK_MULTI_CH,
+    USECASE_AUDIO_PLAYBACK_VOIP,
 
     USECASE_AUDIO_HFP_SCO,
 
     /* Capture usecases */
     USECASE_AUDIO_CAPTURE,
     USECASE_AUDIO_CAPTURE_LOW_LATENCY,
+    USECASE_AUDIO_CAPTURE_VOICE_CALL,
+    USECASE_AUDIO_CAPTURE_VOIP,
 
     USECASE_VOICE_CALL,
 
@@ -112,6 +179,7 @@ typedef enum {
     PCM_CAPTURE,
     VOICE_CALL,
     PCM_HPF_CALL,
+    USECASE_TYPE_MAX
 } usecase_type_t;
 
 struct pcm_device_profile {
@@ -120,18 +188,42 @@ struct pcm_device_profile {
     int               id;
     usecase_type_t    type;
     audio_devices_t   devices;
+    /* probed at adev_open */
+    struct link_rates rates;
+};
+
+struct pcm_device {
+    struct listnode             stream_list_node;
+    struct pcm_device_profile*  pcm_profile;
+    /* profile config, with the deep buffer periods for those outputs */
+    struct pcm_config           config;
+    struct pcm*                 pcm;
+    /* stream rate to link rate, rate_conv for the integer SCO ratios */
+    struct rate_conv*           rate_conv;
+    struct resampler_itfe*      resampler;
+    int16_t*                    res_buffer;
+    size_t                      res_byte_count;
+    /* stream format to link format, NULL if both are 16 bit */
+    void*                       conv_buffer;
+    size_t                      conv_frames;
+    /* stuck pcm_write() or pcm_read(), see pcm_watch.h */
+    struct pcm_watch            watch;
+    enum pcm_watch_action       recovery;
+    /* open time and wakeups, see energy.h */
+    struct energy_pcm           energy;
 };
 
 struct stream_out {
     struct audio_stream_out     stream;
 
-    pthread_mutex_t             lock; /* see note below on mutex acquisition order */
-    pthread_mutex_t             pre_lock; /* acquire before lock to avoid DOS by playback thread */
+    /*
+     * Control state: set up at open, changed by the binder threads and only
+     * read by out_write().
+     */
+    struct hal_lock             lock; /* see note below on mutex acquisition order */
+    struct hal_lock             pre_lock; /* acquire before lock to avoid DOS by playback thread */
     pthread_cond_t              cond;
 
-    struct pcm_config           config;
-    struct listnode             pcm_dev_list;
-    bool                        standby;
     unsigned int                sample_rate;
     audio_channel_mask_t        channel_mask;
     audio_format_t              format;
@@ -140,24 +232,81 @@ struct stream_out {
     audio_usecase_t             usecase;
     /* Array of supported channel mask configurations. +1 so that the last entry is always 0 */
     audio_channel_mask_t        supported_channel_masks[MAX_SUPPORTED_CHANNEL_MASKS + 1];
+    /* "sup_channels=..." reply, built from supported_channel_masks[] */
+    char                        sup_channels_reply[128];
+    /* "sup_sampling_rates=...", the rate chosen at open or those of the HDMI sink */
+    char                        sup_rates_reply[64];
+    audio_io_handle_t           handle;
+    /* entry in adev->dev_state */
+    int                         state_slot;
+    /* entry in adev->output_list */
+    struct listnode             adev_list_node;
+
+    struct audio_device         *dev;
+
+    /*
+     * Write path state, touched by out_write() every period. It starts on a
+     * cache line of its own so that the mixer thread does not share lines
+     * with the control threads, see stream_pool.h.
+     */
+    struct pcm_config           config __cacheline_aligned;
+    struct listnode             pcm_dev_list;
+    bool                        standby;
     bool                        muted;
+    /* writer thread with a role, given back in standby, see thread_mgr.h */
+    pid_t                       writer_tid;
     /* total frames written, not cleared when entering standby */
     uint64_t                    written;
     int64_t                     last_write_time_us;
-    audio_io_handle_t           handle;
-
-    struct audio_device         *dev;
-}
+    /* CPU time spent converting to the link rate, see out_dump() */
+    int64_t                     resample_ns;
+    uint64_t                    resampled_frames;
+    /* high resolution streams: link format conversion and its cost */
+    struct pcm_dither           dither;
+    int16_t                     *ref_s16;
+    int64_t                     convert_ns;
+    uint64_t                    converted_frames;
+    /* limiter and compressor of the speaker, see spk_prot.h */
+    struct spk_prot             spk_prot;
+    /* what the HAL changes of a write, a buffer sized at open */
+    void                        *work_buf;
+    size_t                      work_bytes;
+    /* time out_write() waited for locks, see out_dump() */
+    struct {
+        uint64_t                writes;
+        uint64_t                contended;
+        int64_t                 wait_sum_ns;
+        int64_t                 wait_max_ns;
+    } lock_stats;
+
+    /*
+     * Deep buffer outputs: low power periods in use, and the last frames
+     * written so that the audio still queued in the kernel can be written
+     * again when the periods change, see out_update_deep_buffer().
+     */
+    bool                        low_power;
+    bool                        low_power_wanted;
+    void                        *history;   /* in the link format */
+    size_t                      history_frames;
+    size_t                      history_pos;
+    /* per mode, normal and low power */
+    struct {
+        uint64_t                frames;
+        uint64_t                wakeups;
+        uint32_t                switches;
+    } power_stats[2];
+};
 
 struct stream_in {
     struct audio_stream_in              stream;
 
-    pthread_mutex_t                     lock; /* see note below on mutex acquisition order */
-    pthread_mutex_t                     pre_lock; /* acquire before lock to avoid DOS by
+    /*
+     * Control state: set up at open, changed by the binder threads and only
+     * read by in_read().
+     */
+    struct hal_lock                     lock; /* see note below on mutex acquisition order */
+    struct hal_lock                     pre_lock; /* acquire before lock to avoid DOS by
                                                      capture thread */
-    struct pcm_config                   config;
-    struct listnode                     pcm_dev_list;
-    int                                 standby;
     audio_source_t                      source;
     audio_devices_t                     devices;
     uint32_t                            main_channels;
@@ -165,17 +314,65 @@ struct stream_in {
     usecase_type_t                      usecase_type;
     bool                                enable_aec;
     audio_input_flags_t                 input_flags;
+    /* layout of the uplink/downlink slots for call recording */
+    enum voice_rec_mode                 voice_rec_mode;
+    /* of the pre-roll to start with, "preroll_offset" */
+    unsigned int                        preroll_ms;
+
+    effect_handle_t                     preprocessors[MAX_PREPROCESSORS];
+    int                                 num_preprocessors;
 
     /* TODO: remove resampler if possible when AudioFlinger supports downsampling from 48 to 8 */
     unsigned int                        requested_rate;
+
+    struct audio_device*                dev;
+
+    /*
+     * Read path state, touched by in_read() every period, on cache lines of
+     * its own (see stream_out).
+     */
+    struct pcm_config                   config __cacheline_aligned;
+    struct listnode                     pcm_dev_list;
+    int                                 standby;
+    /* reader thread with a role, given back in standby (see stream_out) */
+    pid_t                               reader_tid;
     struct resampler_itfe*              resampler;
+    struct rate_conv*                   rate_conv;
     struct resampler_buffer_provider    buf_provider;
     int                                 read_status;
+    /* total frames read, not cleared when entering standby */
+    int64_t                             frames_read;
+    int64_t                             last_read_time_us;
+    /* volume ramp when capture starts, see in_start_ramp() */
+    uint16_t                            ramp_vol;
+    uint16_t                            ramp_step;
+    size_t                              ramp_frames;
+    /* took the PCM over from the pre-roll, reads its ring first */
+    bool                                preroll_taken;
+
+    /* Buffers carved from arena at open, see in_init_arena() */
+    struct arena                        arena;
+    size_t                              max_frames;
+    /* one capture period */
     int16_t*                            read_buf;
-    size_t                              read_buf_size;
     size_t                              read_buf_frames;
-
-    struct audio_device*                dev;
+    /* max_frames with all the captured channels */
+    int16_t*                            proc_buf;
+
+    /* echo reference at the playback rate and at the requested rate */
+    struct resampler_itfe*              ref_resampler;
+    int16_t*                            ref_buf;
+    int16_t*                            ref_out_buf;
+    int16_t*                            aec_buf;
+    struct {
+        uint64_t                        blocks;
+        uint64_t                        frames;
+        int64_t                         cpu_sum_ns;
+        int64_t                         cpu_max_ns;
+    } aec_stats;
+    /* front/back noise reduction outside of calls */
+    struct two_mic*                     two_mic;
+    bool                                two_mic_active;
 };
 
 struct audio_usecase {
@@ -187,15 +384,19 @@ struct audio_usecase {
     snd_device_t            in_snd_device;
     struct audio_stream*    stream;
     struct listnode         mixer_list;
+    /* position in usecase_list, lower is nearer the head */
+    int                     seq;
 };
 
 struct audio_device {
     struct audio_hw_device  hw_device;
-    pthread_mutex_t         lock; /* see note below on mutex acquisition order */
+    struct hal_lock         lock; /* see note below on mutex acquisition order */
 
+    /* audio_route is set up by init, join it first, see adev_mixer_ready() */
     struct {
         struct audio_route *audio_route;
         struct timespec shutdown_time;
+        struct startup_task init;
     } mixer;
 
     audio_mode_t            mode;
@@ -209,16 +410,86 @@ struct audio_device {
         bool                    bluetooth_nrec;
         bool                    wb_amr;
         bool                    two_mic_config;
+        /* the call, hostless */
+        struct energy_pcm       energy;
     } voice;
 
-    int                     *snd_dev_ref_cnt;
+    /* "noise_suppression" for capture outside of calls */
+    bool                    ns_in_voice_rec;
+
+    /* "screen_state", read by the deep buffer output with __atomic_load_n */
+    bool                    screen_off;
+
+    /* persist.audio.spk_prot, set at open */
+    bool                    spk_prot_enabled;
+
+    /* Bluetooth SCO link, hostless while a call is routed to SCO */
+    struct {
+        struct pcm              *rx;
+        struct pcm              *tx;
+        bool                    wbs;
+        struct energy_pcm       rx_energy;
+        struct energy_pcm       tx_energy;
+    } sco;
+
+    int                     snd_dev_ref_cnt[SND_DEVICE_MAX];
     struct listnode         usecase_list;
+    /* First usecase of each id and of each type in usecase_list */
+    struct audio_usecase    *usecase_by_id[AUDIO_USECASE_MAX];
+    struct audio_usecase    *usecase_by_type[USECASE_TYPE_MAX];
+    int                     usecase_head_seq;
+    int                     usecase_tail_seq;
+
+    /* Open outputs and how many of each usecase, under lock_outputs */
+    struct listnode         output_list;
+    unsigned int            output_count[AUDIO_USECASE_MAX];
+
+    /* VoIP downlink, feeds the echo reference while open */
+    struct stream_out       *voip_output;
+    unsigned int            voip_period_ms;
+
+    /* What each output plays to, read by the other outputs without locks */
+    struct dev_state        dev_state;
 
-    /* RIL */
+    /* Stream structs, aligned for their hot sections */
+    struct stream_pool      *out_pool;
+    struct stream_pool      *in_pool;
+
+    /* RIL, opened by ril_init, see adev_ril() */
     struct ril_handle ril;
+    struct startup_task ril_init;
+
+    /* probes the rates of the PCM profiles, see adev_link_rates_ready() */
+    struct startup_task link_rates;
+
+    /* Primary output, as mixed, for the capture side AEC */
+    struct echo_ref         *echo_ref;
 
-    pthread_mutex_t         lock_inputs; /* see note below on mutex acquisition order */
-    pthread_mutex_t         lock_outputs; /* see note below on mutex acquisition order */
+    /* Round trip latency test, "loopback_test" */
+    struct loopback         *loopback;
+    char                    loopback_path[32];
+
+    /* Main mic kept running while nothing captures, see preroll.h */
+    struct preroll          *preroll;
+    snd_device_t            preroll_snd_device;
+    struct energy_pcm       preroll_energy;
+    unsigned int            preroll_offset_ms;
+
+    struct hal_lock         lock_inputs; /* see note below on mutex acquisition order */
+    struct hal_lock         lock_outputs; /* see note below on mutex acquisition order */
 };
 
+/*
+ * NOTE: when multiple mutexes have to be acquired, always take the
+ * audio_device lock_outputs first, then stream_out pre_lock/lock (in
+ * output_list order), then audio_device lock. A stream changing its own state takes
+ * only its own lock and the audio_device lock, what the other outputs play
+ * to is read from dev_state without locking them. lock_outputs and the other
+ * streams are only needed when the HDMI output starts or stops.
+ *
+ * The ranks in hal_lock.h follow this order, taking a lock while holding one
+ * ranked after it is reported in adev_dump. All locks inherit priority, the
+ * pre_lock is still needed so that a waiter gets in between two writes.
+ */
+
 #endif /* WOLFSON_AUDIO_HW_H */
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_dev_state"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "dev_state.h"
+
+void dev_state_init(struct dev_state *state)
+{
+    int i;
+
+    memset(state, 0, sizeof(struct dev_state));
+    hal_lock_init(&state->write_lock, "dev_state", HAL_LOCK_RANK_LEAF);
+
+    for (i = 0; i < DEV_STATE_MAX_OUTPUTS; i++) {
+        state->snap.out_devices[i] = AUDIO_DEVICE_NONE;
+    }
+    state->snap.hdmi_slot = -1;
+}
+
+void dev_state_destroy(struct dev_state *state)
+{
+    hal_lock_destroy(&state->write_lock);
+}
+
+/* must be called with write_lock held */
+static void dev_state_write_begin(struct dev_state *state)
+{
+    __atomic_store_n(&state->seq, state->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* must be called with write_lock held */
+static void dev_state_write_end(struct dev_state *state)
+{
+    state->snap.version++;
+    __atomic_store_n(&state->seq, state->seq + 1, __ATOMIC_RELEASE);
+}
+
+int dev_state_add_output(struct dev_state *state)
+{
+    int slot;
+
+    hal_lock_acquire(&state->write_lock);
+
+    for (slot = 0; slot < DEV_STATE_MAX_OUTPUTS; slot++) {
+        if (!(state->used & (1u << slot))) {
+            break;
+        }
+    }
+
+    if (slot == DEV_STATE_MAX_OUTPUTS) {
+        hal_lock_release(&state->write_lock);
+        ALOGE("%s: no free slot", __func__);
+        return -ENOSPC;
+    }
+
+    state->used |= 1u << slot;
+
+    hal_lock_release(&state->write_lock);
+
+    return slot;
+}
+
+void dev_state_remove_output(struct dev_state *state, int slot)
+{
+    if (slot < 0 || slot >= DEV_STATE_MAX_OUTPUTS) {
+        return;
+    }
+
+    dev_state_set_output(state, slot, AUDIO_DEVICE_NONE, 0);
+
+    hal_lock_acquire(&state->write_lock);
+    state->used &= ~(1u << slot);
+    hal_lock_release(&state->write_lock);
+}
+
+void dev_state_set_output(struct dev_state *state,
+                          int slot,
+                          audio_devices_t devices,
+                          uint32_t flags)
+{
+    int hdmi_slot;
+    uint32_t low_latency_slots;
+
+    if (slot < 0 || slot >= DEV_STATE_MAX_OUTPUTS) {
+        return;
+    }
+
+    hal_lock_acquire(&state->write_lock);
+
+    hdmi_slot = state->snap.hdmi_slot;
+    if ((flags & DEV_STATE_OUTPUT_HDMI) && devices != AUDIO_DEVICE_NONE) {
+        hdmi_slot = slot;
+    } else if (hdmi_slot == slot) {
+        hdmi_slot = -1;
+    }
+
+    low_latency_slots = state->snap.low_latency_slots & ~(1u << slot);
+    if ((flags & DEV_STATE_OUTPUT_LOW_LATENCY) && devices != AUDIO_DEVICE_NONE) {
+        low_latency_slots |= 1u << slot;
+    }
+
+    if (state->snap.out_devices[slot] != devices ||
+        state->snap.hdmi_slot != hdmi_slot ||
+        state->snap.low_latency_slots != low_latency_slots) {
+        dev_state_write_begin(state);
+        __atomic_store_n(&state->snap.out_devices[slot], devices,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&state->snap.hdmi_slot, hdmi_slot, __ATOMIC_RELAXED);
+        __atomic_store_n(&state->snap.low_latency_slots, low_latency_slots,
+                         __ATOMIC_RELAXED);
+        dev_state_write_end(state);
+
+        ALOGV("%s: slot %d devices %#x hdmi slot %d low latency %#x, version %u",
+              __func__, slot, devices, hdmi_slot, low_latency_slots,
+              state->snap.version);
+    }
+
+    hal_lock_release(&state->write_lock);
+}
+
+uint32_t dev_state_version(const struct dev_state *state)
+{
+    return __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE);
+}
+
+void dev_state_read(const struct dev_state *state,
+                    struct dev_state_snapshot *snap)
+{
+    struct dev_state *s = (struct dev_state *)state;
+    uint32_t seq;
+    int i;
+
+    for (;;) {
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            snap->version = __atomic_load_n(&s->snap.version, __ATOMIC_RELAXED);
+            for (i = 0; i < DEV_STATE_MAX_OUTPUTS; i++) {
+                snap->out_devices[i] =
+                        __atomic_load_n(&s->snap.out_devices[i], __ATOMIC_RELAXED);
+            }
+            snap->hdmi_slot = __atomic_load_n(&s->snap.hdmi_slot, __ATOMIC_RELAXED);
+            snap->low_latency_slots =
+                    __atomic_load_n(&s->snap.low_latency_slots, __ATOMIC_RELAXED);
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+                return;
+            }
+        }
+
+        __atomic_add_fetch(&s->read_retries, 1, __ATOMIC_RELAXED);
+        sched_yield();
+    }
+}
+
+audio_devices_t dev_state_other_devices(const struct dev_state *state,
+                                        int slot)
+{
+    struct dev_state_snapshot snap;
+    audio_devices_t devices = AUDIO_DEVICE_NONE;
+    int i;
+
+    dev_state_read(state, &snap);
+
+    for (i = 0; i < DEV_STATE_MAX_OUTPUTS; i++) {
+        if (i != slot) {
+            devices |= snap.out_devices[i];
+        }
+    }
+
+    return devices;
+}
+
+bool dev_state_hdmi_active(const struct dev_state *state, int slot)
+{
+    struct dev_state_snapshot snap;
+
+    dev_state_read(state, &snap);
+
+    return snap.hdmi_slot >= 0 && snap.hdmi_slot != slot;
+}
+
+/* A single word, consistent without the sequence check */
+bool dev_state_low_latency_active(const struct dev_state *state)
+{
+    return __atomic_load_n(&state->snap.low_latency_slots, __ATOMIC_ACQUIRE) != 0;
+}
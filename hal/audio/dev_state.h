@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEV_STATE_H
+#define DEV_STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <system/audio.h>
+
+#include "hal_lock.h"
+
+/*
+ * Versioned snapshot of what every output is playing to.
+ *
+ * A stream that starts, stops or is rerouted publishes its own entry; the
+ * other streams read the snapshot without taking any lock (seqlock), so
+ * changing the state of one output no longer needs the locks of all the
+ * others. Publishers are serialized internally and never block readers,
+ * readers retry while a publish is in progress.
+ */
+#define DEV_STATE_MAX_OUTPUTS 8
+
+/* dev_state_set_output() flags */
+#define DEV_STATE_OUTPUT_HDMI           (1u << 0)
+#define DEV_STATE_OUTPUT_LOW_LATENCY    (1u << 1)
+
+struct dev_state_snapshot {
+    uint32_t            version;
+    /* AUDIO_DEVICE_NONE while the output is in standby or the slot is free */
+    audio_devices_t     out_devices[DEV_STATE_MAX_OUTPUTS];
+    /* slot of the HDMI output if it is active, -1 otherwise */
+    int                 hdmi_slot;
+    /* bitmap of the active low latency outputs */
+    uint32_t            low_latency_slots;
+};
+
+struct dev_state {
+    struct hal_lock             write_lock;
+    uint32_t                    seq;    /* odd while a publish is in progress */
+    uint32_t                    used;   /* slot bitmap */
+    uint32_t                    read_retries;
+    struct dev_state_snapshot   snap;
+};
+
+/* Function prototypes */
+void dev_state_init(struct dev_state *state);
+
+void dev_state_destroy(struct dev_state *state);
+
+/* Returns a slot for a new output, or -ENOSPC */
+int dev_state_add_output(struct dev_state *state);
+
+void dev_state_remove_output(struct dev_state *state, int slot);
+
+void dev_state_set_output(struct dev_state *state,
+                          int slot,
+                          audio_devices_t devices,
+                          uint32_t flags);
+
+/* Changes with every publish, for readers that cache what they derived */
+uint32_t dev_state_version(const struct dev_state *state);
+
+void dev_state_read(const struct dev_state *state,
+                    struct dev_state_snapshot *snap);
+
+/* Devices of the active outputs other than slot */
+audio_devices_t dev_state_other_devices(const struct dev_state *state,
+                                        int slot);
+
+/* Whether an HDMI output other than slot is active */
+bool dev_state_hdmi_active(const struct dev_state *state, int slot);
+
+/* Whether any low latency output is active */
+bool dev_state_low_latency_active(const struct dev_state *state);
+
+#endif
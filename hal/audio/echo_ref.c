@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_echo_ref"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include <cutils/log.h>
+
+#include "echo_ref.h"
+
+/* Jump to the computed position if the reader drifted more than this */
+#define ECHO_REF_RESYNC_US 2000
+
+/* Spin limit while the writer updates the anchor */
+#define ECHO_REF_SEQ_RETRIES 16
+
+struct echo_ref {
+    int16_t  *buf;
+    size_t   frames; /* power of two */
+    size_t   mask;
+    uint32_t rate;
+
+    bool     active;
+
+    /* writer side, published with release semantics */
+    uint32_t seq;
+    uint64_t wr_pos;
+    uint64_t anchor_pos;
+    int64_t  anchor_ns;
+
+    /* reader side */
+    bool     rd_valid;
+    uint64_t rd_pos;
+
+    struct echo_ref_stats stats;
+};
+
+struct echo_ref *echo_ref_create(uint32_t rate, size_t frames)
+{
+    struct echo_ref *ref;
+    size_t size = 1;
+
+    while (size < frames) {
+        size <<= 1;
+    }
+
+    ref = calloc(1, sizeof(struct echo_ref));
+    if (ref == NULL) {
+        return NULL;
+    }
+
+    ref->buf = calloc(size, sizeof(int16_t));
+    if (ref->buf == NULL) {
+        free(ref);
+        return NULL;
+    }
+
+    ref->frames = size;
+    ref->mask = size - 1;
+    ref->rate = rate;
+
+    ALOGV("%s: rate(%u) frames(%zu)", __func__, rate, size);
+
+    return ref;
+}
+
+void echo_ref_destroy(struct echo_ref *ref)
+{
+    if (ref == NULL) {
+        return;
+    }
+
+    free(ref->buf);
+    free(ref);
+}
+
+uint32_t echo_ref_get_rate(const struct echo_ref *ref)
+{
+    return __atomic_load_n(&ref->rate, __ATOMIC_RELAXED);
+}
+
+int echo_ref_set_rate(struct echo_ref *ref, uint32_t rate)
+{
+    if (echo_ref_is_active(ref)) {
+        return -EBUSY;
+    }
+
+    /* the writer does nothing while inactive, what it wrote before is stale */
+    __atomic_store_n(&ref->rate, rate, __ATOMIC_RELAXED);
+
+    ALOGV("%s: rate(%u)", __func__, rate);
+
+    return 0;
+}
+
+void echo_ref_set_active(struct echo_ref *ref, bool active)
+{
+    if (active) {
+        ref->rd_valid = false;
+        memset(&ref->stats, 0, sizeof(ref->stats));
+    }
+
+    __atomic_store_n(&ref->active, active, __ATOMIC_RELEASE);
+}
+
+bool echo_ref_is_active(const struct echo_ref *ref)
+{
+    return __atomic_load_n(&ref->active, __ATOMIC_ACQUIRE);
+}
+
+static void echo_ref_downmix(const int16_t *src,
+                             int16_t *dst,
+                             size_t frames,
+                             uint32_t channels)
+{
+    size_t i = 0;
+
+    if (channels == 1) {
+        memcpy(dst, src, frames * sizeof(int16_t));
+        return;
+    }
+
+#ifdef __ARM_NEON__
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t in = vld2q_s16(src + 2 * i);
+
+        vst1q_s16(dst + i, vhaddq_s16(in.val[0], in.val[1]));
+    }
+#endif
+
+    for (; i < frames; i++) {
+        dst[i] = (int16_t)(((int32_t)src[2 * i] + src[2 * i + 1]) >> 1);
+    }
+}
+
+void echo_ref_write(struct echo_ref *ref,
+                    const int16_t *buffer,
+                    size_t frames,
+                    uint32_t channels,
+                    int64_t render_ns)
+{
+    uint64_t wr_pos;
+    size_t done = 0;
+
+    if (!echo_ref_is_active(ref) || channels == 0 || channels > 2) {
+        return;
+    }
+
+    wr_pos = ref->wr_pos;
+
+    /* Only the newest part of an oversized buffer fits */
+    if (frames > ref->frames) {
+        buffer += (frames - ref->frames) * channels;
+        frames = ref->frames;
+    }
+
+    while (done < frames) {
+        size_t offset = (wr_pos + done) & ref->mask;
+        size_t count = ref->frames - offset;
+
+        if (count > frames - done) {
+            count = frames - done;
+        }
+
+        echo_ref_downmix(buffer + done * channels,
+                         ref->buf + offset,
+                         count,
+                         channels);
+        done += count;
+    }
+
+    __atomic_store_n(&ref->seq, ref->seq + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ref->anchor_pos = wr_pos + frames;
+    ref->anchor_ns = render_ns;
+    __atomic_store_n(&ref->wr_pos, wr_pos + frames, __ATOMIC_RELEASE);
+    __atomic_store_n(&ref->seq, ref->seq + 1, __ATOMIC_RELEASE);
+}
+
+static bool echo_ref_get_anchor(struct echo_ref *ref,
+                                uint64_t *anchor_pos,
+                                int64_t *anchor_ns,
+                                uint64_t *wr_pos)
+{
+    int i;
+
+    for (i = 0; i < ECHO_REF_SEQ_RETRIES; i++) {
+        uint32_t seq = __atomic_load_n(&ref->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1) {
+            continue;
+        }
+
+        *anchor_pos = ref->anchor_pos;
+        *anchor_ns = ref->anchor_ns;
+        *wr_pos = __atomic_load_n(&ref->wr_pos, __ATOMIC_ACQUIRE);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ref->seq, __ATOMIC_RELAXED) == seq) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void echo_ref_update_stats(struct echo_ref *ref, int64_t err_frames)
+{
+    int64_t err_ns = err_frames * 1000000000LL / ref->rate;
+    int64_t abs_ns = err_ns < 0 ? -err_ns : err_ns;
+
+    ref->stats.blocks++;
+    ref->stats.align_err_last_ns = err_ns;
+    ref->stats.align_err_sum_ns += abs_ns;
+    if (abs_ns > ref->stats.align_err_max_ns) {
+        ref->stats.align_err_max_ns = abs_ns;
+    }
+}
+
+int echo_ref_read(struct echo_ref *ref,
+                  int16_t *buffer,
+                  size_t frames,
+                  int64_t capture_ns)
+{
+    uint64_t anchor_pos;
+    int64_t anchor_ns;
+    uint64_t wr_pos;
+    int64_t target;
+    int64_t rd_pos;
+    int64_t oldest;
+    size_t done = 0;
+    size_t count;
+
+    if (!echo_ref_is_active(ref) ||
+        !echo_ref_get_anchor(ref, &anchor_pos, &anchor_ns, &wr_pos) ||
+        wr_pos == 0) {
+        memset(buffer, 0, frames * sizeof(int16_t));
+        return -ENODATA;
+    }
+
+    /* Position of the frame rendered at capture_ns */
+    target = (int64_t)anchor_pos -
+             (anchor_ns - capture_ns) * (int64_t)ref->rate / 1000000000LL;
+
+    /*
+     * Keep reading contiguously as long as the timestamps agree, the
+     * difference is the alignment error of this block. Resync on jumps.
+     */
+    rd_pos = (int64_t)ref->rd_pos;
+    if (!ref->rd_valid ||
+        llabs(target - rd_pos) * 1000000LL / ref->rate > ECHO_REF_RESYNC_US) {
+        if (ref->rd_valid) {
+            ref->stats.resyncs++;
+        }
+        rd_pos = target;
+        ref->rd_valid = true;
+    }
+    echo_ref_update_stats(ref, target - rd_pos);
+
+    oldest = (wr_pos > ref->frames) ? (int64_t)(wr_pos - ref->frames) : 0;
+    if (rd_pos < oldest) {
+        ref->stats.overruns++;
+        count = (size_t)(oldest - rd_pos);
+        if (count > frames) {
+            count = frames;
+        }
+        memset(buffer, 0, count * sizeof(int16_t));
+        done = count;
+    }
+
+    while (done < frames && rd_pos + (int64_t)done < (int64_t)wr_pos) {
+        size_t offset = (size_t)(rd_pos + done) & ref->mask;
+
+        count = ref->frames - offset;
+        if (count > frames - done) {
+            count = frames - done;
+        }
+        if ((int64_t)count > (int64_t)wr_pos - (rd_pos + (int64_t)done)) {
+            count = (size_t)((int64_t)wr_pos - (rd_pos + (int64_t)done));
+        }
+
+        memcpy(buffer + done, ref->buf + offset, count * sizeof(int16_t));
+        done += count;
+    }
+
+    if (done < frames) {
+        ref->stats.underruns++;
+        memset(buffer + done, 0, (frames - done) * sizeof(int16_t));
+    }
+
+    /* The writer may have wrapped over what we just copied */
+    wr_pos = __atomic_load_n(&ref->wr_pos, __ATOMIC_ACQUIRE);
+    if (done > 0 && rd_pos < (int64_t)wr_pos - (int64_t)ref->frames) {
+        ref->stats.overruns++;
+    }
+
+    ref->rd_pos = (uint64_t)(rd_pos + (int64_t)frames);
+
+    return 0;
+}
+
+void echo_ref_get_stats(const struct echo_ref *ref,
+                        struct echo_ref_stats *stats)
+{
+    *stats = ref->stats;
+}
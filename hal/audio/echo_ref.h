@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ECHO_REF_H
+#define ECHO_REF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Echo reference ring.
+ *
+ * The primary output pushes what it hands to pcm_write(), downmixed to mono,
+ * together with the time the last frame will be rendered. The capture side
+ * asks for the frames which were rendered when its first frame was captured.
+ * There is exactly one writer (the playback thread) and one reader (the
+ * capture thread); neither of them ever blocks on the other.
+ */
+struct echo_ref;
+
+struct echo_ref_stats {
+    uint64_t blocks;
+    int64_t  align_err_last_ns;
+    int64_t  align_err_max_ns;
+    int64_t  align_err_sum_ns;
+    uint32_t resyncs;
+    uint32_t underruns;
+    uint32_t overruns;
+};
+
+/* Function prototypes */
+struct echo_ref *echo_ref_create(uint32_t rate, size_t frames);
+
+void echo_ref_destroy(struct echo_ref *ref);
+
+uint32_t echo_ref_get_rate(const struct echo_ref *ref);
+
+/*
+ * The ring is kept, only its rate changes, so that a writer still holding
+ * the reference never sees it freed. Returns -EBUSY while a reader has it
+ * active.
+ */
+int echo_ref_set_rate(struct echo_ref *ref, uint32_t rate);
+
+/* Called by the reader to start or stop the reference, resets the ring */
+void echo_ref_set_active(struct echo_ref *ref, bool active);
+
+bool echo_ref_is_active(const struct echo_ref *ref);
+
+/*
+ * buffer holds interleaved 16 bit frames with the given channel count,
+ * render_ns is the CLOCK_MONOTONIC time the last frame will be rendered.
+ */
+void echo_ref_write(struct echo_ref *ref,
+                    const int16_t *buffer,
+                    size_t frames,
+                    uint32_t channels,
+                    int64_t render_ns);
+
+/*
+ * Fills buffer with frames mono frames which were rendered starting at
+ * capture_ns. Missing frames are replaced by silence.
+ */
+int echo_ref_read(struct echo_ref *ref,
+                  int16_t *buffer,
+                  size_t frames,
+                  int64_t capture_ns);
+
+void echo_ref_get_stats(const struct echo_ref *ref,
+                        struct echo_ref_stats *stats);
+
+#endif
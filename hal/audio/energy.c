@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_energy"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
+#include <sys/_system_properties.h>
+
+#include <cutils/log.h>
+
+#include "energy.h"
+
+struct energy_stats {
+    /* PCMs of the class open now, and the sum of their period rates */
+    unsigned int    open_pcms;
+    uint64_t        period_mhz;
+    int64_t         settled_ns;
+
+    uint32_t        opens;
+    int64_t         active_ns;      /* with any PCM open */
+    int64_t         pcm_ns;         /* summed over the PCMs */
+    int64_t         longest_ns;
+    uint64_t        milliwakeups;
+
+    uint32_t        dapm_waits;
+    int64_t         dapm_ns;
+    uint32_t        route_changes;
+};
+
+struct energy_route {
+    int64_t             time_ns;
+    enum energy_class   class;
+    const char          *usecase;
+    const char          *out_device;
+    const char          *in_device;
+};
+
+/* Copied out of the lock to be printed */
+struct energy_totals {
+    int64_t             now_ns;
+    int64_t             init_ns;
+    struct energy_stats stats[ENERGY_CLASS_COUNT];
+    struct energy_route routes[ENERGY_HISTORY];
+    unsigned int        route_count;
+};
+
+#define SNAPSHOT_NICE 10
+
+static const char * const class_names[ENERGY_CLASS_COUNT] = {
+    [ENERGY_PLAYBACK] = "playback",
+    [ENERGY_DEEP_BUFFER] = "deep buffer",
+    [ENERGY_CAPTURE] = "capture",
+    [ENERGY_VOICE] = "voice",
+    [ENERGY_SCO] = "sco",
+};
+
+/* A leaf lock, taken under the stream and device locks */
+static pthread_mutex_t energy_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t init_ns;
+static struct energy_stats stats[ENERGY_CLASS_COUNT];
+static struct energy_route routes[ENERGY_HISTORY];
+static unsigned int route_count;
+
+static const prop_info *snapshot_prop;
+static uint32_t snapshot_serial;
+
+/* Requests seen at events, written by a thread of low priority */
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static char snapshot_tag[PROP_VALUE_MAX];
+static bool snapshot_pending;
+static bool snapshot_running;
+static pthread_t snapshot_thread;
+
+static int64_t energy_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Brings the time of the open PCMs of the class up to now */
+static void energy_settle_l(struct energy_stats *s, int64_t now_ns)
+{
+    int64_t elapsed_ns = now_ns - s->settled_ns;
+
+    if (s->open_pcms > 0 && elapsed_ns > 0) {
+        s->active_ns += elapsed_ns;
+        s->pcm_ns += elapsed_ns * s->open_pcms;
+        s->milliwakeups += (uint64_t)(elapsed_ns / 1000) * s->period_mhz / 1000000;
+    }
+    s->settled_ns = now_ns;
+}
+
+static void energy_settle_all_l(int64_t now_ns)
+{
+    int i;
+
+    for (i = 0; i < ENERGY_CLASS_COUNT; i++) {
+        energy_settle_l(&stats[i], now_ns);
+    }
+}
+
+static void energy_copy_l(struct energy_totals *totals, int64_t now_ns)
+{
+    energy_settle_all_l(now_ns);
+
+    totals->now_ns = now_ns;
+    totals->init_ns = init_ns;
+    memcpy(totals->stats, stats, sizeof(stats));
+    memcpy(totals->routes, routes, sizeof(routes));
+    totals->route_count = route_count;
+}
+
+static void energy_print(int fd, const struct energy_totals *totals)
+{
+    const struct energy_stats *s;
+    const struct energy_route *route;
+    unsigned int route_count = totals->route_count;
+    unsigned int count;
+    unsigned int i;
+
+    dprintf(fd, "  Energy: over %lld s, \"%s\" appends to %s\n",
+            (long long)((totals->now_ns - totals->init_ns) / 1000000000LL),
+            ENERGY_SNAPSHOT_PROPERTY, ENERGY_SNAPSHOT_FILE);
+
+    for (i = 0; i < ENERGY_CLASS_COUNT; i++) {
+        s = &totals->stats[i];
+        dprintf(fd, "    %s: %u opens, %u open, active %lld ms, PCMs %lld ms, "
+                "longest %lld ms, %llu wakeups (%llu/s active), "
+                "%u DAPM waits %lld ms, %u route changes\n",
+                class_names[i], s->opens, s->open_pcms,
+                (long long)(s->active_ns / 1000000),
+                (long long)(s->pcm_ns / 1000000),
+                (long long)(s->longest_ns / 1000000),
+                (unsigned long long)(s->milliwakeups / 1000),
+                (unsigned long long)(s->active_ns > 0 ?
+                        s->milliwakeups * 1000000 / (uint64_t)s->active_ns : 0),
+                s->dapm_waits, (long long)(s->dapm_ns / 1000000),
+                s->route_changes);
+    }
+
+    count = route_count < ENERGY_HISTORY ? route_count : ENERGY_HISTORY;
+    if (count == 0) {
+        return;
+    }
+
+    dprintf(fd, "    last route changes, from adev_open:\n");
+    for (i = route_count - count; i < route_count; i++) {
+        route = &totals->routes[i % ENERGY_HISTORY];
+        dprintf(fd, "      %lld.%03lld s %s (%s): out %s, in %s\n",
+                (long long)(route->time_ns / 1000000000LL),
+                (long long)(route->time_ns / 1000000 % 1000),
+                route->usecase, class_names[route->class],
+                route->out_device, route->in_device);
+    }
+}
+
+static void energy_write_snapshot(const char *tag, const struct energy_totals *totals)
+{
+    int fd;
+
+    fd = open(ENERGY_SNAPSHOT_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        ALOGE("%s: cannot open %s: %s", __func__, ENERGY_SNAPSHOT_FILE,
+              strerror(errno));
+        return;
+    }
+
+    dprintf(fd, "\nSnapshot %s at %lld ms:\n", tag,
+            (long long)(totals->now_ns / 1000000));
+    energy_print(fd, totals);
+    close(fd);
+
+    ALOGI("%s: snapshot %s written to %s", __func__, tag, ENERGY_SNAPSHOT_FILE);
+}
+
+static void *energy_snapshot_loop(void *arg __unused)
+{
+    struct energy_totals totals;
+    char tag[PROP_VALUE_MAX];
+
+    setpriority(PRIO_PROCESS, 0, SNAPSHOT_NICE);
+
+    pthread_mutex_lock(&energy_lock);
+    while (snapshot_running) {
+        if (!snapshot_pending) {
+            pthread_cond_wait(&snapshot_cond, &energy_lock);
+            continue;
+        }
+
+        snapshot_pending = false;
+        strlcpy(tag, snapshot_tag, sizeof(tag));
+        energy_copy_l(&totals, energy_now_ns());
+        pthread_mutex_unlock(&energy_lock);
+
+        energy_write_snapshot(tag, &totals);
+
+        pthread_mutex_lock(&energy_lock);
+    }
+    pthread_mutex_unlock(&energy_lock);
+
+    return NULL;
+}
+
+/*
+ * At each event: the serial of the property tells whether it changed, the
+ * value is only read when it did. The file is written by the snapshot
+ * thread, the events only latch the request.
+ */
+static void energy_check_snapshot_l(void)
+{
+    char value[PROP_VALUE_MAX];
+    uint32_t serial;
+
+    if (snapshot_prop == NULL) {
+        snapshot_prop = __system_property_find(ENERGY_SNAPSHOT_PROPERTY);
+        if (snapshot_prop == NULL) {
+            return;
+        }
+        /* set since energy_init() */
+        snapshot_serial = ~__system_property_serial(snapshot_prop);
+    }
+
+    serial = __system_property_serial(snapshot_prop);
+    if (serial == snapshot_serial) {
+        return;
+    }
+    snapshot_serial = serial;
+
+    if (__system_property_read(snapshot_prop, NULL, value) > 0) {
+        strlcpy(snapshot_tag, value, sizeof(snapshot_tag));
+        snapshot_pending = true;
+        pthread_cond_signal(&snapshot_cond);
+    }
+}
+
+void energy_init(void)
+{
+    int i;
+
+    pthread_mutex_lock(&energy_lock);
+
+    init_ns = energy_now_ns();
+    memset(stats, 0, sizeof(stats));
+    for (i = 0; i < ENERGY_CLASS_COUNT; i++) {
+        stats[i].settled_ns = init_ns;
+    }
+    route_count = 0;
+
+    /* a value left from before the HAL was opened is not a request */
+    snapshot_prop = __system_property_find(ENERGY_SNAPSHOT_PROPERTY);
+    if (snapshot_prop != NULL) {
+        snapshot_serial = __system_property_serial(snapshot_prop);
+    }
+    snapshot_pending = false;
+
+    if (!snapshot_running) {
+        snapshot_running = true;
+        if (pthread_create(&snapshot_thread, NULL, energy_snapshot_loop, NULL) != 0) {
+            ALOGE("%s: no snapshot thread", __func__);
+            snapshot_running = false;
+        }
+    }
+
+    pthread_mutex_unlock(&energy_lock);
+}
+
+void energy_release(void)
+{
+    bool running;
+
+    pthread_mutex_lock(&energy_lock);
+    running = snapshot_running;
+    snapshot_running = false;
+    pthread_cond_signal(&snapshot_cond);
+    pthread_mutex_unlock(&energy_lock);
+
+    if (running) {
+        pthread_join(snapshot_thread, NULL);
+    }
+}
+
+void energy_pcm_open(struct energy_pcm *pcm,
+                     enum energy_class class,
+                     const struct pcm_config *config)
+{
+    struct energy_stats *s = &stats[class];
+    int64_t now_ns = energy_now_ns();
+
+    if (pcm->open) {
+        energy_pcm_close(pcm);
+    }
+
+    pcm->open = true;
+    pcm->class = class;
+    pcm->period_mhz = 0;
+    if (config != NULL && config->period_size > 0) {
+        pcm->period_mhz = (uint32_t)((uint64_t)config->rate * 1000 /
+                                     config->period_size);
+    }
+    pcm->open_ns = now_ns;
+
+    pthread_mutex_lock(&energy_lock);
+    energy_settle_l(s, now_ns);
+    s->open_pcms++;
+    s->period_mhz += pcm->period_mhz;
+    s->opens++;
+    energy_check_snapshot_l();
+    pthread_mutex_unlock(&energy_lock);
+}
+
+void energy_pcm_close(struct energy_pcm *pcm)
+{
+    struct energy_stats *s = &stats[pcm->class];
+    int64_t now_ns;
+
+    if (!pcm->open) {
+        return;
+    }
+    pcm->open = false;
+
+    now_ns = energy_now_ns();
+
+    pthread_mutex_lock(&energy_lock);
+    energy_settle_l(s, now_ns);
+    s->open_pcms--;
+    s->period_mhz -= pcm->period_mhz;
+    if (now_ns - pcm->open_ns > s->longest_ns) {
+        s->longest_ns = now_ns - pcm->open_ns;
+    }
+    energy_check_snapshot_l();
+    pthread_mutex_unlock(&energy_lock);
+}
+
+void energy_dapm_wait(enum energy_class class, int64_t wait_ns)
+{
+    pthread_mutex_lock(&energy_lock);
+    stats[class].dapm_waits++;
+    stats[class].dapm_ns += wait_ns;
+    pthread_mutex_unlock(&energy_lock);
+}
+
+void energy_route_change(enum energy_class class,
+                         const char *usecase,
+                         const char *out_device,
+                         const char *in_device)
+{
+    struct energy_route *route;
+    int64_t now_ns = energy_now_ns();
+
+    pthread_mutex_lock(&energy_lock);
+
+    stats[class].route_changes++;
+
+    route = &routes[route_count % ENERGY_HISTORY];
+    route->time_ns = now_ns - init_ns;
+    route->class = class;
+    route->usecase = usecase;
+    route->out_device = out_device;
+    route->in_device = in_device;
+    route_count++;
+
+    energy_check_snapshot_l();
+
+    pthread_mutex_unlock(&energy_lock);
+}
+
+void energy_dump(int fd)
+{
+    struct energy_totals totals;
+
+    pthread_mutex_lock(&energy_lock);
+    energy_copy_l(&totals, energy_now_ns());
+    pthread_mutex_unlock(&energy_lock);
+
+    energy_print(fd, &totals);
+}
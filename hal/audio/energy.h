@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <tinyalsa/asoundlib.h>
+
+/*
+ * Accounting of what audio costs in power, per class of usecase.
+ *
+ * Each PCM is timed from open to close, and while it is open it wakes the
+ * CPU once per period: the wakeups are counted from its configured period
+ * size and rate rather than from the writes, so that they hold whatever
+ * the client does. Hostless links, that the codec and the modem run
+ * without the CPU, are timed only. The sleeps enable_snd_device() takes to
+ * let DAPM power down, and the changes of sound devices made by
+ * select_devices(), are counted against the class of the usecase behind
+ * them, the last changes kept with their time.
+ *
+ * The counters run from adev_open() and are read in adev_dump(). Setting
+ * ENERGY_SNAPSHOT_PROPERTY to a new value appends them to
+ * ENERGY_SNAPSHOT_FILE, tagged with the value, after the next PCM or route
+ * event: while audio is idle there is nothing to account. The event only
+ * notes the request, a thread of low priority writes the file.
+ */
+enum energy_class {
+    ENERGY_PLAYBACK,
+    ENERGY_DEEP_BUFFER,
+    ENERGY_CAPTURE,
+    ENERGY_VOICE,               /* calls and VoIP */
+    ENERGY_SCO,
+    ENERGY_CLASS_COUNT
+};
+
+#define ENERGY_HISTORY 16
+
+#define ENERGY_SNAPSHOT_PROPERTY "audio.energy.snapshot"
+#define ENERGY_SNAPSHOT_FILE "/data/misc/audioserver/audio_energy.txt"
+
+/* Of one PCM, zeroed is closed */
+struct energy_pcm {
+    bool                open;
+    enum energy_class   class;
+    uint32_t            period_mhz;     /* periods per second, 0 if hostless */
+    int64_t             open_ns;
+};
+
+/* Function prototypes */
+
+/* In adev_open(), before the first event, starts the snapshot thread */
+void energy_init(void);
+
+/* In adev_close(), stops the snapshot thread */
+void energy_release(void);
+
+/* config: of the PCM just opened, NULL for a hostless link */
+void energy_pcm_open(struct energy_pcm *pcm,
+                     enum energy_class class,
+                     const struct pcm_config *config);
+
+/* Before the PCM is closed, does nothing if it was not accounted */
+void energy_pcm_close(struct energy_pcm *pcm);
+
+/* wait_ns: slept for DAPM before enabling a sound device */
+void energy_dapm_wait(enum energy_class class, int64_t wait_ns);
+
+/* A usecase switched sound devices, names of static storage */
+void energy_route_change(enum energy_class class,
+                         const char *usecase,
+                         const char *out_device,
+                         const char *in_device);
+
+/* Per class: PCM time, wakeups, DAPM sleeps and routing, then the last changes */
+void energy_dump(int fd);
+
+#endif
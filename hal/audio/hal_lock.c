@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_lock"
+/*#define LOG_NDEBUG 0*/
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <cutils/log.h>
+
+#include "hal_lock.h"
+
+static const char * const rank_names[HAL_LOCK_RANK_COUNT] = {
+    [HAL_LOCK_RANK_OUTPUTS] = "outputs",
+    [HAL_LOCK_RANK_INPUTS] = "inputs",
+    [HAL_LOCK_RANK_STREAM] = "stream",
+    [HAL_LOCK_RANK_DEVICE] = "device",
+    [HAL_LOCK_RANK_LEAF] = "leaf",
+};
+
+/* Locks held by the calling thread, per rank */
+static __thread uint8_t held[HAL_LOCK_RANK_COUNT];
+static __thread int64_t thread_wait_ns;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hal_lock *registry;
+
+static int64_t hal_lock_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void hal_lock_init(struct hal_lock *lock,
+                   const char *name,
+                   enum hal_lock_rank rank)
+{
+    pthread_mutexattr_t attr;
+
+    memset(lock, 0, sizeof(struct hal_lock));
+    lock->name = name;
+    lock->rank = rank;
+    lock->site = -1;
+
+    pthread_mutexattr_init(&attr);
+#ifdef PTHREAD_PRIO_INHERIT
+    if (pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT) != 0) {
+        ALOGW("%s: %s: no priority inheritance", __func__, name);
+    }
+#endif
+    pthread_mutex_init(&lock->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_mutex_lock(&registry_lock);
+    lock->next = registry;
+    registry = lock;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void hal_lock_destroy(struct hal_lock *lock)
+{
+    struct hal_lock **node;
+
+    pthread_mutex_lock(&registry_lock);
+    for (node = &registry; *node != NULL; node = &(*node)->next) {
+        if (*node == lock) {
+            *node = lock->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+/* must be called with the lock held */
+static int hal_lock_find_site(struct hal_lock *lock, const char *name)
+{
+    int i;
+
+    for (i = 0; i < lock->num_sites; i++) {
+        if (lock->sites[i].name == name) {
+            return i;
+        }
+    }
+
+    /* The last entry collects the sites that did not fit */
+    if (lock->num_sites == HAL_LOCK_MAX_SITES) {
+        lock->sites[HAL_LOCK_MAX_SITES - 1].name = "(other)";
+        return HAL_LOCK_MAX_SITES - 1;
+    }
+
+    lock->sites[lock->num_sites].name = name;
+
+    return lock->num_sites++;
+}
+
+static bool hal_lock_order_ok(enum hal_lock_rank rank)
+{
+    int r;
+
+    for (r = rank + 1; r < HAL_LOCK_RANK_COUNT; r++) {
+        if (held[r] > 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool hal_lock_is_rt(void)
+{
+    int policy = sched_getscheduler(0);
+
+    return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+int64_t hal_lock_acquire_site(struct hal_lock *lock, const char *name)
+{
+    struct hal_lock_site *site;
+    bool order_ok = hal_lock_order_ok(lock->rank);
+    const char *blocked_by = NULL;
+    bool rt = false;
+    int64_t wait_ns = 0;
+    int64_t start_ns;
+    int owner_site;
+
+    if (pthread_mutex_trylock(&lock->mutex) == 0) {
+        lock->acquired_ns = hal_lock_now_ns();
+    } else {
+        rt = hal_lock_is_rt();
+        owner_site = __atomic_load_n(&lock->site, __ATOMIC_RELAXED);
+        if (owner_site >= 0) {
+            blocked_by = lock->sites[owner_site].name;
+        }
+
+        start_ns = hal_lock_now_ns();
+        pthread_mutex_lock(&lock->mutex);
+        lock->acquired_ns = hal_lock_now_ns();
+        wait_ns = lock->acquired_ns - start_ns;
+        thread_wait_ns += wait_ns;
+    }
+
+    held[lock->rank]++;
+
+    site = &lock->sites[hal_lock_find_site(lock, name)];
+    __atomic_store_n(&lock->site, (int)(site - lock->sites), __ATOMIC_RELAXED);
+
+    site->acquisitions++;
+    if (wait_ns > 0) {
+        site->contended++;
+        site->wait_sum_ns += wait_ns;
+        if (wait_ns > site->wait_max_ns) {
+            site->wait_max_ns = wait_ns;
+        }
+        if (rt) {
+            site->rt_waits++;
+            site->rt_blocked_by = blocked_by;
+            if (wait_ns > site->rt_wait_max_ns) {
+                site->rt_wait_max_ns = wait_ns;
+            }
+        }
+    }
+
+    if (!order_ok && site->order_violations++ == 0) {
+        ALOGE("%s: %s taken by %s while holding a lock ranked after %s",
+              __func__, lock->name, name, rank_names[lock->rank]);
+    }
+
+    return wait_ns;
+}
+
+int64_t hal_lock_thread_wait_ns(void)
+{
+    return thread_wait_ns;
+}
+
+void hal_lock_release(struct hal_lock *lock)
+{
+    struct hal_lock_site *site = &lock->sites[lock->site];
+    int64_t hold_ns = hal_lock_now_ns() - lock->acquired_ns;
+
+    site->hold_sum_ns += hold_ns;
+    if (hold_ns > site->hold_max_ns) {
+        site->hold_max_ns = hold_ns;
+    }
+
+    __atomic_store_n(&lock->site, -1, __ATOMIC_RELAXED);
+    held[lock->rank]--;
+
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+void hal_lock_dump(int fd)
+{
+    struct hal_lock *lock;
+    int i;
+
+    pthread_mutex_lock(&registry_lock);
+
+    dprintf(fd, "  Locks:\n");
+    for (lock = registry; lock != NULL; lock = lock->next) {
+        dprintf(fd, "    %s (%s):\n", lock->name, rank_names[lock->rank]);
+
+        for (i = 0; i < lock->num_sites; i++) {
+            const struct hal_lock_site *site = &lock->sites[i];
+
+            dprintf(fd, "      %s: %llu taken, %llu contended, "
+                    "wait avg %lld us max %lld us, hold avg %lld us max %lld us\n",
+                    site->name,
+                    (unsigned long long)site->acquisitions,
+                    (unsigned long long)site->contended,
+                    (long long)(site->contended > 0 ?
+                                site->wait_sum_ns /
+                                (int64_t)site->contended / 1000 : 0),
+                    (long long)(site->wait_max_ns / 1000),
+                    (long long)(site->acquisitions > 0 ?
+                                site->hold_sum_ns /
+                                (int64_t)site->acquisitions / 1000 : 0),
+                    (long long)(site->hold_max_ns / 1000));
+
+            if (site->rt_waits > 0) {
+                dprintf(fd, "        real time waits: %u, max %lld us, "
+                        "last behind %s\n",
+                        site->rt_waits,
+                        (long long)(site->rt_wait_max_ns / 1000),
+                        site->rt_blocked_by != NULL ?
+                        site->rt_blocked_by : "unknown");
+            }
+
+            if (site->order_violations > 0) {
+                dprintf(fd, "        lock order violations: %u\n",
+                        site->order_violations);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HAL_LOCK_H
+#define HAL_LOCK_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Instrumented mutex for the HAL locks.
+ *
+ * The mutex uses priority inheritance, so a binder thread holding a lock
+ * the FAST mixer waits for runs at the mixer's priority until it lets go.
+ * Every acquisition is accounted to its call site: how long it waited,
+ * how long it held the lock, and whether the waiter was a real time
+ * thread. Taking a lock while holding one of a higher rank breaks the
+ * documented order (see audio_hw.h) and is counted and logged.
+ */
+enum hal_lock_rank {
+    HAL_LOCK_RANK_OUTPUTS,  /* audio_device lock_outputs */
+    HAL_LOCK_RANK_INPUTS,   /* audio_device lock_inputs */
+    HAL_LOCK_RANK_STREAM,   /* stream pre_lock and lock */
+    HAL_LOCK_RANK_DEVICE,   /* audio_device lock */
+    HAL_LOCK_RANK_LEAF,     /* taken last, e.g. dev_state */
+    HAL_LOCK_RANK_COUNT
+};
+
+#define HAL_LOCK_MAX_SITES 16
+
+struct hal_lock_site {
+    const char          *name;
+    uint64_t            acquisitions;
+    uint64_t            contended;
+    int64_t             wait_sum_ns;
+    int64_t             wait_max_ns;
+    int64_t             hold_sum_ns;
+    int64_t             hold_max_ns;
+    /* waits of SCHED_FIFO/SCHED_RR threads, and the site they waited for */
+    uint32_t            rt_waits;
+    int64_t             rt_wait_max_ns;
+    const char          *rt_blocked_by;
+    uint32_t            order_violations;
+};
+
+struct hal_lock {
+    pthread_mutex_t     mutex;
+    const char          *name;
+    enum hal_lock_rank  rank;
+
+    /* written by the owner */
+    int64_t             acquired_ns;
+    int                 site;
+
+    int                 num_sites;
+    struct hal_lock_site sites[HAL_LOCK_MAX_SITES];
+
+    struct hal_lock     *next;  /* all locks, for hal_lock_dump() */
+};
+
+/* Function prototypes */
+void hal_lock_init(struct hal_lock *lock,
+                   const char *name,
+                   enum hal_lock_rank rank);
+
+void hal_lock_destroy(struct hal_lock *lock);
+
+/* Returns how long the caller waited, 0 without contention */
+int64_t hal_lock_acquire_site(struct hal_lock *lock, const char *site);
+
+void hal_lock_release(struct hal_lock *lock);
+
+#define hal_lock_acquire(lock) hal_lock_acquire_site((lock), __func__)
+
+/* Total time the calling thread waited for HAL locks */
+int64_t hal_lock_thread_wait_ns(void);
+
+/* Statistics of every lock, values of concurrent acquisitions may be torn */
+void hal_lock_dump(int fd);
+
+#endif
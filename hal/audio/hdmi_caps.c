@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_hdmi"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <cutils/uevent.h>
+
+#include "hdmi_caps.h"
+
+#define UEVENT_BUFFER_SIZE 1024
+#define UEVENT_SOCKET_SIZE (64 * 1024)
+
+#define CEA_EXTENSION_TAG 0x02
+#define CEA_BASIC_AUDIO (1 << 6)
+#define CEA_AUDIO_DATA_BLOCK 1
+#define CEA_SAD_SIZE 3
+
+static const uint8_t edid_header[8] = {
+    0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+};
+
+/* Bits of the second byte of a short audio descriptor */
+static const uint32_t sad_rates[HDMI_CAPS_MAX_RATES] = {
+    32000, 44100, 48000, 88200, 96000, 176400, 192000
+};
+
+struct hdmi_caps_stats {
+    uint32_t    hotplugs;
+    uint32_t    rechecks;           /* opens before the thread saw the hotplug */
+    uint32_t    edid_reads;
+    uint32_t    edid_errors;
+    int64_t     edid_max_ns;
+    uint32_t    lookups;
+    uint32_t    channel_writes;
+    uint32_t    channel_skips;      /* already written for this sink */
+};
+
+/* Guards the cache, the stats and what was written to the driver */
+static pthread_mutex_t caps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hdmi_caps cache;
+static struct hdmi_caps_stats stats;
+static unsigned int written_channels;
+static uint32_t written_generation;
+
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static pthread_t uevent_thread;
+
+static int64_t hdmi_caps_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool edid_block_valid(const uint8_t *block)
+{
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 0; i < HDMI_EDID_BLOCK_SIZE; i++) {
+        sum += block[i];
+    }
+
+    return sum == 0;
+}
+
+/* What a sink must support when it has no audio data block */
+static void hdmi_caps_set_basic_audio(uint32_t *rate_bits, struct hdmi_caps *caps)
+{
+    caps->max_channels = 2;
+    caps->sample_sizes |= HDMI_CAPS_16_BIT;
+    caps->formats |= 1 << HDMI_CAPS_FORMAT_LPCM;
+    *rate_bits |= 0x07;
+}
+
+static void hdmi_caps_parse_sads(const uint8_t *sad,
+                                 size_t len,
+                                 uint32_t *rate_bits,
+                                 struct hdmi_caps *caps)
+{
+    unsigned int format;
+    unsigned int channels;
+
+    for (; len >= CEA_SAD_SIZE; sad += CEA_SAD_SIZE, len -= CEA_SAD_SIZE) {
+        format = (sad[0] >> 3) & 0x0f;
+        channels = (sad[0] & 0x07) + 1;
+
+        caps->formats |= 1 << format;
+        if (format != HDMI_CAPS_FORMAT_LPCM) {
+            continue;
+        }
+
+        if (channels > caps->max_channels) {
+            caps->max_channels = channels;
+        }
+        *rate_bits |= sad[1] & 0x7f;
+        caps->sample_sizes |= sad[2] & 0x07;
+    }
+}
+
+int hdmi_caps_parse_edid(const uint8_t *edid, size_t size, struct hdmi_caps *caps)
+{
+    const uint8_t *block;
+    uint32_t rate_bits = 0;
+    bool basic_audio = false;
+    size_t blocks;
+    size_t dtd;
+    size_t pos;
+    size_t len;
+    size_t i;
+    int n;
+
+    caps->edid_valid = false;
+    caps->max_channels = 0;
+    caps->sample_sizes = 0;
+    caps->formats = 0;
+    memset(caps->rates, 0, sizeof(caps->rates));
+    memset(caps->channel_masks, 0, sizeof(caps->channel_masks));
+
+    if (size < HDMI_EDID_BLOCK_SIZE ||
+        memcmp(edid, edid_header, sizeof(edid_header)) != 0 ||
+        !edid_block_valid(edid)) {
+        hdmi_caps_set_basic_audio(&rate_bits, caps);
+        goto done;
+    }
+    caps->edid_valid = true;
+
+    blocks = 1 + edid[126];
+    if (blocks > size / HDMI_EDID_BLOCK_SIZE) {
+        blocks = size / HDMI_EDID_BLOCK_SIZE;
+    }
+
+    for (i = 1; i < blocks; i++) {
+        block = edid + i * HDMI_EDID_BLOCK_SIZE;
+        if (block[0] != CEA_EXTENSION_TAG || block[1] < 3 ||
+            !edid_block_valid(block)) {
+            continue;
+        }
+
+        basic_audio |= (block[3] & CEA_BASIC_AUDIO) != 0;
+
+        /* data blocks from byte 4 up to the first detailed timing */
+        dtd = block[2];
+        if (dtd < 4 || dtd > HDMI_EDID_BLOCK_SIZE - 1) {
+            continue;
+        }
+        for (pos = 4; pos < dtd; pos += 1 + len) {
+            len = block[pos] & 0x1f;
+            if (pos + 1 + len > dtd) {
+                break;
+            }
+            if ((block[pos] >> 5) == CEA_AUDIO_DATA_BLOCK) {
+                hdmi_caps_parse_sads(block + pos + 1, len, &rate_bits, caps);
+            }
+        }
+    }
+
+    if (caps->max_channels == 0) {
+        if (!basic_audio) {
+            ALOGW("%s: no audio in the EDID, assuming basic audio", __func__);
+        }
+        hdmi_caps_set_basic_audio(&rate_bits, caps);
+    }
+
+done:
+    for (i = 0, n = 0; i < HDMI_CAPS_MAX_RATES; i++) {
+        if (rate_bits & (1 << i)) {
+            caps->rates[n++] = sad_rates[i];
+        }
+    }
+
+    n = 0;
+    if (caps->max_channels >= 6) {
+        caps->channel_masks[n++] = AUDIO_CHANNEL_OUT_5POINT1;
+    }
+    if (caps->max_channels >= 8) {
+        caps->channel_masks[n++] = AUDIO_CHANNEL_OUT_7POINT1;
+    }
+
+    return caps->edid_valid ? 0 : -EINVAL;
+}
+
+static int hdmi_caps_read_file(const char *path, uint8_t *buffer, size_t size)
+{
+    ssize_t ret;
+    size_t done = 0;
+    int err;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    while (done < size) {
+        ret = read(fd, buffer + done, size - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+    err = errno;
+
+    close(fd);
+
+    return ret < 0 ? -err : (int)done;
+}
+
+static bool hdmi_caps_read_state(void)
+{
+    uint8_t state[8];
+    int ret;
+
+    ret = hdmi_caps_read_file(HDMI_SWITCH_STATE_PATH, state, sizeof(state) - 1);
+    if (ret <= 0) {
+        return false;
+    }
+    state[ret] = '\0';
+
+    return atoi((const char *)state) != 0;
+}
+
+/* Reads and parses the EDID outside the lock, then publishes it */
+static void hdmi_caps_update(bool connected)
+{
+    uint8_t edid[HDMI_EDID_BLOCK_SIZE * HDMI_EDID_MAX_BLOCKS];
+    struct hdmi_caps caps;
+    int64_t start_ns;
+    int64_t read_ns = 0;
+    int ret = 0;
+
+    memset(&caps, 0, sizeof(caps));
+    caps.connected = connected;
+
+    if (connected) {
+        start_ns = hdmi_caps_now_ns();
+        ret = hdmi_caps_read_file(HDMI_EDID_PATH, edid, sizeof(edid));
+        if (ret < 0) {
+            ALOGE("%s: cannot read %s: %s", __func__, HDMI_EDID_PATH,
+                  strerror(-ret));
+            ret = 0;
+        }
+        ret = hdmi_caps_parse_edid(edid, ret, &caps);
+        read_ns = hdmi_caps_now_ns() - start_ns;
+
+        ALOGI("%s: sink of %u channels, rates %#x, formats %#x%s", __func__,
+              caps.max_channels, caps.rates[0], caps.formats,
+              ret == 0 ? "" : " (no EDID)");
+    } else {
+        ALOGI("%s: sink disconnected", __func__);
+    }
+
+    pthread_mutex_lock(&caps_lock);
+
+    caps.generation = cache.generation + 1;
+    cache = caps;
+    if (connected) {
+        stats.edid_reads++;
+        if (ret != 0) {
+            stats.edid_errors++;
+        }
+        if (read_ns > stats.edid_max_ns) {
+            stats.edid_max_ns = read_ns;
+        }
+    }
+
+    pthread_mutex_unlock(&caps_lock);
+}
+
+static void hdmi_caps_handle_uevent(const char *msg, size_t size)
+{
+    const char *end = msg + size;
+    bool hdmi = false;
+    int state = -1;
+
+    for (; msg < end; msg += strlen(msg) + 1) {
+        if (strcmp(msg, "SWITCH_NAME=hdmi") == 0) {
+            hdmi = true;
+        } else if (strncmp(msg, "SWITCH_STATE=", 13) == 0) {
+            state = atoi(msg + 13);
+        }
+    }
+
+    if (!hdmi || state < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&caps_lock);
+    stats.hotplugs++;
+    pthread_mutex_unlock(&caps_lock);
+
+    hdmi_caps_update(state != 0);
+}
+
+static void *hdmi_caps_loop(void *arg __unused)
+{
+    char msg[UEVENT_BUFFER_SIZE + 2];
+    ssize_t n;
+    int fd;
+
+    fd = uevent_open_socket(UEVENT_SOCKET_SIZE, true);
+    if (fd < 0) {
+        ALOGE("%s: uevent_open_socket failed", __func__);
+        return NULL;
+    }
+
+    for (;;) {
+        n = uevent_kernel_multicast_recv(fd, msg, UEVENT_BUFFER_SIZE);
+        if (n <= 0) {
+            continue;
+        }
+        msg[n] = '\0';
+        msg[n + 1] = '\0';
+        hdmi_caps_handle_uevent(msg, n);
+    }
+
+    return NULL;
+}
+
+static void hdmi_caps_start_thread(void)
+{
+    pthread_attr_t attr;
+    int ret;
+
+    hdmi_caps_update(hdmi_caps_read_state());
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&uevent_thread, &attr, hdmi_caps_loop, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        ALOGE("%s: pthread_create failed: %s", __func__, strerror(ret));
+    }
+}
+
+void hdmi_caps_init(void)
+{
+    pthread_once(&thread_once, hdmi_caps_start_thread);
+}
+
+bool hdmi_caps_get(struct hdmi_caps *caps)
+{
+    pthread_mutex_lock(&caps_lock);
+    *caps = cache;
+    stats.lookups++;
+    pthread_mutex_unlock(&caps_lock);
+
+    if (!caps->connected && hdmi_caps_read_state()) {
+        /* the uevent is still on its way to the thread */
+        hdmi_caps_update(true);
+
+        pthread_mutex_lock(&caps_lock);
+        *caps = cache;
+        stats.rechecks++;
+        pthread_mutex_unlock(&caps_lock);
+    }
+
+    return caps->connected;
+}
+
+int hdmi_caps_set_channels(unsigned int channels)
+{
+    char value[8];
+    int len;
+    int ret = 0;
+    int fd;
+
+    pthread_mutex_lock(&caps_lock);
+
+    if (!cache.connected) {
+        ret = -ENODEV;
+        goto exit;
+    }
+    if (channels == written_channels && cache.generation == written_generation) {
+        stats.channel_skips++;
+        goto exit;
+    }
+
+    fd = open(HDMI_CHANNELS_PATH, O_WRONLY);
+    if (fd < 0) {
+        ret = -errno;
+        ALOGE("%s: cannot open %s: %s", __func__, HDMI_CHANNELS_PATH,
+              strerror(errno));
+        goto exit;
+    }
+    len = snprintf(value, sizeof(value), "%u", channels);
+    if (write(fd, value, len) != len) {
+        ret = -errno;
+        ALOGE("%s: cannot write %u channels: %s", __func__, channels,
+              strerror(errno));
+    }
+    close(fd);
+
+    if (ret == 0) {
+        written_channels = channels;
+        written_generation = cache.generation;
+        stats.channel_writes++;
+    }
+
+exit:
+    pthread_mutex_unlock(&caps_lock);
+
+    return ret;
+}
+
+void hdmi_caps_dump(int fd)
+{
+    int i;
+
+    pthread_mutex_lock(&caps_lock);
+
+    dprintf(fd, "  HDMI sink: %s, generation %u\n",
+            cache.connected ? "connected" : "disconnected", cache.generation);
+    if (cache.connected) {
+        dprintf(fd, "    %s, %u channels, formats %#x, sizes %#x, rates",
+                cache.edid_valid ? "EDID" : "basic audio", cache.max_channels,
+                cache.formats, cache.sample_sizes);
+        for (i = 0; cache.rates[i] != 0; i++) {
+            dprintf(fd, " %u", cache.rates[i]);
+        }
+        dprintf(fd, "\n    driver: %u channels%s\n", written_channels,
+                written_generation == cache.generation ? "" : " (other sink)");
+    }
+    dprintf(fd, "    %u hotplugs, %u rechecks, %u EDID reads, %u errors, "
+            "max %lld us, %u lookups, %u channel writes, %u skipped\n",
+            stats.hotplugs, stats.rechecks, stats.edid_reads, stats.edid_errors,
+            (long long)(stats.edid_max_ns / 1000), stats.lookups,
+            stats.channel_writes, stats.channel_skips);
+
+    pthread_mutex_unlock(&caps_lock);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HDMI_CAPS_H
+#define HDMI_CAPS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <system/audio.h>
+
+/*
+ * Audio capabilities of the HDMI sink.
+ *
+ * The EDID of the sink is read and its CEA audio data blocks parsed once
+ * per hotplug, by a thread listening to the uevents of the hdmi switch.
+ * Opening an HDMI output, its get_parameters() and its start are answered
+ * from the cache, none of them talks to the driver or reads sysfs on the
+ * way. The channel count is only written to the driver when it differs
+ * from what was written since the sink was plugged in.
+ *
+ * If an output is opened before the thread saw the hotplug, the state of
+ * the switch is read once more instead of failing the open.
+ */
+#define HDMI_SWITCH_STATE_PATH "/sys/class/switch/hdmi/state"
+#define HDMI_EDID_PATH "/sys/class/hdmi/hdmi/edid"
+#define HDMI_CHANNELS_PATH "/sys/class/hdmi/hdmi/audio_channels"
+
+#define HDMI_EDID_BLOCK_SIZE 128
+#define HDMI_EDID_MAX_BLOCKS 4
+
+/* 32 to 192 kHz, CEA-861 short audio descriptors */
+#define HDMI_CAPS_MAX_RATES 7
+#define HDMI_CAPS_MAX_CHANNEL_MASKS 2
+
+/* sample_sizes, of LPCM */
+#define HDMI_CAPS_16_BIT (1 << 0)
+#define HDMI_CAPS_20_BIT (1 << 1)
+#define HDMI_CAPS_24_BIT (1 << 2)
+
+/* formats, CEA-861 audio format codes */
+#define HDMI_CAPS_FORMAT_LPCM 1
+#define HDMI_CAPS_FORMAT_AC3 2
+#define HDMI_CAPS_FORMAT_DTS 7
+#define HDMI_CAPS_FORMAT_EAC3 10
+
+struct hdmi_caps {
+    bool                    connected;
+    uint32_t                generation;     /* bumped on every hotplug */
+    bool                    edid_valid;     /* defaults to basic audio if not */
+    unsigned int            max_channels;   /* of LPCM */
+    uint32_t                rates[HDMI_CAPS_MAX_RATES + 1];     /* 0 terminated */
+    uint32_t                sample_sizes;
+    uint32_t                formats;        /* 1 << format code */
+    /* multichannel masks only, 0 terminated */
+    audio_channel_mask_t    channel_masks[HDMI_CAPS_MAX_CHANNEL_MASKS + 1];
+};
+
+/* Function prototypes */
+
+/* Reads the current sink and starts the uevent thread, once */
+void hdmi_caps_init(void);
+
+/* Copies the cache, returns false if no sink is connected */
+bool hdmi_caps_get(struct hdmi_caps *caps);
+
+/* Writes the channel count to the driver unless already written for this sink */
+int hdmi_caps_set_channels(unsigned int channels);
+
+/* Parses an EDID into caps, returns 0 or a negative errno */
+int hdmi_caps_parse_edid(const uint8_t *edid, size_t size, struct hdmi_caps *caps);
+
+/* The cache, the hotplugs and the EDID reads */
+void hdmi_caps_dump(int fd);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_link_rate"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <tinyalsa/asoundlib.h>
+
+#include "link_rate.h"
+
+int link_rate_probe(struct link_rates *rates,
+                    unsigned int card,
+                    unsigned int device,
+                    bool playback,
+                    unsigned int profile_rate)
+{
+    struct pcm_params *params;
+    char value[PROPERTY_VALUE_MAX];
+    unsigned int board_rate;
+
+    rates->probed = false;
+    rates->min = profile_rate;
+    rates->max = profile_rate;
+    rates->native = profile_rate;
+    rates->max_bits = 16;
+
+    params = pcm_params_get(card, device, playback ? PCM_OUT : PCM_IN);
+    if (params == NULL) {
+        ALOGW("%s: card %u device %u: no hw params, using %u Hz",
+              __func__, card, device, profile_rate);
+        return -ENODEV;
+    }
+
+    rates->min = pcm_params_get_min(params, PCM_PARAM_RATE);
+    rates->max = pcm_params_get_max(params, PCM_PARAM_RATE);
+    rates->max_bits = pcm_params_get_max(params, PCM_PARAM_SAMPLE_BITS);
+    rates->probed = true;
+    pcm_params_free(params);
+
+    if (rates->min == rates->max) {
+        rates->native = rates->min;
+    } else {
+        board_rate = 0;
+        if (playback &&
+            property_get("ro.audio.playback_native_rate", value, NULL) > 0) {
+            board_rate = atoi(value);
+        }
+
+        if (board_rate != 0 && link_rate_supported(rates, board_rate)) {
+            rates->native = board_rate;
+        } else if (!link_rate_supported(rates, profile_rate)) {
+            rates->native = rates->max;
+        }
+    }
+
+    ALOGV("%s: card %u device %u: %u - %u Hz, native %u Hz, %u bits", __func__,
+          card, device, rates->min, rates->max, rates->native, rates->max_bits);
+
+    return 0;
+}
+
+bool link_rate_supported(const struct link_rates *rates, unsigned int rate)
+{
+    return rate >= rates->min && rate <= rates->max;
+}
+
+unsigned int link_rate_select(const struct link_rates *rates, unsigned int rate)
+{
+    if (rate != 0 && link_rate_supported(rates, rate)) {
+        return rate;
+    }
+
+    return rates->native;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LINK_RATE_H
+#define LINK_RATE_H
+
+#include <stdbool.h>
+
+/*
+ * Sample rates and widths a PCM link accepts, probed from the driver at
+ * adev_open.
+ *
+ * The native rate is the one the codec clocks at: the only rate the driver
+ * accepts if it is fixed, otherwise what the board declares in
+ * ro.audio.playback_native_rate (the FLORIDA codec runs at 44.1 kHz but
+ * its DAI takes 48 kHz as well), otherwise the rate of the profile.
+ */
+struct link_rates {
+    bool            probed;
+    unsigned int    min;
+    unsigned int    max;
+    unsigned int    native;
+    /* widest sample the link takes, 16 if it was not probed */
+    unsigned int    max_bits;
+};
+
+/* Function prototypes */
+
+/* Returns 0, or -ENODEV and leaves only the profile rate supported */
+int link_rate_probe(struct link_rates *rates,
+                    unsigned int card,
+                    unsigned int device,
+                    bool playback,
+                    unsigned int profile_rate);
+
+bool link_rate_supported(const struct link_rates *rates, unsigned int rate);
+
+/*
+ * Rate to open the link at for a stream at rate: the stream rate itself if
+ * the link runs at it, so that nothing is resampled, the native rate
+ * otherwise.
+ */
+unsigned int link_rate_select(const struct link_rates *rates, unsigned int rate);
+
+#endif
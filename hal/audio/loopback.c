@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_loopback"
+/*#define LOG_NDEBUG 0*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include <cutils/log.h>
+
+#include "loopback.h"
+
+/* x^10 + x^7 + 1, 1023 chips, padded with a zero to a multiple of 8 */
+#define LOOPBACK_MLS_BITS 10
+#define LOOPBACK_MLS_LEN ((1 << LOOPBACK_MLS_BITS) - 1)
+#define LOOPBACK_MLS_TAPS (LOOPBACK_MLS_LEN + 1)
+
+#define LOOPBACK_AMPLITUDE 8192
+#define LOOPBACK_INTERVAL_MS 500
+#define LOOPBACK_FIRST_BURST_MS 100
+#define LOOPBACK_MAX_LATENCY_MS 250
+
+/* Correlation peak over its RMS for a valid measurement */
+#define LOOPBACK_PEAK_RATIO 8.0f
+
+/* Timestamp deviation counted as a glitch */
+#define LOOPBACK_GLITCH_NS 1000000LL
+
+struct loopback {
+    uint32_t rate;
+    int16_t  mls[LOOPBACK_MLS_TAPS];
+
+    bool     active;
+    uint32_t gen;          /* bumped on start and stop */
+
+    /* playback thread */
+    uint32_t out_gen;
+    uint64_t out_pos;
+    uint64_t next_burst;
+    int      burst_idx;    /* chip being played, -1 between bursts */
+    int64_t  out_next_ns;
+    uint32_t out_period;
+
+    /* published to the capture thread */
+    int64_t  burst_ns;
+    uint32_t burst_count;
+    uint32_t out_glitches;
+
+    /* capture thread */
+    uint32_t in_gen;
+    uint32_t seen_bursts;
+    int64_t  in_next_ns;
+    uint32_t in_glitches;
+    int64_t  win_ns;       /* render time of the burst in win[0], 0 if idle */
+    int16_t  *win;
+    size_t   win_frames;
+    size_t   win_fill;
+    size_t   next_lag;
+    int64_t  peak;
+    size_t   peak_lag;
+    float    corr_sumsq;
+
+    struct loopback_stats profiles[LOOPBACK_MAX_PROFILES];
+    int      num_profiles;
+};
+
+static void loopback_gen_mls(int16_t *mls)
+{
+    uint32_t reg = 1;
+    int i;
+
+    for (i = 0; i < LOOPBACK_MLS_LEN; i++) {
+        uint32_t bit = ((reg >> 0) ^ (reg >> 3)) & 1;
+
+        mls[i] = (reg & 1) ? 1 : -1;
+        reg = (reg >> 1) | (bit << (LOOPBACK_MLS_BITS - 1));
+    }
+
+    mls[LOOPBACK_MLS_LEN] = 0;
+}
+
+struct loopback *loopback_create(uint32_t rate)
+{
+    struct loopback *lb;
+
+    lb = calloc(1, sizeof(struct loopback));
+    if (lb == NULL) {
+        return NULL;
+    }
+
+    lb->rate = rate;
+    lb->win_frames = (size_t)rate * LOOPBACK_MAX_LATENCY_MS / 1000 +
+                     LOOPBACK_MLS_TAPS;
+    lb->win = calloc(lb->win_frames, sizeof(int16_t));
+    if (lb->win == NULL) {
+        free(lb);
+        return NULL;
+    }
+
+    loopback_gen_mls(lb->mls);
+
+    return lb;
+}
+
+void loopback_destroy(struct loopback *lb)
+{
+    if (lb == NULL) {
+        return;
+    }
+
+    free(lb->win);
+    free(lb);
+}
+
+uint32_t loopback_get_rate(const struct loopback *lb)
+{
+    return lb->rate;
+}
+
+void loopback_start(struct loopback *lb)
+{
+    __atomic_add_fetch(&lb->gen, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&lb->active, true, __ATOMIC_RELEASE);
+
+    ALOGV("%s", __func__);
+}
+
+void loopback_stop(struct loopback *lb)
+{
+    __atomic_store_n(&lb->active, false, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&lb->gen, 1, __ATOMIC_RELEASE);
+
+    ALOGV("%s", __func__);
+}
+
+bool loopback_is_active(const struct loopback *lb)
+{
+    return lb != NULL && __atomic_load_n(&lb->active, __ATOMIC_ACQUIRE);
+}
+
+void loopback_render(struct loopback *lb,
+                     int16_t *buffer,
+                     size_t frames,
+                     uint32_t channels,
+                     uint32_t period,
+                     int64_t render_ns)
+{
+    uint32_t gen = __atomic_load_n(&lb->gen, __ATOMIC_ACQUIRE);
+    int64_t first_ns;
+    size_t i;
+    uint32_t c;
+
+    if (frames == 0) {
+        return;
+    }
+
+    if (lb->out_gen != gen) {
+        lb->out_gen = gen;
+        lb->out_pos = 0;
+        lb->next_burst = (uint64_t)lb->rate * LOOPBACK_FIRST_BURST_MS / 1000;
+        lb->burst_idx = -1;
+        lb->out_next_ns = 0;
+    }
+
+    __atomic_store_n(&lb->out_period, period, __ATOMIC_RELAXED);
+
+    first_ns = render_ns - (int64_t)(frames - 1) * 1000000000LL / lb->rate;
+    if (lb->out_next_ns != 0 &&
+        llabs(first_ns - lb->out_next_ns) > LOOPBACK_GLITCH_NS) {
+        __atomic_add_fetch(&lb->out_glitches, 1, __ATOMIC_RELAXED);
+    }
+    lb->out_next_ns = render_ns + 1000000000LL / lb->rate;
+
+    for (i = 0; i < frames; i++) {
+        int16_t sample = 0;
+
+        if (lb->burst_idx < 0 && lb->out_pos + i == lb->next_burst) {
+            __atomic_store_n(&lb->burst_ns,
+                             first_ns + (int64_t)i * 1000000000LL / lb->rate,
+                             __ATOMIC_RELAXED);
+            __atomic_add_fetch(&lb->burst_count, 1, __ATOMIC_RELEASE);
+            lb->burst_idx = 0;
+            lb->next_burst += (uint64_t)lb->rate * LOOPBACK_INTERVAL_MS / 1000;
+        }
+
+        if (lb->burst_idx >= 0) {
+            sample = lb->mls[lb->burst_idx++] * LOOPBACK_AMPLITUDE;
+            if (lb->burst_idx == LOOPBACK_MLS_LEN) {
+                lb->burst_idx = -1;
+            }
+        }
+
+        for (c = 0; c < channels; c++) {
+            buffer[i * channels + c] = sample;
+        }
+    }
+
+    lb->out_pos += frames;
+}
+
+static int32_t loopback_correlate(const int16_t *mls, const int16_t *x)
+{
+    int32_t sum = 0;
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    int32x4_t acc = vdupq_n_s32(0);
+    int32x2_t s;
+
+    for (; i < LOOPBACK_MLS_TAPS; i += 8) {
+        int16x8_t a = vld1q_s16(mls + i);
+        int16x8_t b = vld1q_s16(x + i);
+
+        acc = vmlal_s16(acc, vget_low_s16(a), vget_low_s16(b));
+        acc = vmlal_s16(acc, vget_high_s16(a), vget_high_s16(b));
+    }
+
+    s = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    s = vpadd_s32(s, s);
+    sum = vget_lane_s32(s, 0);
+#endif
+
+    for (; i < LOOPBACK_MLS_TAPS; i++) {
+        sum += mls[i] * x[i];
+    }
+
+    return sum;
+}
+
+static struct loopback_stats *loopback_get_profile(struct loopback *lb,
+                                                   uint32_t out_period,
+                                                   uint32_t in_period)
+{
+    struct loopback_stats *stats;
+    int i;
+
+    for (i = 0; i < lb->num_profiles; i++) {
+        stats = &lb->profiles[i];
+        if (stats->out_period == out_period && stats->in_period == in_period) {
+            return stats;
+        }
+    }
+
+    if (lb->num_profiles == LOOPBACK_MAX_PROFILES) {
+        return &lb->profiles[LOOPBACK_MAX_PROFILES - 1];
+    }
+
+    stats = &lb->profiles[lb->num_profiles++];
+    stats->out_period = out_period;
+    stats->in_period = in_period;
+
+    return stats;
+}
+
+static void loopback_finish(struct loopback *lb, uint32_t in_period)
+{
+    struct loopback_stats *stats;
+    size_t lags = lb->win_frames - LOOPBACK_MLS_TAPS + 1;
+    float rms = sqrtf(lb->corr_sumsq / (float)lags);
+
+    stats = loopback_get_profile(lb,
+                                 __atomic_load_n(&lb->out_period,
+                                                 __ATOMIC_RELAXED),
+                                 in_period);
+
+    stats->glitches += lb->in_glitches +
+                       __atomic_exchange_n(&lb->out_glitches, 0,
+                                           __ATOMIC_RELAXED);
+    lb->in_glitches = 0;
+
+    if ((float)lb->peak > LOOPBACK_PEAK_RATIO * rms) {
+        int64_t latency_us = (int64_t)lb->peak_lag * 1000000LL / lb->rate;
+
+        if (stats->measurements == 0 || latency_us < stats->latency_min_us) {
+            stats->latency_min_us = latency_us;
+        }
+        if (latency_us > stats->latency_max_us) {
+            stats->latency_max_us = latency_us;
+        }
+        stats->latency_last_us = latency_us;
+        stats->latency_sum_us += latency_us;
+        stats->latency_sumsq_us += latency_us * latency_us;
+        stats->measurements++;
+
+        ALOGV("%s: latency %lld us", __func__, (long long)latency_us);
+    } else {
+        stats->missed++;
+
+        ALOGV("%s: no peak, %lld vs rms %f", __func__,
+              (long long)lb->peak, rms);
+    }
+
+    lb->win_ns = 0;
+}
+
+void loopback_capture(struct loopback *lb,
+                      const int16_t *buffer,
+                      size_t frames,
+                      uint32_t channels,
+                      uint32_t period,
+                      int64_t capture_ns)
+{
+    uint32_t gen = __atomic_load_n(&lb->gen, __ATOMIC_ACQUIRE);
+    uint32_t bursts;
+    size_t skip = 0;
+    size_t i;
+
+    if (lb->in_gen != gen) {
+        lb->in_gen = gen;
+        lb->seen_bursts = __atomic_load_n(&lb->burst_count, __ATOMIC_ACQUIRE);
+        lb->in_next_ns = 0;
+        lb->in_glitches = 0;
+        lb->win_ns = 0;
+        memset(lb->profiles, 0, sizeof(lb->profiles));
+        lb->num_profiles = 0;
+    }
+
+    if (lb->in_next_ns != 0 &&
+        llabs(capture_ns - lb->in_next_ns) > LOOPBACK_GLITCH_NS) {
+        lb->in_glitches++;
+    }
+    lb->in_next_ns = capture_ns + (int64_t)frames * 1000000000LL / lb->rate;
+
+    if (lb->win_ns == 0) {
+        bursts = __atomic_load_n(&lb->burst_count, __ATOMIC_ACQUIRE);
+        if (bursts == lb->seen_bursts) {
+            return;
+        }
+
+        lb->seen_bursts = bursts;
+        lb->win_ns = __atomic_load_n(&lb->burst_ns, __ATOMIC_RELAXED);
+        lb->win_fill = 0;
+        lb->next_lag = 0;
+        lb->peak = 0;
+        lb->peak_lag = 0;
+        lb->corr_sumsq = 0.0f;
+    }
+
+    if (lb->win_fill == 0) {
+        /* Align win[0] with the burst, capture may have started later */
+        int64_t offset = (capture_ns - lb->win_ns) * lb->rate / 1000000000LL;
+
+        if (offset < 0) {
+            if ((size_t)-offset >= frames) {
+                return;
+            }
+            skip = (size_t)-offset;
+        } else if ((size_t)offset < lb->win_frames) {
+            memset(lb->win, 0, (size_t)offset * sizeof(int16_t));
+            lb->win_fill = (size_t)offset;
+        } else {
+            /* Too late, nothing to correlate */
+            lb->win_fill = lb->win_frames;
+            lb->next_lag = lb->win_frames;
+        }
+    }
+
+    for (i = skip; i < frames && lb->win_fill < lb->win_frames; i++) {
+        const int16_t *frame = buffer + i * channels;
+
+        lb->win[lb->win_fill++] = (channels == 1) ?
+                frame[0] :
+                (int16_t)(((int32_t)frame[0] + frame[1]) >> 1);
+    }
+
+    /* Every lag whose samples are all in */
+    while (lb->next_lag + LOOPBACK_MLS_TAPS <= lb->win_fill) {
+        int32_t corr = loopback_correlate(lb->mls, lb->win + lb->next_lag);
+        int64_t mag = corr < 0 ? -(int64_t)corr : corr;
+
+        lb->corr_sumsq += (float)corr * (float)corr;
+        if (mag > lb->peak) {
+            lb->peak = mag;
+            lb->peak_lag = lb->next_lag;
+        }
+        lb->next_lag++;
+    }
+
+    if (lb->win_fill == lb->win_frames) {
+        loopback_finish(lb, period);
+    }
+}
+
+int loopback_get_stats(const struct loopback *lb,
+                       struct loopback_stats *stats,
+                       int max)
+{
+    int count = lb->num_profiles < max ? lb->num_profiles : max;
+
+    memcpy(stats, lb->profiles, count * sizeof(struct loopback_stats));
+
+    return count;
+}
+
+int64_t loopback_jitter_us(const struct loopback_stats *stats)
+{
+    int64_t mean;
+    int64_t var;
+
+    if (stats->measurements < 2) {
+        return 0;
+    }
+
+    mean = stats->latency_sum_us / stats->measurements;
+    var = stats->latency_sumsq_us / stats->measurements - mean * mean;
+
+    return var > 0 ? (int64_t)sqrt((double)var) : 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Round trip latency measurement.
+ *
+ * While active, the FAST output plays a maximum length sequence every
+ * LOOPBACK_INTERVAL_MS instead of its content, and remembers when its
+ * first sample is rendered. The capture side collects what it captures
+ * from that moment on and correlates it with the sequence as the frames
+ * come in; the lag of the peak is the round trip latency. Timestamp
+ * discontinuities on either side count as glitches, bursts without a
+ * clear peak as missed.
+ *
+ * Results are kept per output/input period size combination.
+ */
+struct loopback;
+
+#define LOOPBACK_MAX_PROFILES 8
+
+struct loopback_stats {
+    uint32_t out_period;
+    uint32_t in_period;
+    uint32_t measurements;
+    uint32_t missed;
+    uint32_t glitches;
+    int64_t  latency_last_us;
+    int64_t  latency_min_us;
+    int64_t  latency_max_us;
+    int64_t  latency_sum_us;
+    int64_t  latency_sumsq_us;
+};
+
+/* Function prototypes */
+struct loopback *loopback_create(uint32_t rate);
+
+void loopback_destroy(struct loopback *lb);
+
+uint32_t loopback_get_rate(const struct loopback *lb);
+
+/* Results are cleared once the capture side sees the new run */
+void loopback_start(struct loopback *lb);
+
+void loopback_stop(struct loopback *lb);
+
+bool loopback_is_active(const struct loopback *lb);
+
+/*
+ * Playback thread: replaces frames of interleaved 16 bit audio, render_ns
+ * is the CLOCK_MONOTONIC time the last frame will be rendered.
+ */
+void loopback_render(struct loopback *lb,
+                     int16_t *buffer,
+                     size_t frames,
+                     uint32_t channels,
+                     uint32_t period,
+                     int64_t render_ns);
+
+/*
+ * Capture thread: buffer holds frames of interleaved 16 bit audio, the
+ * first of which was captured at capture_ns.
+ */
+void loopback_capture(struct loopback *lb,
+                      const int16_t *buffer,
+                      size_t frames,
+                      uint32_t channels,
+                      uint32_t period,
+                      int64_t capture_ns);
+
+/* Returns the number of profiles copied to stats */
+int loopback_get_stats(const struct loopback *lb,
+                       struct loopback_stats *stats,
+                       int max);
+
+int64_t loopback_jitter_us(const struct loopback_stats *stats);
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_parms"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include <hardware/audio.h>
+
+#include "parms.h"
+
+#define PARMS_HASH_SIZE 16
+
+/*
+ * Collision free for the keys below; a new key either gets a free slot or
+ * the multipliers have to be searched again.
+ */
+#define PARMS_HASH(str, len) \
+    (((len) * 3 + (str)[0] + (str)[(len) - 1] * 7) & (PARMS_HASH_SIZE - 1))
+
+struct parms_entry {
+    const char      *name;
+    size_t          len;
+    enum parms_key  key;
+};
+
+#define PARMS_ENTRY(slot, str, k) \
+    [slot] = { .name = str, .len = sizeof(str) - 1, .key = k }
+
+static const struct parms_entry parms_table[PARMS_HASH_SIZE] = {
+    PARMS_ENTRY(0, AUDIO_PARAMETER_STREAM_INPUT_SOURCE, PARMS_KEY_INPUT_SOURCE),
+    PARMS_ENTRY(2, "hal_api_trace", PARMS_KEY_API_TRACE),
+    PARMS_ENTRY(3, "noise_suppression", PARMS_KEY_NOISE_SUPPRESSION),
+    PARMS_ENTRY(4, AUDIO_PARAMETER_KEY_BT_NREC, PARMS_KEY_BT_NREC),
+    PARMS_ENTRY(5, "loopback_result", PARMS_KEY_LOOPBACK_RESULT),
+    PARMS_ENTRY(6, "preroll_offset", PARMS_KEY_PREROLL_OFFSET),
+    PARMS_ENTRY(8, AUDIO_PARAMETER_STREAM_ROUTING, PARMS_KEY_ROUTING),
+    PARMS_ENTRY(9, AUDIO_PARAMETER_KEY_BT_SCO_WB, PARMS_KEY_BT_SCO_WB),
+    PARMS_ENTRY(10, "screen_state", PARMS_KEY_SCREEN_STATE),
+    PARMS_ENTRY(11, "loopback_path", PARMS_KEY_LOOPBACK_PATH),
+    PARMS_ENTRY(12, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, PARMS_KEY_SUP_CHANNELS),
+    PARMS_ENTRY(13, "pcm_taps", PARMS_KEY_PCM_TAPS),
+    PARMS_ENTRY(14, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES,
+                PARMS_KEY_SUP_SAMPLING_RATES),
+    PARMS_ENTRY(15, "loopback_test", PARMS_KEY_LOOPBACK_TEST),
+};
+
+/* Slot of each key, for parms_key_name() */
+static uint8_t parms_slots[PARMS_KEY_COUNT];
+
+void parms_init(void)
+{
+    unsigned int i;
+    unsigned int found = 0;
+
+    for (i = 0; i < PARMS_HASH_SIZE; i++) {
+        const struct parms_entry *entry = &parms_table[i];
+
+        if (entry->name == NULL) {
+            continue;
+        }
+
+        LOG_ALWAYS_FATAL_IF(PARMS_HASH(entry->name, entry->len) != i,
+                            "%s: key %s is not in slot %u", __func__,
+                            entry->name, i);
+
+        parms_slots[entry->key] = i;
+        found++;
+    }
+
+    LOG_ALWAYS_FATAL_IF(found != PARMS_KEY_COUNT,
+                        "%s: %u of %u keys in the table", __func__,
+                        found, PARMS_KEY_COUNT);
+}
+
+static const struct parms_entry *parms_lookup(const char *str, size_t len)
+{
+    const struct parms_entry *entry;
+
+    if (len == 0) {
+        return NULL;
+    }
+
+    entry = &parms_table[PARMS_HASH((const unsigned char *)str, len)];
+    if (entry->len != len || memcmp(entry->name, str, len) != 0) {
+        return NULL;
+    }
+
+    return entry;
+}
+
+void parms_parse(const char *kvpairs, struct parms *parms)
+{
+    const char *p = kvpairs;
+
+    parms->present = 0;
+
+    while (*p != '\0') {
+        const struct parms_entry *entry;
+        const char *key = p;
+        const char *value;
+        size_t key_len;
+        size_t value_len = 0;
+
+        while (*p != '\0' && *p != '=' && *p != ';') {
+            p++;
+        }
+        key_len = p - key;
+
+        if (*p == '=') {
+            p++;
+        }
+        value = p;
+        while (*p != '\0' && *p != ';') {
+            p++;
+        }
+        value_len = p - value;
+
+        if (*p == ';') {
+            p++;
+        }
+
+        entry = parms_lookup(key, key_len);
+        if (entry == NULL) {
+            continue;
+        }
+
+        /* like str_parms, the last occurrence of a key wins */
+        parms->values[entry->key].str = value;
+        parms->values[entry->key].len = value_len;
+        parms->present |= 1u << entry->key;
+    }
+}
+
+int parms_get_uint(const struct parms *parms, enum parms_key key, uint32_t *val)
+{
+    const struct parms_value *value = &parms->values[key];
+    uint64_t result = 0;
+    size_t i;
+
+    if (!parms_has(parms, key)) {
+        return -ENOENT;
+    }
+
+    if (value->len == 0) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < value->len; i++) {
+        char c = value->str[i];
+
+        if (c < '0' || c > '9') {
+            return -EINVAL;
+        }
+
+        result = result * 10 + (c - '0');
+        if (result > UINT32_MAX) {
+            return -EINVAL;
+        }
+    }
+
+    *val = result;
+    return 0;
+}
+
+int parms_get_str(const struct parms *parms, enum parms_key key,
+                  char *buf, size_t size)
+{
+    const struct parms_value *value = &parms->values[key];
+    size_t len;
+
+    if (!parms_has(parms, key)) {
+        return -ENOENT;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    len = value->len < size - 1 ? value->len : size - 1;
+    memcpy(buf, value->str, len);
+    buf[len] = '\0';
+
+    return len;
+}
+
+bool parms_value_is(const struct parms *parms, enum parms_key key,
+                    const char *str)
+{
+    const struct parms_value *value = &parms->values[key];
+
+    return parms_has(parms, key) &&
+           strlen(str) == value->len &&
+           memcmp(value->str, str, value->len) == 0;
+}
+
+const char *parms_key_name(enum parms_key key)
+{
+    return parms_table[parms_slots[key]].name;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PARMS_H
+#define PARMS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Key/value scanner for the set_parameters()/get_parameters() strings.
+ *
+ * Unlike str_parms it builds no hashmap and copies nothing: parms_parse()
+ * records where the value of each key the HAL understands starts in the
+ * caller's string, keys are looked up in a perfect hash table built with
+ * the HAL. Other keys are skipped.
+ */
+enum parms_key {
+    PARMS_KEY_ROUTING,
+    PARMS_KEY_INPUT_SOURCE,
+    PARMS_KEY_BT_NREC,
+    PARMS_KEY_BT_SCO_WB,
+    PARMS_KEY_NOISE_SUPPRESSION,
+    PARMS_KEY_LOOPBACK_PATH,
+    PARMS_KEY_LOOPBACK_TEST,
+    PARMS_KEY_LOOPBACK_RESULT,
+    PARMS_KEY_SUP_CHANNELS,
+    PARMS_KEY_SUP_SAMPLING_RATES,
+    PARMS_KEY_SCREEN_STATE,
+    PARMS_KEY_API_TRACE,
+    PARMS_KEY_PCM_TAPS,
+    PARMS_KEY_PREROLL_OFFSET,
+    PARMS_KEY_COUNT
+};
+
+struct parms_value {
+    const char  *str;   /* not terminated, points into the parsed string */
+    size_t      len;
+};
+
+struct parms {
+    uint32_t            present;    /* bitmap of PARMS_KEY_* */
+    struct parms_value  values[PARMS_KEY_COUNT];
+};
+
+/* Function prototypes */
+
+/* Checks the key table, aborts if a key is not in its hash slot */
+void parms_init(void);
+
+/* "key1=value1;key2=value2", or "key1;key2" for a query */
+void parms_parse(const char *kvpairs, struct parms *parms);
+
+static inline bool parms_has(const struct parms *parms, enum parms_key key)
+{
+    return (parms->present & (1u << key)) != 0;
+}
+
+/* Returns 0, -ENOENT if the key is missing or -EINVAL if not a number */
+int parms_get_uint(const struct parms *parms, enum parms_key key, uint32_t *val);
+
+/* Returns the length of the value, which may have been truncated, or -ENOENT */
+int parms_get_str(const struct parms *parms, enum parms_key key,
+                  char *buf, size_t size);
+
+/* Whether the key is present with exactly this value */
+bool parms_value_is(const struct parms *parms, enum parms_key key,
+                    const char *str);
+
+const char *parms_key_name(enum parms_key key);
+
+#endif
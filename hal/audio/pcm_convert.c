@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_pcm_convert"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "pcm_convert.h"
+
+#define S24_MAX 8388607
+#define S24_MIN (-8388608)
+#define FLOAT_TO_S24 8388608.0f
+
+/* Numerical Recipes LCG */
+#define DITHER_MUL 1664525u
+#define DITHER_ADD 1013904223u
+
+void pcm_dither_init(struct pcm_dither *dither, bool enabled)
+{
+    int i;
+
+    dither->enabled = enabled;
+    for (i = 0; i < 4; i++) {
+        dither->state[i] = 0x12345678u * (i + 1);
+    }
+}
+
+size_t pcm_convert_sample_size(audio_format_t format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        return sizeof(int16_t);
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        return sizeof(int32_t);
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return sizeof(float);
+    default:
+        return 0;
+    }
+}
+
+bool pcm_convert_supported(audio_format_t src_format,
+                           enum pcm_format dst_format)
+{
+    return pcm_convert_sample_size(src_format) != 0 &&
+           (dst_format == PCM_FORMAT_S16_LE || dst_format == PCM_FORMAT_S24_LE);
+}
+
+/* Triangular, -255..255 in units of the 24 bit LSB */
+static inline int32_t dither_next(uint32_t *state)
+{
+    uint32_t s = *state * DITHER_MUL + DITHER_ADD;
+
+    *state = s;
+    return (int32_t)(s >> 24) + (int32_t)((s >> 16) & 0xff) - 255;
+}
+
+static inline int32_t float_to_s24(float f)
+{
+    f *= FLOAT_TO_S24;
+    if (f >= (float)S24_MAX) {
+        return S24_MAX;
+    }
+    if (f <= (float)S24_MIN) {
+        return S24_MIN;
+    }
+    return (int32_t)f;
+}
+
+static inline int32_t clamp_s24(int32_t x)
+{
+    return x > S24_MAX ? S24_MAX : (x < S24_MIN ? S24_MIN : x);
+}
+
+/* 24 bit to 16 bit, rounded and saturated */
+static inline int16_t s24_to_s16(int32_t x)
+{
+    x = (x + 128) >> 8;
+    return x > INT16_MAX ? INT16_MAX : (x < INT16_MIN ? INT16_MIN : x);
+}
+
+/*
+ * Both 8.24 and float go through 24 bit, the NEON loops convert 8 samples
+ * at a time and leave the rest to the scalar tail.
+ */
+static void convert_q8_23_to_s24(int32_t *dst, const int32_t *src, size_t samples)
+{
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    const int32x4_t max = vdupq_n_s32(S24_MAX);
+    const int32x4_t min = vdupq_n_s32(S24_MIN);
+
+    for (; i + 8 <= samples; i += 8) {
+        int32x4_t a = vld1q_s32(src + i);
+        int32x4_t b = vld1q_s32(src + i + 4);
+
+        vst1q_s32(dst + i, vmaxq_s32(vminq_s32(a, max), min));
+        vst1q_s32(dst + i + 4, vmaxq_s32(vminq_s32(b, max), min));
+    }
+#endif
+
+    for (; i < samples; i++) {
+        dst[i] = clamp_s24(src[i]);
+    }
+}
+
+static void convert_float_to_s24(int32_t *dst, const float *src, size_t samples)
+{
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    const float32x4_t scale = vdupq_n_f32(FLOAT_TO_S24);
+    const int32x4_t max = vdupq_n_s32(S24_MAX);
+    const int32x4_t min = vdupq_n_s32(S24_MIN);
+
+    for (; i + 8 <= samples; i += 8) {
+        /* vcvt saturates to 32 bit, the clamp takes it to 24 */
+        int32x4_t a = vcvtq_s32_f32(vmulq_f32(vld1q_f32(src + i), scale));
+        int32x4_t b = vcvtq_s32_f32(vmulq_f32(vld1q_f32(src + i + 4), scale));
+
+        vst1q_s32(dst + i, vmaxq_s32(vminq_s32(a, max), min));
+        vst1q_s32(dst + i + 4, vmaxq_s32(vminq_s32(b, max), min));
+    }
+#endif
+
+    for (; i < samples; i++) {
+        dst[i] = float_to_s24(src[i]);
+    }
+}
+
+static void convert_s16_to_s24(int32_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++) {
+        dst[i] = (int32_t)src[i] << 8;
+    }
+}
+
+#ifdef __ARM_NEON__
+static inline int32x4_t dither_next_neon(uint32x4_t *state)
+{
+    const uint32x4_t mul = vdupq_n_u32(DITHER_MUL);
+    const uint32x4_t add = vdupq_n_u32(DITHER_ADD);
+    const uint32x4_t mask = vdupq_n_u32(0xff);
+    uint32x4_t s = vmlaq_u32(add, *state, mul);
+
+    *state = s;
+    return vsubq_s32(vreinterpretq_s32_u32(vaddq_u32(vshrq_n_u32(s, 24),
+                                                     vandq_u32(vshrq_n_u32(s, 16), mask))),
+                     vdupq_n_s32(255));
+}
+#endif
+
+/* src is 24 bit (8.24 clamped or converted from float) */
+static void convert_s24_to_s16(int16_t *dst, const int32_t *src, size_t samples,
+                               struct pcm_dither *dither)
+{
+    bool dithered = dither != NULL && dither->enabled;
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    if (dithered) {
+        uint32x4_t state = vld1q_u32(dither->state);
+
+        for (; i + 8 <= samples; i += 8) {
+            int32x4_t a = vqaddq_s32(vld1q_s32(src + i), dither_next_neon(&state));
+            int32x4_t b = vqaddq_s32(vld1q_s32(src + i + 4), dither_next_neon(&state));
+
+            vst1q_s16(dst + i, vcombine_s16(vqrshrn_n_s32(a, 8), vqrshrn_n_s32(b, 8)));
+        }
+
+        vst1q_u32(dither->state, state);
+    } else {
+        for (; i + 8 <= samples; i += 8) {
+            int32x4_t a = vld1q_s32(src + i);
+            int32x4_t b = vld1q_s32(src + i + 4);
+
+            vst1q_s16(dst + i, vcombine_s16(vqrshrn_n_s32(a, 8), vqrshrn_n_s32(b, 8)));
+        }
+    }
+#endif
+
+    for (; i < samples; i++) {
+        int32_t x = src[i];
+
+        if (dithered) {
+            x += dither_next(&dither->state[0]);
+        }
+        dst[i] = s24_to_s16(x);
+    }
+}
+
+/* Through a stack buffer of this many samples when going down to 16 bit */
+#define CONVERT_CHUNK 256
+
+int pcm_convert(void *dst,
+                enum pcm_format dst_format,
+                const void *src,
+                audio_format_t src_format,
+                size_t samples,
+                struct pcm_dither *dither)
+{
+    int32_t s24[CONVERT_CHUNK];
+    size_t done;
+    size_t count;
+
+    if (!pcm_convert_supported(src_format, dst_format)) {
+        ALOGE("%s: %#x to %d not supported", __func__, src_format, dst_format);
+        return -EINVAL;
+    }
+
+    if (dst_format == PCM_FORMAT_S24_LE) {
+        switch (src_format) {
+        case AUDIO_FORMAT_PCM_16_BIT:
+            convert_s16_to_s24(dst, src, samples);
+            break;
+        case AUDIO_FORMAT_PCM_8_24_BIT:
+            convert_q8_23_to_s24(dst, src, samples);
+            break;
+        default:
+            convert_float_to_s24(dst, src, samples);
+            break;
+        }
+        return 0;
+    }
+
+    if (src_format == AUDIO_FORMAT_PCM_16_BIT) {
+        if (dst != src) {
+            memcpy(dst, src, samples * sizeof(int16_t));
+        }
+        return 0;
+    }
+
+    for (done = 0; done < samples; done += count) {
+        count = samples - done < CONVERT_CHUNK ? samples - done : CONVERT_CHUNK;
+
+        if (src_format == AUDIO_FORMAT_PCM_8_24_BIT) {
+            convert_q8_23_to_s24(s24, (const int32_t *)src + done, count);
+        } else {
+            convert_float_to_s24(s24, (const float *)src + done, count);
+        }
+        convert_s24_to_s16((int16_t *)dst + done, s24, count, dither);
+    }
+
+    return 0;
+}
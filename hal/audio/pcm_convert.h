@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PCM_CONVERT_H
+#define PCM_CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <system/audio.h>
+#include <tinyalsa/asoundlib.h>
+
+/*
+ * Stream to link sample format conversion.
+ *
+ * Streams are 16 bit, 8.24 (AUDIO_FORMAT_PCM_8_24_BIT, 24 bit in the low
+ * bits of 32 like PCM_FORMAT_S24_LE) or float; links are S16_LE or S24_LE.
+ * Going down to 16 bit, TPDF dither of +/- 1 LSB decorrelates the
+ * truncation error from the signal; without it samples are rounded.
+ */
+struct pcm_dither {
+    bool        enabled;
+    uint32_t    state[4];   /* one generator per NEON lane */
+};
+
+/* Function prototypes */
+void pcm_dither_init(struct pcm_dither *dither, bool enabled);
+
+size_t pcm_convert_sample_size(audio_format_t format);
+
+bool pcm_convert_supported(audio_format_t src_format,
+                           enum pcm_format dst_format);
+
+/* samples is frames times channels, dither may be NULL */
+int pcm_convert(void *dst,
+                enum pcm_format dst_format,
+                const void *src,
+                audio_format_t src_format,
+                size_t samples,
+                struct pcm_dither *dither);
+
+#endif
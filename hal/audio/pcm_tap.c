@@ -0,0 +1,616 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_pcm_tap"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "pcm_tap.h"
+
+#define DRAIN_PERIOD_US 20000
+#define DRAIN_NICE 10
+
+#define WAV_HEADER_BYTES 44
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_IEEE_FLOAT 3
+
+/* Ahead of the data of each chunk in the ring */
+struct tap_chunk {
+    uint32_t    bytes;
+    uint32_t    rate;
+    uint16_t    channels;
+    uint16_t    format;
+};
+
+/* Chunks are split to fit the ring a few times */
+#define MAX_CHUNK_BYTES (PCM_TAP_RING_BYTES / 8)
+
+/* Streams come aligned from their pool, the point goes in the low bits */
+#define KEY_POINT_MASK ((uintptr_t)0x7)
+
+struct tap_file {
+    int                 fd;
+    uint8_t             *map;
+    uint32_t            data_bytes;
+    struct tap_chunk    format;     /* bytes unused */
+    uint32_t            index;
+};
+
+struct pcm_tap {
+    /* (owner | point), 0 if free, claimed with a CAS */
+    uintptr_t           key;
+    uint8_t             *ring;
+    /* owner closed, the drain thread frees the tap once it is empty */
+    bool                released;
+
+    /* producer */
+    uint32_t            head;       /* published with release */
+    uint64_t            chunks;
+    uint64_t            bytes;
+    uint32_t            overruns;
+    int64_t             copy_sum_ns;
+    int64_t             copy_max_ns;
+
+    /* drain thread */
+    uint32_t            tail;       /* published with release */
+    struct tap_file     file;
+    uint32_t            files;
+    uint64_t            bytes_written;
+    uint32_t            write_errors;
+};
+
+static const char * const point_names[PCM_TAP_POINT_COUNT] = {
+    [PCM_TAP_OUT_POST_MUTE] = "out_post_mute",
+    [PCM_TAP_OUT_POST_RESAMPLE] = "out_post_resample",
+    [PCM_TAP_OUT_PRE_PCM] = "out_pre_pcm",
+    [PCM_TAP_IN_POST_PCM] = "in_post_pcm",
+    [PCM_TAP_IN_POST_MUTE] = "in_post_mute",
+};
+
+static const unsigned int format_bytes[] = {
+    [PCM_TAP_S16] = 2,
+    [PCM_TAP_S24_IN_32] = 4,
+    [PCM_TAP_FLOAT] = 4,
+};
+
+/* enable, the drain thread and dump */
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Allocated by the first enable, kept for the life of the process */
+static struct pcm_tap *taps;
+static uint32_t enabled_points;
+/* Writes of points enabled while all taps were taken */
+static uint32_t no_tap;
+
+static pthread_t drain_thread;
+static bool draining;
+
+static int64_t pcm_tap_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct pcm_tap *pcm_tap_get(enum pcm_tap_point point, const void *owner)
+{
+    uintptr_t key = (uintptr_t)owner | point;
+    uintptr_t expected;
+    int i;
+
+    for (i = 0; i < PCM_TAP_MAX; i++) {
+        if (__atomic_load_n(&taps[i].key, __ATOMIC_ACQUIRE) == key) {
+            return &taps[i];
+        }
+    }
+
+    for (i = 0; i < PCM_TAP_MAX; i++) {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&taps[i].key, &expected, key, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return &taps[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void ring_write(struct pcm_tap *tap, uint32_t pos, const void *src, size_t len)
+{
+    size_t offset = pos % PCM_TAP_RING_BYTES;
+    size_t first = PCM_TAP_RING_BYTES - offset;
+
+    if (first >= len) {
+        memcpy(tap->ring + offset, src, len);
+    } else {
+        memcpy(tap->ring + offset, src, first);
+        memcpy(tap->ring, (const uint8_t *)src + first, len - first);
+    }
+}
+
+static void ring_read(const struct pcm_tap *tap, uint32_t pos, void *dst, size_t len)
+{
+    size_t offset = pos % PCM_TAP_RING_BYTES;
+    size_t first = PCM_TAP_RING_BYTES - offset;
+
+    if (first >= len) {
+        memcpy(dst, tap->ring + offset, len);
+    } else {
+        memcpy(dst, tap->ring + offset, first);
+        memcpy((uint8_t *)dst + first, tap->ring, len - first);
+    }
+}
+
+void pcm_tap_write(enum pcm_tap_point point,
+                   const void *owner,
+                   const void *buffer,
+                   size_t bytes,
+                   uint32_t rate,
+                   uint32_t channels,
+                   enum pcm_tap_format format)
+{
+    const uint8_t *src = buffer;
+    struct tap_chunk chunk;
+    struct pcm_tap *tap;
+    uint32_t head;
+    uint32_t tail;
+    size_t frame_bytes = format_bytes[format] * channels;
+    size_t count;
+    int64_t start_ns;
+    int64_t copy_ns;
+
+    if (!(__atomic_load_n(&enabled_points, __ATOMIC_ACQUIRE) & (1u << point)) ||
+        bytes == 0 || frame_bytes == 0) {
+        return;
+    }
+
+    start_ns = pcm_tap_now_ns();
+
+    tap = pcm_tap_get(point, owner);
+    if (tap == NULL) {
+        __atomic_add_fetch(&no_tap, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    chunk.rate = rate;
+    chunk.channels = channels;
+    chunk.format = format;
+
+    head = tap->head;
+    tail = __atomic_load_n(&tap->tail, __ATOMIC_ACQUIRE);
+
+    while (bytes > 0) {
+        count = MAX_CHUNK_BYTES - MAX_CHUNK_BYTES % frame_bytes;
+        if (count > bytes) {
+            count = bytes;
+        }
+
+        if (PCM_TAP_RING_BYTES - (head - tail) < sizeof(chunk) + count) {
+            tap->overruns++;
+            break;
+        }
+
+        chunk.bytes = count;
+        ring_write(tap, head, &chunk, sizeof(chunk));
+        ring_write(tap, head + sizeof(chunk), src, count);
+        head += sizeof(chunk) + count;
+
+        tap->chunks++;
+        tap->bytes += count;
+        src += count;
+        bytes -= count;
+    }
+
+    __atomic_store_n(&tap->head, head, __ATOMIC_RELEASE);
+
+    copy_ns = pcm_tap_now_ns() - start_ns;
+    tap->copy_sum_ns += copy_ns;
+    if (copy_ns > tap->copy_max_ns) {
+        tap->copy_max_ns = copy_ns;
+    }
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void wav_header(uint8_t *p, const struct tap_chunk *format, uint32_t data_bytes)
+{
+    uint32_t sample_bytes = format_bytes[format->format];
+
+    memcpy(p, "RIFF", 4);
+    put_le32(p + 4, 36 + data_bytes);
+    memcpy(p + 8, "WAVEfmt ", 8);
+    put_le32(p + 16, 16);
+    put_le16(p + 20, format->format == PCM_TAP_FLOAT ?
+                     WAV_FORMAT_IEEE_FLOAT : WAV_FORMAT_PCM);
+    put_le16(p + 22, format->channels);
+    put_le32(p + 24, format->rate);
+    put_le32(p + 28, format->rate * format->channels * sample_bytes);
+    put_le16(p + 32, format->channels * sample_bytes);
+    put_le16(p + 34, sample_bytes * 8);
+    memcpy(p + 36, "data", 4);
+    put_le32(p + 40, data_bytes);
+}
+
+static void tap_file_close(struct pcm_tap *tap)
+{
+    struct tap_file *file = &tap->file;
+
+    if (file->map == NULL) {
+        return;
+    }
+
+    wav_header(file->map, &file->format, file->data_bytes);
+    munmap(file->map, PCM_TAP_FILE_BYTES);
+    if (ftruncate(file->fd, WAV_HEADER_BYTES + file->data_bytes) != 0) {
+        tap->write_errors++;
+    }
+    close(file->fd);
+
+    file->map = NULL;
+    file->fd = -1;
+    file->index++;
+}
+
+static int tap_file_open(struct pcm_tap *tap, const struct tap_chunk *format)
+{
+    struct tap_file *file = &tap->file;
+    enum pcm_tap_point point = tap->key & KEY_POINT_MASK;
+    char path[128];
+
+    snprintf(path, sizeof(path), "%s/tap_%s_%d_%u.wav", PCM_TAP_DIR,
+             point_names[point], (int)(tap - taps), file->index % PCM_TAP_FILES);
+
+    file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (file->fd < 0) {
+        ALOGE_IF(tap->write_errors++ == 0, "%s: %s: %s", __func__, path,
+                 strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(file->fd, PCM_TAP_FILE_BYTES) != 0) {
+        goto error;
+    }
+    file->map = mmap(NULL, PCM_TAP_FILE_BYTES, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, file->fd, 0);
+    if (file->map == MAP_FAILED) {
+        file->map = NULL;
+        goto error;
+    }
+
+    file->format = *format;
+    file->data_bytes = 0;
+    tap->files++;
+
+    return 0;
+
+error:
+    ALOGE_IF(tap->write_errors++ == 0, "%s: %s: %s", __func__, path,
+             strerror(errno));
+    close(file->fd);
+    file->fd = -1;
+    return -errno;
+}
+
+/* Into the file, S24 moved to the top of its 32 bits */
+static void tap_file_append(struct pcm_tap *tap, uint32_t pos, uint32_t len)
+{
+    struct tap_file *file = &tap->file;
+    uint8_t *dst = file->map + WAV_HEADER_BYTES + file->data_bytes;
+    int32_t *samples;
+    uint32_t i;
+
+    ring_read(tap, pos, dst, len);
+
+    if (file->format.format == PCM_TAP_S24_IN_32) {
+        samples = (int32_t *)dst;
+        for (i = 0; i < len / sizeof(int32_t); i++) {
+            samples[i] = (int32_t)((uint32_t)samples[i] << 8);
+        }
+    }
+
+    file->data_bytes += len;
+    tap->bytes_written += len;
+}
+
+static void pcm_tap_drain(struct pcm_tap *tap)
+{
+    struct tap_file *file = &tap->file;
+    uint32_t head = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = tap->tail;
+    struct tap_chunk chunk;
+
+    while (tail != head) {
+        ring_read(tap, tail, &chunk, sizeof(chunk));
+        tail += sizeof(chunk);
+
+        if (file->map != NULL &&
+            (chunk.rate != file->format.rate ||
+             chunk.channels != file->format.channels ||
+             chunk.format != file->format.format ||
+             WAV_HEADER_BYTES + file->data_bytes + chunk.bytes > PCM_TAP_FILE_BYTES)) {
+            tap_file_close(tap);
+        }
+        if (file->map == NULL) {
+            tap_file_open(tap, &chunk);
+        }
+        if (file->map != NULL) {
+            tap_file_append(tap, tail, chunk.bytes);
+        }
+
+        tail += chunk.bytes;
+    }
+
+    __atomic_store_n(&tap->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void pcm_tap_reset(struct pcm_tap *tap)
+{
+    uint8_t *ring = tap->ring;
+
+    memset(tap, 0, sizeof(struct pcm_tap));
+    tap->ring = ring;
+    tap->file.fd = -1;
+}
+
+/* Drain thread: the key is the last to go, a writer may claim the tap then */
+static void pcm_tap_free(struct pcm_tap *tap)
+{
+    struct pcm_tap fresh;
+
+    tap_file_close(tap);
+
+    memset(&fresh, 0, sizeof(struct pcm_tap));
+    fresh.key = tap->key;
+    fresh.ring = tap->ring;
+    fresh.file.fd = -1;
+    *tap = fresh;
+
+    __atomic_store_n(&tap->key, 0, __ATOMIC_RELEASE);
+}
+
+static void *pcm_tap_drain_loop(void *arg __unused)
+{
+    bool running = true;
+    int i;
+
+    setpriority(PRIO_PROCESS, 0, DRAIN_NICE);
+
+    while (running) {
+        running = __atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+
+        for (i = 0; i < PCM_TAP_MAX; i++) {
+            if (__atomic_load_n(&taps[i].key, __ATOMIC_ACQUIRE) != 0) {
+                pcm_tap_drain(&taps[i]);
+                if (__atomic_load_n(&taps[i].released, __ATOMIC_ACQUIRE)) {
+                    pcm_tap_free(&taps[i]);
+                }
+            }
+        }
+
+        if (running) {
+            usleep(DRAIN_PERIOD_US);
+        }
+    }
+
+    for (i = 0; i < PCM_TAP_MAX; i++) {
+        tap_file_close(&taps[i]);
+    }
+
+    return NULL;
+}
+
+static int pcm_tap_alloc(void)
+{
+    struct pcm_tap *t = calloc(PCM_TAP_MAX, sizeof(struct pcm_tap));
+    int i;
+
+    if (t == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < PCM_TAP_MAX; i++) {
+        t[i].ring = malloc(PCM_TAP_RING_BYTES);
+        if (t[i].ring == NULL) {
+            while (i-- > 0) {
+                free(t[i].ring);
+            }
+            free(t);
+            return -ENOMEM;
+        }
+    }
+
+    taps = t;
+
+    return 0;
+}
+
+int pcm_tap_enable(uint32_t points)
+{
+    int ret = 0;
+    int i;
+
+    pthread_mutex_lock(&control_lock);
+
+    if (points != 0 && taps == NULL) {
+        ret = pcm_tap_alloc();
+        if (ret != 0) {
+            goto exit;
+        }
+    }
+
+    if (draining) {
+        /* The last chunks of writes in flight may be lost */
+        __atomic_store_n(&enabled_points, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&draining, false, __ATOMIC_RELEASE);
+        pthread_join(drain_thread, NULL);
+    }
+
+    if (points == 0) {
+        goto exit;
+    }
+
+    for (i = 0; i < PCM_TAP_MAX; i++) {
+        pcm_tap_reset(&taps[i]);
+    }
+    no_tap = 0;
+
+    draining = true;
+    ret = -pthread_create(&drain_thread, NULL, pcm_tap_drain_loop, NULL);
+    if (ret != 0) {
+        draining = false;
+        goto exit;
+    }
+    __atomic_store_n(&enabled_points, points, __ATOMIC_RELEASE);
+
+exit:
+    pthread_mutex_unlock(&control_lock);
+
+    ALOGI("%s: points %#x: %d", __func__, points, ret);
+
+    return ret;
+}
+
+void pcm_tap_release(const void *owner)
+{
+    struct pcm_tap *tap;
+    int i;
+
+    pthread_mutex_lock(&control_lock);
+
+    for (i = 0; taps != NULL && i < PCM_TAP_MAX; i++) {
+        tap = &taps[i];
+        if ((__atomic_load_n(&tap->key, __ATOMIC_ACQUIRE) & ~KEY_POINT_MASK) !=
+                (uintptr_t)owner) {
+            continue;
+        }
+
+        if (draining) {
+            __atomic_store_n(&tap->released, true, __ATOMIC_RELEASE);
+        } else {
+            /* Files already closed by the drain thread */
+            pcm_tap_reset(tap);
+        }
+    }
+
+    pthread_mutex_unlock(&control_lock);
+}
+
+int pcm_tap_parse_points(const char *str, size_t len)
+{
+    uint32_t points = 0;
+    const char *end = str + len;
+    const char *name;
+    size_t name_len;
+    int i;
+
+    if (len == 3 && memcmp(str, "off", 3) == 0) {
+        return 0;
+    }
+    if (len == 3 && memcmp(str, "all", 3) == 0) {
+        return (1u << PCM_TAP_POINT_COUNT) - 1;
+    }
+
+    while (str < end) {
+        name = str;
+        while (str < end && *str != ',') {
+            str++;
+        }
+        name_len = str - name;
+        if (str < end) {
+            str++;
+        }
+
+        for (i = 0; i < PCM_TAP_POINT_COUNT; i++) {
+            if (strlen(point_names[i]) == name_len &&
+                memcmp(point_names[i], name, name_len) == 0) {
+                break;
+            }
+        }
+        if (i == PCM_TAP_POINT_COUNT) {
+            ALOGE("%s: unknown point %.*s", __func__, (int)name_len, name);
+            return -EINVAL;
+        }
+        points |= 1u << i;
+    }
+
+    return points;
+}
+
+/* Values of taps being written may be torn */
+void pcm_tap_dump(int fd)
+{
+    uint32_t points = __atomic_load_n(&enabled_points, __ATOMIC_ACQUIRE);
+    const struct pcm_tap *tap;
+    uintptr_t key;
+    int i;
+
+    pthread_mutex_lock(&control_lock);
+
+    if (taps == NULL) {
+        pthread_mutex_unlock(&control_lock);
+        return;
+    }
+
+    dprintf(fd, "  PCM taps: points %#x, %u writes without a tap\n",
+            points, __atomic_load_n(&no_tap, __ATOMIC_RELAXED));
+
+    for (i = 0; i < PCM_TAP_MAX; i++) {
+        tap = &taps[i];
+        key = __atomic_load_n(&tap->key, __ATOMIC_ACQUIRE);
+        if (key == 0) {
+            continue;
+        }
+
+        dprintf(fd, "    %d %s of %#x: %llu chunks, %llu bytes, %u overruns, "
+                "copy avg %lld ns max %lld ns\n",
+                i, point_names[key & KEY_POINT_MASK],
+                (uint32_t)(key & ~KEY_POINT_MASK),
+                (unsigned long long)tap->chunks,
+                (unsigned long long)tap->bytes, tap->overruns,
+                (long long)(tap->chunks > 0 ? tap->copy_sum_ns / (int64_t)tap->chunks : 0),
+                (long long)tap->copy_max_ns);
+        dprintf(fd, "      %u files, %llu bytes written, %u errors\n",
+                tap->files, (unsigned long long)tap->bytes_written,
+                tap->write_errors);
+    }
+
+    pthread_mutex_unlock(&control_lock);
+}
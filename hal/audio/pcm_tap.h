@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PCM_TAP_H
+#define PCM_TAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Copies of the audio at points along the HAL's paths, to WAV files.
+ *
+ * Each enabled point of each stream gets a tap: a single producer ring
+ * the audio thread copies into, without blocking, and that a low priority
+ * thread drains into memory mapped WAV files under PCM_TAP_DIR. A chunk
+ * that does not fit is dropped and counted. A file is closed when it is
+ * full or the format changes, and the next one of PCM_TAP_FILES rotating
+ * names is opened.
+ */
+enum pcm_tap_point {
+    PCM_TAP_OUT_POST_MUTE,      /* written by the client, muted */
+    PCM_TAP_OUT_POST_RESAMPLE,  /* 16 bit at the link rate */
+    PCM_TAP_OUT_PRE_PCM,        /* as written to the link */
+    PCM_TAP_IN_POST_PCM,        /* as read from the link */
+    PCM_TAP_IN_POST_MUTE,       /* as returned to the client */
+    PCM_TAP_POINT_COUNT
+};
+
+enum pcm_tap_format {
+    PCM_TAP_S16,
+    PCM_TAP_S24_IN_32,          /* written as 32 bit */
+    PCM_TAP_FLOAT,
+};
+
+#define PCM_TAP_MAX 6
+#define PCM_TAP_RING_BYTES (512 * 1024)
+#define PCM_TAP_FILE_BYTES (8 * 1024 * 1024)
+#define PCM_TAP_FILES 4
+
+#define PCM_TAP_DIR "/data/misc/audioserver"
+
+/* Function prototypes */
+
+/* points: bitmap of enum pcm_tap_point, 0 stops the taps and closes the files */
+int pcm_tap_enable(uint32_t points);
+
+/* "out_post_mute,in_post_pcm", "all" or "off", returns the bitmap or -EINVAL */
+int pcm_tap_parse_points(const char *str, size_t len);
+
+/*
+ * Audio thread of owner: copies bytes of buffer if point is enabled.
+ * Never blocks.
+ */
+void pcm_tap_write(enum pcm_tap_point point,
+                   const void *owner,
+                   const void *buffer,
+                   size_t bytes,
+                   uint32_t rate,
+                   uint32_t channels,
+                   enum pcm_tap_format format);
+
+/*
+ * owner is closed: its taps are freed once drained. The owner must not
+ * write any more, its memory may come back as another owner.
+ */
+void pcm_tap_release(const void *owner);
+
+/* Per tap: what was copied, dropped, written and the cost on the audio thread */
+void pcm_tap_dump(int fd);
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_watch"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "pcm_watch.h"
+
+/*
+ * A call moves the state from IDLE to ARMED and back. The watchdog thread
+ * takes an overrun call from ARMED to FIRING, stops the PCM and leaves it
+ * FIRED; the call waits for that before it goes back to IDLE, the PCM is
+ * never stopped after the call returned.
+ */
+enum {
+    WATCH_IDLE,
+    WATCH_ARMED,
+    WATCH_FIRING,
+    WATCH_FIRED,
+};
+
+struct recovery_record {
+    const char              *name;
+    bool                    input;
+    int64_t                 fired_ns;
+    int64_t                 stall_ns;       /* blocked until stopped */
+    int64_t                 recovery_ns;    /* stopped until recovered */
+    enum pcm_watch_action   action;
+    int                     result;
+};
+
+static const char * const action_names[PCM_WATCH_ACTION_COUNT] = {
+    [PCM_WATCH_NONE] = "none",
+    [PCM_WATCH_PREPARE] = "prepare",
+    [PCM_WATCH_REOPEN] = "reopen",
+    [PCM_WATCH_REROUTE] = "reroute",
+};
+
+/* Guards the watches and the history, held while stopping a PCM */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_cond = PTHREAD_COND_INITIALIZER;
+static struct pcm_watch *watches[PCM_WATCH_MAX];
+static int attached;
+
+static struct recovery_record history[PCM_WATCH_HISTORY];
+static uint32_t history_count;
+
+static int watch_multiple = PCM_WATCH_MULTIPLE;
+
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static pthread_t watch_thread;
+static bool thread_failed;
+
+static int64_t pcm_watch_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* must be called with watch_lock held */
+static void pcm_watch_check_l(int64_t now_ns)
+{
+    struct pcm_watch *watch;
+    int expected;
+    int i;
+
+    for (i = 0; i < PCM_WATCH_MAX; i++) {
+        watch = watches[i];
+        if (watch == NULL ||
+            __atomic_load_n(&watch->state, __ATOMIC_ACQUIRE) != WATCH_ARMED ||
+            now_ns - __atomic_load_n(&watch->start_ns, __ATOMIC_RELAXED) <
+                    __atomic_load_n(&watch->budget_ns, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        expected = WATCH_ARMED;
+        if (!__atomic_compare_exchange_n(&watch->state, &expected, WATCH_FIRING,
+                                         false, __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        ALOGW("%s: %s %s blocked for %lld ms, stopping the PCM", __func__,
+              watch->name, watch->input ? "read" : "write",
+              (long long)((now_ns - watch->start_ns) / 1000000));
+
+        watch->fired_ns = now_ns;
+        pcm_stop(watch->pcm);
+        __atomic_store_n(&watch->state, WATCH_FIRED, __ATOMIC_RELEASE);
+    }
+}
+
+static void *pcm_watch_loop(void *arg __unused)
+{
+    pthread_mutex_lock(&watch_lock);
+
+    for (;;) {
+        while (attached == 0) {
+            pthread_cond_wait(&watch_cond, &watch_lock);
+        }
+
+        pcm_watch_check_l(pcm_watch_now_ns());
+
+        pthread_mutex_unlock(&watch_lock);
+        usleep(PCM_WATCH_POLL_MS * 1000);
+        pthread_mutex_lock(&watch_lock);
+    }
+
+    return NULL;
+}
+
+static void pcm_watch_start_thread(void)
+{
+    pthread_attr_t attr;
+    int ret;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&watch_thread, &attr, pcm_watch_loop, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        ALOGE("%s: pthread_create failed: %s", __func__, strerror(ret));
+        thread_failed = true;
+    }
+}
+
+void pcm_watch_set_multiple(int multiple)
+{
+    __atomic_store_n(&watch_multiple, multiple > 0 ? multiple : 0,
+                     __ATOMIC_RELAXED);
+}
+
+int pcm_watch_attach(struct pcm_watch *watch, const char *name, bool input)
+{
+    int ret = -ENOSPC;
+    int i;
+
+    if (watch->attached) {
+        return 0;
+    }
+
+    pthread_once(&thread_once, pcm_watch_start_thread);
+    if (thread_failed) {
+        return -EAGAIN;
+    }
+
+    pthread_mutex_lock(&watch_lock);
+
+    for (i = 0; i < PCM_WATCH_MAX; i++) {
+        if (watches[i] == NULL) {
+            watch->name = name;
+            watch->input = input;
+            watch->attached = true;
+            __atomic_store_n(&watch->state, WATCH_IDLE, __ATOMIC_RELAXED);
+            watches[i] = watch;
+            if (attached++ == 0) {
+                pthread_cond_signal(&watch_cond);
+            }
+            ret = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&watch_lock);
+
+    if (ret != 0) {
+        ALOGW("%s: no watch left for %s", __func__, name);
+    }
+
+    return ret;
+}
+
+void pcm_watch_detach(struct pcm_watch *watch)
+{
+    int i;
+
+    if (!watch->attached) {
+        return;
+    }
+
+    pthread_mutex_lock(&watch_lock);
+
+    for (i = 0; i < PCM_WATCH_MAX; i++) {
+        if (watches[i] == watch) {
+            watches[i] = NULL;
+            attached--;
+            break;
+        }
+    }
+    watch->attached = false;
+
+    pthread_mutex_unlock(&watch_lock);
+}
+
+void pcm_watch_begin(struct pcm_watch *watch,
+                     struct pcm *pcm,
+                     size_t frames,
+                     const struct pcm_config *config)
+{
+    int multiple = __atomic_load_n(&watch_multiple, __ATOMIC_RELAXED);
+
+    if (!watch->attached || multiple == 0 || config->rate == 0) {
+        return;
+    }
+
+    if (frames < config->period_size) {
+        frames = config->period_size;
+    }
+
+    watch->pcm = pcm;
+    __atomic_store_n(&watch->budget_ns,
+                     (int64_t)frames * multiple * 1000000000LL / config->rate,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&watch->start_ns, pcm_watch_now_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&watch->state, WATCH_ARMED, __ATOMIC_RELEASE);
+}
+
+enum pcm_watch_action pcm_watch_end(struct pcm_watch *watch)
+{
+    int expected = WATCH_ARMED;
+    int64_t now_ns;
+
+    if (!watch->attached ||
+        __atomic_compare_exchange_n(&watch->state, &expected, WATCH_IDLE,
+                                    false, __ATOMIC_RELEASE,
+                                    __ATOMIC_ACQUIRE) ||
+        expected == WATCH_IDLE) {
+        return PCM_WATCH_NONE;
+    }
+
+    /* Only for as long as pcm_stop() takes */
+    while (__atomic_load_n(&watch->state, __ATOMIC_ACQUIRE) != WATCH_FIRED) {
+        sched_yield();
+    }
+    __atomic_store_n(&watch->state, WATCH_IDLE, __ATOMIC_RELAXED);
+
+    now_ns = pcm_watch_now_ns();
+    if (watch->level != PCM_WATCH_NONE &&
+        now_ns - watch->recovered_ns < PCM_WATCH_ESCALATE_NS) {
+        if (watch->level < PCM_WATCH_REROUTE) {
+            watch->level++;
+        }
+    } else {
+        watch->level = PCM_WATCH_PREPARE;
+    }
+    watch->stalls++;
+
+    return watch->level;
+}
+
+void pcm_watch_recovered(struct pcm_watch *watch,
+                         enum pcm_watch_action action,
+                         int result)
+{
+    struct recovery_record *record;
+    int64_t now_ns = pcm_watch_now_ns();
+    int64_t recovery_ns = now_ns - watch->fired_ns;
+
+    watch->recovered_ns = now_ns;
+    watch->recoveries[action]++;
+    if (result != 0) {
+        watch->failures++;
+    }
+    if (recovery_ns > watch->recovery_max_ns) {
+        watch->recovery_max_ns = recovery_ns;
+    }
+
+    ALOGW("%s: %s %s %s in %lld us", __func__, watch->name,
+          action_names[action], result == 0 ? "done" : "failed",
+          (long long)(recovery_ns / 1000));
+
+    pthread_mutex_lock(&watch_lock);
+
+    record = &history[history_count++ % PCM_WATCH_HISTORY];
+    record->name = watch->name;
+    record->input = watch->input;
+    record->fired_ns = watch->fired_ns;
+    record->stall_ns = watch->fired_ns - watch->start_ns;
+    record->recovery_ns = recovery_ns;
+    record->action = action;
+    record->result = result;
+
+    pthread_mutex_unlock(&watch_lock);
+}
+
+/* Counters of watches in a call may be torn */
+void pcm_watch_dump(int fd)
+{
+    const struct pcm_watch *watch;
+    const struct recovery_record *record;
+    uint32_t count;
+    uint32_t n;
+    int i;
+
+    pthread_mutex_lock(&watch_lock);
+
+    dprintf(fd, "  PCM watchdog: %d x the call duration, %d watched\n",
+            __atomic_load_n(&watch_multiple, __ATOMIC_RELAXED), attached);
+
+    for (i = 0; i < PCM_WATCH_MAX; i++) {
+        watch = watches[i];
+        if (watch == NULL) {
+            continue;
+        }
+
+        dprintf(fd, "    %s %s: %u stalls, %u prepared, %u reopened, "
+                "%u rerouted, %u failed, recovery max %lld us\n",
+                watch->name, watch->input ? "in" : "out", watch->stalls,
+                watch->recoveries[PCM_WATCH_PREPARE],
+                watch->recoveries[PCM_WATCH_REOPEN],
+                watch->recoveries[PCM_WATCH_REROUTE],
+                watch->failures, (long long)(watch->recovery_max_ns / 1000));
+    }
+
+    count = history_count < PCM_WATCH_HISTORY ? history_count : PCM_WATCH_HISTORY;
+    for (n = history_count - count; n < history_count; n++) {
+        record = &history[n % PCM_WATCH_HISTORY];
+        dprintf(fd, "    at %lld ms: %s %s blocked %lld ms, %s %s in %lld us\n",
+                (long long)(record->fired_ns / 1000000), record->name,
+                record->input ? "read" : "write",
+                (long long)(record->stall_ns / 1000000),
+                action_names[record->action],
+                record->result == 0 ? "done" : "failed",
+                (long long)(record->recovery_ns / 1000));
+    }
+
+    pthread_mutex_unlock(&watch_lock);
+}
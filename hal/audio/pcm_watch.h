@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PCM_WATCH_H
+#define PCM_WATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tinyalsa/asoundlib.h>
+
+/*
+ * Watchdog of the calls blocking on a PCM.
+ *
+ * If the DMA of the codec stalls, pcm_write() and pcm_read() never return
+ * and the stream mutex they are called with is held forever, which takes
+ * AudioFlinger and every routing change down with it. Each open PCM has a
+ * watch; a call is given a multiple of the time the frames it moves
+ * should take, at least a period. A thread checks the calls in progress
+ * every PCM_WATCH_POLL_MS and stops the PCM of one that overran, which
+ * makes the call return with an error.
+ *
+ * The thread that made the call then recovers the PCM, in its own context
+ * and with its own locks: the first stall prepares it again, a stall within
+ * PCM_WATCH_ESCALATE_NS of the last recovery takes the next step, reopening
+ * it and then applying the route again. Each recovery is recorded with how
+ * long the call had blocked and how long it took to play again.
+ */
+enum pcm_watch_action {
+    PCM_WATCH_NONE,
+    PCM_WATCH_PREPARE,          /* pcm_prepare() the stopped PCM */
+    PCM_WATCH_REOPEN,           /* close and open it again */
+    PCM_WATCH_REROUTE,          /* reopen and apply the mixer paths again */
+    PCM_WATCH_ACTION_COUNT
+};
+
+#define PCM_WATCH_MULTIPLE 4        /* persist.audio.pcm_watchdog, 0 to disable */
+#define PCM_WATCH_POLL_MS 50
+#define PCM_WATCH_ESCALATE_NS 10000000000LL
+#define PCM_WATCH_MAX 8
+#define PCM_WATCH_HISTORY 16
+
+struct pcm_watch {
+    const char      *name;
+    bool            attached;
+    bool            input;
+
+    /* Of the call in progress, published by state */
+    struct pcm      *pcm;
+    int64_t         start_ns;
+    int64_t         budget_ns;
+    int             state;
+    int64_t         fired_ns;
+
+    /* Thread of the calls only */
+    enum pcm_watch_action level;
+    int64_t         recovered_ns;   /* end of the last recovery */
+    uint32_t        stalls;
+    uint32_t        recoveries[PCM_WATCH_ACTION_COUNT];
+    uint32_t        failures;
+    int64_t         recovery_max_ns;
+};
+
+/* Function prototypes */
+
+/* multiple: of the duration of a call it may block for, 0 disables the watchdog */
+void pcm_watch_set_multiple(int multiple);
+
+/* Before the first call on the PCM, starts the watchdog thread if needed */
+int pcm_watch_attach(struct pcm_watch *watch, const char *name, bool input);
+
+/* Before the PCM is closed, the watch is left idle */
+void pcm_watch_detach(struct pcm_watch *watch);
+
+void pcm_watch_begin(struct pcm_watch *watch,
+                     struct pcm *pcm,
+                     size_t frames,
+                     const struct pcm_config *config);
+
+/* Returns what to do if the watchdog stopped the PCM during the call */
+enum pcm_watch_action pcm_watch_end(struct pcm_watch *watch);
+
+/* result: of the recovery, 0 or a negative errno */
+void pcm_watch_recovered(struct pcm_watch *watch,
+                         enum pcm_watch_action action,
+                         int result);
+
+/* Per watch: stalls, recoveries and their time, then the last recoveries */
+void pcm_watch_dump(int fd);
+
+#endif
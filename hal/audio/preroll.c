@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_preroll"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "pcm_watch.h"
+#include "preroll.h"
+#include "rate_conv.h"
+#include "thread_mgr.h"
+
+struct preroll {
+    uint32_t                link_rate;
+    uint32_t                link_channels;
+
+    /* link to PREROLL_RATE mono, one period at a time */
+    struct rate_conv        *down;
+    int16_t                 *read_buf;
+    int16_t                 *conv_buf;
+    size_t                  conv_frames;
+
+    /* Frames written and served so far, the ring holds the last ring_frames */
+    int16_t                 *ring;
+    size_t                  ring_frames;
+    uint64_t                wr;
+    uint64_t                rd;
+
+    /* Armed: the thread owns pcm and writes the ring */
+    struct pcm              *pcm;
+    struct pcm_config       config;
+    pthread_t               thread;
+    bool                    running;
+    struct pcm_watch        watch;
+    int64_t                 armed_start_ns;
+
+    /* Taken: the input reads the ring, through up unless at PREROLL_RATE */
+    bool                    taken;
+    struct rate_conv        *up;
+    uint32_t                out_rate;
+    uint32_t                out_channels;
+
+    pthread_mutex_t         stats_lock;
+    struct preroll_stats    stats;
+};
+
+static int64_t preroll_now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void preroll_ring_write(struct preroll *preroll,
+                               const int16_t *frames,
+                               size_t count)
+{
+    size_t pos;
+    size_t n;
+
+    if (count > preroll->ring_frames) {
+        frames += count - preroll->ring_frames;
+        preroll->wr += count - preroll->ring_frames;
+        count = preroll->ring_frames;
+    }
+
+    while (count > 0) {
+        pos = preroll->wr % preroll->ring_frames;
+        n = count < preroll->ring_frames - pos ? count : preroll->ring_frames - pos;
+        memcpy(preroll->ring + pos, frames, n * sizeof(int16_t));
+        preroll->wr += n;
+        frames += n;
+        count -= n;
+    }
+}
+
+static void *preroll_loop(void *arg)
+{
+    struct preroll *preroll = arg;
+    size_t bytes = pcm_frames_to_bytes(preroll->pcm, preroll->config.period_size);
+    int64_t period_us = preroll->config.period_size * 1000000LL /
+                        preroll->config.rate;
+    enum pcm_watch_action action;
+    size_t in_frames;
+    size_t out_frames;
+    int64_t cpu_base_ns;
+    int ret;
+
+    pthread_mutex_lock(&preroll->stats_lock);
+    cpu_base_ns = preroll->stats.cpu_ns;
+    pthread_mutex_unlock(&preroll->stats_lock);
+
+    while (__atomic_load_n(&preroll->running, __ATOMIC_ACQUIRE)) {
+        thread_mgr_enter(THREAD_ROLE_BACKGROUND);
+
+        pcm_watch_begin(&preroll->watch, preroll->pcm,
+                        preroll->config.period_size, &preroll->config);
+        ret = pcm_read(preroll->pcm, preroll->read_buf, bytes);
+        action = pcm_watch_end(&preroll->watch);
+        if (action != PCM_WATCH_NONE) {
+            /* the PCM and its route are the caller's, preparing is all we can do */
+            pcm_watch_recovered(&preroll->watch, PCM_WATCH_PREPARE,
+                                pcm_prepare(preroll->pcm));
+        }
+
+        if (ret != 0) {
+            ALOGV("%s: pcm_read error %d", __func__, ret);
+            pthread_mutex_lock(&preroll->stats_lock);
+            preroll->stats.read_errors++;
+            pthread_mutex_unlock(&preroll->stats_lock);
+            usleep(period_us);
+            continue;
+        }
+
+        in_frames = preroll->config.period_size;
+        out_frames = preroll->conv_frames;
+        rate_conv_process(preroll->down, preroll->read_buf, &in_frames,
+                          preroll->conv_buf, &out_frames);
+        preroll_ring_write(preroll, preroll->conv_buf, out_frames);
+
+        pthread_mutex_lock(&preroll->stats_lock);
+        preroll->stats.reads++;
+        preroll->stats.cpu_ns = cpu_base_ns +
+                                preroll_now_ns(CLOCK_THREAD_CPUTIME_ID);
+        pthread_mutex_unlock(&preroll->stats_lock);
+    }
+
+    return NULL;
+}
+
+struct preroll *preroll_create(unsigned int seconds,
+                               uint32_t link_rate,
+                               uint32_t link_channels)
+{
+    struct preroll *preroll;
+
+    if (seconds == 0 || seconds > PREROLL_MAX_SECONDS ||
+        !rate_conv_supported(link_rate, PREROLL_RATE)) {
+        return NULL;
+    }
+
+    preroll = calloc(1, sizeof(struct preroll));
+    if (preroll == NULL) {
+        return NULL;
+    }
+
+    preroll->link_rate = link_rate;
+    preroll->link_channels = link_channels;
+    preroll->ring_frames = seconds * PREROLL_RATE;
+    preroll->down = rate_conv_create(link_rate, PREROLL_RATE, link_channels, 1);
+    if (preroll->down != NULL) {
+        preroll->conv_frames = rate_conv_out_frames(preroll->down,
+                                                    PREROLL_PERIOD_SIZE) + 1;
+    }
+    preroll->read_buf = malloc(PREROLL_PERIOD_SIZE * link_channels * sizeof(int16_t));
+    preroll->conv_buf = malloc(preroll->conv_frames * sizeof(int16_t));
+    preroll->ring = malloc(preroll->ring_frames * sizeof(int16_t));
+    pthread_mutex_init(&preroll->stats_lock, NULL);
+
+    if (preroll->down == NULL || preroll->read_buf == NULL ||
+        preroll->conv_buf == NULL || preroll->ring == NULL) {
+        preroll_destroy(preroll);
+        return NULL;
+    }
+
+    return preroll;
+}
+
+void preroll_destroy(struct preroll *preroll)
+{
+    struct pcm *pcm;
+
+    if (preroll == NULL) {
+        return;
+    }
+
+    pcm = preroll_stop(preroll);
+    if (pcm != NULL) {
+        pcm_close(pcm);
+    }
+
+    rate_conv_destroy(preroll->down);
+    rate_conv_destroy(preroll->up);
+    free(preroll->read_buf);
+    free(preroll->conv_buf);
+    free(preroll->ring);
+    pthread_mutex_destroy(&preroll->stats_lock);
+    free(preroll);
+}
+
+int preroll_start(struct preroll *preroll,
+                  struct pcm *pcm,
+                  const struct pcm_config *config)
+{
+    int ret;
+
+    if (preroll->pcm != NULL) {
+        return -EBUSY;
+    }
+    if (config->rate != preroll->link_rate ||
+        config->channels != preroll->link_channels ||
+        config->format != PCM_FORMAT_S16_LE ||
+        config->period_size > PREROLL_PERIOD_SIZE) {
+        return -EINVAL;
+    }
+
+    /* What the ring held is not contiguous with what comes now */
+    preroll->wr = 0;
+    preroll->rd = 0;
+    preroll->taken = false;
+    rate_conv_reset(preroll->down);
+
+    preroll->pcm = pcm;
+    preroll->config = *config;
+    __atomic_store_n(&preroll->running, true, __ATOMIC_RELEASE);
+    pcm_watch_attach(&preroll->watch, "preroll", true);
+
+    ret = -pthread_create(&preroll->thread, NULL, preroll_loop, preroll);
+    if (ret != 0) {
+        ALOGE("%s: pthread_create failed: %s", __func__, strerror(-ret));
+        pcm_watch_detach(&preroll->watch);
+        __atomic_store_n(&preroll->running, false, __ATOMIC_RELEASE);
+        preroll->pcm = NULL;
+        return ret;
+    }
+
+    pthread_mutex_lock(&preroll->stats_lock);
+    preroll->armed_start_ns = preroll_now_ns(CLOCK_MONOTONIC);
+    pthread_mutex_unlock(&preroll->stats_lock);
+
+    ALOGV("%s: %u x %u frames", __func__, config->period_count,
+          config->period_size);
+
+    return 0;
+}
+
+struct pcm *preroll_stop(struct preroll *preroll)
+{
+    struct pcm *pcm = preroll->pcm;
+
+    if (pcm == NULL) {
+        return NULL;
+    }
+
+    /* pcm_read() returns within a period, or is stopped by the watchdog */
+    __atomic_store_n(&preroll->running, false, __ATOMIC_RELEASE);
+    pthread_join(preroll->thread, NULL);
+    pcm_watch_detach(&preroll->watch);
+    preroll->pcm = NULL;
+
+    pthread_mutex_lock(&preroll->stats_lock);
+    preroll->stats.armed_ns += preroll_now_ns(CLOCK_MONOTONIC) -
+                               preroll->armed_start_ns;
+    preroll->armed_start_ns = 0;
+    pthread_mutex_unlock(&preroll->stats_lock);
+
+    return pcm;
+}
+
+bool preroll_armed(const struct preroll *preroll)
+{
+    return preroll->pcm != NULL;
+}
+
+struct pcm *preroll_take(struct preroll *preroll,
+                         unsigned int offset_ms,
+                         uint32_t rate,
+                         uint32_t channels,
+                         struct pcm_config *config)
+{
+    int64_t start_ns = preroll_now_ns(CLOCK_MONOTONIC);
+    uint64_t frames = (uint64_t)offset_ms * PREROLL_RATE / 1000;
+    int64_t handoff_ns;
+    struct pcm *pcm;
+
+    *config = preroll->config;
+    pcm = preroll_stop(preroll);
+    if (pcm == NULL) {
+        return NULL;
+    }
+
+    if (rate != PREROLL_RATE &&
+        (preroll->up == NULL || preroll->out_rate != rate ||
+         preroll->out_channels != channels)) {
+        rate_conv_destroy(preroll->up);
+        preroll->up = rate_conv_supported(PREROLL_RATE, rate) ?
+                      rate_conv_create(PREROLL_RATE, rate, 1, channels) : NULL;
+    }
+    if (preroll->up != NULL) {
+        rate_conv_reset(preroll->up);
+    }
+    preroll->out_rate = rate;
+    preroll->out_channels = channels;
+
+    /* Only what the ring still holds, nothing if it cannot be converted */
+    if (frames > preroll->wr) {
+        frames = preroll->wr;
+    }
+    if (frames > preroll->ring_frames) {
+        frames = preroll->ring_frames;
+    }
+    if (rate != PREROLL_RATE && preroll->up == NULL) {
+        frames = 0;
+    }
+    preroll->rd = preroll->wr - frames;
+    preroll->taken = true;
+
+    handoff_ns = preroll_now_ns(CLOCK_MONOTONIC) - start_ns;
+
+    pthread_mutex_lock(&preroll->stats_lock);
+    preroll->stats.handoffs++;
+    preroll->stats.handoff_sum_ns += handoff_ns;
+    if (handoff_ns > preroll->stats.handoff_max_ns) {
+        preroll->stats.handoff_max_ns = handoff_ns;
+    }
+    pthread_mutex_unlock(&preroll->stats_lock);
+
+    ALOGV("%s: %llu frames of pre-roll, handoff in %lld us", __func__,
+          (unsigned long long)frames, (long long)(handoff_ns / 1000));
+
+    return pcm;
+}
+
+size_t preroll_pending(const struct preroll *preroll)
+{
+    if (!preroll->taken) {
+        return 0;
+    }
+
+    return (size_t)((preroll->wr - preroll->rd) * preroll->out_rate / PREROLL_RATE);
+}
+
+size_t preroll_read(struct preroll *preroll, int16_t *buffer, size_t frames)
+{
+    size_t served = 0;
+    size_t pos;
+    size_t avail;
+    size_t in_frames;
+    size_t out_frames;
+    size_t i;
+    uint32_t c;
+
+    if (!preroll->taken) {
+        return 0;
+    }
+
+    while (served < frames && preroll->rd < preroll->wr) {
+        pos = preroll->rd % preroll->ring_frames;
+        avail = preroll->wr - preroll->rd;
+        if (avail > preroll->ring_frames - pos) {
+            avail = preroll->ring_frames - pos;
+        }
+
+        if (preroll->up == NULL) {
+            in_frames = avail < frames - served ? avail : frames - served;
+            for (i = 0; i < in_frames; i++) {
+                for (c = 0; c < preroll->out_channels; c++) {
+                    buffer[(served + i) * preroll->out_channels + c] =
+                            preroll->ring[pos + i];
+                }
+            }
+            out_frames = in_frames;
+        } else {
+            in_frames = avail;
+            out_frames = frames - served;
+            rate_conv_process(preroll->up, preroll->ring + pos, &in_frames,
+                              buffer + served * preroll->out_channels,
+                              &out_frames);
+            if (in_frames == 0 && out_frames == 0) {
+                break;
+            }
+        }
+
+        preroll->rd += in_frames;
+        served += out_frames;
+    }
+
+    if (served > 0) {
+        pthread_mutex_lock(&preroll->stats_lock);
+        preroll->stats.frames_served += served;
+        pthread_mutex_unlock(&preroll->stats_lock);
+    }
+
+    return served;
+}
+
+void preroll_account_start(struct preroll *preroll, bool taken, int64_t ns)
+{
+    pthread_mutex_lock(&preroll->stats_lock);
+    if (taken) {
+        preroll->stats.taken++;
+        preroll->stats.take_sum_ns += ns;
+    } else {
+        preroll->stats.opened++;
+        preroll->stats.open_sum_ns += ns;
+    }
+    pthread_mutex_unlock(&preroll->stats_lock);
+}
+
+void preroll_get_stats(const struct preroll *preroll, struct preroll_stats *stats)
+{
+    pthread_mutex_lock((pthread_mutex_t *)&preroll->stats_lock);
+    *stats = preroll->stats;
+    if (preroll->armed_start_ns != 0) {
+        stats->armed_ns += preroll_now_ns(CLOCK_MONOTONIC) -
+                           preroll->armed_start_ns;
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)&preroll->stats_lock);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PREROLL_H
+#define PREROLL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tinyalsa/asoundlib.h>
+
+/*
+ * Pre-roll of the main mic, for inputs that must not miss what was said
+ * just before they started (voice assistants, the camcorder).
+ *
+ * While armed, a thread of its own keeps the capture PCM running with long
+ * periods and keeps what it reads, downmixed to mono at PREROLL_RATE, in
+ * a ring of the last few seconds. An input starting on the same PCM takes
+ * it over still running: the thread stops after its current period, what
+ * it had not read yet stays queued in the kernel for the input, and the
+ * input first gets the ring from the offset it asked for, converted to its
+ * rate and channels. Nothing is lost or repeated between the two.
+ *
+ * The thread runs in the capture role of thread_mgr, and its reads are
+ * watched by pcm_watch: a stalled read is stopped and the PCM prepared
+ * again, so that preroll_stop(), called with the hw device mutex held,
+ * never waits on the codec for longer than the watchdog allows.
+ *
+ * The PCM and its route are owned by the caller, see preroll_start() and
+ * preroll_take(). The ring is allocated in preroll_create(), the converter
+ * to the rate of the input when it takes over.
+ */
+struct preroll;
+
+#define PREROLL_RATE 16000
+#define PREROLL_MAX_SECONDS 10
+
+/* 4 x 40 ms at 48 kHz, the thread wakes up 25 times a second */
+#define PREROLL_PERIOD_SIZE 1920
+#define PREROLL_PERIOD_COUNT 4
+
+struct preroll_stats {
+    int64_t     armed_ns;           /* total, including the current arming */
+    uint64_t    reads;              /* wakeups of the thread */
+    int64_t     cpu_ns;             /* of the thread */
+    uint32_t    read_errors;        /* overruns are retried by tinyalsa */
+    uint32_t    handoffs;
+    int64_t     handoff_sum_ns;     /* preroll_take(), waiting for the thread */
+    int64_t     handoff_max_ns;
+    uint64_t    frames_served;      /* at the rates of the inputs */
+    /* start of the inputs, opening the PCM or taking it over */
+    uint32_t    opened;
+    int64_t     open_sum_ns;
+    uint32_t    taken;
+    int64_t     take_sum_ns;
+};
+
+/* Function prototypes */
+struct preroll *preroll_create(unsigned int seconds,
+                               uint32_t link_rate,
+                               uint32_t link_channels);
+
+void preroll_destroy(struct preroll *preroll);
+
+/* Starts keeping the ring from pcm, opened by the caller with link rate and channels */
+int preroll_start(struct preroll *preroll,
+                  struct pcm *pcm,
+                  const struct pcm_config *config);
+
+/* Stops the thread, returns the PCM for the caller to close */
+struct pcm *preroll_stop(struct preroll *preroll);
+
+bool preroll_armed(const struct preroll *preroll);
+
+/*
+ * Stops the thread and hands its PCM over, running. The input then gets up
+ * to offset_ms of the ring from preroll_read(), at rate and with channels
+ * (no pre-roll if the rate cannot be converted to). config: of the PCM.
+ */
+struct pcm *preroll_take(struct preroll *preroll,
+                         unsigned int offset_ms,
+                         uint32_t rate,
+                         uint32_t channels,
+                         struct pcm_config *config);
+
+/* Frames of the ring the input has not read yet, at its rate */
+size_t preroll_pending(const struct preroll *preroll);
+
+/* Returns the frames written to buffer, 0 once the pre-roll is over */
+size_t preroll_read(struct preroll *preroll, int16_t *buffer, size_t frames);
+
+/* Time an input took to start, taken: whether it took the PCM over */
+void preroll_account_start(struct preroll *preroll, bool taken, int64_t ns);
+
+void preroll_get_stats(const struct preroll *preroll, struct preroll_stats *stats);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_rate_conv"
+/*#define LOG_NDEBUG 0*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include <cutils/log.h>
+
+#include "rate_conv.h"
+
+#define RATE_CONV_MAX_RATIO 6
+
+/* Zero crossings of the sinc on each side, counted at the low rate */
+#define RATE_CONV_ZEROS 8
+
+/* Passband edge relative to the low rate Nyquist frequency */
+#define RATE_CONV_PASSBAND 0.9f
+
+/* Samples appended to the history before it is moved back */
+#define RATE_CONV_HIST_FRAMES 256
+
+struct rate_conv {
+    uint32_t in_rate;
+    uint32_t out_rate;
+    uint32_t in_channels;
+    uint32_t out_channels;
+    uint32_t ratio;
+    bool     up;
+
+    /*
+     * Decimation: one reversed filter of win taps at the input rate.
+     * Interpolation: ratio reversed phases of win taps each.
+     */
+    float    *coefs;
+    size_t   win;
+
+    float    *hist;  /* win + RATE_CONV_HIST_FRAMES */
+    size_t   wr;
+
+    uint32_t phase;
+    bool     pending; /* interpolation: phases left for the last input */
+};
+
+static uint32_t rate_conv_ratio(uint32_t in_rate, uint32_t out_rate)
+{
+    uint32_t hi = in_rate > out_rate ? in_rate : out_rate;
+    uint32_t lo = in_rate > out_rate ? out_rate : in_rate;
+
+    if (lo == 0 || hi == lo || hi % lo != 0 || hi / lo > RATE_CONV_MAX_RATIO) {
+        return 0;
+    }
+
+    return hi / lo;
+}
+
+bool rate_conv_supported(uint32_t in_rate, uint32_t out_rate)
+{
+    return rate_conv_ratio(in_rate, out_rate) != 0;
+}
+
+/* Windowed sinc lowpass at the high rate, n taps, dc gain of gain */
+static void rate_conv_design(float *h, size_t n, uint32_t ratio, float gain)
+{
+    float fc = RATE_CONV_PASSBAND * 0.5f / (float)ratio;
+    float center = (float)(n - 1) / 2.0f;
+    float sum = 0.0f;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        float t = (float)i - center;
+        float sinc = (t == 0.0f) ?
+                     2.0f * fc :
+                     sinf(2.0f * (float)M_PI * fc * t) / ((float)M_PI * t);
+        float window = 0.42f -
+                       0.5f * cosf(2.0f * (float)M_PI * i / (float)(n - 1)) +
+                       0.08f * cosf(4.0f * (float)M_PI * i / (float)(n - 1));
+
+        h[i] = sinc * window;
+        sum += h[i];
+    }
+
+    for (i = 0; i < n; i++) {
+        h[i] *= gain / sum;
+    }
+}
+
+struct rate_conv *rate_conv_create(uint32_t in_rate,
+                                   uint32_t out_rate,
+                                   uint32_t in_channels,
+                                   uint32_t out_channels)
+{
+    struct rate_conv *conv;
+    uint32_t ratio = rate_conv_ratio(in_rate, out_rate);
+    size_t taps;
+    float *h;
+    size_t p;
+    size_t k;
+
+    if (ratio == 0 ||
+        in_channels == 0 || in_channels > 2 ||
+        out_channels == 0 || out_channels > 2) {
+        ALOGE("%s: unsupported %u/%u -> %u/%u", __func__,
+              in_rate, in_channels, out_rate, out_channels);
+        return NULL;
+    }
+
+    conv = calloc(1, sizeof(struct rate_conv));
+    if (conv == NULL) {
+        return NULL;
+    }
+
+    conv->in_rate = in_rate;
+    conv->in_channels = in_channels;
+    conv->out_rate = out_rate;
+    conv->out_channels = out_channels;
+    conv->ratio = ratio;
+    conv->up = out_rate > in_rate;
+
+    /* A multiple of 4 taps per phase */
+    taps = 2 * RATE_CONV_ZEROS * ratio;
+    conv->win = conv->up ? taps / ratio : taps;
+
+    h = malloc(taps * sizeof(float));
+    conv->coefs = malloc(taps * sizeof(float));
+    conv->hist = malloc((conv->win + RATE_CONV_HIST_FRAMES) * sizeof(float));
+    if (h == NULL || conv->coefs == NULL || conv->hist == NULL) {
+        free(h);
+        rate_conv_destroy(conv);
+        return NULL;
+    }
+
+    if (conv->up) {
+        /* Each phase of the zero stuffed input keeps unity gain */
+        rate_conv_design(h, taps, ratio, (float)ratio);
+        for (p = 0; p < ratio; p++) {
+            for (k = 0; k < conv->win; k++) {
+                conv->coefs[p * conv->win + k] =
+                        h[(conv->win - 1 - k) * ratio + p];
+            }
+        }
+    } else {
+        rate_conv_design(h, taps, ratio, 1.0f);
+        for (k = 0; k < taps; k++) {
+            conv->coefs[k] = h[taps - 1 - k];
+        }
+    }
+    free(h);
+
+    rate_conv_reset(conv);
+
+    ALOGV("%s: %u -> %u, ratio %u, %zu taps", __func__,
+          in_rate, out_rate, ratio, taps);
+
+    return conv;
+}
+
+void rate_conv_destroy(struct rate_conv *conv)
+{
+    if (conv == NULL) {
+        return;
+    }
+
+    free(conv->coefs);
+    free(conv->hist);
+    free(conv);
+}
+
+void rate_conv_reset(struct rate_conv *conv)
+{
+    memset(conv->hist, 0, conv->win * sizeof(float));
+    conv->wr = conv->win;
+    conv->phase = 0;
+    conv->pending = false;
+}
+
+size_t rate_conv_in_frames(const struct rate_conv *conv, size_t out_frames)
+{
+    if (conv->up) {
+        return (out_frames + conv->ratio - 1) / conv->ratio;
+    }
+
+    return out_frames * conv->ratio;
+}
+
+size_t rate_conv_out_frames(const struct rate_conv *conv, size_t in_frames)
+{
+    if (conv->up) {
+        return in_frames * conv->ratio;
+    }
+
+    return (in_frames + conv->ratio - 1) / conv->ratio;
+}
+
+static float rate_conv_dot(const float *a, const float *b, size_t n)
+{
+    float sum = 0.0f;
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    float32x2_t s;
+
+    for (; i + 4 <= n; i += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+
+    s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    s = vpadd_f32(s, s);
+    sum = vget_lane_f32(s, 0);
+#endif
+
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+
+    return sum;
+}
+
+static inline void rate_conv_push(struct rate_conv *conv, const int16_t *frame)
+{
+    float sample = frame[0];
+
+    if (conv->in_channels == 2) {
+        sample = 0.5f * (sample + frame[1]);
+    }
+
+    if (conv->wr == conv->win + RATE_CONV_HIST_FRAMES) {
+        memmove(conv->hist,
+                conv->hist + RATE_CONV_HIST_FRAMES,
+                conv->win * sizeof(float));
+        conv->wr = conv->win;
+    }
+
+    conv->hist[conv->wr++] = sample;
+}
+
+static inline void rate_conv_store(struct rate_conv *conv,
+                                   int16_t *frame,
+                                   const float *coefs)
+{
+    float sample = rate_conv_dot(coefs, conv->hist + conv->wr - conv->win,
+                                 conv->win);
+    int16_t value;
+
+    if (sample > 32767.0f) {
+        value = 32767;
+    } else if (sample < -32768.0f) {
+        value = -32768;
+    } else {
+        value = (int16_t)lrintf(sample);
+    }
+
+    frame[0] = value;
+    if (conv->out_channels == 2) {
+        frame[1] = value;
+    }
+}
+
+void rate_conv_process(struct rate_conv *conv,
+                       const int16_t *in,
+                       size_t *in_frames,
+                       int16_t *out,
+                       size_t *out_frames)
+{
+    size_t i = 0;
+    size_t o = 0;
+
+    if (conv->up) {
+        for (;;) {
+            while (conv->pending && o < *out_frames) {
+                rate_conv_store(conv, out + o * conv->out_channels,
+                                conv->coefs + conv->phase * conv->win);
+                o++;
+                if (++conv->phase == conv->ratio) {
+                    conv->phase = 0;
+                    conv->pending = false;
+                }
+            }
+
+            if (conv->pending || i == *in_frames) {
+                break;
+            }
+
+            rate_conv_push(conv, in + i * conv->in_channels);
+            conv->pending = true;
+            i++;
+        }
+    } else {
+        while (i < *in_frames) {
+            /* The next input completes an output, keep it for later */
+            if (conv->phase == conv->ratio - 1 && o == *out_frames) {
+                break;
+            }
+
+            rate_conv_push(conv, in + i * conv->in_channels);
+            i++;
+
+            if (++conv->phase == conv->ratio) {
+                conv->phase = 0;
+                rate_conv_store(conv, out + o * conv->out_channels, conv->coefs);
+                o++;
+            }
+        }
+    }
+
+    *in_frames = i;
+    *out_frames = o;
+}
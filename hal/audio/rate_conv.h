@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RATE_CONV_H
+#define RATE_CONV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fixed integer ratio sample rate converter for the SCO link, e.g.
+ * 48 kHz <-> 16 kHz (mSBC) or 48 kHz <-> 8 kHz (CVSD).
+ *
+ * SCO only carries voice, so the converter filters a single channel: the
+ * input is downmixed to mono and the output is copied to every channel.
+ * The filter is a windowed sinc designed at creation, run as a polyphase
+ * FIR for interpolation. Nothing is allocated after rate_conv_create().
+ */
+struct rate_conv;
+
+/* Function prototypes */
+bool rate_conv_supported(uint32_t in_rate, uint32_t out_rate);
+
+struct rate_conv *rate_conv_create(uint32_t in_rate,
+                                   uint32_t out_rate,
+                                   uint32_t in_channels,
+                                   uint32_t out_channels);
+
+void rate_conv_destroy(struct rate_conv *conv);
+
+void rate_conv_reset(struct rate_conv *conv);
+
+/* Input frames needed to produce out_frames */
+size_t rate_conv_in_frames(const struct rate_conv *conv, size_t out_frames);
+
+/* Output frames produced from in_frames, at most */
+size_t rate_conv_out_frames(const struct rate_conv *conv, size_t in_frames);
+
+/*
+ * Consumes up to *in_frames and produces up to *out_frames, both are
+ * updated with what was actually done.
+ */
+void rate_conv_process(struct rate_conv *conv,
+                       const int16_t *in,
+                       size_t *in_frames,
+                       int16_t *out,
+                       size_t *out_frames);
+
+#endif
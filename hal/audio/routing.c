@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_routing"
+/*#define LOG_NDEBUG 0*/
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <cutils/log.h>
+
+#include "routing.h"
+
+/*
+ * Every device bit the decisions below look at gets its own bit in the
+ * table key, all other bits of the mask fold into one. The decisions treat
+ * all of those alike, so a table entry stands for every mask of its key.
+ */
+#define ROUTE_OUT_MASK (AUDIO_DEVICE_OUT_EARPIECE | \
+                        AUDIO_DEVICE_OUT_SPEAKER | \
+                        AUDIO_DEVICE_OUT_WIRED_HEADSET | \
+                        AUDIO_DEVICE_OUT_WIRED_HEADPHONE | \
+                        AUDIO_DEVICE_OUT_ALL_SCO)
+#define ROUTE_OUT_OTHER (ROUTE_OUT_MASK + 1)
+#define ROUTE_OUT_KEYS (ROUTE_OUT_OTHER << 1)
+/* stands for the folded bits when filling the tables */
+#define ROUTE_OUT_OTHER_DEVICE AUDIO_DEVICE_OUT_AUX_DIGITAL
+
+#define ROUTE_IN_MASK ((AUDIO_DEVICE_IN_COMMUNICATION | \
+                        AUDIO_DEVICE_IN_AMBIENT | \
+                        AUDIO_DEVICE_IN_BUILTIN_MIC | \
+                        AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET | \
+                        AUDIO_DEVICE_IN_WIRED_HEADSET | \
+                        AUDIO_DEVICE_IN_AUX_DIGITAL | \
+                        AUDIO_DEVICE_IN_VOICE_CALL | \
+                        AUDIO_DEVICE_IN_BACK_MIC) & ~AUDIO_DEVICE_BIT_IN)
+#define ROUTE_IN_OTHER (ROUTE_IN_MASK + 1)
+#define ROUTE_IN_KEYS (ROUTE_IN_OTHER << 1)
+#define ROUTE_IN_OTHER_DEVICE (AUDIO_DEVICE_IN_ANLG_DOCK_HEADSET & ~AUDIO_DEVICE_BIT_IN)
+
+enum {
+    ROUTE_OUT_NORMAL,
+    ROUTE_OUT_CALL,
+    ROUTE_OUT_CALL_WB,
+    ROUTE_OUT_STATES
+};
+
+/* snd_device_t values, all of them fit */
+static uint8_t out_routes[ROUTE_OUT_STATES][ROUTE_OUT_KEYS];
+/* input devices of a call by its output devices, NONE to route as below */
+static uint8_t call_in_routes[ROUTE_OUT_KEYS];
+/* by the input devices, NONE to route by the output devices */
+static uint8_t in_routes[ROUTE_IN_KEYS];
+static uint8_t in_by_out_routes[ROUTE_OUT_KEYS];
+
+static pthread_once_t routes_once = PTHREAD_ONCE_INIT;
+
+static inline unsigned int out_key(audio_devices_t devices)
+{
+    return (devices & ROUTE_OUT_MASK) | ((devices & ~ROUTE_OUT_MASK) ? ROUTE_OUT_OTHER : 0);
+}
+
+static inline unsigned int in_key(audio_devices_t devices)
+{
+    devices &= ~AUDIO_DEVICE_BIT_IN;
+
+    return (devices & ROUTE_IN_MASK) | ((devices & ~ROUTE_IN_MASK) ? ROUTE_IN_OTHER : 0);
+}
+
+static audio_devices_t out_key_devices(unsigned int key)
+{
+    return (key & ROUTE_OUT_MASK) | ((key & ROUTE_OUT_OTHER) ? ROUTE_OUT_OTHER_DEVICE : 0);
+}
+
+static audio_devices_t in_key_devices(unsigned int key)
+{
+    return (key & ROUTE_IN_MASK) | ((key & ROUTE_IN_OTHER) ? ROUTE_IN_OTHER_DEVICE : 0);
+}
+
+/*
+ * The routing decisions themselves, only run to fill the tables. devices
+ * never has AUDIO_DEVICE_BIT_IN set here.
+ */
+static snd_device_t decide_output(bool in_call, bool wb_amr, audio_devices_t devices)
+{
+    if (devices == AUDIO_DEVICE_NONE) {
+        return SND_DEVICE_NONE;
+    }
+
+    if (in_call) {
+        if (devices & (AUDIO_DEVICE_OUT_WIRED_HEADPHONE |
+                       AUDIO_DEVICE_OUT_WIRED_HEADSET)) {
+            return wb_amr ? SND_DEVICE_OUT_VOICE_HEADPHONES_WB :
+                            SND_DEVICE_OUT_VOICE_HEADPHONES;
+        } else if (devices & AUDIO_DEVICE_OUT_SPEAKER) {
+            return wb_amr ? SND_DEVICE_OUT_VOICE_SPEAKER_WB :
+                            SND_DEVICE_OUT_VOICE_SPEAKER;
+        } else if (devices & AUDIO_DEVICE_OUT_EARPIECE) {
+            return wb_amr ? SND_DEVICE_OUT_VOICE_EARPIECE_WB :
+                            SND_DEVICE_OUT_VOICE_EARPIECE;
+        } else if (devices & AUDIO_DEVICE_OUT_ALL_SCO) {
+            return SND_DEVICE_OUT_BT_SCO;
+        }
+    }
+
+    if (__builtin_popcount(devices) == 2) {
+        if (devices == (AUDIO_DEVICE_OUT_WIRED_HEADPHONE | AUDIO_DEVICE_OUT_SPEAKER) ||
+            devices == (AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_SPEAKER)) {
+            return SND_DEVICE_OUT_SPEAKER_AND_HEADPHONES;
+        }
+        return SND_DEVICE_NONE;
+    }
+
+    if (__builtin_popcount(devices) != 1) {
+        return SND_DEVICE_NONE;
+    }
+
+    if (devices & (AUDIO_DEVICE_OUT_WIRED_HEADPHONE | AUDIO_DEVICE_OUT_WIRED_HEADSET)) {
+        return SND_DEVICE_OUT_HEADPHONES;
+    } else if (devices & AUDIO_DEVICE_OUT_SPEAKER) {
+        return SND_DEVICE_OUT_SPEAKER;
+    } else if (devices & AUDIO_DEVICE_OUT_EARPIECE) {
+        return SND_DEVICE_OUT_EARPIECE;
+    } else if (devices & AUDIO_DEVICE_OUT_ALL_SCO) {
+        return SND_DEVICE_OUT_BT_SCO;
+    }
+
+    return SND_DEVICE_NONE;
+}
+
+static snd_device_t decide_call_input(audio_devices_t out_device)
+{
+    if (out_device & (AUDIO_DEVICE_OUT_EARPIECE | AUDIO_DEVICE_OUT_WIRED_HEADPHONE)) {
+        return SND_DEVICE_IN_EARPIECE_MIC;
+    } else if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
+        return SND_DEVICE_IN_VOICE_HEADSET_MIC;
+    } else if (out_device & AUDIO_DEVICE_OUT_SPEAKER) {
+        return SND_DEVICE_IN_VOICE_SPEAKER_MIC;
+    } else if (out_device & AUDIO_DEVICE_OUT_ALL_SCO) {
+        return SND_DEVICE_IN_BT_SCO_MIC;
+    }
+
+    return SND_DEVICE_NONE;
+}
+
+/* in_device without AUDIO_DEVICE_BIT_IN */
+static snd_device_t decide_input(audio_devices_t in_device)
+{
+    if (in_device == AUDIO_DEVICE_NONE ||
+        in_device & (AUDIO_DEVICE_IN_VOICE_CALL & ~AUDIO_DEVICE_BIT_IN) ||
+        in_device & (AUDIO_DEVICE_IN_COMMUNICATION & ~AUDIO_DEVICE_BIT_IN)) {
+        return SND_DEVICE_NONE;
+    }
+
+    if (in_device & AUDIO_DEVICE_IN_BUILTIN_MIC) {
+        return SND_DEVICE_IN_EARPIECE_MIC;
+    } else if (in_device & AUDIO_DEVICE_IN_BACK_MIC) {
+        return SND_DEVICE_IN_SPEAKER_MIC;
+    } else if (in_device & AUDIO_DEVICE_IN_WIRED_HEADSET) {
+        return SND_DEVICE_IN_HEADSET_MIC;
+    } else if (in_device & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
+        return SND_DEVICE_IN_BT_SCO_MIC;
+    } else if (in_device & AUDIO_DEVICE_IN_AUX_DIGITAL) {
+        return SND_DEVICE_IN_HDMI_MIC;
+    }
+
+    /* Unknown input devices, the handset mic */
+    return SND_DEVICE_IN_EARPIECE_MIC;
+}
+
+static snd_device_t decide_input_by_output(audio_devices_t out_device)
+{
+    if (out_device & AUDIO_DEVICE_OUT_EARPIECE) {
+        return SND_DEVICE_IN_EARPIECE_MIC;
+    } else if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
+        return SND_DEVICE_IN_HEADSET_MIC;
+    } else if (out_device & AUDIO_DEVICE_OUT_SPEAKER) {
+        return SND_DEVICE_IN_SPEAKER_MIC;
+    } else if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
+        return SND_DEVICE_IN_EARPIECE_MIC;
+    } else if (out_device & AUDIO_DEVICE_OUT_BLUETOOTH_SCO_HEADSET) {
+        return SND_DEVICE_IN_BT_SCO_MIC;
+    }
+
+    /* Unknown output devices, the handset mic */
+    return SND_DEVICE_IN_EARPIECE_MIC;
+}
+
+static void routing_fill_tables(void)
+{
+    unsigned int key;
+
+    for (key = 0; key < ROUTE_OUT_KEYS; key++) {
+        audio_devices_t devices = out_key_devices(key);
+
+        out_routes[ROUTE_OUT_NORMAL][key] = decide_output(false, false, devices);
+        out_routes[ROUTE_OUT_CALL][key] = decide_output(true, false, devices);
+        out_routes[ROUTE_OUT_CALL_WB][key] = decide_output(true, true, devices);
+        call_in_routes[key] = decide_call_input(devices);
+        in_by_out_routes[key] = decide_input_by_output(devices);
+    }
+
+    for (key = 0; key < ROUTE_IN_KEYS; key++) {
+        in_routes[key] = decide_input(in_key_devices(key));
+    }
+}
+
+void routing_init(void)
+{
+    pthread_once(&routes_once, routing_fill_tables);
+}
+
+snd_device_t routing_output_snd_device(bool in_call, bool wb_amr,
+                                       audio_devices_t devices)
+{
+    snd_device_t snd_device;
+
+    if (devices & AUDIO_DEVICE_BIT_IN) {
+        ALOGV("%s: Invalid output devices (%#x)", __func__, devices);
+        return SND_DEVICE_NONE;
+    }
+
+    snd_device = out_routes[in_call ? (wb_amr ? ROUTE_OUT_CALL_WB : ROUTE_OUT_CALL) :
+                                      ROUTE_OUT_NORMAL][out_key(devices)];
+
+    ALOGE_IF(snd_device == SND_DEVICE_NONE && devices != AUDIO_DEVICE_NONE,
+             "%s: Invalid output devices(%#x)", __func__, devices);
+
+    return snd_device;
+}
+
+snd_device_t routing_input_snd_device(bool in_call,
+                                      audio_devices_t out_device,
+                                      audio_devices_t in_device,
+                                      audio_source_t source,
+                                      bool two_mic)
+{
+    snd_device_t snd_device;
+
+    in_device &= ~AUDIO_DEVICE_BIT_IN;
+
+    if (in_call) {
+        if (out_device == AUDIO_DEVICE_NONE) {
+            ALOGE("%s: No output device set for voice call", __func__);
+            return SND_DEVICE_NONE;
+        }
+        snd_device = call_in_routes[out_key(out_device)];
+        if (snd_device != SND_DEVICE_NONE) {
+            return snd_device;
+        }
+    } else if (two_mic) {
+        /* Raw front/back capture or the HAL noise reduction */
+        return SND_DEVICE_IN_TWO_MIC;
+    } else {
+        switch (source) {
+        case AUDIO_SOURCE_DEFAULT:
+            return SND_DEVICE_NONE;
+        case AUDIO_SOURCE_CAMCORDER:
+            if (in_device & (AUDIO_DEVICE_IN_BUILTIN_MIC | AUDIO_DEVICE_IN_BACK_MIC)) {
+                return SND_DEVICE_IN_CAMCORDER_MIC;
+            }
+            break;
+        case AUDIO_SOURCE_VOICE_COMMUNICATION:
+        case AUDIO_SOURCE_MIC:
+            if (out_device & AUDIO_DEVICE_OUT_SPEAKER) {
+                in_device = AUDIO_DEVICE_IN_BACK_MIC & ~AUDIO_DEVICE_BIT_IN;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    snd_device = in_routes[in_key(in_device)];
+    if (snd_device == SND_DEVICE_NONE) {
+        snd_device = in_by_out_routes[out_key(out_device)];
+    }
+
+    return snd_device;
+}
@@ -19,6 +19,12 @@
 #ifndef _AUDIO_ROUTING_H_
 #define _AUDIO_ROUTING_H_
 
+#include <stdbool.h>
+
+#include <system/audio.h>
+
+typedef int snd_device_t;
+
 enum {
     SND_DEVICE_NONE = 0,
 
@@ -60,6 +66,8 @@ enum {
     SND_DEVICE_IN_CAMCORDER_MIC,
     SND_DEVICE_IN_VOICE_REC_HEADSET_MIC,
     SND_DEVICE_IN_VOICE_REC_MIC,
+    SND_DEVICE_IN_VOICE_CALL_REC,
+    SND_DEVICE_IN_TWO_MIC,
     SND_DEVICE_IN_END,
 
     SND_DEVICE_MAX = SND_DEVICE_IN_END,
@@ -74,11 +82,11 @@ static const char * const device_table[SND_DEVICE_MAX] = {
     [SND_DEVICE_OUT_HEADPHONES] = "headphones",
     [SND_DEVICE_OUT_SPEAKER_AND_HEADPHONES] = "speaker-and-headphones",
     [SND_DEVICE_OUT_VOICE_EARPIECE] = "voice-earpiece",
-    [SND_DEVICE_OUT_VOICE_EARPIECE] = "voice-earpiece-wb",
+    [SND_DEVICE_OUT_VOICE_EARPIECE_WB] = "voice-earpiece-wb",
     [SND_DEVICE_OUT_VOICE_SPEAKER] = "voice-speaker",
-    [SND_DEVICE_OUT_VOICE_SPEAKER] = "voice-speaker-wb",
+    [SND_DEVICE_OUT_VOICE_SPEAKER_WB] = "voice-speaker-wb",
     [SND_DEVICE_OUT_VOICE_HEADPHONES] = "voice-headphones",
-    [SND_DEVICE_OUT_VOICE_HEADPHONES] = "voice-headphones-wb",
+    [SND_DEVICE_OUT_VOICE_HEADPHONES_WB] = "voice-headphones-wb",
     [SND_DEVICE_OUT_HDMI] = "hdmi",
     [SND_DEVICE_OUT_SPEAKER_AND_HDMI] = "speaker-and-hdmi",
     [SND_DEVICE_OUT_BT_SCO] = "bt-sco-headset",
@@ -95,6 +103,26 @@ static const char * const device_table[SND_DEVICE_MAX] = {
     [SND_DEVICE_IN_CAMCORDER_MIC] = "camcorder-mic",
     [SND_DEVICE_IN_VOICE_REC_HEADSET_MIC] = "voice-rec-headset-mic",
     [SND_DEVICE_IN_VOICE_REC_MIC] = "voice-rec-mic",
+    [SND_DEVICE_IN_VOICE_CALL_REC] = "incall-record",
+    [SND_DEVICE_IN_TWO_MIC] = "two-mic",
 };
 
+/*
+ * Sound device selection, looked up in tables filled once by routing_init()
+ * from every combination of the device bits it depends on.
+ */
+
+/* Function prototypes */
+void routing_init(void);
+
+snd_device_t routing_output_snd_device(bool in_call, bool wb_amr,
+                                       audio_devices_t devices);
+
+/* two_mic: front/back capture or the HAL noise reduction is active */
+snd_device_t routing_input_snd_device(bool in_call,
+                                      audio_devices_t out_device,
+                                      audio_devices_t in_device,
+                                      audio_source_t source,
+                                      bool two_mic);
+
 #endif /* _AUDIO_ROUTING_H */
@@ -0,0 +1,688 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_spk_prot"
+/*#define LOG_NDEBUG 0*/
+
+#include <fcntl.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "spk_prot.h"
+
+#define S16_SCALE (1.0f / 32768.0f)
+#define Q8_23_SCALE (1.0f / 8388608.0f)
+#define S24_MAX 8388607
+#define S24_MIN (-8388608)
+
+/* 20 * log10(x) = DB_PER_LOG2 * log2(x) */
+#define DB_PER_LOG2 6.0205999f
+
+#define BUTTERWORTH_Q 0.70710678f
+
+struct band_tuning {
+    float   threshold_db;
+    float   ratio;
+    float   attack_ms;
+    float   release_ms;
+    float   makeup_db;
+};
+
+struct route_tuning {
+    const char          *name;
+    float               crossover_hz[SPK_PROT_BANDS - 1];
+    struct band_tuning  bands[SPK_PROT_BANDS];
+    float               ceiling_db;
+    float               release_ms;
+};
+
+/*
+ * The low band holds back the excursion of the cone, the mid band carries
+ * the level, the high band is kept gentle not to sound harsh.
+ */
+static const struct route_tuning tunings[SPK_PROT_ROUTE_COUNT] = {
+    [SPK_PROT_ROUTE_NONE] = {
+        .name = "none",
+    },
+    [SPK_PROT_ROUTE_MEDIA] = {
+        .name = "media",
+        .crossover_hz = { 300.0f, 4000.0f },
+        .bands = {
+            { -22.0f, 4.0f, 10.0f, 200.0f, 2.0f },
+            { -16.0f, 2.0f, 5.0f, 120.0f, 3.0f },
+            { -14.0f, 2.0f, 2.0f, 80.0f, 2.0f },
+        },
+        .ceiling_db = -1.0f,
+        .release_ms = 60.0f,
+    },
+    /* voice band only, more level in the mids for intelligibility */
+    [SPK_PROT_ROUTE_VOICE] = {
+        .name = "voice",
+        .crossover_hz = { 500.0f, 3500.0f },
+        .bands = {
+            { -28.0f, 6.0f, 5.0f, 150.0f, 0.0f },
+            { -20.0f, 3.0f, 3.0f, 100.0f, 4.0f },
+            { -18.0f, 2.0f, 2.0f, 80.0f, 3.0f },
+        },
+        .ceiling_db = -1.5f,
+        .release_ms = 40.0f,
+    },
+};
+
+static const char * const cluster_names[SPK_PROT_CLUSTERS] = {
+    "LITTLE", "big"
+};
+
+/* Of the first CPU of each cluster, for the cycles per block */
+static const char * const cluster_max_freq_paths[SPK_PROT_CLUSTERS] = {
+    "/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq",
+    "/sys/devices/system/cpu/cpu4/cpufreq/cpuinfo_max_freq",
+};
+
+/* Per sub-block, from a time constant */
+static float smoothing(float ms, uint32_t rate)
+{
+    return 1.0f - expf(-(float)SPK_PROT_SUBBLOCK_FRAMES * 1000.0f / (ms * rate));
+}
+
+enum biquad_type {
+    BIQUAD_LOWPASS,
+    BIQUAD_HIGHPASS,
+    BIQUAD_ALLPASS,
+    BIQUAD_PASS,
+};
+
+/* RBJ cookbook, on the lanes [first, first + 2) */
+static void biquad4_design(struct spk_prot_biquad4 *bq,
+                           int first,
+                           enum biquad_type type,
+                           float hz,
+                           uint32_t rate)
+{
+    float w0 = 2.0f * (float)M_PI * hz / rate;
+    float cosw = cosf(w0);
+    float alpha = sinf(w0) / (2.0f * BUTTERWORTH_Q);
+    float a0 = 1.0f + alpha;
+    float b0, b1, b2, a1, a2;
+    int i;
+
+    switch (type) {
+    case BIQUAD_LOWPASS:
+        b0 = (1.0f - cosw) / 2.0f;
+        b1 = 1.0f - cosw;
+        b2 = b0;
+        break;
+    case BIQUAD_HIGHPASS:
+        b0 = (1.0f + cosw) / 2.0f;
+        b1 = -(1.0f + cosw);
+        b2 = b0;
+        break;
+    case BIQUAD_ALLPASS:
+        b0 = 1.0f - alpha;
+        b1 = -2.0f * cosw;
+        b2 = 1.0f + alpha;
+        break;
+    default:
+        b0 = a0;
+        b1 = b2 = 0.0f;
+        break;
+    }
+
+    if (type == BIQUAD_PASS) {
+        a1 = a2 = 0.0f;
+    } else {
+        a1 = -2.0f * cosw;
+        a2 = 1.0f - alpha;
+    }
+
+    for (i = first; i < first + 2; i++) {
+        bq->b0[i] = b0 / a0;
+        bq->b1[i] = b1 / a0;
+        bq->b2[i] = b2 / a0;
+        bq->a1[i] = a1 / a0;
+        bq->a2[i] = a2 / a0;
+    }
+}
+
+/* In place, frames of four lanes */
+static void biquad4_process(struct spk_prot_biquad4 *bq, float *buf, size_t frames)
+{
+    size_t i;
+
+#ifdef __ARM_NEON__
+    const float32x4_t b0 = vld1q_f32(bq->b0);
+    const float32x4_t b1 = vld1q_f32(bq->b1);
+    const float32x4_t b2 = vld1q_f32(bq->b2);
+    const float32x4_t a1 = vld1q_f32(bq->a1);
+    const float32x4_t a2 = vld1q_f32(bq->a2);
+    float32x4_t z1 = vld1q_f32(bq->z1);
+    float32x4_t z2 = vld1q_f32(bq->z2);
+
+    for (i = 0; i < frames; i++) {
+        float32x4_t x = vld1q_f32(buf + i * 4);
+        float32x4_t y = vmlaq_f32(z1, b0, x);
+
+        z1 = vmlsq_f32(vmlaq_f32(z2, b1, x), a1, y);
+        z2 = vmlsq_f32(vmulq_f32(b2, x), a2, y);
+        vst1q_f32(buf + i * 4, y);
+    }
+
+    vst1q_f32(bq->z1, z1);
+    vst1q_f32(bq->z2, z2);
+#else
+    int lane;
+
+    for (i = 0; i < frames; i++) {
+        for (lane = 0; lane < 4; lane++) {
+            float x = buf[i * 4 + lane];
+            float y = bq->b0[lane] * x + bq->z1[lane];
+
+            bq->z1[lane] = bq->b1[lane] * x - bq->a1[lane] * y + bq->z2[lane];
+            bq->z2[lane] = bq->b2[lane] * x - bq->a2[lane] * y;
+            buf[i * 4 + lane] = y;
+        }
+    }
+#endif
+}
+
+/* Largest magnitude in each lane */
+static void peak4(const float *buf, size_t frames, float peaks[4])
+{
+    size_t i;
+
+#ifdef __ARM_NEON__
+    float32x4_t m = vdupq_n_f32(0.0f);
+
+    for (i = 0; i < frames; i++) {
+        m = vmaxq_f32(m, vabsq_f32(vld1q_f32(buf + i * 4)));
+    }
+    vst1q_f32(peaks, m);
+#else
+    int lane;
+
+    peaks[0] = peaks[1] = peaks[2] = peaks[3] = 0.0f;
+    for (i = 0; i < frames; i++) {
+        for (lane = 0; lane < 4; lane++) {
+            float x = fabsf(buf[i * 4 + lane]);
+
+            if (x > peaks[lane]) {
+                peaks[lane] = x;
+            }
+        }
+    }
+#endif
+}
+
+static void spk_prot_load_tuning(struct spk_prot *prot)
+{
+    const struct route_tuning *tuning = &tunings[prot->route];
+    const float *hz = tuning->crossover_hz;
+    uint32_t rate = prot->rate;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        biquad4_design(&prot->split_low[i], 0, BIQUAD_LOWPASS, hz[0], rate);
+        biquad4_design(&prot->split_low[i], 2, BIQUAD_HIGHPASS, hz[0], rate);
+        biquad4_design(&prot->split_high[i], 0, BIQUAD_LOWPASS, hz[1], rate);
+        biquad4_design(&prot->split_high[i], 2, BIQUAD_HIGHPASS, hz[1], rate);
+    }
+    /* the mid and high bands go through the f2 split, the low band matches its phase */
+    biquad4_design(&prot->allpass, 0, BIQUAD_ALLPASS, hz[1], rate);
+    biquad4_design(&prot->allpass, 2, BIQUAD_PASS, hz[1], rate);
+
+    for (i = 0; i < SPK_PROT_BANDS; i++) {
+        const struct band_tuning *band = &tuning->bands[i];
+
+        prot->bands[i].attack = smoothing(band->attack_ms, rate);
+        prot->bands[i].release = smoothing(band->release_ms, rate);
+        prot->bands[i].threshold_db = band->threshold_db;
+        prot->bands[i].slope = 1.0f - 1.0f / band->ratio;
+        prot->bands[i].makeup_db = band->makeup_db;
+    }
+
+    prot->ceiling = exp2f(tuning->ceiling_db / DB_PER_LOG2);
+    prot->limiter_release = smoothing(tuning->release_ms, rate);
+}
+
+void spk_prot_init(struct spk_prot *prot)
+{
+    memset(prot, 0, sizeof(*prot));
+    spk_prot_reset(prot);
+}
+
+void spk_prot_set_route(struct spk_prot *prot,
+                        enum spk_prot_route route,
+                        uint32_t rate)
+{
+    if (route == prot->route && rate == prot->rate) {
+        return;
+    }
+
+    ALOGV("%s: %s at %u Hz", __func__, tunings[route].name, rate);
+
+    prot->route = route;
+    prot->rate = rate;
+    prot->limiter_only = false;
+    prot->overruns = 0;
+    if (route != SPK_PROT_ROUTE_NONE && rate > 0) {
+        spk_prot_load_tuning(prot);
+    }
+    spk_prot_reset(prot);
+}
+
+void spk_prot_reset(struct spk_prot *prot)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        memset(prot->split_low[i].z1, 0, sizeof(prot->split_low[i].z1));
+        memset(prot->split_low[i].z2, 0, sizeof(prot->split_low[i].z2));
+        memset(prot->split_high[i].z1, 0, sizeof(prot->split_high[i].z1));
+        memset(prot->split_high[i].z2, 0, sizeof(prot->split_high[i].z2));
+    }
+    memset(prot->allpass.z1, 0, sizeof(prot->allpass.z1));
+    memset(prot->allpass.z2, 0, sizeof(prot->allpass.z2));
+
+    for (i = 0; i < SPK_PROT_BANDS; i++) {
+        prot->bands[i].env = 0.0f;
+        prot->bands[i].gain = exp2f(prot->bands[i].makeup_db / DB_PER_LOG2);
+    }
+
+    prot->limiter_gain = 1.0f;
+    for (i = 0; i <= SPK_PROT_LOOKAHEAD_BLOCKS; i++) {
+        prot->allowed[i] = 1.0f;
+    }
+    memset(prot->delay, 0, sizeof(prot->delay));
+    prot->delay_pos = 0;
+    memset(prot->ready, 0, sizeof(prot->ready));
+    prot->fill = 0;
+}
+
+static void load_frames(float *dst, const void *src, audio_format_t format,
+                        size_t frames)
+{
+    size_t i;
+
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        for (i = 0; i < frames * 2; i++) {
+            dst[i] = ((const int16_t *)src)[i] * S16_SCALE;
+        }
+        break;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        for (i = 0; i < frames * 2; i++) {
+            dst[i] = ((const int32_t *)src)[i] * Q8_23_SCALE;
+        }
+        break;
+    default:
+        memcpy(dst, src, frames * 2 * sizeof(float));
+        break;
+    }
+}
+
+/* The limiter holds the samples under the ceiling, clamping only rounds */
+static void store_frames(void *dst, const float *src, audio_format_t format,
+                         size_t frames)
+{
+    size_t i = 0;
+
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+#ifdef __ARM_NEON__
+        for (; i + 8 <= frames * 2; i += 8) {
+            int32x4_t a = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(src + i), 32768.0f));
+            int32x4_t b = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(src + i + 4), 32768.0f));
+
+            vst1q_s16((int16_t *)dst + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+        }
+#endif
+        for (; i < frames * 2; i++) {
+            int32_t x = (int32_t)(src[i] * 32768.0f);
+
+            ((int16_t *)dst)[i] = x > INT16_MAX ? INT16_MAX :
+                                  (x < INT16_MIN ? INT16_MIN : x);
+        }
+        break;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        for (; i < frames * 2; i++) {
+            int32_t x = (int32_t)(src[i] * 8388608.0f);
+
+            ((int32_t *)dst)[i] = x > S24_MAX ? S24_MAX : (x < S24_MIN ? S24_MIN : x);
+        }
+        break;
+    default:
+        memcpy(dst, src, frames * 2 * sizeof(float));
+        break;
+    }
+}
+
+/* Gain of a band for the peak of the sub-block, makeup included */
+static float band_gain(struct spk_prot_band *band, float peak)
+{
+    float level_db;
+    float gain_db = band->makeup_db;
+
+    band->env += (peak > band->env ? band->attack : band->release) *
+                 (peak - band->env);
+
+    level_db = DB_PER_LOG2 * log2f(band->env + 1e-9f);
+    if (level_db > band->threshold_db) {
+        gain_db -= (level_db - band->threshold_db) * band->slope;
+    }
+
+    return exp2f(gain_db / DB_PER_LOG2);
+}
+
+/* Splits prot->io in three bands, compresses each and sums them back */
+static void spk_prot_compress(struct spk_prot *prot)
+{
+    const size_t frames = SPK_PROT_SUBBLOCK_FRAMES;
+    float *low = prot->low;
+    float *high = prot->high;
+    float *io = prot->io;
+    float start[SPK_PROT_BANDS];
+    float step[SPK_PROT_BANDS];
+    float low_peaks[4];
+    float high_peaks[4];
+    float gain;
+    size_t i;
+    int b;
+
+    /* [L R L R] split in [low L, low R, rest L, rest R] */
+    for (i = 0; i < frames; i++) {
+        low[i * 4] = low[i * 4 + 2] = io[i * 2];
+        low[i * 4 + 1] = low[i * 4 + 3] = io[i * 2 + 1];
+    }
+    biquad4_process(&prot->split_low[0], low, frames);
+    biquad4_process(&prot->split_low[1], low, frames);
+    biquad4_process(&prot->allpass, low, frames);
+
+    /* [rest L, rest R] twice, split in [mid L, mid R, high L, high R] */
+    for (i = 0; i < frames; i++) {
+        high[i * 4] = high[i * 4 + 2] = low[i * 4 + 2];
+        high[i * 4 + 1] = high[i * 4 + 3] = low[i * 4 + 3];
+    }
+    biquad4_process(&prot->split_high[0], high, frames);
+    biquad4_process(&prot->split_high[1], high, frames);
+
+    /* one gain per band, the channels are linked */
+    peak4(low, frames, low_peaks);
+    peak4(high, frames, high_peaks);
+    for (b = 0; b < SPK_PROT_BANDS; b++) {
+        const float *peaks = b == 0 ? low_peaks : high_peaks;
+        int lane = b == 2 ? 2 : 0;
+        float peak = fmaxf(peaks[lane], peaks[lane + 1]);
+
+        gain = band_gain(&prot->bands[b], peak);
+        start[b] = prot->bands[b].gain;
+        step[b] = (gain - start[b]) / frames;
+        prot->bands[b].gain = gain;
+    }
+
+#ifdef __ARM_NEON__
+    {
+        float32x4_t g_high = { start[1], start[1], start[2], start[2] };
+        float32x4_t d_high = { step[1], step[1], step[2], step[2] };
+        float32x2_t g_low = vdup_n_f32(start[0]);
+        float32x2_t d_low = vdup_n_f32(step[0]);
+
+        for (i = 0; i < frames; i++) {
+            float32x4_t h;
+            float32x2_t y;
+
+            g_high = vaddq_f32(g_high, d_high);
+            g_low = vadd_f32(g_low, d_low);
+            h = vmulq_f32(vld1q_f32(high + i * 4), g_high);
+            y = vmla_f32(vadd_f32(vget_low_f32(h), vget_high_f32(h)),
+                         vld1_f32(low + i * 4), g_low);
+            vst1_f32(io + i * 2, y);
+        }
+    }
+#else
+    for (i = 0; i < frames; i++) {
+        float gl = start[0] + step[0] * (i + 1);
+        float gm = start[1] + step[1] * (i + 1);
+        float gh = start[2] + step[2] * (i + 1);
+
+        io[i * 2] = gl * low[i * 4] + gm * high[i * 4] + gh * high[i * 4 + 2];
+        io[i * 2 + 1] = gl * low[i * 4 + 1] + gm * high[i * 4 + 1] +
+                        gh * high[i * 4 + 3];
+    }
+#endif
+}
+
+/*
+ * The sub-block in prot->io goes into the delay line and the one that comes
+ * out replaces it. The gain at both ends of the sub-block that comes out is
+ * at most what its peak allows, and at most what the peaks behind it allow
+ * once ramped to over the sub-blocks in between.
+ */
+static void spk_prot_limit(struct spk_prot *prot)
+{
+    const size_t frames = SPK_PROT_SUBBLOCK_FRAMES;
+    float *delayed = prot->delay[prot->delay_pos];
+    float *io = prot->io;
+    float peaks[4];
+    float peak;
+    float start = prot->limiter_gain;
+    float gain;
+    float bound;
+    float step;
+    float x;
+    size_t i;
+    int m;
+
+    /* two frames at a time, both channels in the lanes */
+    peak4(io, frames / 2, peaks);
+    peak = fmaxf(fmaxf(peaks[0], peaks[1]), fmaxf(peaks[2], peaks[3]));
+
+    memmove(prot->allowed, prot->allowed + 1,
+            SPK_PROT_LOOKAHEAD_BLOCKS * sizeof(prot->allowed[0]));
+    prot->allowed[SPK_PROT_LOOKAHEAD_BLOCKS] =
+            peak > prot->ceiling ? prot->ceiling / peak : 1.0f;
+
+    gain = start + prot->limiter_release * (1.0f - start);
+    for (m = 0; m <= SPK_PROT_LOOKAHEAD_BLOCKS; m++) {
+        float allowed = prot->allowed[m];
+
+        bound = allowed + (1.0f - allowed) * (m > 0 ? m - 1 : 0) /
+                          SPK_PROT_LOOKAHEAD_BLOCKS;
+        if (bound < gain) {
+            gain = bound;
+        }
+    }
+    if (gain < 1.0f) {
+        prot->limited++;
+    }
+    prot->limiter_gain = gain;
+    step = (gain - start) / frames;
+
+    for (i = 0; i < frames; i++) {
+        start += step;
+        x = delayed[i * 2];
+        delayed[i * 2] = io[i * 2];
+        io[i * 2] = x * start;
+        x = delayed[i * 2 + 1];
+        delayed[i * 2 + 1] = io[i * 2 + 1];
+        io[i * 2 + 1] = x * start;
+    }
+
+    prot->delay_pos = (prot->delay_pos + 1) % SPK_PROT_LOOKAHEAD_BLOCKS;
+}
+
+static int64_t spk_prot_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void spk_prot_account(struct spk_prot *prot, int64_t ns, size_t frames)
+{
+    int cpu = sched_getcpu();
+    int cluster = cpu >= 4 ? 1 : 0;
+    int64_t block_ns = ns * SPK_PROT_BLOCK_FRAMES / (int64_t)frames;
+
+    prot->cost[cluster].frames += frames;
+    prot->cost[cluster].ns_sum += ns;
+    if (block_ns > prot->cost[cluster].ns_max) {
+        prot->cost[cluster].ns_max = block_ns;
+    }
+
+    if (block_ns <= SPK_PROT_BUDGET_NS) {
+        prot->overruns = 0;
+    } else if (++prot->overruns >= SPK_PROT_MAX_OVERRUNS && !prot->limiter_only) {
+        ALOGW("%s: %lld us per block on CPU %d, over budget, limiter only",
+              __func__, (long long)(block_ns / 1000), cpu);
+        prot->limiter_only = true;
+    }
+}
+
+bool spk_prot_process(struct spk_prot *prot,
+                      const void *in,
+                      void *out,
+                      audio_format_t format,
+                      size_t frames)
+{
+    const uint8_t *src = in;
+    uint8_t *dst = out;
+    size_t frame_size;
+    int64_t start_ns;
+    size_t count;
+    size_t i;
+
+    if (prot->route == SPK_PROT_ROUTE_NONE) {
+        return false;
+    }
+
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        frame_size = 2 * sizeof(int16_t);
+        break;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+    case AUDIO_FORMAT_PCM_FLOAT:
+        frame_size = 2 * sizeof(int32_t);
+        break;
+    default:
+        frame_size = 0;
+        break;
+    }
+
+    if (frame_size == 0 || frames == 0) {
+        /* what is in the delay line no longer follows */
+        prot->passed++;
+        spk_prot_reset(prot);
+        return false;
+    }
+
+    start_ns = spk_prot_cpu_ns();
+
+    /* each frame in takes the place of one of the sub-block processed last */
+    for (i = 0; i < frames; i += count) {
+        count = SPK_PROT_SUBBLOCK_FRAMES - prot->fill;
+        if (count > frames - i) {
+            count = frames - i;
+        }
+        load_frames(prot->io + prot->fill * 2, src, format, count);
+        store_frames(dst, prot->ready + prot->fill * 2, format, count);
+        src += count * frame_size;
+        dst += count * frame_size;
+        prot->fill += count;
+
+        if (prot->fill == SPK_PROT_SUBBLOCK_FRAMES) {
+            if (!prot->limiter_only) {
+                spk_prot_compress(prot);
+            }
+            spk_prot_limit(prot);
+            memcpy(prot->ready, prot->io, sizeof(prot->ready));
+            prot->fill = 0;
+        }
+    }
+
+    spk_prot_account(prot, spk_prot_cpu_ns() - start_ns, frames);
+
+    return true;
+}
+
+uint32_t spk_prot_latency_frames(const struct spk_prot *prot)
+{
+    return prot->route == SPK_PROT_ROUTE_NONE ? 0 : SPK_PROT_LATENCY_FRAMES;
+}
+
+static uint32_t read_max_khz(const char *path)
+{
+    char value[16];
+    ssize_t ret;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ret = read(fd, value, sizeof(value) - 1);
+    close(fd);
+    if (ret <= 0) {
+        return 0;
+    }
+    value[ret] = '\0';
+
+    return strtoul(value, NULL, 10);
+}
+
+void spk_prot_dump(const struct spk_prot *prot, int fd)
+{
+    uint64_t frames;
+    int64_t avg_ns;
+    uint32_t khz;
+    int c;
+
+    dprintf(fd, "    Speaker protection: %s at %u Hz%s, %llu sub-blocks limited, "
+            "%u writes passed\n",
+            tunings[prot->route].name, prot->rate,
+            prot->limiter_only ? ", limiter only" : "",
+            (unsigned long long)prot->limited, prot->passed);
+
+    for (c = 0; c < SPK_PROT_CLUSTERS; c++) {
+        frames = prot->cost[c].frames;
+        if (frames == 0) {
+            continue;
+        }
+
+        avg_ns = prot->cost[c].ns_sum * SPK_PROT_BLOCK_FRAMES / (int64_t)frames;
+        khz = read_max_khz(cluster_max_freq_paths[c]);
+        dprintf(fd, "      %s: %llu blocks, avg %lld us, max %lld us "
+                "(budget %d us), %lld kcycles per block at %u MHz\n",
+                cluster_names[c],
+                (unsigned long long)(frames / SPK_PROT_BLOCK_FRAMES),
+                (long long)(avg_ns / 1000),
+                (long long)(prot->cost[c].ns_max / 1000),
+                SPK_PROT_BUDGET_NS / 1000,
+                (long long)(avg_ns * khz / 1000000000LL), khz / 1000);
+    }
+}
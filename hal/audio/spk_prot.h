@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPK_PROT_H
+#define SPK_PROT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <system/audio.h>
+
+/*
+ * Protection of the speaker: a three band compressor followed by a look-ahead
+ * limiter, on stereo outputs playing to the speaker alone.
+ *
+ * Linkwitz-Riley crossovers split the signal in three bands, each with a
+ * compressor of its own, and the limiter holds the sum under a ceiling,
+ * delayed by SPK_PROT_LOOKAHEAD_FRAMES so that its gain is down before a
+ * peak gets out. Gains are computed once per sub-block and ramped across
+ * it; the filters run on NEON, four lanes at a time.
+ *
+ * The state is part of the stream and the tuning a table per route, nothing
+ * is allocated. Writes of any length are processed: the frames that do not
+ * fill a sub-block wait for the next write, and the output trails the input
+ * by one sub-block on top of the look-ahead, SPK_PROT_LATENCY_FRAMES in
+ * all. Writes in other formats are passed through and the state reset. The
+ * CPU time is accounted per cluster and per block of SPK_PROT_BLOCK_FRAMES
+ * against SPK_PROT_BUDGET_NS: after SPK_PROT_MAX_OVERRUNS writes over it in
+ * a row only the limiter is kept.
+ */
+enum spk_prot_route {
+    SPK_PROT_ROUTE_NONE,        /* passed through */
+    SPK_PROT_ROUTE_MEDIA,       /* SND_DEVICE_OUT_SPEAKER */
+    SPK_PROT_ROUTE_VOICE,       /* SND_DEVICE_OUT_SPEAKER, VoIP */
+    SPK_PROT_ROUTE_COUNT
+};
+
+#define SPK_PROT_BLOCK_FRAMES 240           /* PLAYBACK_PERIOD_SIZE */
+#define SPK_PROT_SUBBLOCK_FRAMES 16
+#define SPK_PROT_LOOKAHEAD_BLOCKS 4
+#define SPK_PROT_LOOKAHEAD_FRAMES (SPK_PROT_SUBBLOCK_FRAMES * SPK_PROT_LOOKAHEAD_BLOCKS)
+#define SPK_PROT_LATENCY_FRAMES (SPK_PROT_LOOKAHEAD_FRAMES + SPK_PROT_SUBBLOCK_FRAMES)
+#define SPK_PROT_BANDS 3
+
+#define SPK_PROT_BUDGET_NS 250000           /* per block, 5% of a 5 ms period */
+#define SPK_PROT_MAX_OVERRUNS 16
+
+/* LITTLE (0-3) and big (4-7) clusters */
+#define SPK_PROT_CLUSTERS 2
+
+/* Biquads on four lanes, transposed direct form II */
+struct spk_prot_biquad4 {
+    float   b0[4];
+    float   b1[4];
+    float   b2[4];
+    float   a1[4];
+    float   a2[4];
+    float   z1[4];
+    float   z2[4];
+};
+
+struct spk_prot_band {
+    float   attack;         /* per sub-block */
+    float   release;
+    float   threshold_db;
+    float   slope;          /* 1 - 1 / ratio */
+    float   makeup_db;
+    float   env;
+    float   gain;
+};
+
+struct spk_prot {
+    enum spk_prot_route         route;
+    uint32_t                    rate;
+    bool                        limiter_only;   /* over budget */
+    uint32_t                    overruns;       /* in a row */
+
+    /*
+     * [low L, low R, rest L, rest R], twice for the fourth order, then
+     * the f2 allpass on the low band (rest passed), then the rest split in
+     * [mid L, mid R, high L, high R].
+     */
+    struct spk_prot_biquad4     split_low[2];
+    struct spk_prot_biquad4     allpass;
+    struct spk_prot_biquad4     split_high[2];
+    struct spk_prot_band        bands[SPK_PROT_BANDS];
+
+    float                       ceiling;
+    float                       limiter_release;
+    float                       limiter_gain;
+    /* what the peaks of the sub-blocks in the delay line allow, oldest first */
+    float                       allowed[SPK_PROT_LOOKAHEAD_BLOCKS + 1];
+    float                       delay[SPK_PROT_LOOKAHEAD_BLOCKS]
+                                     [SPK_PROT_SUBBLOCK_FRAMES * 2];
+    unsigned int                delay_pos;
+
+    /*
+     * The sub-block being filled, then processed, stereo; fill frames of it
+     * are in, and as many of the last one processed, ready, are out.
+     */
+    float                       io[SPK_PROT_SUBBLOCK_FRAMES * 2];
+    float                       ready[SPK_PROT_SUBBLOCK_FRAMES * 2];
+    unsigned int                fill;
+    /* the sub-block in the lanes of the filters */
+    float                       low[SPK_PROT_SUBBLOCK_FRAMES * 4];
+    float                       high[SPK_PROT_SUBBLOCK_FRAMES * 4];
+
+    /* per cluster, reported per block of SPK_PROT_BLOCK_FRAMES */
+    struct {
+        uint64_t                frames;
+        int64_t                 ns_sum;
+        int64_t                 ns_max;
+    } cost[SPK_PROT_CLUSTERS];
+    uint64_t                    limited;        /* sub-blocks */
+    uint32_t                    passed;         /* writes not processed */
+};
+
+/* Function prototypes */
+void spk_prot_init(struct spk_prot *prot);
+
+/* Loads the tuning of route at rate, only if either changed */
+void spk_prot_set_route(struct spk_prot *prot,
+                        enum spk_prot_route route,
+                        uint32_t rate);
+
+/* Clears the filters and the delay line, when the output starts */
+void spk_prot_reset(struct spk_prot *prot);
+
+/*
+ * Stereo frames from in to out, which may be in; returns false if passed
+ * through, out is then left untouched.
+ */
+bool spk_prot_process(struct spk_prot *prot,
+                      const void *in,
+                      void *out,
+                      audio_format_t format,
+                      size_t frames);
+
+/* How far the output trails the input, 0 when passed through */
+uint32_t spk_prot_latency_frames(const struct spk_prot *prot);
+
+/* Route, CPU time per block and cycles at the top clock of each cluster */
+void spk_prot_dump(const struct spk_prot *prot, int fd);
+
+#endif
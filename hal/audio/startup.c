@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_startup"
+/*#define LOG_NDEBUG 0*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <cutils/log.h>
+
+#include "startup.h"
+
+struct startup_phase {
+    const char  *name;
+    int64_t     end_ns;
+};
+
+/* Written by adev_open() only, before the device is returned */
+static bool startup_deferred;
+static int64_t open_start_ns;
+static int64_t open_end_ns;
+static struct startup_phase phases[STARTUP_MAX_PHASES];
+static int phase_count;
+
+/* Guards tasks[] against adev_dump() */
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct startup_task *tasks[STARTUP_MAX_TASKS];
+
+static int64_t startup_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t startup_elapsed_ns(void)
+{
+    return startup_now_ns() - open_start_ns;
+}
+
+void startup_begin(bool deferred)
+{
+    startup_deferred = deferred;
+    phase_count = 0;
+    open_end_ns = 0;
+    open_start_ns = startup_now_ns();
+}
+
+void startup_phase(const char *name)
+{
+    if (phase_count < STARTUP_MAX_PHASES) {
+        phases[phase_count].name = name;
+        phases[phase_count].end_ns = startup_elapsed_ns();
+        phase_count++;
+    }
+}
+
+void startup_end(void)
+{
+    open_end_ns = startup_elapsed_ns();
+
+    ALOGI("%s: adev_open took %lld us", __func__,
+          (long long)(open_end_ns / 1000));
+}
+
+static void startup_task_run(struct startup_task *task)
+{
+    task->start_ns = startup_elapsed_ns();
+    task->run(task->arg);
+    task->ready_ns = startup_elapsed_ns();
+
+    pthread_mutex_lock(&task->lock);
+    __atomic_store_n(&task->ready, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+
+    if (task->after != NULL) {
+        task->after(task->arg);
+    }
+    task->end_ns = startup_elapsed_ns();
+
+    ALOGV("%s: %s ready after %lld us", __func__, task->name,
+          (long long)(task->ready_ns / 1000));
+}
+
+static void *startup_task_loop(void *arg)
+{
+    startup_task_run((struct startup_task *)arg);
+
+    return NULL;
+}
+
+void startup_task_start(struct startup_task *task,
+                        const char *name,
+                        void (*run)(void *arg),
+                        void (*after)(void *arg),
+                        void *arg)
+{
+    int ret;
+    int i;
+
+    memset(task, 0, sizeof(*task));
+    task->name = name;
+    task->run = run;
+    task->after = after;
+    task->arg = arg;
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->cond, NULL);
+
+    pthread_mutex_lock(&tasks_lock);
+    for (i = 0; i < STARTUP_MAX_TASKS; i++) {
+        if (tasks[i] == NULL) {
+            tasks[i] = task;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tasks_lock);
+
+    if (startup_deferred) {
+        ret = pthread_create(&task->thread, NULL, startup_task_loop, task);
+        if (ret == 0) {
+            task->threaded = true;
+            return;
+        }
+        ALOGE("%s: pthread_create failed for %s: %s", __func__, name,
+              strerror(ret));
+    }
+
+    startup_task_run(task);
+}
+
+void startup_task_join(struct startup_task *task)
+{
+    int64_t start_ns;
+    int64_t wait_ns;
+
+    if (__atomic_load_n(&task->ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    start_ns = startup_now_ns();
+
+    pthread_mutex_lock(&task->lock);
+    while (!__atomic_load_n(&task->ready, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&task->cond, &task->lock);
+    }
+
+    wait_ns = startup_now_ns() - start_ns;
+    task->waits++;
+    task->wait_sum_ns += wait_ns;
+    if (wait_ns > task->wait_max_ns) {
+        task->wait_max_ns = wait_ns;
+    }
+    pthread_mutex_unlock(&task->lock);
+
+    ALOGI("%s: waited %lld us for %s", __func__, (long long)(wait_ns / 1000),
+          task->name);
+}
+
+void startup_task_stop(struct startup_task *task)
+{
+    int i;
+
+    if (task->threaded) {
+        pthread_join(task->thread, NULL);
+        task->threaded = false;
+    }
+
+    pthread_mutex_lock(&tasks_lock);
+    for (i = 0; i < STARTUP_MAX_TASKS; i++) {
+        if (tasks[i] == task) {
+            tasks[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&tasks_lock);
+
+    pthread_cond_destroy(&task->cond);
+    pthread_mutex_destroy(&task->lock);
+}
+
+/* Times of a task still running may be torn */
+void startup_dump(int fd)
+{
+    const struct startup_task *task;
+    int64_t prev_ns = 0;
+    int i;
+
+    dprintf(fd, "  Startup: adev_open took %lld us, tasks %s\n",
+            (long long)(open_end_ns / 1000),
+            startup_deferred ? "deferred" : "inline");
+
+    dprintf(fd, "    phases:");
+    for (i = 0; i < phase_count; i++) {
+        dprintf(fd, " %s %lld us", phases[i].name,
+                (long long)((phases[i].end_ns - prev_ns) / 1000));
+        prev_ns = phases[i].end_ns;
+    }
+    dprintf(fd, "\n");
+
+    pthread_mutex_lock(&tasks_lock);
+
+    for (i = 0; i < STARTUP_MAX_TASKS; i++) {
+        task = tasks[i];
+        if (task == NULL) {
+            continue;
+        }
+
+        if (!__atomic_load_n(&task->ready, __ATOMIC_ACQUIRE)) {
+            dprintf(fd, "    %s: running since %lld us\n", task->name,
+                    (long long)(task->start_ns / 1000));
+            continue;
+        }
+
+        dprintf(fd, "    %s: ran from %lld to %lld us%s, "
+                "%u calls waited, avg %lld us, max %lld us\n",
+                task->name, (long long)(task->start_ns / 1000),
+                (long long)(task->ready_ns / 1000),
+                task->end_ns != 0 || task->after == NULL ? "" : " (second step running)",
+                task->waits,
+                (long long)(task->waits > 0 ?
+                            task->wait_sum_ns / 1000 / task->waits : 0),
+                (long long)(task->wait_max_ns / 1000));
+    }
+
+    pthread_mutex_unlock(&tasks_lock);
+}
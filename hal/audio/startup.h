@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Startup of the device.
+ *
+ * adev_open() returns as soon as the state every call relies on is valid.
+ * The slow parts of the initialization run as tasks, each on a thread of
+ * its own, in parallel with each other and with audioserver going on with
+ * its own startup. The first call that needs what a task sets up joins it,
+ * waiting only if it is still running; later calls see it ready with a
+ * single atomic load.
+ *
+ * A task may have a second step, run once it is ready: joining never waits
+ * for it, so it may take locks held by the callers that join the task.
+ *
+ * The synchronous phases of adev_open(), the tasks and the time the calls
+ * spent waiting for them are kept for adev_dump().
+ */
+#define STARTUP_MAX_PHASES 8
+#define STARTUP_MAX_TASKS 4
+
+struct startup_task {
+    const char          *name;
+    void                (*run)(void *arg);
+    void                (*after)(void *arg);    /* once ready, may be NULL */
+    void                *arg;
+
+    pthread_t           thread;
+    bool                threaded;   /* false if run inline */
+    int                 ready;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+
+    /* from the start of adev_open() */
+    int64_t             start_ns;
+    int64_t             ready_ns;
+    int64_t             end_ns;     /* after the second step */
+
+    /* calls that joined while it was running */
+    uint32_t            waits;
+    int64_t             wait_sum_ns;
+    int64_t             wait_max_ns;
+};
+
+/* Function prototypes */
+
+/* At the start of adev_open(), deferred: whether tasks get a thread */
+void startup_begin(bool deferred);
+
+/* Ends the synchronous phase called name */
+void startup_phase(const char *name);
+
+/* When adev_open() returns */
+void startup_end(void);
+
+/* Runs the task on a thread of its own, inline if it cannot be created */
+void startup_task_start(struct startup_task *task,
+                        const char *name,
+                        void (*run)(void *arg),
+                        void (*after)(void *arg),
+                        void *arg);
+
+/* Returns once run() has returned */
+void startup_task_join(struct startup_task *task);
+
+/* Waits for both steps and releases the thread, before their state is freed */
+void startup_task_stop(struct startup_task *task);
+
+/* adev_open() phases, then per task when it ran and how long calls waited */
+void startup_dump(int fd);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_stream_pool"
+/*#define LOG_NDEBUG 0*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "hal_lock.h"
+#include "stream_pool.h"
+
+#define STREAM_POOL_MAX_OBJECTS 32
+
+struct stream_pool {
+    struct hal_lock lock;
+    size_t          object_size;    /* rounded up to CACHE_LINE_SIZE */
+    unsigned int    count;
+    uint32_t        used;           /* bitmap */
+    uint8_t         *objects;
+};
+
+static void *stream_pool_alloc_aligned(size_t size)
+{
+    void *object;
+
+    if (posix_memalign(&object, CACHE_LINE_SIZE, size) != 0) {
+        return NULL;
+    }
+
+    return object;
+}
+
+struct stream_pool *stream_pool_create(size_t object_size, unsigned int count)
+{
+    struct stream_pool *pool;
+
+    if (count == 0 || count > STREAM_POOL_MAX_OBJECTS) {
+        ALOGE("%s: invalid count %u", __func__, count);
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(struct stream_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->object_size = (object_size + CACHE_LINE_SIZE - 1) &
+                        ~((size_t)CACHE_LINE_SIZE - 1);
+    pool->count = count;
+
+    pool->objects = stream_pool_alloc_aligned(pool->object_size * count);
+    if (pool->objects == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    /* Fault the pages in now rather than on the first stream open */
+    memset(pool->objects, 0, pool->object_size * count);
+
+    hal_lock_init(&pool->lock, "stream pool", HAL_LOCK_RANK_LEAF);
+
+    ALOGV("%s: %u objects of %zu bytes", __func__, count, pool->object_size);
+
+    return pool;
+}
+
+void stream_pool_destroy(struct stream_pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    if (pool->used != 0) {
+        ALOGW("%s: objects still in use: %#x", __func__, pool->used);
+    }
+
+    hal_lock_destroy(&pool->lock);
+    free(pool->objects);
+    free(pool);
+}
+
+void *stream_pool_alloc(struct stream_pool *pool)
+{
+    void *object = NULL;
+    unsigned int i;
+
+    hal_lock_acquire(&pool->lock);
+    for (i = 0; i < pool->count; i++) {
+        if (!(pool->used & (1u << i))) {
+            pool->used |= 1u << i;
+            object = pool->objects + i * pool->object_size;
+            break;
+        }
+    }
+    hal_lock_release(&pool->lock);
+
+    if (object == NULL) {
+        ALOGW("%s: pool of %u used up", __func__, pool->count);
+        object = stream_pool_alloc_aligned(pool->object_size);
+        if (object == NULL) {
+            return NULL;
+        }
+    }
+
+    memset(object, 0, pool->object_size);
+
+    return object;
+}
+
+void stream_pool_free(struct stream_pool *pool, void *object)
+{
+    uint8_t *ptr = object;
+    unsigned int i;
+
+    if (object == NULL) {
+        return;
+    }
+
+    if (ptr < pool->objects || ptr >= pool->objects + pool->count * pool->object_size) {
+        free(object);
+        return;
+    }
+
+    i = (ptr - pool->objects) / pool->object_size;
+
+    hal_lock_acquire(&pool->lock);
+    pool->used &= ~(1u << i);
+    hal_lock_release(&pool->lock);
+}
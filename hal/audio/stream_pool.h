@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STREAM_POOL_H
+#define STREAM_POOL_H
+
+#include <stddef.h>
+
+/* L1 line of the Cortex-A15 and A7 cores */
+#define CACHE_LINE_SIZE 64
+
+#define __cacheline_aligned __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/*
+ * Fixed size objects on cache line boundaries, allocated and faulted in
+ * up front. The stream structs keep their hot section on lines of its own,
+ * which only holds if the struct itself starts on a line; calloc() does not
+ * guarantee that. Once the pool is used up, further objects are allocated
+ * one by one with the same alignment.
+ */
+struct stream_pool;
+
+/* Function prototypes */
+struct stream_pool *stream_pool_create(size_t object_size, unsigned int count);
+
+void stream_pool_destroy(struct stream_pool *pool);
+
+/* Returns a zeroed object, or NULL */
+void *stream_pool_alloc(struct stream_pool *pool);
+
+void stream_pool_free(struct stream_pool *pool, void *object);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Round trip latency of the primary HAL, on the device.
+ *
+ * Opens the HAL the way audioserver does, turns "loopback_test" on, and
+ * drives a FAST output with silence and a capture input for a while: the
+ * HAL replaces the output with its bursts and correlates what comes back
+ * (see loopback.h). Prints "loopback_result" and exits with 1 if nothing
+ * was measured. The PCMs must be free, stop audioserver first:
+ *
+ *   stop audioserver
+ *   audio_loopback_test [-s seconds] [-p mixer path|none]
+ *   start audioserver
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hardware/audio.h>
+#include <hardware/hardware.h>
+
+#define LOOPBACK_TEST_RATE 48000        /* the rate loopback_create() is given */
+#define LOOPBACK_TEST_SECONDS 10
+
+struct loopback_test {
+    struct audio_stream_out *out;
+    struct audio_stream_in  *in;
+    volatile bool           done;
+};
+
+static void *loopback_test_play(void *arg)
+{
+    struct loopback_test *test = (struct loopback_test *)arg;
+    size_t bytes = test->out->common.get_buffer_size(&test->out->common);
+    void *buffer = calloc(1, bytes);
+
+    while (buffer != NULL && !test->done) {
+        /* the HAL renders its bursts in place of the silence */
+        memset(buffer, 0, bytes);
+        if (test->out->write(test->out, buffer, bytes) < 0) {
+            fprintf(stderr, "output write failed\n");
+            break;
+        }
+    }
+
+    free(buffer);
+
+    return NULL;
+}
+
+static void *loopback_test_capture(void *arg)
+{
+    struct loopback_test *test = (struct loopback_test *)arg;
+    size_t bytes = test->in->common.get_buffer_size(&test->in->common);
+    void *buffer = malloc(bytes);
+
+    while (buffer != NULL && !test->done) {
+        if (test->in->read(test->in, buffer, bytes) < 0) {
+            fprintf(stderr, "input read failed\n");
+            break;
+        }
+    }
+
+    free(buffer);
+
+    return NULL;
+}
+
+/* Whether any period combination got a measurement */
+static bool loopback_test_measured(const char *result)
+{
+    const char *count = result;
+
+    while ((count = strstr(count, "count:")) != NULL) {
+        count += strlen("count:");
+        if (atoi(count) > 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seconds] [-p mixer path|none]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const hw_module_t *module;
+    struct audio_hw_device *dev;
+    struct audio_config config;
+    struct loopback_test test;
+    pthread_t play_thread;
+    pthread_t capture_thread;
+    const char *path = NULL;
+    char kvpairs[64];
+    char *result;
+    int seconds = LOOPBACK_TEST_SECONDS;
+    int status = 1;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "s:p:")) != -1) {
+        switch (opt) {
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    ret = hw_get_module_by_class(AUDIO_HARDWARE_MODULE_ID,
+                                 AUDIO_HARDWARE_MODULE_ID_PRIMARY, &module);
+    if (ret != 0) {
+        fprintf(stderr, "cannot load the primary HAL: %s\n", strerror(-ret));
+        return 1;
+    }
+
+    ret = audio_hw_device_open(module, &dev);
+    if (ret != 0) {
+        fprintf(stderr, "cannot open the primary HAL: %s\n", strerror(-ret));
+        return 1;
+    }
+
+    memset(&test, 0, sizeof(test));
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = LOOPBACK_TEST_RATE;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    ret = dev->open_output_stream(dev, 1, AUDIO_DEVICE_OUT_SPEAKER,
+                                  AUDIO_OUTPUT_FLAG_PRIMARY | AUDIO_OUTPUT_FLAG_FAST,
+                                  &config, &test.out, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "cannot open the FAST output: %s\n", strerror(-ret));
+        goto close_dev;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = LOOPBACK_TEST_RATE;
+    config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    ret = dev->open_input_stream(dev, 2, AUDIO_DEVICE_IN_BUILTIN_MIC,
+                                 &config, &test.in, AUDIO_INPUT_FLAG_FAST,
+                                 NULL, AUDIO_SOURCE_MIC);
+    if (ret != 0) {
+        fprintf(stderr, "cannot open the input: %s\n", strerror(-ret));
+        goto close_out;
+    }
+
+    if (path != NULL) {
+        snprintf(kvpairs, sizeof(kvpairs), "loopback_path=%s", path);
+        dev->set_parameters(dev, kvpairs);
+    }
+    dev->set_parameters(dev, "loopback_test=on");
+
+    pthread_create(&play_thread, NULL, loopback_test_play, &test);
+    pthread_create(&capture_thread, NULL, loopback_test_capture, &test);
+
+    sleep(seconds);
+
+    test.done = true;
+    pthread_join(play_thread, NULL);
+    pthread_join(capture_thread, NULL);
+
+    result = dev->get_parameters(dev, "loopback_result");
+    dev->set_parameters(dev, "loopback_test=off");
+
+    if (result != NULL) {
+        /* "loopback_result=" then one entry per period combination */
+        printf("%s\n", result);
+        status = loopback_test_measured(result) ? 0 : 1;
+        free(result);
+    }
+
+    dev->close_input_stream(dev, test.in);
+close_out:
+    dev->close_output_stream(dev, test.out);
+close_dev:
+    audio_hw_device_close(dev);
+
+    return status;
+}
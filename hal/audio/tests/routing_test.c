@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The routing tables against the branch chains they replaced.
+ *
+ * get_output_snd_device() and get_input_snd_device() used to walk the
+ * chains below on every route change, routing.c now reads tables filled
+ * from folded device masks. This runs both over every combination of the
+ * low device bits, then over random full masks, and prints each mismatch.
+ * It exits with 1 if there was any:
+ *
+ *   audio_routing_test [-n random masks] [-r seed]
+ *
+ * The chains are kept as they were, with the fixes that went in with the
+ * tables: the handset devices are the earpiece ones, and the back mic a
+ * speaker call switches to is compared without AUDIO_DEVICE_BIT_IN.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <system/audio.h>
+
+#include "../routing.h"
+
+#define ROUTING_TEST_RANDOM 1000000
+#define ROUTING_TEST_MAX_ERRORS 32
+
+static const audio_source_t sources[] = {
+    AUDIO_SOURCE_DEFAULT,
+    AUDIO_SOURCE_MIC,
+    AUDIO_SOURCE_VOICE_UPLINK,
+    AUDIO_SOURCE_VOICE_DOWNLINK,
+    AUDIO_SOURCE_VOICE_CALL,
+    AUDIO_SOURCE_CAMCORDER,
+    AUDIO_SOURCE_VOICE_RECOGNITION,
+    AUDIO_SOURCE_VOICE_COMMUNICATION,
+    AUDIO_SOURCE_REMOTE_SUBMIX,
+    AUDIO_SOURCE_UNPROCESSED,
+    AUDIO_SOURCE_HOTWORD,
+};
+
+static unsigned long errors;
+
+/* get_output_snd_device() before the tables */
+static snd_device_t chain_output(bool in_call, bool wb_amr, audio_devices_t devices)
+{
+    snd_device_t snd_device = SND_DEVICE_NONE;
+
+    if (devices == AUDIO_DEVICE_NONE ||
+        devices & AUDIO_DEVICE_BIT_IN) {
+        goto exit;
+    }
+
+    if (in_call) {
+        if (devices & AUDIO_DEVICE_OUT_WIRED_HEADPHONE ||
+            devices & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
+            if (wb_amr) {
+                snd_device = SND_DEVICE_OUT_VOICE_HEADPHONES_WB;
+            } else {
+                snd_device = SND_DEVICE_OUT_VOICE_HEADPHONES;
+            }
+        } else if (devices & AUDIO_DEVICE_OUT_SPEAKER) {
+            if (wb_amr) {
+                snd_device = SND_DEVICE_OUT_VOICE_SPEAKER_WB;
+            } else {
+                snd_device = SND_DEVICE_OUT_VOICE_SPEAKER;
+            }
+        } else if (devices & AUDIO_DEVICE_OUT_EARPIECE) {
+            if (wb_amr) {
+                snd_device = SND_DEVICE_OUT_VOICE_EARPIECE_WB;
+            } else {
+                snd_device = SND_DEVICE_OUT_VOICE_EARPIECE;
+            }
+        } else if (devices & AUDIO_DEVICE_OUT_ALL_SCO) {
+            snd_device = SND_DEVICE_OUT_BT_SCO;
+        }
+
+        if (snd_device != SND_DEVICE_NONE) {
+            goto exit;
+        }
+    }
+
+    if (__builtin_popcount(devices) == 2) {
+        if (devices == (AUDIO_DEVICE_OUT_WIRED_HEADPHONE |
+                        AUDIO_DEVICE_OUT_SPEAKER)) {
+            snd_device = SND_DEVICE_OUT_SPEAKER_AND_HEADPHONES;
+        } else if (devices == (AUDIO_DEVICE_OUT_WIRED_HEADSET |
+                               AUDIO_DEVICE_OUT_SPEAKER)) {
+            snd_device = SND_DEVICE_OUT_SPEAKER_AND_HEADPHONES;
+        }
+        goto exit;
+    }
+
+    if (__builtin_popcount(devices) != 1) {
+        goto exit;
+    }
+
+    if (devices & AUDIO_DEVICE_OUT_WIRED_HEADPHONE ||
+        devices & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
+        snd_device = SND_DEVICE_OUT_HEADPHONES;
+    } else if (devices & AUDIO_DEVICE_OUT_SPEAKER) {
+        snd_device = SND_DEVICE_OUT_SPEAKER;
+    } else if (devices & AUDIO_DEVICE_OUT_EARPIECE) {
+        snd_device = SND_DEVICE_OUT_EARPIECE;
+    } else if (devices & AUDIO_DEVICE_OUT_ALL_SCO) {
+        snd_device = SND_DEVICE_OUT_BT_SCO;
+    }
+
+exit:
+    return snd_device;
+}
+
+/* get_input_snd_device() before the tables, from the active input */
+static snd_device_t chain_input(bool in_call,
+                                audio_devices_t out_device,
+                                audio_devices_t in_device,
+                                audio_source_t source,
+                                bool two_mic)
+{
+    snd_device_t snd_device = SND_DEVICE_NONE;
+
+    in_device &= ~AUDIO_DEVICE_BIT_IN;
+
+    if (in_call) {
+        if (out_device == AUDIO_DEVICE_NONE) {
+            goto exit;
+        }
+
+        if (out_device & AUDIO_DEVICE_OUT_EARPIECE ||
+            out_device & AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
+            snd_device = SND_DEVICE_IN_EARPIECE_MIC;
+        } else if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
+            snd_device = SND_DEVICE_IN_VOICE_HEADSET_MIC;
+        } else if (out_device & AUDIO_DEVICE_OUT_SPEAKER) {
+            snd_device = SND_DEVICE_IN_VOICE_SPEAKER_MIC;
+        } else if (out_device & AUDIO_DEVICE_OUT_ALL_SCO) {
+            snd_device = SND_DEVICE_IN_BT_SCO_MIC;
+        }
+    } else if (two_mic) {
+        snd_device = SND_DEVICE_IN_TWO_MIC;
+    } else if (source == AUDIO_SOURCE_CAMCORDER) {
+        if (in_device & AUDIO_DEVICE_IN_BUILTIN_MIC ||
+            in_device & AUDIO_DEVICE_IN_BACK_MIC) {
+            snd_device = SND_DEVICE_IN_CAMCORDER_MIC;
+        }
+    } else if (source == AUDIO_SOURCE_VOICE_COMMUNICATION ||
+               source == AUDIO_SOURCE_MIC) {
+        if (out_device & AUDIO_DEVICE_OUT_SPEAKER) {
+            in_device = AUDIO_DEVICE_IN_BACK_MIC & ~AUDIO_DEVICE_BIT_IN;
+        }
+    } else if (source == AUDIO_SOURCE_DEFAULT) {
+        goto exit;
+    }
+
+    if (snd_device != SND_DEVICE_NONE) {
+        goto exit;
+    }
+
+    if (in_device != AUDIO_DEVICE_NONE &&
+        !(in_device & AUDIO_DEVICE_IN_VOICE_CALL) &&
+        !(in_device & AUDIO_DEVICE_IN_COMMUNICATION)) {
+        if (in_device & AUDIO_DEVICE_IN_BUILTIN_MIC) {
+            snd_device = SND_DEVICE_IN_EARPIECE_MIC;
+        } else if (in_device & AUDIO_DEVICE_IN_BACK_MIC) {
+            snd_device = SND_DEVICE_IN_SPEAKER_MIC;
+        } else if (in_device & AUDIO_DEVICE_IN_WIRED_HEADSET) {
+            snd_device = SND_DEVICE_IN_HEADSET_MIC;
+        } else if (in_device & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
+            snd_device = SND_DEVICE_IN_BT_SCO_MIC;
+        } else if (in_device & AUDIO_DEVICE_IN_AUX_DIGITAL) {
+            snd_device = SND_DEVICE_IN_HDMI_MIC;
+        } else {
+            snd_device = SND_DEVICE_IN_EARPIECE_MIC;
+        }
+    } else {
+        if (out_device & AUDIO_DEVICE_OUT_EARPIECE) {
+            snd_device = SND_DEVICE_IN_EARPIECE_MIC;
+        } else if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADSET) {
+            snd_device = SND_DEVICE_IN_HEADSET_MIC;
+        } else if (out_device & AUDIO_DEVICE_OUT_SPEAKER) {
+            snd_device = SND_DEVICE_IN_SPEAKER_MIC;
+        } else if (out_device & AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
+            snd_device = SND_DEVICE_IN_EARPIECE_MIC;
+        } else if (out_device & AUDIO_DEVICE_OUT_BLUETOOTH_SCO_HEADSET) {
+            snd_device = SND_DEVICE_IN_BT_SCO_MIC;
+        } else {
+            snd_device = SND_DEVICE_IN_EARPIECE_MIC;
+        }
+    }
+
+exit:
+    return snd_device;
+}
+
+static const char *snd_device_name(snd_device_t snd_device)
+{
+    if (snd_device < 0 || snd_device >= SND_DEVICE_MAX ||
+        device_table[snd_device] == NULL) {
+        return "?";
+    }
+
+    return device_table[snd_device];
+}
+
+static void check_output(bool in_call, bool wb_amr, audio_devices_t devices)
+{
+    snd_device_t expected = chain_output(in_call, wb_amr, devices);
+    snd_device_t table = routing_output_snd_device(in_call, wb_amr, devices);
+
+    if (table == expected) {
+        return;
+    }
+
+    if (errors++ < ROUTING_TEST_MAX_ERRORS) {
+        printf("output %#x, call %d, wb %d: table %s, chain %s\n",
+               devices, in_call, wb_amr,
+               snd_device_name(table), snd_device_name(expected));
+    }
+}
+
+static void check_input(bool in_call,
+                        audio_devices_t out_device,
+                        audio_devices_t in_device)
+{
+    snd_device_t expected;
+    snd_device_t table;
+    size_t i;
+    int two_mic;
+
+    for (i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        for (two_mic = 0; two_mic <= 1; two_mic++) {
+            expected = chain_input(in_call, out_device, in_device,
+                                   sources[i], two_mic);
+            table = routing_input_snd_device(in_call, out_device, in_device,
+                                             sources[i], two_mic);
+            if (table == expected) {
+                continue;
+            }
+
+            if (errors++ < ROUTING_TEST_MAX_ERRORS) {
+                printf("input %#x, output %#x, call %d, source %d, two mic %d: "
+                       "table %s, chain %s\n",
+                       in_device, out_device, in_call, sources[i], two_mic,
+                       snd_device_name(table), snd_device_name(expected));
+            }
+        }
+    }
+}
+
+static void check_all_outputs(audio_devices_t devices)
+{
+    check_output(false, false, devices);
+    check_output(true, false, devices);
+    check_output(true, true, devices);
+}
+
+static audio_devices_t random_mask(void)
+{
+    /* several bits set as often as one or two */
+    audio_devices_t mask = (audio_devices_t)random() ^ ((audio_devices_t)random() << 16);
+
+    switch (random() % 3) {
+    case 0:
+        return mask & (mask >> 7) & (mask >> 13);
+    case 1:
+        return mask & (mask >> 11);
+    default:
+        return mask;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n random masks] [-r seed]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long count = ROUTING_TEST_RANDOM;
+    unsigned int seed = 1;
+    audio_devices_t out_device;
+    audio_devices_t in_device;
+    unsigned long n;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    routing_init();
+
+    /* every combination of the bits the tables key on, and some more */
+    for (out_device = 0; out_device < 0x10000; out_device++) {
+        check_all_outputs(out_device);
+        check_all_outputs(out_device | AUDIO_DEVICE_BIT_IN);
+    }
+
+    for (out_device = 0; out_device < 0x100; out_device++) {
+        for (in_device = 0; in_device < 0x400; in_device++) {
+            check_input(false, out_device, in_device | AUDIO_DEVICE_BIT_IN);
+            check_input(true, out_device, in_device | AUDIO_DEVICE_BIT_IN);
+        }
+    }
+
+    srandom(seed);
+    for (n = 0; n < count; n++) {
+        out_device = random_mask();
+        in_device = random_mask() | AUDIO_DEVICE_BIT_IN;
+
+        check_all_outputs(out_device);
+        check_input(false, out_device, in_device);
+        check_input(true, out_device, in_device);
+    }
+
+    printf("%lu mismatches, %lu random masks from seed %u\n",
+           errors, count, seed);
+
+    return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_thread"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "thread_mgr.h"
+
+#define LITTLE_CPUS 0x0f
+#define BIG_CPUS 0xf0
+#define BIG_FIRST_CPU 4
+#define MAX_CPUS 8
+
+#define SAMPLE_NS 1000000000LL
+
+/* Written by init.universal5430.power.rc, group audio */
+#define BOOST_PATH "/sys/devices/system/cpu/cpu4/cpufreq/interactive/boost"
+
+struct role_policy {
+    const char      *name;
+    const char      *cpus_name;
+    unsigned int    cpus;
+    int             fifo_priority;  /* 0 to leave the policy alone */
+};
+
+/*
+ * Below the FAST mixer and capture threads AudioFlinger makes real time
+ * itself, those keep their priority. The deep buffer output runs on the
+ * LITTLE cluster, its periods are long enough, and so does the pre-roll,
+ * which may stay armed for hours.
+ */
+static const struct role_policy role_policies[THREAD_ROLE_COUNT] = {
+    [THREAD_ROLE_FAST_WRITER] = { "fast writer", "4-7", BIG_CPUS, 2 },
+    [THREAD_ROLE_DEEP_WRITER] = { "deep writer", "0-3", LITTLE_CPUS, 0 },
+    [THREAD_ROLE_CAPTURE] = { "capture", "4-7", BIG_CPUS, 2 },
+    [THREAD_ROLE_RIL] = { "ril", "0-3", LITTLE_CPUS, 0 },
+    [THREAD_ROLE_BACKGROUND] = { "background", "0-3", LITTLE_CPUS, 0 },
+};
+
+static pthread_mutex_t entries_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_entry entries[THREAD_MGR_MAX_THREADS];
+
+/* Entry of the calling thread, freed by the key destructor when it exits */
+static __thread struct thread_entry *current;
+static __thread bool untracked;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static pthread_mutex_t boost_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool boosted;
+static bool boost_failed;
+static uint32_t boosts;
+
+static int64_t thread_mgr_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void thread_mgr_exit(void *arg)
+{
+    struct thread_entry *entry = arg;
+
+    pthread_mutex_lock(&entries_lock);
+    entry->applied = false;
+    entry->tid = 0;
+    pthread_mutex_unlock(&entries_lock);
+}
+
+static void thread_mgr_key_create(void)
+{
+    pthread_key_create(&key, thread_mgr_exit);
+}
+
+/* /proc/self/task/<tid>/schedstat: time run, time waited to run, runs */
+static void thread_mgr_sample(struct thread_entry *entry, int64_t now)
+{
+    unsigned long long exec_ns, run_delay_ns, run_count;
+    char path[48];
+    char buf[96];
+    ssize_t len;
+    int fd;
+
+    entry->sample_ns = now;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", entry->tid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return;
+    }
+    buf[len] = '\0';
+
+    if (sscanf(buf, "%llu %llu %llu", &exec_ns, &run_delay_ns, &run_count) != 3) {
+        return;
+    }
+
+    if (entry->run_count > 0 && run_count > entry->run_count) {
+        uint64_t wakeups = run_count - entry->run_count;
+        uint64_t wait_ns = run_delay_ns - entry->run_delay_ns;
+
+        entry->wakeups += wakeups;
+        entry->wait_sum_ns += wait_ns;
+        if (wait_ns / wakeups > entry->wait_max_avg_ns) {
+            entry->wait_max_avg_ns = wait_ns / wakeups;
+        }
+    }
+
+    entry->run_delay_ns = run_delay_ns;
+    entry->run_count = run_count;
+}
+
+/* entries_lock held */
+static void thread_mgr_restore(struct thread_entry *entry)
+{
+    const struct role_policy *policy = &role_policies[entry->role];
+    struct sched_param param;
+
+    if (entry->saved_cpus_valid &&
+        sched_setaffinity(entry->tid, sizeof(entry->saved_cpus),
+                          &entry->saved_cpus) != 0) {
+        ALOGW("%s: %s affinity: %s", __func__, policy->name, strerror(errno));
+    }
+
+    if (entry->policy != entry->saved_policy) {
+        param.sched_priority = entry->saved_priority;
+        if (sched_setscheduler(entry->tid, entry->saved_policy, &param) != 0) {
+            ALOGW("%s: %s policy %d: %s", __func__, policy->name,
+                  entry->saved_policy, strerror(errno));
+        }
+    }
+
+    entry->applied = false;
+
+    ALOGV("%s: thread %d %s given back, policy %d priority %d", __func__,
+          entry->tid, policy->name, entry->saved_policy, entry->saved_priority);
+}
+
+/* entries_lock held, by the thread of entry */
+static void thread_mgr_apply_role(struct thread_entry *entry, enum thread_role role)
+{
+    const struct role_policy *policy = &role_policies[role];
+    struct sched_param param;
+    cpu_set_t set;
+    int cpu;
+
+    if (entry->applied) {
+        thread_mgr_restore(entry);
+    }
+
+    entry->role = role;
+    entry->fifo_denied = false;
+
+    entry->saved_cpus_valid =
+            sched_getaffinity(0, sizeof(entry->saved_cpus), &entry->saved_cpus) == 0;
+    entry->saved_policy = sched_getscheduler(0);
+    entry->saved_priority = sched_getparam(0, &param) == 0 ? param.sched_priority : 0;
+
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (policy->cpus & (1u << cpu)) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        ALOGW("%s: %s affinity: %s", __func__, policy->name, strerror(errno));
+    }
+
+    entry->policy = entry->saved_policy;
+    if (policy->fifo_priority > 0 &&
+        entry->policy != SCHED_FIFO && entry->policy != SCHED_RR) {
+        param.sched_priority = policy->fifo_priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+            ALOGW("%s: %s SCHED_FIFO: %s", __func__, policy->name,
+                  strerror(errno));
+            entry->fifo_denied = true;
+        }
+        entry->policy = sched_getscheduler(0);
+    }
+
+    if (sched_getparam(0, &param) == 0) {
+        entry->priority = param.sched_priority;
+    }
+
+    __atomic_store_n(&entry->applied, true, __ATOMIC_RELEASE);
+
+    ALOGV("%s: thread %d %s, cpus %s, policy %d priority %d", __func__,
+          entry->tid, policy->name, policy->cpus_name,
+          entry->policy, entry->priority);
+}
+
+static struct thread_entry *thread_mgr_attach(void)
+{
+    struct thread_entry *entry = NULL;
+    int i;
+
+    pthread_once(&key_once, thread_mgr_key_create);
+
+    pthread_mutex_lock(&entries_lock);
+    for (i = 0; i < THREAD_MGR_MAX_THREADS; i++) {
+        if (entries[i].tid == 0) {
+            entry = &entries[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        pthread_mutex_unlock(&entries_lock);
+        ALOGW("%s: more than %d threads, %d not tracked", __func__,
+              THREAD_MGR_MAX_THREADS, gettid());
+        untracked = true;
+        return NULL;
+    }
+
+    memset(entry, 0, sizeof(struct thread_entry));
+    entry->tid = gettid();
+    entry->last_cluster = -1;
+    pthread_mutex_unlock(&entries_lock);
+
+    thread_mgr_sample(entry, thread_mgr_now_ns());
+
+    current = entry;
+    pthread_setspecific(key, entry);
+
+    return entry;
+}
+
+pid_t thread_mgr_enter(enum thread_role role)
+{
+    struct thread_entry *entry = current;
+    int64_t now;
+    int cluster;
+
+    if (untracked) {
+        return 0;
+    }
+
+    if (entry == NULL) {
+        entry = thread_mgr_attach();
+        if (entry == NULL) {
+            return 0;
+        }
+    }
+
+    if (!__atomic_load_n(&entry->applied, __ATOMIC_ACQUIRE) || entry->role != role) {
+        pthread_mutex_lock(&entries_lock);
+        thread_mgr_apply_role(entry, role);
+        pthread_mutex_unlock(&entries_lock);
+    }
+
+    cluster = sched_getcpu() >= BIG_FIRST_CPU;
+    if (cluster != entry->last_cluster) {
+        if (entry->last_cluster >= 0) {
+            entry->migrations++;
+        }
+        entry->last_cluster = cluster;
+    }
+
+    now = thread_mgr_now_ns();
+    if (now - entry->sample_ns >= SAMPLE_NS) {
+        thread_mgr_sample(entry, now);
+    }
+
+    return entry->tid;
+}
+
+void thread_mgr_leave(pid_t tid)
+{
+    int i;
+
+    pthread_mutex_lock(&entries_lock);
+
+    for (i = 0; i < THREAD_MGR_MAX_THREADS; i++) {
+        if (entries[i].tid == tid && entries[i].applied) {
+            thread_mgr_restore(&entries[i]);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&entries_lock);
+}
+
+void thread_mgr_set_boost(bool boost)
+{
+    int fd;
+
+    pthread_mutex_lock(&boost_lock);
+
+    if (boost != boosted) {
+        fd = open(BOOST_PATH, O_WRONLY | O_CLOEXEC);
+        if (fd >= 0 && write(fd, boost ? "1" : "0", 1) == 1) {
+            boosted = boost;
+            boosts += boost;
+        } else {
+            ALOGW_IF(!boost_failed, "%s: %s: %s", __func__, BOOST_PATH,
+                     strerror(errno));
+            boost_failed = true;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    pthread_mutex_unlock(&boost_lock);
+}
+
+void thread_mgr_dump(int fd)
+{
+    static const char * const policy_names[] = {
+        [SCHED_OTHER] = "other",
+        [SCHED_FIFO] = "fifo",
+        [SCHED_RR] = "rr",
+    };
+    int i;
+
+    dprintf(fd, "  Threads: big cluster boost %s, %u boosts%s\n",
+            boosted ? "on" : "off", boosts,
+            boost_failed ? ", boost not writable" : "");
+
+    pthread_mutex_lock(&entries_lock);
+
+    for (i = 0; i < THREAD_MGR_MAX_THREADS; i++) {
+        const struct thread_entry *entry = &entries[i];
+        const struct role_policy *policy = &role_policies[entry->role];
+
+        if (entry->tid == 0) {
+            continue;
+        }
+
+        dprintf(fd, "    %d %s%s: cpus %s, %s %d%s, %u cluster migrations\n",
+                entry->tid, policy->name, entry->applied ? "" : " (given back)",
+                policy->cpus_name,
+                entry->policy >= 0 && entry->policy <= SCHED_RR ?
+                        policy_names[entry->policy] : "?",
+                entry->priority,
+                entry->fifo_denied ? " (fifo denied)" : "",
+                entry->migrations);
+        dprintf(fd, "      wakeup to run: %llu wakeups, avg %llu us, "
+                "worst second avg %llu us\n",
+                (unsigned long long)entry->wakeups,
+                (unsigned long long)(entry->wakeups > 0 ?
+                                     entry->wait_sum_ns / entry->wakeups / 1000 : 0),
+                (unsigned long long)(entry->wait_max_avg_ns / 1000));
+    }
+
+    pthread_mutex_unlock(&entries_lock);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THREAD_MGR_H
+#define THREAD_MGR_H
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Scheduling of the threads doing the HAL's audio work.
+ *
+ * Apart from the pre-roll capture thread the HAL creates no threads of its
+ * own, it runs on the AudioFlinger mixer and record threads and on the RIL
+ * client thread. Each of them takes a role the first time it enters the
+ * HAL: the CPUs it may run on and, for the low latency roles, a SCHED_FIFO
+ * priority unless it already has a real time one. Once a second it samples
+ * its schedstat, how long it waited to run after waking up, and counts the
+ * times it moved between the LITTLE (0-3) and big (4-7) clusters.
+ *
+ * The threads are not ours: what they had before the role is given back
+ * when their stream goes to standby, the next entry applies the role again.
+ *
+ * While low latency streams play, the big cluster governor is boosted.
+ */
+enum thread_role {
+    THREAD_ROLE_FAST_WRITER,    /* low latency and VoIP outputs */
+    THREAD_ROLE_DEEP_WRITER,    /* deep buffer and HDMI outputs */
+    THREAD_ROLE_CAPTURE,
+    THREAD_ROLE_RIL,
+    THREAD_ROLE_BACKGROUND,     /* the HAL's own threads, e.g. the pre-roll */
+    THREAD_ROLE_COUNT
+};
+
+#define THREAD_MGR_MAX_THREADS 8
+
+struct thread_entry {
+    pid_t               tid;        /* 0 if the entry is free */
+    enum thread_role    role;
+    bool                applied;    /* false once given back */
+    int                 policy;     /* after the role was applied */
+    int                 priority;
+    bool                fifo_denied;
+
+    /* before the role was applied */
+    cpu_set_t           saved_cpus;
+    bool                saved_cpus_valid;
+    int                 saved_policy;
+    int                 saved_priority;
+
+    int                 last_cluster;
+    uint32_t            migrations;
+
+    /* schedstat at the last sample */
+    int64_t             sample_ns;
+    uint64_t            run_delay_ns;
+    uint64_t            run_count;
+
+    /* since the role was applied */
+    uint64_t            wakeups;
+    uint64_t            wait_sum_ns;
+    /* worst average wait over a sample period */
+    uint64_t            wait_max_avg_ns;
+};
+
+/* Function prototypes */
+
+/*
+ * Called by the thread itself on every entry, only the first applies the
+ * role. Returns the thread's id for thread_mgr_leave(), 0 if not tracked.
+ */
+pid_t thread_mgr_enter(enum thread_role role);
+
+/* Gives thread tid back the CPUs and policy it had before its role */
+void thread_mgr_leave(pid_t tid);
+
+/* Boosts the big cluster governor, only writes on a change */
+void thread_mgr_set_boost(bool boost);
+
+/* Values of threads running concurrently may be torn */
+void thread_mgr_dump(int fd);
+
+#endif
@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_two_mic"
+/*#define LOG_NDEBUG 0*/
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include <cutils/log.h>
+
+#include "two_mic.h"
+
+/* Canceller length, a multiple of 4. The primary is delayed by half of it */
+#define TWO_MIC_TAPS 32
+#define TWO_MIC_DELAY (TWO_MIC_TAPS / 2)
+
+/* NLMS step size */
+#define TWO_MIC_MU 0.05f
+#define TWO_MIC_EPS 1e-6f
+
+/* Front/back power ratio above which the talker dominates, about 3 dB */
+#define TWO_MIC_NEAR_RATIO 2.0f
+
+/* Share of a block's duration the engine may spend, in percent */
+#define TWO_MIC_CPU_BUDGET_PCT 10
+
+/* Blocks without adaptation after the budget has been exceeded */
+#define TWO_MIC_FREEZE_BLOCKS 200
+
+/* Noise gate: floor, over-subtraction and floor rise in dB per second */
+#define TWO_MIC_GATE_MIN 0.25f
+#define TWO_MIC_GATE_OVER 2.0f
+#define TWO_MIC_FLOOR_RISE_DB 2.0f
+
+struct two_mic {
+    enum two_mic_mode mode;
+    uint32_t rate;
+    size_t   block_frames;
+
+    float    w[TWO_MIC_TAPS] __attribute__((aligned(16)));
+    float    *ref_hist;  /* TWO_MIC_TAPS - 1 + block_frames */
+    float    *main_hist; /* TWO_MIC_DELAY + block_frames */
+    float    *out;       /* block_frames */
+
+    float    noise_floor;
+    float    floor_rise;
+    float    gain;
+    uint32_t freeze;
+
+    struct two_mic_stats stats;
+};
+
+struct two_mic *two_mic_create(uint32_t rate,
+                               size_t block_frames,
+                               enum two_mic_mode mode)
+{
+    struct two_mic *tm;
+    float *mem;
+
+    if (rate == 0 || block_frames == 0) {
+        return NULL;
+    }
+
+    tm = calloc(1, sizeof(struct two_mic));
+    if (tm == NULL) {
+        return NULL;
+    }
+
+    mem = calloc((TWO_MIC_TAPS - 1 + block_frames) +
+                 (TWO_MIC_DELAY + block_frames) +
+                 block_frames,
+                 sizeof(float));
+    if (mem == NULL) {
+        free(tm);
+        return NULL;
+    }
+
+    tm->ref_hist = mem;
+    tm->main_hist = tm->ref_hist + TWO_MIC_TAPS - 1 + block_frames;
+    tm->out = tm->main_hist + TWO_MIC_DELAY + block_frames;
+
+    tm->mode = mode;
+    tm->rate = rate;
+    tm->block_frames = block_frames;
+    tm->floor_rise = powf(10.0f, TWO_MIC_FLOOR_RISE_DB / 10.0f *
+                                 (float)block_frames / (float)rate);
+    tm->stats.budget_ns = (int64_t)block_frames * 1000000000LL / rate *
+                          TWO_MIC_CPU_BUDGET_PCT / 100;
+
+    two_mic_reset(tm);
+
+    ALOGV("%s: rate(%u) block(%zu) mode(%d) budget(%lld ns)",
+          __func__, rate, block_frames, mode,
+          (long long)tm->stats.budget_ns);
+
+    return tm;
+}
+
+void two_mic_destroy(struct two_mic *tm)
+{
+    if (tm == NULL) {
+        return;
+    }
+
+    free(tm->ref_hist);
+    free(tm);
+}
+
+void two_mic_reset(struct two_mic *tm)
+{
+    memset(tm->w, 0, sizeof(tm->w));
+    memset(tm->ref_hist, 0, (TWO_MIC_TAPS - 1) * sizeof(float));
+    memset(tm->main_hist, 0, TWO_MIC_DELAY * sizeof(float));
+
+    tm->noise_floor = 0.0f;
+    tm->gain = 1.0f;
+    tm->freeze = 0;
+}
+
+static float two_mic_dot(const float *a, const float *b, size_t n)
+{
+    float sum = 0.0f;
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    float32x2_t s;
+
+    for (; i + 4 <= n; i += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+
+    s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    s = vpadd_f32(s, s);
+    sum = vget_lane_f32(s, 0);
+#endif
+
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+
+    return sum;
+}
+
+/* w += step * x over the canceller length */
+static void two_mic_update(float *w, const float *x, float step)
+{
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    for (; i < TWO_MIC_TAPS; i += 4) {
+        vst1q_f32(w + i, vmlaq_n_f32(vld1q_f32(w + i), vld1q_f32(x + i), step));
+    }
+#endif
+
+    for (; i < TWO_MIC_TAPS; i++) {
+        w[i] += step * x[i];
+    }
+}
+
+static void two_mic_load(const int16_t *src,
+                         float *front,
+                         float *back,
+                         size_t frames)
+{
+    const float scale = 1.0f / 32768.0f;
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t in = vld2q_s16(src + 2 * i);
+
+        vst1q_f32(front + i,
+                  vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(in.val[0]))),
+                              scale));
+        vst1q_f32(front + i + 4,
+                  vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(in.val[0]))),
+                              scale));
+        vst1q_f32(back + i,
+                  vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(in.val[1]))),
+                              scale));
+        vst1q_f32(back + i + 4,
+                  vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(in.val[1]))),
+                              scale));
+    }
+#endif
+
+    for (; i < frames; i++) {
+        front[i] = src[2 * i] * scale;
+        back[i] = src[2 * i + 1] * scale;
+    }
+}
+
+/* Writes src ramped from gain g0 to g1 to both slots of dst */
+static void two_mic_store(const float *src,
+                          int16_t *dst,
+                          size_t frames,
+                          float g0,
+                          float g1)
+{
+    float step = (g1 - g0) / (float)frames;
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    const float32x4_t ramp = { 0.0f, 1.0f, 2.0f, 3.0f };
+    float32x4_t gain = vmlaq_n_f32(vdupq_n_f32(g0 * 32768.0f), ramp,
+                                   step * 32768.0f);
+    float32x4_t gain_step = vdupq_n_f32(4.0f * step * 32768.0f);
+
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t out;
+        int16x4_t lo;
+        int16x4_t hi;
+
+        lo = vqmovn_s32(vcvtq_s32_f32(vmulq_f32(vld1q_f32(src + i), gain)));
+        gain = vaddq_f32(gain, gain_step);
+        hi = vqmovn_s32(vcvtq_s32_f32(vmulq_f32(vld1q_f32(src + i + 4), gain)));
+        gain = vaddq_f32(gain, gain_step);
+
+        out.val[0] = vcombine_s16(lo, hi);
+        out.val[1] = out.val[0];
+        vst2q_s16(dst + 2 * i, out);
+    }
+#endif
+
+    for (; i < frames; i++) {
+        float sample = src[i] * (g0 + step * (float)i) * 32768.0f;
+
+        if (sample > 32767.0f) {
+            sample = 32767.0f;
+        } else if (sample < -32768.0f) {
+            sample = -32768.0f;
+        }
+
+        dst[2 * i] = (int16_t)sample;
+        dst[2 * i + 1] = (int16_t)sample;
+    }
+}
+
+static void two_mic_cancel(struct two_mic *tm, size_t frames, bool adapt)
+{
+    const float *x = tm->ref_hist;
+    float energy = two_mic_dot(x, x, TWO_MIC_TAPS);
+    size_t n;
+
+    for (n = 0; n < frames; n++, x++) {
+        float e;
+
+        if (n > 0) {
+            energy += x[TWO_MIC_TAPS - 1] * x[TWO_MIC_TAPS - 1] - x[-1] * x[-1];
+            if (energy < 0.0f) {
+                energy = 0.0f;
+            }
+        }
+
+        e = tm->main_hist[n] - two_mic_dot(tm->w, x, TWO_MIC_TAPS);
+        tm->out[n] = e;
+
+        if (adapt) {
+            two_mic_update(tm->w, x,
+                           TWO_MIC_MU * e / (energy + TWO_MIC_EPS * TWO_MIC_TAPS));
+        }
+    }
+}
+
+static void two_mic_sum(struct two_mic *tm, size_t frames)
+{
+    const float *front = tm->main_hist + TWO_MIC_DELAY;
+    const float *back = tm->ref_hist + TWO_MIC_TAPS - 1;
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    for (; i + 4 <= frames; i += 4) {
+        vst1q_f32(tm->out + i,
+                  vmulq_n_f32(vaddq_f32(vld1q_f32(front + i),
+                                        vld1q_f32(back + i)),
+                              0.5f));
+    }
+#endif
+
+    for (; i < frames; i++) {
+        tm->out[i] = 0.5f * (front[i] + back[i]);
+    }
+}
+
+/* Returns the new gate gain for a block with the given mean power */
+static float two_mic_gate(struct two_mic *tm, float power)
+{
+    float gain;
+
+    if (tm->noise_floor <= 0.0f || power < tm->noise_floor) {
+        tm->noise_floor = power;
+    } else {
+        tm->noise_floor *= tm->floor_rise;
+    }
+    if (tm->noise_floor < 1e-10f) {
+        tm->noise_floor = 1e-10f;
+    }
+
+    gain = 1.0f - TWO_MIC_GATE_OVER * tm->noise_floor / (power + 1e-10f);
+    if (gain < TWO_MIC_GATE_MIN) {
+        gain = TWO_MIC_GATE_MIN;
+    }
+
+    /* Open at once on onsets, close slowly */
+    if (gain < tm->gain) {
+        gain = 0.8f * tm->gain + 0.2f * gain;
+    }
+
+    return gain;
+}
+
+static void two_mic_process_block(struct two_mic *tm,
+                                  int16_t *buffer,
+                                  size_t frames)
+{
+    float *front = tm->main_hist + TWO_MIC_DELAY;
+    float *back = tm->ref_hist + TWO_MIC_TAPS - 1;
+    float gain;
+
+    two_mic_load(buffer, front, back, frames);
+
+    if (tm->mode == TWO_MIC_NEAR) {
+        float front_power = two_mic_dot(front, front, frames);
+        float back_power = two_mic_dot(back, back, frames);
+        float out_power;
+        bool adapt = front_power < TWO_MIC_NEAR_RATIO * back_power;
+
+        if (tm->freeze > 0) {
+            tm->freeze--;
+            tm->stats.frozen_blocks++;
+            adapt = false;
+        } else if (adapt) {
+            tm->stats.adapt_blocks++;
+        }
+
+        two_mic_cancel(tm, frames, adapt);
+
+        /* Diverged: the output must never be louder than the primary */
+        out_power = two_mic_dot(tm->out, tm->out, frames);
+        if (out_power > 4.0f * front_power + TWO_MIC_EPS) {
+            memset(tm->w, 0, sizeof(tm->w));
+            memcpy(tm->out, tm->main_hist, frames * sizeof(float));
+            tm->stats.resets++;
+        }
+
+        memmove(tm->ref_hist, tm->ref_hist + frames,
+                (TWO_MIC_TAPS - 1) * sizeof(float));
+        memmove(tm->main_hist, tm->main_hist + frames,
+                TWO_MIC_DELAY * sizeof(float));
+    } else {
+        two_mic_sum(tm, frames);
+    }
+
+    gain = two_mic_gate(tm, two_mic_dot(tm->out, tm->out, frames) / frames);
+    two_mic_store(tm->out, buffer, frames, tm->gain, gain);
+    tm->gain = gain;
+}
+
+static int64_t two_mic_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void two_mic_process(struct two_mic *tm, int16_t *buffer, size_t frames)
+{
+    while (frames > 0) {
+        size_t count = frames < tm->block_frames ? frames : tm->block_frames;
+        int64_t start = two_mic_cpu_ns();
+        int64_t cpu;
+
+        two_mic_process_block(tm, buffer, count);
+
+        cpu = two_mic_cpu_ns() - start;
+        tm->stats.blocks++;
+        tm->stats.frames += count;
+        tm->stats.cpu_sum_ns += cpu;
+        if (cpu > tm->stats.cpu_max_ns) {
+            tm->stats.cpu_max_ns = cpu;
+        }
+
+        /* Adaptation is the expensive part, drop it for a while */
+        if (cpu > tm->stats.budget_ns) {
+            tm->stats.over_budget++;
+            tm->freeze = TWO_MIC_FREEZE_BLOCKS;
+        }
+
+        buffer += 2 * count;
+        frames -= count;
+    }
+}
+
+void two_mic_get_stats(const struct two_mic *tm, struct two_mic_stats *stats)
+{
+    *stats = tm->stats;
+    stats->noise_floor_db = 10.0f * log10f(tm->noise_floor + 1e-12f);
+    stats->gain_db = 20.0f * log10f(tm->gain);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TWO_MIC_H
+#define TWO_MIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Two mic noise reduction for capture outside of calls.
+ *
+ * The "two-mic" mixer path puts the builtin (front) mic on the left and the
+ * back mic on the right capture slot. The engine works in place on those
+ * interleaved frames and writes the processed mono signal to both slots, so
+ * the usual channel removal afterwards picks it up unchanged.
+ *
+ * TWO_MIC_NEAR (VoIP): the front mic is the primary, an NLMS filter on the
+ * back mic cancels the noise common to both. Adaptation is frozen while the
+ * talker dominates the front mic.
+ * TWO_MIC_FAR (camcorder): the source is far away from both mics, the two
+ * are summed to a broadside beam.
+ *
+ * Both are followed by a broadband noise gate driven by a tracked noise
+ * floor. All memory is allocated in two_mic_create().
+ */
+struct two_mic;
+
+enum two_mic_mode {
+    TWO_MIC_NEAR = 0,
+    TWO_MIC_FAR,
+};
+
+struct two_mic_stats {
+    uint64_t blocks;
+    uint64_t frames;
+    int64_t  cpu_sum_ns;
+    int64_t  cpu_max_ns;
+    int64_t  budget_ns;      /* allowed cpu time per block */
+    uint32_t over_budget;    /* blocks which took longer than budget_ns */
+    uint64_t adapt_blocks;   /* blocks the canceller adapted on */
+    uint64_t frozen_blocks;  /* adaptation skipped to get back in budget */
+    uint32_t resets;         /* canceller diverged and was reset */
+    float    noise_floor_db; /* dBFS */
+    float    gain_db;        /* last noise gate gain */
+};
+
+/* Function prototypes */
+struct two_mic *two_mic_create(uint32_t rate,
+                               size_t block_frames,
+                               enum two_mic_mode mode);
+
+void two_mic_destroy(struct two_mic *tm);
+
+/* Clears the filter and noise floor, keeps the statistics */
+void two_mic_reset(struct two_mic *tm);
+
+/*
+ * Processes frames of interleaved front/back 16 bit samples in place, in
+ * chunks of at most block_frames.
+ */
+void two_mic_process(struct two_mic *tm, int16_t *buffer, size_t frames);
+
+void two_mic_get_stats(const struct two_mic *tm, struct two_mic_stats *stats);
+
+#endif
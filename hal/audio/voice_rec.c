@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_voice_rec"
+/*#define LOG_NDEBUG 0*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include <cutils/log.h>
+
+#include "voice_rec.h"
+
+enum voice_rec_mode voice_rec_get_mode(audio_source_t source,
+                                       audio_channel_mask_t channel_mask)
+{
+    bool uplink = (channel_mask & AUDIO_CHANNEL_IN_VOICE_UPLINK) != 0;
+    bool dnlink = (channel_mask & AUDIO_CHANNEL_IN_VOICE_DNLINK) != 0;
+
+    if (uplink && dnlink) {
+        if (channel_mask & AUDIO_CHANNEL_IN_MONO) {
+            return VOICE_REC_MIX;
+        }
+        return VOICE_REC_STEREO;
+    } else if (uplink) {
+        return VOICE_REC_UPLINK;
+    } else if (dnlink) {
+        return VOICE_REC_DOWNLINK;
+    }
+
+    switch (source) {
+    case AUDIO_SOURCE_VOICE_UPLINK:
+        return VOICE_REC_UPLINK;
+    case AUDIO_SOURCE_VOICE_DOWNLINK:
+        return VOICE_REC_DOWNLINK;
+    case AUDIO_SOURCE_VOICE_CALL:
+        return VOICE_REC_MIX;
+    default:
+        break;
+    }
+
+    return VOICE_REC_NONE;
+}
+
+size_t voice_rec_channel_count(enum voice_rec_mode mode)
+{
+    return (mode == VOICE_REC_STEREO) ? 2 : 1;
+}
+
+audio_channel_mask_t voice_rec_channel_mask(enum voice_rec_mode mode)
+{
+    switch (mode) {
+    case VOICE_REC_UPLINK:
+        return AUDIO_CHANNEL_IN_VOICE_UPLINK;
+    case VOICE_REC_DOWNLINK:
+        return AUDIO_CHANNEL_IN_VOICE_DNLINK;
+    case VOICE_REC_STEREO:
+        return AUDIO_CHANNEL_IN_VOICE_UPLINK | AUDIO_CHANNEL_IN_VOICE_DNLINK;
+    default:
+        break;
+    }
+
+    return AUDIO_CHANNEL_IN_MONO;
+}
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if ((sample >> 15) ^ (sample >> 31)) {
+        sample = 0x7fff ^ (sample >> 31);
+    }
+
+    return sample;
+}
+
+static void voice_rec_select(const int16_t *src,
+                             int16_t *dst,
+                             size_t frames,
+                             size_t slot)
+{
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t in = vld2q_s16(src + 2 * i);
+
+        vst1q_s16(dst + i, in.val[slot]);
+    }
+#endif
+
+    for (; i < frames; i++) {
+        dst[i] = src[2 * i + slot];
+    }
+}
+
+static void voice_rec_mix(const int16_t *src, int16_t *dst, size_t frames)
+{
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t in = vld2q_s16(src + 2 * i);
+
+        vst1q_s16(dst + i, vqaddq_s16(in.val[0], in.val[1]));
+    }
+#endif
+
+    for (; i < frames; i++) {
+        dst[i] = clamp16((int32_t)src[2 * i] + src[2 * i + 1]);
+    }
+}
+
+void voice_rec_process(enum voice_rec_mode mode,
+                       const int16_t *src,
+                       int16_t *dst,
+                       size_t frames)
+{
+    switch (mode) {
+    case VOICE_REC_UPLINK:
+        voice_rec_select(src, dst, frames, 0);
+        break;
+    case VOICE_REC_DOWNLINK:
+        voice_rec_select(src, dst, frames, 1);
+        break;
+    case VOICE_REC_MIX:
+        voice_rec_mix(src, dst, frames);
+        break;
+    case VOICE_REC_STEREO:
+        if (dst != src) {
+            memmove(dst, src, frames * 2 * sizeof(int16_t));
+        }
+        break;
+    case VOICE_REC_NONE:
+    default:
+        ALOGE("%s: invalid mode %d", __func__, mode);
+        break;
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VOICE_REC_H
+#define VOICE_REC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <system/audio.h>
+
+/*
+ * While a call is active the "incall-record" mixer path puts the uplink
+ * (mics after the TX DSP, the same signal fed to the baseband link) on the
+ * left capture slot and the baseband downlink (after ASRC2) on the right
+ * capture slot. The baseband link itself is never opened or read, so the
+ * recorder cannot stall or re-clock the call.
+ */
+enum voice_rec_mode {
+    VOICE_REC_NONE = 0,
+    VOICE_REC_UPLINK,   /* left slot only, mono */
+    VOICE_REC_DOWNLINK, /* right slot only, mono */
+    VOICE_REC_MIX,      /* uplink + downlink, saturated, mono */
+    VOICE_REC_STEREO,   /* uplink left, downlink right */
+};
+
+/* Function prototypes */
+enum voice_rec_mode voice_rec_get_mode(audio_source_t source,
+                                       audio_channel_mask_t channel_mask);
+
+size_t voice_rec_channel_count(enum voice_rec_mode mode);
+
+/* The mask a client asks for to get mode, with voice_rec_channel_count() channels */
+audio_channel_mask_t voice_rec_channel_mask(enum voice_rec_mode mode);
+
+/*
+ * Converts frames of interleaved stereo capture data to the layout
+ * requested by mode. dst may alias src.
+ */
+void voice_rec_process(enum voice_rec_mode mode,
+                       const int16_t *src,
+                       int16_t *dst,
+                       size_t frames);
+
+#endif